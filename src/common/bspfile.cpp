@@ -3,19 +3,26 @@
 #include "cli_option_defaults.h"
 #include "color.h"
 #include "filelib.h"
+#include "intermediate_files.h"
 #include "log.h"
 #include "map_entity_parser.h"
 #include "mathtypes.h"
 #include "messages.h"
 #include "numeric_string_conversions.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <charconv>
 #include <cstddef>
 #include <cstring>
 #include <filesystem>
+#include <memory>
+#include <optional>
 #include <ranges>
 #include <span>
+#include <system_error>
 #include <type_traits>
+#include <utility>
 
 using namespace std::literals;
 
@@ -297,11 +304,62 @@ get_lump_data(dheader_t const * header) {
 	return std::span{ start, length / sizeof(lump_element) };
 }
 
+// The file bspGlobals were last written to, while they still match it
+static std::filesystem::path bspDataWrittenTo;
+// The file the next LoadBSPFile() doesn't have to read
+static std::filesystem::path bspDataHandedOver;
+
+bool hand_bsp_data_to_next_stage() {
+	bspDataHandedOver = std::exchange(bspDataWrittenTo, {});
+	return !bspDataHandedOver.empty();
+}
+
+static bool bsp_file_exists(std::filesystem::path const & filename) {
+	if (intermediate_files_in_memory()) {
+		return find_intermediate_file(filename).has_value();
+	}
+	std::error_code ec;
+	return std::filesystem::exists(filename, ec);
+}
+
 // =====================================================================================
 //  LoadBSPFile
 //      balh
 // =====================================================================================
 void LoadBSPFile(std::filesystem::path const & filename) {
+	if (std::exchange(bspDataHandedOver, {}) == filename
+	    && bsp_file_exists(filename)) {
+		// The same limits as when reading the lumps
+		hlassume(
+			g_max_map_miptex > g_texdatasize,
+			assume_msg::exceeded_MAX_MAP_MIPTEX
+		);
+		hlassume(
+			g_max_map_lightdata > std::ptrdiff_t(
+				g_dlightdata.size() * sizeof(g_dlightdata[0])
+			),
+			assume_msg::exceeded_MAX_MAP_LIGHTING
+		);
+		return;
+	}
+
+	std::optional<std::span<std::byte const>> const inMemory{
+		find_intermediate_file(filename)
+	};
+	if (inMemory) {
+		if (inMemory->size() < sizeof(dheader_t)) {
+			Error("Failed to load BSP file %s", filename.c_str());
+		}
+		// LoadBSPImage() copies the lumps out, but it wants a mutable
+		// header
+		auto bsp = std::make_unique_for_overwrite<std::byte[]>(
+			inMemory->size()
+		);
+		std::ranges::copy(*inMemory, bsp.get());
+		LoadBSPImage((dheader_t*) bsp.get());
+		return;
+	}
+
 	auto [readBspSuccessfully, bspSize, bsp] = read_binary_file(filename);
 	if (!readBspSuccessfully || bspSize < sizeof(dheader_t)) {
 		Error("Failed to load BSP file %s", filename.c_str());
@@ -317,6 +375,7 @@ void LoadBSPImage(dheader_t* const header) {
 	if (header->version != BSPVERSION) {
 		Error("BSP is version %i, not %i", header->version, BSPVERSION);
 	}
+	bspDataWrittenTo.clear();
 
 	auto modelData = get_lump_data<lump_id::models>(header);
 	memcpy(
@@ -442,7 +501,12 @@ void WriteBSPFile(std::filesystem::path const & filename) {
 
 	header->version = (BSPVERSION);
 
-	bspfile = SafeOpenWrite(filename.c_str());
+	bspfile = open_intermediate_file(filename, "wb");
+	if (!bspfile) {
+		Error(
+			"Error opening %s: %s", filename.c_str(), std::strerror(errno)
+		);
+	}
 	SafeWrite(bspfile, header, sizeof(dheader_t)); // overwritten later
 
 	//      LUMP TYPE       DATA            LENGTH HEADER  BSPFILE
@@ -494,10 +558,14 @@ void WriteBSPFile(std::filesystem::path const & filename) {
 		std::span(g_dtexdata.data(), g_texdatasize), header, bspfile
 	);
 
+	// A memory stream ends where the position is when it's closed
+	long const fileEnd = ftell(bspfile);
 	fseek(bspfile, 0, SEEK_SET);
 	SafeWrite(bspfile, header, sizeof(dheader_t));
+	fseek(bspfile, fileEnd, SEEK_SET);
 
 	fclose(bspfile);
+	bspDataWrittenTo = filename;
 }
 
 // =====================================================================================
@@ -888,11 +956,9 @@ void DeleteEmbeddedLightmaps() {
  * ================
  */
 
-// Each tool should has its own version of GetParamsFromEnt which
-// parseentity calls
-extern void GetParamsFromEnt(entity_t* mapent);
-
-void add_entity_from_bsp_file(parsed_entity& parsedEntity) {
+static void add_entity_from_bsp_file(
+	parsed_entity& parsedEntity, void (*getParamsFromEnt)(entity_t* mapent)
+) {
 	if (g_numentities == MAX_MAP_ENTITIES) {
 		Error("g_numentities == MAX_MAP_ENTITIES");
 	}
@@ -904,7 +970,7 @@ void add_entity_from_bsp_file(parsed_entity& parsedEntity) {
 	if (key_value_is(mapent, u8"classname", u8"info_compile_parameters")) {
 		Log("Map entity info_compile_parameters detected, using compile "
 		    "settings\n");
-		GetParamsFromEnt(mapent);
+		getParamsFromEnt(mapent);
 	}
 	// Ugly code
 	if (key_value_starts_with(mapent, u8"classname", u8"light")
@@ -933,7 +999,8 @@ void add_entity_from_bsp_file(parsed_entity& parsedEntity) {
 }
 
 // Parses the dentdata string into entities
-void parse_entities_from_bsp_file() {
+void parse_entities_from_bsp_file(void (*getParamsFromEnt)(entity_t* mapent)
+) {
 	g_numentities = 0;
 
 	map_entity_parser parser{ { g_dentdata.data(), g_entdatasize } };
@@ -941,7 +1008,7 @@ void parse_entities_from_bsp_file() {
 	parsed_entity parsedEntity;
 	while ((parseOutcome = parser.parse_entity(parsedEntity))
 	       == parse_entity_outcome::entity_parsed) {
-		add_entity_from_bsp_file(parsedEntity);
+		add_entity_from_bsp_file(parsedEntity, getParamsFromEnt);
 	}
 
 	if (parseOutcome == parse_entity_outcome::bad_input) {
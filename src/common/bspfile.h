@@ -454,8 +454,10 @@ constexpr float ANGLE_DOWN{ -2.0 };
 // Entity Related Stuff
 //
 
-// Called by every stage except hlcsg
-extern void parse_entities_from_bsp_file();
+// Called by every stage except hlcsg. getParamsFromEnt handles the
+// stage's settings in an info_compile_parameters entity
+extern void
+parse_entities_from_bsp_file(void (*getParamsFromEnt)(entity_t* mapent));
 
 extern void DeleteKey(entity_t* ent, std::u8string_view key);
 extern void set_key_value(entity_t* ent, entity_key_value&& newKeyValue);
@@ -711,6 +713,12 @@ extern int CompressVis(
 extern void LoadBSPImage(dheader_t* header);
 extern void LoadBSPFile(std::filesystem::path const & filename);
 extern void WriteBSPFile(std::filesystem::path const & filename);
+
+// HLCOMPILE calls this between two stages. If bspGlobals still hold the
+// BSP file that was written last, the next LoadBSPFile() of that file
+// keeps them instead of reading the file again. Returns false if they
+// don't, and bspGlobals should be reset then
+extern bool hand_bsp_data_to_next_stage();
 extern void WriteExtentFile(std::filesystem::path const & filename);
 extern bool CalcFaceExtents_test();
 
@@ -0,0 +1,165 @@
+#include "hull_file.h"
+
+#include "filelib.h"
+#include "intermediate_files.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+
+#ifdef SYSTEM_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+void append_hull_file_header(
+	std::string& out, std::array<char, 8> const & magic
+) {
+	append_hull_file_record(
+		out,
+		hull_file_header{ .magic = magic,
+	                      .version = hullFileVersion,
+	                      .pointSize = sizeof(double3_array) }
+	);
+}
+
+void append_hull_file_points(
+	std::string& out, std::span<double3_array const> points
+) {
+	out.append(
+		reinterpret_cast<char const *>(points.data()), points.size_bytes()
+	);
+}
+
+std::optional<hull_file_reader> hull_file_reader::open(
+	std::filesystem::path const & filePath,
+	std::array<char, 8> const & magic
+) {
+	{
+		// Check the magic first so text files don't get read twice
+		FILE* file = open_intermediate_file(filePath, "rb");
+		if (!file) {
+			return std::nullopt;
+		}
+		hull_file_header header{};
+		std::size_t const headerSize = fread(
+			&header, 1, sizeof(header), file
+		);
+		fclose(file);
+		if (headerSize != sizeof(header) || header.magic != magic) {
+			return std::nullopt;
+		}
+		if (header.version != hullFileVersion
+		    || header.pointSize != sizeof(double3_array)) {
+			Error(
+				"%s was written by an incompatible version of the compile tools",
+				filePath.c_str()
+			);
+		}
+	}
+
+	hull_file_reader reader;
+	reader.filePath = filePath;
+
+	// HLCOMPILE keeps the file in memory until the next stage removes or
+	// rewrites it, after the readers are gone
+	std::optional<std::span<std::byte const>> const inMemory{
+		find_intermediate_file(filePath)
+	};
+	if (inMemory) {
+		reader.bytes = inMemory.value();
+		reader.take(sizeof(hull_file_header));
+		return reader;
+	}
+
+#ifdef SYSTEM_POSIX
+	int const fd = ::open(filePath.c_str(), O_RDONLY);
+	if (fd != -1) {
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0) {
+			void* const data = mmap(
+				nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0
+			);
+			if (data != MAP_FAILED) {
+				madvise(data, fileStat.st_size, MADV_SEQUENTIAL);
+				reader.bytes = std::span{
+					static_cast<std::byte const *>(data),
+					std::size_t(fileStat.st_size)
+				};
+				reader.mapped = true;
+			}
+		}
+		::close(fd);
+	}
+#endif
+
+	if (!reader.mapped) {
+		auto [success, size, buffer] = read_binary_file(filePath);
+		if (!success) {
+			Error("Can't open %s", filePath.c_str());
+		}
+		reader.buffer = std::move(buffer);
+		reader.bytes = std::span{ reader.buffer.get(), size };
+	}
+
+	// Skip the header
+	reader.take(sizeof(hull_file_header));
+	return reader;
+}
+
+hull_file_reader::hull_file_reader(hull_file_reader&& other) noexcept :
+	filePath(std::move(other.filePath)),
+	bytes(std::exchange(other.bytes, {})),
+	position(other.position),
+	buffer(std::move(other.buffer)),
+	mapped(std::exchange(other.mapped, false)) {}
+
+hull_file_reader& hull_file_reader::operator=(hull_file_reader&& other
+) noexcept {
+	if (this != &other) {
+		close();
+		filePath = std::move(other.filePath);
+		bytes = std::exchange(other.bytes, {});
+		position = other.position;
+		buffer = std::move(other.buffer);
+		mapped = std::exchange(other.mapped, false);
+	}
+	return *this;
+}
+
+hull_file_reader::~hull_file_reader() {
+	close();
+}
+
+void hull_file_reader::close() noexcept {
+#ifdef SYSTEM_POSIX
+	if (mapped) {
+		munmap(const_cast<std::byte*>(bytes.data()), bytes.size());
+	}
+#endif
+	mapped = false;
+	bytes = {};
+	buffer.reset();
+}
+
+std::span<std::byte const> hull_file_reader::take(std::size_t count) {
+	if (bytes.size() - position < count) {
+		Error("%s ends unexpectedly", filePath.c_str());
+	}
+	std::span<std::byte const> const taken = bytes.subspan(position, count);
+	position += count;
+	return taken;
+}
+
+std::span<double3_array const>
+hull_file_reader::read_points(std::size_t count) {
+	std::span<std::byte const> const pointBytes = take(
+		count * sizeof(double3_array)
+	);
+	return std::span{
+		reinterpret_cast<double3_array const *>(pointBytes.data()), count
+	};
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "external_types/texinfo.h"
+#include "internal_types/various.h"
+#include "mathtypes.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+
+// The binary alternative to the text .p0-.p3 and .b0-.b3 files, written by
+// HLCSG with -binaryhulls, and to the text .prt file, written by HLBSP
+// with -binaryportals. Values are stored in the machine's own byte
+// order and every record is 8-byte aligned, so HLBSP can use the points
+// where they are in the mapped file. The points are the exact doubles HLCSG
+// computed instead of going through "%5.8f" text
+//
+// .p0-.p3: hull_file_header, then for each model a poly_file_face followed
+// by its points for each face, then a poly_file_face with planenum -1
+//
+// .b0-.b3: hull_file_header, then for each model a brush_file_brush with
+// brushinfo 0 for each detail brush followed by its sides, each a
+// brush_file_side and its points, then a brush_file_side with planenum -1.
+// A brush_file_brush with brushinfo -1 ends the model
+//
+// .prt: hull_file_header, portal_file_counts, a portal_file_leaf for each
+// vis leaf, then a portal_file_portal followed by its points for each
+// portal
+
+constexpr std::array<char, 8> polyFileMagic{ 'O', 'H', 'L', 'T',
+	                                         'P', 'O', 'L', 'Y' };
+constexpr std::array<char, 8> brushFileMagic{ 'O', 'H', 'L', 'T',
+	                                          'B', 'R', 'S', 'H' };
+constexpr std::array<char, 8> portalFileMagic{ 'O', 'H', 'L', 'T',
+	                                           'P', 'R', 'T', 'L' };
+constexpr std::uint32_t hullFileVersion = 1;
+
+struct hull_file_header final {
+	std::array<char, 8> magic;
+	std::uint32_t version;
+	std::uint32_t pointSize;
+};
+
+struct poly_file_face final {
+	std::int32_t planenum;
+	std::uint32_t numPoints;
+	detail_level detailLevel;
+	texinfo_count texinfo;
+	std::int32_t contents;
+};
+
+struct brush_file_brush final {
+	std::int32_t brushinfo;
+	std::uint32_t padding;
+};
+
+struct brush_file_side final {
+	std::int32_t planenum;
+	std::uint32_t numPoints;
+};
+
+struct portal_file_counts final {
+	std::uint32_t numLeafs;
+	std::uint32_t numPortals;
+};
+
+struct portal_file_leaf final {
+	// How many BSP leafs the vis leaf is made of
+	std::int32_t numBspLeafs;
+	std::uint32_t padding;
+};
+
+struct portal_file_portal final {
+	std::uint32_t numPoints;
+	std::array<std::int32_t, 2> leafs;
+	std::uint32_t padding;
+};
+
+static_assert(sizeof(hull_file_header) % alignof(double3_array) == 0);
+static_assert(sizeof(poly_file_face) % alignof(double3_array) == 0);
+static_assert(sizeof(brush_file_brush) % alignof(double3_array) == 0);
+static_assert(sizeof(brush_file_side) % alignof(double3_array) == 0);
+static_assert(sizeof(portal_file_counts) % alignof(double3_array) == 0);
+static_assert(sizeof(portal_file_leaf) % alignof(double3_array) == 0);
+static_assert(sizeof(portal_file_portal) % alignof(double3_array) == 0);
+
+template <class Record>
+void append_hull_file_record(std::string& out, Record const & record) {
+	out.append(reinterpret_cast<char const *>(&record), sizeof(record));
+}
+
+void append_hull_file_header(
+	std::string& out, std::array<char, 8> const & magic
+);
+void append_hull_file_points(
+	std::string& out, std::span<double3_array const> points
+);
+
+// Reads a binary hull file, memory-mapped where supported
+class hull_file_reader final {
+  public:
+	// Returns std::nullopt if the file can't be opened or doesn't start
+	// with the magic, so the caller can read it as text instead and
+	// report a missing file the way it does for text files
+	static std::optional<hull_file_reader> open(
+		std::filesystem::path const & filePath,
+		std::array<char, 8> const & magic
+	);
+
+	hull_file_reader(hull_file_reader&& other) noexcept;
+	hull_file_reader& operator=(hull_file_reader&& other) noexcept;
+	~hull_file_reader();
+
+	bool at_end() const noexcept {
+		return position == bytes.size();
+	}
+
+	// Calls Error() if the file ends before the record does
+	template <class Record>
+	Record read_record() {
+		Record record;
+		std::span<std::byte const> const recordBytes = take(sizeof(record));
+		std::copy(
+			recordBytes.begin(),
+			recordBytes.end(),
+			reinterpret_cast<std::byte*>(&record)
+		);
+		return record;
+	}
+
+	std::span<double3_array const> read_points(std::size_t count);
+
+  private:
+	hull_file_reader() = default;
+	std::span<std::byte const> take(std::size_t count);
+	void close() noexcept;
+
+	std::filesystem::path filePath;
+	std::span<std::byte const> bytes;
+	std::size_t position{ 0 };
+	// Only used when the file couldn't be mapped
+	std::unique_ptr<std::byte[]> buffer;
+	bool mapped{ false };
+};
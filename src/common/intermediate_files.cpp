@@ -0,0 +1,132 @@
+#include "intermediate_files.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <system_error>
+
+namespace {
+	// The buffer is owned by the stream while it's open for writing, and
+	// open_memstream() updates data and size when it's closed, so entries
+	// must never move
+	struct stored_file final {
+		char* data{ nullptr };
+		std::size_t size{ 0 };
+
+		stored_file() = default;
+		stored_file(stored_file const &) = delete;
+		void operator=(stored_file const &) = delete;
+
+		~stored_file() {
+			std::free(data);
+		}
+	};
+
+	std::atomic<bool> inMemory{ false };
+	std::mutex filesMutex;
+	std::map<std::filesystem::path, stored_file> files;
+} // namespace
+
+// The stages build the paths the same way, but a relative and an
+// absolute path to the same file should still match
+static std::filesystem::path key_for(std::filesystem::path const & path) {
+	std::error_code error;
+	std::filesystem::path absolutePath{ std::filesystem::absolute(
+		path, error
+	) };
+	if (error) {
+		return path.lexically_normal();
+	}
+	return absolutePath.lexically_normal();
+}
+
+bool keep_intermediate_files_in_memory() {
+#ifdef SYSTEM_POSIX
+	inMemory.store(true, std::memory_order_release);
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool intermediate_files_in_memory() noexcept {
+	return inMemory.load(std::memory_order_acquire);
+}
+
+FILE* open_intermediate_file(
+	std::filesystem::path const & filePath, char const * mode
+) {
+#ifdef SYSTEM_POSIX
+	if (intermediate_files_in_memory()) {
+		std::filesystem::path const key{ key_for(filePath) };
+		std::unique_lock lock{ filesMutex };
+
+		if (mode[0] == 'w') {
+			// Nothing reads a file while the next stage rewrites it, so
+			// the old contents can go
+			files.erase(key);
+			stored_file& file = files.try_emplace(key).first->second;
+			return open_memstream(&file.data, &file.size);
+		}
+
+		auto const it = files.find(key);
+		if (mode[0] == 'r' && it != files.end()) {
+			if (it->second.size == 0) {
+				// fmemopen() may refuse a zero-sized buffer
+				return tmpfile();
+			}
+			return fmemopen(it->second.data, it->second.size, mode);
+		}
+	}
+#endif
+	return fopen(filePath.c_str(), mode);
+}
+
+std::optional<std::span<std::byte const>>
+find_intermediate_file(std::filesystem::path const & filePath) {
+	if (!intermediate_files_in_memory()) {
+		return std::nullopt;
+	}
+
+	std::unique_lock lock{ filesMutex };
+	auto const it = files.find(key_for(filePath));
+	if (it == files.end()) {
+		return std::nullopt;
+	}
+	return std::span{ reinterpret_cast<std::byte const *>(it->second.data),
+		              it->second.size };
+}
+
+void remove_intermediate_file(std::filesystem::path const & filePath) {
+	if (intermediate_files_in_memory()) {
+		std::unique_lock lock{ filesMutex };
+		files.erase(key_for(filePath));
+	}
+	std::error_code error;
+	std::filesystem::remove(filePath, error);
+}
+
+bool write_intermediate_files_to_disk(
+	std::function<bool(std::filesystem::path const &)> const & shouldWrite
+) {
+	std::unique_lock lock{ filesMutex };
+	bool success = true;
+	for (auto const & [filePath, file] : files) {
+		if (!shouldWrite(filePath)) {
+			continue;
+		}
+		FILE* f = fopen(filePath.c_str(), "wb");
+		if (!f) {
+			success = false;
+			continue;
+		}
+		if (fwrite(file.data, 1, file.size, f) != file.size) {
+			success = false;
+		}
+		if (fclose(f) != 0) {
+			success = false;
+		}
+	}
+	return success;
+}
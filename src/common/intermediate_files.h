@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <span>
+
+// The files one stage of the compile writes for the next: the .bsp, the
+// .p0-.p3 and .b0-.b3 hull files, .pln, .hsz and .prt.
+//
+// When HLCOMPILE runs all the stages in one process it keeps these files
+// in memory, and only writes them to disk when the compile ends. The
+// standalone tools never turn it on, and then the functions below just
+// use the files on disk
+
+// Only supported on POSIX systems. Returns false if unsupported, and the
+// files stay on disk then
+bool keep_intermediate_files_in_memory();
+bool intermediate_files_in_memory() noexcept;
+
+// Like fopen(). In memory mode, opening for writing replaces the stored
+// file when the stream is closed, and opening for reading reads the
+// stored file if there is one and the file on disk otherwise.
+// Use fclose() to close the file
+FILE* open_intermediate_file(
+	std::filesystem::path const & filePath, char const * mode
+);
+
+// The stored file, valid until it's replaced or removed. Always
+// std::nullopt when not in memory mode
+std::optional<std::span<std::byte const>>
+find_intermediate_file(std::filesystem::path const & filePath);
+
+// Removes the file from memory and from disk
+void remove_intermediate_file(std::filesystem::path const & filePath);
+
+// Writes the stored files that shouldWrite() accepts to disk.
+// Returns false if any of them couldn't be written
+bool write_intermediate_files_to_disk(
+	std::function<bool(std::filesystem::path const &)> const & shouldWrite
+);
@@ -6,7 +6,9 @@
 #include "messages.h"
 #include "project_constants.h"
 
+#include <atomic>
 #include <filesystem>
+#include <mutex>
 
 std::u8string g_Program = u8"Uninitialized variable";
 std::filesystem::path g_Mapname;
@@ -15,9 +17,14 @@ std::filesystem::path g_Wadpath;
 developer_level g_developer = cli_option_defaults::developer;
 bool g_verbose = cli_option_defaults::verbose;
 bool g_log = cli_option_defaults::log;
+bool g_chart = cli_option_defaults::chart;
+bool g_estimate = cli_option_defaults::estimate;
+bool g_info = cli_option_defaults::info;
 
 static FILE* CompileLog = nullptr;
-static bool fatal = false;
+static std::atomic<bool> fatal = false;
+// Keeps messages from different threads from being interleaved
+static std::mutex logMutex;
 
 ////////
 
@@ -97,6 +104,7 @@ void CheckForErrorLog() {
 
 void LogError(char const * const message) {
 	if (g_log && CompileLog) {
+		std::unique_lock lock{ logMutex };
 		std::filesystem::path filePath{ path_to_error_log_file(g_Mapname) };
 		FILE* ErrorLog{ fopen(filePath.c_str(), "a") };
 
@@ -150,6 +158,7 @@ void CloseLog() {
 //
 
 void WriteLog(char const * const message) {
+	std::unique_lock lock{ logMutex };
 	if (CompileLog) {
 		fprintf(
 			CompileLog, "%s", message
@@ -192,7 +201,7 @@ void FORMAT_PRINTF(1, 2) Error(char const * const error, ...) {
 	WriteLog(message2);
 	LogError(message2);
 
-	fatal = 1;
+	fatal = true;
 	CheckFatal();
 }
 
@@ -229,7 +238,7 @@ void FORMAT_PRINTF(2, 3)
 		);
 	}
 
-	fatal = 1;
+	fatal = true;
 }
 
 // =====================================================================================
@@ -241,13 +250,12 @@ void FORMAT_PRINTF(1, 2) PrintOnce(char const * const warning, ...) {
 	char message[MAX_WARNING];
 	char message2[MAX_WARNING];
 	va_list argptr;
-	static int count = 0;
+	static std::atomic<bool> called = false;
 
-	if (count > 0) // make sure it only gets called once
+	if (called.exchange(true)) // make sure it only gets called once
 	{
 		return;
 	}
-	count++;
 
 	va_start(argptr, warning);
 	vsnprintf(message, MAX_WARNING, warning, argptr);
@@ -18,6 +18,10 @@ extern std::filesystem::path g_Wadpath; // This is just the mod folder...
 extern developer_level g_developer;
 extern bool g_verbose;
 extern bool g_log;
+// "-chart", "-estimate" and "-noinfo", which every tool has
+extern bool g_chart;
+extern bool g_estimate;
+extern bool g_info;
 
 //
 // log.c Functions
@@ -0,0 +1,156 @@
+#include "phase_trace.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+namespace {
+	struct trace_span final {
+		char const * name;
+		int threadNum;
+		trace_clock::time_point start;
+		trace_clock::time_point end;
+		trace_span_stats stats;
+	};
+
+	std::atomic<bool> enabled{ false };
+	bool writeAtExit{ false };
+	std::mutex spansMutex;
+	std::vector<trace_span> spans;
+	std::filesystem::path tracePath;
+	trace_clock::time_point traceStart;
+} // namespace
+
+static double microseconds(trace_clock::duration d) {
+	return std::chrono::duration<double, std::micro>(d).count();
+}
+
+// Phase names are function names, but escape them anyway
+static void write_json_string(FILE* f, char const * str) {
+	fputc('"', f);
+	for (char const * c = str; *c; ++c) {
+		if (*c == '"' || *c == '\\') {
+			fputc('\\', f);
+		}
+		if ((unsigned char) *c >= 0x20) {
+			fputc(*c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+static void write_trace() {
+	if (!enabled.exchange(false)) {
+		return;
+	}
+
+	std::unique_lock lock{ spansMutex };
+	FILE* f = fopen(tracePath.c_str(), "w");
+	if (!f) {
+		Warning("Couldn't open %s", tracePath.c_str());
+		return;
+	}
+
+	int maxThreadNum = 0;
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+	for (trace_span const & span : spans) {
+		maxThreadNum = std::max(maxThreadNum, span.threadNum);
+		fputs("{\"name\":", f);
+		write_json_string(f, span.name);
+		fprintf(
+			f,
+			",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+			span.threadNum,
+			microseconds(span.start - traceStart),
+			microseconds(span.end - span.start)
+		);
+		trace_span_stats const & stats = span.stats;
+		bool hasArgs = false;
+		char const * separator = ",\"args\":{";
+		if (stats.items >= 0) {
+			fprintf(f, "%s\"items\":%td", separator, stats.items);
+			separator = ",";
+			hasArgs = true;
+		}
+		if (stats.busyTime != trace_clock::duration::min()) {
+			fprintf(
+				f,
+				"%s\"busy_ms\":%.3f",
+				separator,
+				microseconds(stats.busyTime) / 1000
+			);
+			separator = ",";
+			hasArgs = true;
+		}
+		if (stats.idleTime != trace_clock::duration::min()) {
+			fprintf(
+				f,
+				"%s\"idle_ms\":%.3f",
+				separator,
+				microseconds(stats.idleTime) / 1000
+			);
+			separator = ",";
+			hasArgs = true;
+		}
+		if (hasArgs) {
+			fputc('}', f);
+		}
+		fputs("},\n", f);
+	}
+
+	for (int i = 0; i <= maxThreadNum; ++i) {
+		fprintf(
+			f,
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+			"\"args\":{\"name\":\"%s %d\"}},\n",
+			i,
+			i == 0 ? "Main thread" : "Worker",
+			i
+		);
+	}
+	fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,", f);
+	fputs("\"args\":{\"name\":", f);
+	write_json_string(f, (char const *) g_Program.c_str());
+	fputs("}}\n]}\n", f);
+	fclose(f);
+
+	Log("Wrote trace to %s\n", tracePath.c_str());
+}
+
+void start_tracing(std::filesystem::path outputPath) {
+	{
+		std::unique_lock lock{ spansMutex };
+		tracePath = std::move(outputPath);
+		traceStart = trace_clock::now();
+		spans.clear();
+		if (!writeAtExit) {
+			atexit(write_trace);
+			writeAtExit = true;
+		}
+	}
+	enabled = true;
+}
+
+void finish_tracing() {
+	write_trace();
+}
+
+bool tracing_enabled() noexcept {
+	return enabled.load(std::memory_order_relaxed);
+}
+
+void record_trace_span(
+	char const * name,
+	int threadNum,
+	trace_clock::time_point start,
+	trace_clock::time_point end,
+	trace_span_stats stats
+) {
+	std::unique_lock lock{ spansMutex };
+	spans.emplace_back(name, threadNum, start, end, stats);
+}
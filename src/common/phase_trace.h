@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+
+// Phase profiler enabled with -trace. The recorded spans are written as
+// a Chrome trace JSON file that can be opened in chrome://tracing or
+// https://ui.perfetto.dev
+
+using trace_clock = std::chrono::steady_clock;
+
+// Starts recording. The file is written when the program exits
+void start_tracing(std::filesystem::path outputPath);
+// Writes the file now and stops recording, if tracing is enabled
+void finish_tracing();
+bool tracing_enabled() noexcept;
+
+// Optional statistics for a span. Unset values are left out of the file
+struct trace_span_stats final {
+	std::ptrdiff_t items{ -1 };
+	trace_clock::duration busyTime{ trace_clock::duration::min() };
+	trace_clock::duration idleTime{ trace_clock::duration::min() };
+};
+
+// Records one finished span. threadNum is the thread's number in
+// RunThreadsOn(), with the main thread being thread 0
+void record_trace_span(
+	char const * name,
+	int threadNum,
+	trace_clock::time_point start,
+	trace_clock::time_point end,
+	trace_span_stats stats = {}
+);
+
+// Records the lifetime of the object as a span on the main thread, for
+// phases that don't use RunThreadsOn()
+class trace_phase final {
+  private:
+	char const * name;
+	trace_clock::time_point start;
+
+  public:
+	explicit trace_phase(char const * phaseName) noexcept :
+		name{ phaseName },
+		start{ tracing_enabled() ? trace_clock::now()
+	                             : trace_clock::time_point{} } { }
+
+	~trace_phase() {
+		if (tracing_enabled()) {
+			record_trace_span(name, 0, start, trace_clock::now());
+		}
+	}
+
+	trace_phase(trace_phase const &) = delete;
+	void operator=(trace_phase const &) = delete;
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "threads.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// A range of work item indices [begin, end) owned by one worker.
+// The owner takes items from the front, idle workers steal the back
+// half. Both ends are packed into one 64-bit word so that taking and
+// stealing are each a single compare-and-swap
+class work_range final {
+  private:
+	alignas(64) std::atomic<std::uint64_t> packed{ 0 };
+
+	static constexpr std::uint64_t
+	pack(std::uint32_t begin, std::uint32_t end) noexcept {
+		return (std::uint64_t(end) << 32) | begin;
+	}
+
+	static constexpr std::uint32_t unpack_begin(std::uint64_t p) noexcept {
+		return std::uint32_t(p);
+	}
+
+	static constexpr std::uint32_t unpack_end(std::uint64_t p) noexcept {
+		return std::uint32_t(p >> 32);
+	}
+
+  public:
+	void reset(std::uint32_t begin, std::uint32_t end) noexcept {
+		packed.store(pack(begin, end), std::memory_order_release);
+	}
+
+	std::uint32_t size() const noexcept {
+		std::uint64_t const p = packed.load(std::memory_order_relaxed);
+		return unpack_end(p) - unpack_begin(p);
+	}
+
+	// Takes up to maxCount items from the front
+	bool take_front(
+		std::uint32_t maxCount, std::uint32_t& begin, std::uint32_t& end
+	) noexcept {
+		std::uint64_t p = packed.load(std::memory_order_acquire);
+		while (true) {
+			std::uint32_t const b = unpack_begin(p);
+			std::uint32_t const e = unpack_end(p);
+			if (b >= e) {
+				return false;
+			}
+			std::uint32_t const taken = std::min(maxCount, e - b);
+			if (packed.compare_exchange_weak(
+					p, pack(b + taken, e), std::memory_order_acq_rel
+				)) {
+				begin = b;
+				end = b + taken;
+				return true;
+			}
+		}
+	}
+
+	// Takes the back half, rounded up so a single item can be stolen
+	bool steal_back(std::uint32_t& begin, std::uint32_t& end) noexcept {
+		std::uint64_t p = packed.load(std::memory_order_acquire);
+		while (true) {
+			std::uint32_t const b = unpack_begin(p);
+			std::uint32_t const e = unpack_end(p);
+			if (b >= e) {
+				return false;
+			}
+			std::uint32_t const mid = b + (e - b) / 2;
+			if (packed.compare_exchange_weak(
+					p, pack(b, mid), std::memory_order_acq_rel
+				)) {
+				begin = mid;
+				end = e;
+				return true;
+			}
+		}
+	}
+};
+
+// Persistent worker threads shared by all the tools. The threads are
+// created the first time they're needed and then sleep between runs, so
+// RunThreadsOn() doesn't pay for thread creation every time.
+// The thread calling run() takes part as thread number 0
+class thread_pool final {
+  public:
+	using job_function = void (*)(int threadNum);
+
+	static thread_pool& get();
+
+	// Calls job(0), ..., job(numThreads - 1), each on its own thread, and
+	// returns when all of them have returned
+	void run(std::size_t numThreads, job_function job);
+
+	// The number of the calling thread in the current run
+	static int current_thread_num() noexcept;
+
+  private:
+	thread_pool() = default;
+	void add_worker();
+	static void* worker_entry(void* pool);
+	void worker_loop(int threadNum);
+
+	std::mutex mutex;
+	std::condition_variable wakeWorkers;
+	std::condition_variable workersDone;
+	std::size_t numWorkers{ 0 };
+	std::size_t numActiveThreads{ 0 };
+	std::size_t numRunningWorkers{ 0 };
+	std::uint64_t generation{ 0 };
+	job_function currentJob{ nullptr };
+};
+
+// Hands out the indices [0, workCount) of a RunThreadsOn() call. Each
+// thread starts with an equal share of the indices, takes them in
+// chunks, and steals half of another thread's remaining share when it
+// runs out
+class work_dispatcher final {
+  public:
+	void start(std::uint32_t workCount, std::size_t numThreads);
+
+	// Returns -1 when there's no work left
+	int next(int threadNum) noexcept;
+
+	std::uint32_t dispatched() const noexcept {
+		return numDispatched.load(std::memory_order_relaxed);
+	}
+
+	std::uint32_t work_count() const noexcept {
+		return workCount;
+	}
+
+	// How many items the thread has taken in this run
+	std::uint32_t taken_by(int threadNum) const noexcept {
+		return chunks[threadNum].taken;
+	}
+
+  private:
+	struct alignas(64) local_chunk final {
+		std::uint32_t begin{ 0 };
+		std::uint32_t end{ 0 };
+		std::uint32_t taken{ 0 };
+	};
+
+	bool refill(int threadNum) noexcept;
+
+	std::array<work_range, MAX_THREADS> ranges;
+	std::array<local_chunk, MAX_THREADS> chunks;
+	std::size_t numThreads{ 1 };
+	std::uint32_t workCount{ 0 };
+	std::uint32_t chunkSize{ 1 };
+	std::atomic<std::uint32_t> numDispatched{ 0 };
+};
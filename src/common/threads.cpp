@@ -3,9 +3,20 @@
 
 #include "cli_option_defaults.h"
 #include "log.h"
+#include "phase_trace.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stop_token>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #ifdef SYSTEM_POSIX
 #include <pthread.h>
@@ -19,13 +30,13 @@ q_threadpriority g_threadpriority = cli_option_defaults::threadPriority;
 #define THREADTIMES_SIZE  100
 #define THREADTIMES_SIZEf (float) (THREADTIMES_SIZE)
 
-static int dispatch = 0;
-static int workcount = 0;
 static int oldf = 0;
 static bool pacifier = false;
-static bool threaded = false;
+static std::atomic<bool> threaded = false;
 static double threadstart = 0;
 static double threadtimes[THREADTIMES_SIZE];
+static work_dispatcher dispatcher;
+static thread_local int currentThreadNum = 0;
 
 double I_FloatTime() {
 	struct timeval tp;
@@ -42,42 +53,77 @@ double I_FloatTime() {
 	return (tp.tv_sec - secbase) + tp.tv_usec / 1000000.0;
 }
 
-int GetThreadWork() {
-	double ct, finish, finish2, finish3;
-
-	ThreadLock();
-
-	if (dispatch == 0) {
-		oldf = 0;
+void work_dispatcher::start(
+	std::uint32_t newWorkCount, std::size_t newNumThreads
+) {
+	workCount = newWorkCount;
+	numThreads = std::clamp<std::size_t>(newNumThreads, 1, MAX_THREADS);
+	numDispatched.store(0, std::memory_order_relaxed);
+
+	// Small chunks keep the load balanced when items differ a lot in
+	// cost, while still making most calls thread-local
+	chunkSize = std::clamp<std::uint32_t>(
+		workCount / (numThreads * 64), 1, 64
+	);
+
+	for (std::size_t i = 0; i < numThreads; ++i) {
+		std::uint32_t const begin = workCount * i / numThreads;
+		std::uint32_t const end = workCount * (i + 1) / numThreads;
+		ranges[i].reset(begin, end);
+		chunks[i] = {};
 	}
+}
 
-	if (dispatch > workcount) {
-		Developer(developer_level::error, "dispatch > workcount!!!\n");
-		ThreadUnlock();
-		return -1;
+bool work_dispatcher::refill(int threadNum) noexcept {
+	local_chunk& chunk = chunks[threadNum];
+	if (ranges[threadNum].take_front(chunkSize, chunk.begin, chunk.end)) {
+		return true;
 	}
-	if (dispatch == workcount) {
-		Developer(
-			developer_level::message,
-			"dispatch == workcount, work is complete\n"
-		);
-		ThreadUnlock();
-		return -1;
+
+	// Our own range is empty, so steal from the other threads,
+	// starting with our neighbour to spread out the thieves
+	for (std::size_t offset = 1; offset < numThreads; ++offset) {
+		std::size_t const victim = (threadNum + offset) % numThreads;
+		std::uint32_t begin;
+		std::uint32_t end;
+		if (ranges[victim].steal_back(begin, end)) {
+			ranges[threadNum].reset(begin, end);
+			return ranges[threadNum].take_front(
+				chunkSize, chunk.begin, chunk.end
+			);
+		}
 	}
-	if (dispatch < 0) {
-		Developer(developer_level::error, "negative dispatch!!!\n");
-		ThreadUnlock();
-		return -1;
+	return false;
+}
+
+int work_dispatcher::next(int threadNum) noexcept {
+	local_chunk& chunk = chunks[threadNum];
+	while (chunk.begin == chunk.end) {
+		if (!refill(threadNum)) {
+			return -1;
+		}
 	}
+	numDispatched.fetch_add(1, std::memory_order_relaxed);
+	++chunk.taken;
+	return int(chunk.begin++);
+}
+
+// Only called from the progress reporter thread, or after it has stopped
+static void UpdatePacifier(int dispatch, int workcount) {
+	double ct, finish, finish2, finish3;
 
+	if (workcount <= 0) {
+		return;
+	}
 	int f = THREADTIMES_SIZE * dispatch / workcount;
+
 	if (pacifier) {
 		PrintConsole("\r%6d /%6d", dispatch, workcount);
 
-		if (f != oldf) {
+		if (f > oldf) {
 			ct = I_FloatTime();
 			/* Fill in current time for threadtimes record */
-			for (int i = oldf; i <= f; i++) {
+			for (int i = std::max(oldf, 0); i <= f; i++) {
 				if (threadtimes[i] < 1) {
 					threadtimes[i] = ct;
 				}
@@ -107,30 +153,137 @@ int GetThreadWork() {
 				}
 			}
 		}
-	} else if (f != oldf) {
+	} else if (f > oldf) {
+		// Several steps may have passed since the last update
+		for (int step = (std::max(oldf, 0) / 10 + 1) * 10; step <= f;
+		     step += 10) {
+			PrintConsole("%d%%...", step);
+		}
+		FlushConsole();
 		oldf = f;
-		switch (f) {
-			case 10:
-			case 20:
-			case 30:
-			case 40:
-			case 50:
-			case 60:
-			case 70:
-			case 80:
-			case 90:
-			case 100:
-				PrintConsole("%d%%...", f);
-				FlushConsole();
-			default:
-				break;
+	}
+}
+
+// Prints the pacifier at a fixed rate from its own thread, so the
+// worker threads only have to bump the dispatcher's atomic counter
+class progress_reporter final {
+  private:
+	static constexpr std::chrono::milliseconds interval{ 250 };
+
+	std::mutex mutex;
+	std::condition_variable_any wakeUp;
+	std::jthread thread;
+
+	void report() {
+		int const dispatched = int(dispatcher.dispatched());
+		UpdatePacifier(std::max(dispatched, 1) - 1, dispatcher.work_count());
+	}
+
+  public:
+	void start() {
+		thread = std::jthread{ [this](std::stop_token stopToken) {
+			std::unique_lock lock{ mutex };
+			while (true) {
+				// Returns early only when a stop is requested
+				wakeUp.wait_for(lock, stopToken, interval, [] {
+					return false;
+				});
+				if (stopToken.stop_requested()) {
+					break;
+				}
+				report();
+			}
+		} };
+	}
+
+	// Stops the thread and prints the final state
+	void stop() {
+		if (thread.joinable()) {
+			thread.request_stop();
+			thread.join();
 		}
+		report();
+	}
+};
+
+static progress_reporter progressReporter;
+
+// The tasks spawned while RunTasks() is running. The newest task runs
+// first, since it's usually the smallest and its data is still cached
+class task_queue final {
+  public:
+	struct queued_task final {
+		std::function<void()> function;
+		task_group* group;
+	};
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::vector<queued_task> tasks;
+	bool running{ false };
+	bool rootFinished{ false };
+
+	// The lock is released while the task runs
+	void run_newest(std::unique_lock<std::mutex>& lock) {
+		queued_task task{ std::move(tasks.back()) };
+		tasks.pop_back();
+		lock.unlock();
+		task.function();
+		lock.lock();
+		if (--task.group->numPending == 0) {
+			changed.notify_all();
+		}
+	}
+
+	// Runs tasks until done() returns true
+	template <class Done>
+	void run_until(std::unique_lock<std::mutex>& lock, Done&& done) {
+		while (!done()) {
+			if (!tasks.empty()) {
+				run_newest(lock);
+			} else {
+				changed.wait(lock);
+			}
+		}
+	}
+};
+
+static task_queue taskQueue;
+
+task_group::~task_group() {
+	wait();
+}
+
+void task_group::spawn(std::function<void()> task) {
+	std::unique_lock lock{ taskQueue.mutex };
+	if (!taskQueue.running) {
+		lock.unlock();
+		task();
+		return;
 	}
+	++numPending;
+	taskQueue.tasks.push_back({ .function = std::move(task), .group = this });
+	lock.unlock();
+	taskQueue.changed.notify_one();
+}
 
-	int r = dispatch;
-	dispatch++;
+void task_group::wait() {
+	std::unique_lock lock{ taskQueue.mutex };
+	taskQueue.run_until(lock, [this] { return numPending == 0; });
+}
+
+int thread_pool::current_thread_num() noexcept {
+	return currentThreadNum;
+}
 
-	ThreadUnlock();
+int GetThreadWork() {
+	int const r = dispatcher.next(thread_pool::current_thread_num());
+	if (r == -1) {
+		Developer(
+			developer_level::message,
+			"dispatch == workcount, work is complete\n"
+		);
+	}
 	return r;
 }
 
@@ -144,10 +297,98 @@ static void ThreadWorkerFunction(int) {
 }
 
 void RunThreadsOnIndividual(
-	int workcnt, bool showpacifier, q_threadfunction func
+	int workcnt, bool showpacifier, q_threadfunction func, char const * name
 ) {
 	workfunction = func;
-	RunThreadsOn(workcnt, showpacifier, ThreadWorkerFunction);
+	RunThreadsOn(workcnt, showpacifier, ThreadWorkerFunction, name);
+}
+
+static q_threadfunction tracedFunction;
+static std::array<
+	std::pair<trace_clock::time_point, trace_clock::time_point>,
+	MAX_THREADS>
+	tracedThreadTimes;
+
+static void TracedThreadFunction(int threadNum) {
+	trace_clock::time_point const start = trace_clock::now();
+	tracedFunction(threadNum);
+	tracedThreadTimes[threadNum] = { start, trace_clock::now() };
+}
+
+// Runs func on the threads, recording a span for the whole run on the
+// main thread and one span per thread with its busy and idle time
+template <class RunFunction>
+static void TraceThreadWork(
+	char const * name, q_threadfunction func, RunFunction&& run
+) {
+	if (!tracing_enabled()) {
+		run(func);
+		return;
+	}
+
+	std::size_t const numThreads = std::clamp<std::size_t>(
+		g_numthreads, 1, MAX_THREADS
+	);
+	tracedFunction = func;
+	trace_clock::time_point const start = trace_clock::now();
+	run(TracedThreadFunction);
+	trace_clock::time_point const end = trace_clock::now();
+	tracedFunction = nullptr;
+
+	trace_clock::duration totalBusy{ 0 };
+	for (std::size_t i = 0; i < numThreads; ++i) {
+		auto const [threadStart, threadEnd] = tracedThreadTimes[i];
+		trace_clock::duration const busy = threadEnd - threadStart;
+		totalBusy += busy;
+		record_trace_span(
+			name,
+			int(i),
+			threadStart,
+			threadEnd,
+			{ .items = dispatcher.taken_by(int(i)),
+			  .busyTime = busy,
+			  .idleTime = (end - start) - busy }
+		);
+	}
+	record_trace_span(
+		name,
+		0,
+		start,
+		end,
+		{ .items = dispatcher.work_count(),
+		  .busyTime = totalBusy,
+		  .idleTime = (end - start) * std::ptrdiff_t(numThreads)
+		      - totalBusy }
+	);
+}
+
+static void StartThreadWork(int workcnt, bool showpacifier) {
+	threadstart = I_FloatTime();
+	for (int i = 0; i < THREADTIMES_SIZE; i++) {
+		threadtimes[i] = 0;
+	}
+
+	dispatcher.start(std::max(workcnt, 0), g_numthreads);
+	oldf = -1;
+	pacifier = showpacifier;
+
+	if (pacifier) {
+		setbuf(stdout, nullptr);
+	}
+#ifndef SINGLE_THREADED
+	progressReporter.start();
+#endif
+}
+
+static void FinishThreadWork() {
+	progressReporter.stop();
+
+	double const end = I_FloatTime();
+	if (pacifier) {
+		PrintConsole("\r%60s\r", "");
+	}
+
+	Log(" (%.2f seconds)\n", end - threadstart);
 }
 
 #ifndef SINGLE_THREADED
@@ -192,77 +433,42 @@ void ThreadSetPriority(q_threadpriority type) {
 	setpriority(PRIO_PROCESS, 0, val);
 }
 
-using pthread_addr_t = void*;
-pthread_mutex_t* my_mutex;
+static std::mutex globalMutex;
 
 void ThreadLock() {
-	if (my_mutex) {
-		pthread_mutex_lock(my_mutex);
+	if (threaded.load(std::memory_order_acquire)) {
+		globalMutex.lock();
 	}
 }
 
 void ThreadUnlock() {
-	if (my_mutex) {
-		pthread_mutex_unlock(my_mutex);
+	if (threaded.load(std::memory_order_acquire)) {
+		globalMutex.unlock();
 	}
 }
 
-q_threadfunction q_entry;
-
-static void* ThreadEntryStub(void* pParam) {
-	q_entry((int) (intptr_t) pParam);
-	return nullptr;
+thread_pool& thread_pool::get() {
+	// Never destroyed, since Error() may exit the process from inside a
+	// worker thread
+	static thread_pool* pool = new thread_pool{};
+	return *pool;
 }
 
-void threads_InitCrit() {
-	pthread_mutexattr_t mattrib;
-
-	if (!my_mutex) {
-		my_mutex = new pthread_mutex_t{};
-		if (pthread_mutexattr_init(&mattrib) == -1) {
-			Error("pthread_mutex_attr_init failed");
-		}
-		if (pthread_mutex_init(my_mutex, &mattrib) == -1) {
-			Error("pthread_mutex_init failed");
-		}
+void* thread_pool::worker_entry(void* pool) {
+	thread_pool& self = *static_cast<thread_pool*>(pool);
+	int threadNum;
+	{
+		// Number 0 is the thread calling run()
+		std::unique_lock lock{ self.mutex };
+		threadNum = int(self.numWorkers) + 1;
 	}
+	self.worker_loop(threadNum);
+	return nullptr;
 }
 
-void threads_UninitCrit() {
-	delete my_mutex;
-	my_mutex = nullptr;
-}
-
-/*
- * =============
- * RunThreadsOn
- * =============
- */
-void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
-	int i;
-	pthread_t work_threads[MAX_THREADS];
-	pthread_addr_t status;
+void thread_pool::add_worker() {
 	pthread_attr_t attrib;
-	double start, end;
-
-	threadstart = I_FloatTime();
-	start = threadstart;
-	for (i = 0; i < THREADTIMES_SIZE; i++) {
-		threadtimes[i] = 0;
-	}
-
-	dispatch = 0;
-	workcount = workcnt;
-	oldf = -1;
-	pacifier = showpacifier;
-	threaded = true;
-	q_entry = func;
-
-	if (pacifier) {
-		setbuf(stdout, nullptr);
-	}
-
-	threads_InitCrit();
+	pthread_t thread;
 
 	if (pthread_attr_init(&attrib) == -1) {
 		Error("pthread_attr_init failed");
@@ -272,36 +478,128 @@ void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
 		Error("pthread_attr_setstacksize failed");
 	}
 #endif
+	if (pthread_create(&thread, &attrib, worker_entry, this) == -1) {
+		Error("pthread_create failed");
+	}
+	pthread_attr_destroy(&attrib);
+	pthread_detach(thread);
+}
 
-	for (i = 0; i < g_numthreads; i++) {
-		if (pthread_create(
-				&work_threads[i],
-				&attrib,
-				ThreadEntryStub,
-				(void*) (intptr_t) i
-			)
-		    == -1) {
-			Error("pthread_create failed");
+void thread_pool::worker_loop(int threadNum) {
+	currentThreadNum = threadNum;
+	std::unique_lock lock{ mutex };
+	std::uint64_t seenGeneration = generation;
+	++numWorkers;
+	workersDone.notify_all();
+
+	while (true) {
+		wakeWorkers.wait(lock, [&] {
+			return generation != seenGeneration;
+		});
+		seenGeneration = generation;
+		if (std::size_t(threadNum) >= numActiveThreads) {
+			continue;
+		}
+
+		job_function const job = currentJob;
+		lock.unlock();
+		job(threadNum);
+		lock.lock();
+
+		if (--numRunningWorkers == 0) {
+			workersDone.notify_all();
 		}
 	}
+}
+
+void thread_pool::run(std::size_t numThreads, job_function job) {
+	numThreads = std::clamp<std::size_t>(numThreads, 1, MAX_THREADS);
 
-	for (i = 0; i < g_numthreads; i++) {
-		if (pthread_join(work_threads[i], &status) == -1) {
-			Error("pthread_join failed");
+	{
+		std::unique_lock lock{ mutex };
+		std::size_t const wantedWorkers = numThreads - 1;
+		while (numWorkers < wantedWorkers) {
+			std::size_t const before = numWorkers;
+			lock.unlock();
+			add_worker();
+			lock.lock();
+			// Wait for the new thread to pick its number before starting
+			// another, so the numbers are assigned in order
+			workersDone.wait(lock, [&] { return numWorkers > before; });
 		}
+
+		currentJob = job;
+		numActiveThreads = numThreads;
+		numRunningWorkers = numThreads - 1;
+		++generation;
 	}
+	wakeWorkers.notify_all();
 
-	threads_UninitCrit();
+	currentThreadNum = 0;
+	job(0);
 
-	q_entry = nullptr;
-	threaded = false;
+	std::unique_lock lock{ mutex };
+	workersDone.wait(lock, [&] { return numRunningWorkers == 0; });
+	currentJob = nullptr;
+}
 
-	end = I_FloatTime();
-	if (pacifier) {
-		PrintConsole("\r%60s\r", "");
+/*
+ * =============
+ * RunThreadsOn
+ * =============
+ */
+void RunThreadsOn(
+	int workcnt, bool showpacifier, q_threadfunction func, char const * name
+) {
+	StartThreadWork(workcnt, showpacifier);
+
+	threaded.store(true, std::memory_order_release);
+	TraceThreadWork(name, func, [](q_threadfunction f) {
+		thread_pool::get().run(g_numthreads, f);
+	});
+	threaded.store(false, std::memory_order_release);
+
+	FinishThreadWork();
+}
+
+static std::function<void()> const * taskRoot;
+
+static void TaskWorkerFunction(int threadNum) {
+	std::unique_lock lock{ taskQueue.mutex };
+	if (threadNum == 0) {
+		lock.unlock();
+		(*taskRoot)();
+		lock.lock();
+		// The root has waited for all its task groups, so no more tasks
+		// can be spawned
+		taskQueue.rootFinished = true;
+		taskQueue.changed.notify_all();
+		return;
+	}
+	taskQueue.run_until(lock, [] { return taskQueue.rootFinished; });
+}
+
+void RunTasks(std::function<void()> const & root, char const * name) {
+	{
+		std::unique_lock lock{ taskQueue.mutex };
+		if (taskQueue.running) {
+			lock.unlock();
+			root();
+			return;
+		}
+		taskQueue.running = true;
+		taskQueue.rootFinished = false;
 	}
 
-	Log(" (%.2f seconds)\n", end - start);
+	trace_phase phase{ name };
+	taskRoot = &root;
+	threaded.store(true, std::memory_order_release);
+	thread_pool::get().run(g_numthreads, TaskWorkerFunction);
+	threaded.store(false, std::memory_order_release);
+	taskRoot = nullptr;
+
+	std::unique_lock lock{ taskQueue.mutex };
+	taskQueue.running = false;
 }
 
 #endif /*SYSTEM_POSIX */
@@ -321,10 +619,6 @@ int g_numthreads = 1;
 
 void ThreadSetPriority(q_threadpriority type) { }
 
-void threads_InitCrit() { }
-
-void threads_UninitCrit() { }
-
 void ThreadSetDefault() {
 	g_numthreads = 1;
 }
@@ -333,32 +627,17 @@ void ThreadLock() { }
 
 void ThreadUnlock() { }
 
-void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
-	int i;
-	double start, end;
-
-	dispatch = 0;
-	workcount = workcnt;
-	oldf = -1;
-	pacifier = showpacifier;
-	threadstart = I_FloatTime();
-	start = threadstart;
-	for (i = 0; i < THREADTIMES_SIZE; i++) {
-		threadtimes[i] = 0.0;
-	}
-
-	if (pacifier) {
-		setbuf(stdout, nullptr);
-	}
-	func(0);
-
-	end = I_FloatTime();
-
-	if (pacifier) {
-		PrintConsole("\r%60s\r", "");
-	}
+void RunTasks(std::function<void()> const & root, char const *) {
+	root();
+}
 
-	Log(" (%.2f seconds)\n", end - start);
+void RunThreadsOn(
+	int workcnt, bool showpacifier, q_threadfunction func, char const * name
+) {
+	StartThreadWork(workcnt, showpacifier);
+	currentThreadNum = 0;
+	TraceThreadWork(name, func, [](q_threadfunction f) { f(0); });
+	FinishThreadWork();
 }
 
 #endif
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <functional>
 
 constexpr std::size_t MAX_THREADS = 64;
 
@@ -21,17 +22,55 @@ extern int GetThreadWork();
 extern void ThreadLock();
 extern void ThreadUnlock();
 
-extern void
-RunThreadsOnIndividual(int workcnt, bool showpacifier, q_threadfunction);
-extern void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction);
+// name is used for the -trace output
+extern void RunThreadsOnIndividual(
+	int workcnt,
+	bool showpacifier,
+	q_threadfunction,
+	char const * name = "RunThreadsOnIndividual"
+);
+extern void RunThreadsOn(
+	int workcnt,
+	bool showpacifier,
+	q_threadfunction,
+	char const * name = "RunThreadsOn"
+);
 
-#define NamedRunThreadsOn(n, p, f) \
-	{                              \
-		Log("%s\n", (#f ":"));     \
-		RunThreadsOn(n, p, f);     \
+// For recursive work, such as building a BSP tree. Tasks spawned in a
+// task_group may run on any thread taking part in RunTasks(). Outside of
+// RunTasks() they run right away on the calling thread
+class task_group final {
+  public:
+	task_group() = default;
+	task_group(task_group const &) = delete;
+	void operator=(task_group const &) = delete;
+	~task_group();
+
+	void spawn(std::function<void()> task);
+
+	// Returns when the tasks spawned in the group have finished. The
+	// calling thread runs queued tasks, from any group, while waiting
+	void wait();
+
+  private:
+	friend class task_queue;
+	std::size_t numPending{ 0 }; // Guarded by the task queue's mutex
+};
+
+// Calls root() on the calling thread while the other threads run the
+// tasks it spawns, and returns when all of them have finished. Inside a
+// task it just calls root(). Don't call RunThreadsOn() from a task
+void RunTasks(
+	std::function<void()> const & root, char const * name = "RunTasks"
+);
+
+#define NamedRunThreadsOn(n, p, f)  \
+	{                               \
+		Log("%s\n", (#f ":"));      \
+		RunThreadsOn(n, p, f, #f);  \
 	}
 #define NamedRunThreadsOnIndividual(n, p, f) \
 	{                                        \
 		Log("%s\n", (#f ":"));               \
-		RunThreadsOnIndividual(n, p, f);     \
+		RunThreadsOnIndividual(n, p, f, #f); \
 	}
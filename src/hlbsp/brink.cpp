@@ -3,10 +3,14 @@
 #include "hlbsp.h"
 #include "log.h"
 #include "messages.h"
+#include "threads.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstring>
-#include <list>
 #include <map>
+#include <memory_resource>
 #include <vector>
 
 // TODO: we should consider corners in addition to brinks.
@@ -177,6 +181,15 @@ void BrinkReplaceClipnode(bbrink_t* b, bclipnode_t* prev, bclipnode_t* n) {
 
 // compute the structure of the whole bsp tree
 
+// The memory of the tree objects of one clip hull. It's pooled, so the
+// objects freed while the cells are split are reused, and it's all given
+// back at once when the arena goes away
+struct btree_arena final {
+	std::pmr::unsynchronized_pool_resource resource;
+	std::pmr::polymorphic_allocator<> allocator{ &resource };
+	int numobjects{ 0 };
+};
+
 struct btreepoint_t final {
 	btreeedge_l* edges; // this is a reversed reference
 	double3_array v;
@@ -212,24 +225,22 @@ struct btreeface_t final {
 	bool tmp_tested;
 };
 
-btreepoint_t* AllocTreepoint(int& numobjects, bool infinite) {
-	numobjects++;
-	btreepoint_t* tp = new btreepoint_t{};
-	hlassume(tp != nullptr, assume_msg::NoMemory);
-	tp->edges = new btreeedge_l();
+btreepoint_t* AllocTreepoint(btree_arena& arena, bool infinite) {
+	arena.numobjects++;
+	btreepoint_t* tp = arena.allocator.new_object<btreepoint_t>();
+	tp->edges = arena.allocator.new_object<btreeedge_l>();
 	tp->infinite = infinite;
 	return tp;
 }
 
-btreeedge_t* AllocTreeedge(int& numobjects, bool infinite) {
-	numobjects++;
-	btreeedge_t* te = new btreeedge_t{};
-	hlassume(te != nullptr, assume_msg::NoMemory);
+btreeedge_t* AllocTreeedge(btree_arena& arena, bool infinite) {
+	arena.numobjects++;
+	btreeedge_t* te = arena.allocator.new_object<btreeedge_t>();
 	te->points[0].p = nullptr;
 	te->points[0].side = false;
 	te->points[1].p = nullptr;
 	te->points[1].side = true;
-	te->faces = new btreeface_l();
+	te->faces = arena.allocator.new_object<btreeface_l>();
 	te->infinite = infinite;
 	// should be followed by SetEdgePoints
 	return te;
@@ -259,11 +270,10 @@ void SetEdgePoints(btreeedge_t* te, btreepoint_t* tp0, btreepoint_t* tp1) {
 	AttachPointToEdge(te, tp1, true);
 }
 
-btreeface_t* AllocTreeface(int& numobjects, bool infinite) {
-	numobjects++;
-	btreeface_t* tf = new btreeface_t{};
-	hlassume(tf != nullptr, assume_msg::NoMemory);
-	tf->edges = new btreeedge_l{};
+btreeface_t* AllocTreeface(btree_arena& arena, bool infinite) {
+	arena.numobjects++;
+	btreeface_t* tf = arena.allocator.new_object<btreeface_t>();
+	tf->edges = arena.allocator.new_object<btreeedge_l>();
 	tf->leafs[0].l = nullptr;
 	tf->leafs[0].side = false;
 	tf->leafs[1].l = nullptr;
@@ -314,31 +324,30 @@ void SetFaceLeafs(btreeface_t* tf, btreeleaf_t* tl0, btreeleaf_t* tl1) {
 	AttachFaceToLeaf(tl1, tf, true);
 }
 
-btreeleaf_t* AllocTreeleaf(int& numobjects, bool infinite) {
-	numobjects++;
-	btreeleaf_t* tl = new btreeleaf_t{};
-	hlassume(tl != nullptr, assume_msg::NoMemory);
-	tl->faces = new btreeface_l{};
+btreeleaf_t* AllocTreeleaf(btree_arena& arena, bool infinite) {
+	arena.numobjects++;
+	btreeleaf_t* tl = arena.allocator.new_object<btreeleaf_t>();
+	tl->faces = arena.allocator.new_object<btreeface_l>();
 	tl->infinite = infinite;
 	return tl;
 }
 
-btreeleaf_t* BuildOutside(int& numobjects) {
+btreeleaf_t* BuildOutside(btree_arena& arena) {
 	btreeleaf_t* leaf_outside;
-	leaf_outside = AllocTreeleaf(numobjects, true);
+	leaf_outside = AllocTreeleaf(arena, true);
 	leaf_outside->clipnode = nullptr;
 	return leaf_outside;
 }
 
 btreeleaf_t* BuildBaseCell(
-	int& numobjects,
+	btree_arena& arena,
 	bclipnode_t* clipnode,
 	double range,
 	btreeleaf_t* leaf_outside
 ) {
 	btreepoint_t* tp[8];
 	for (int i = 0; i < 8; i++) {
-		tp[i] = AllocTreepoint(numobjects, true);
+		tp[i] = AllocTreepoint(arena, true);
 		if (i & 1) {
 			tp[i]->v[0] = range;
 		} else {
@@ -357,7 +366,7 @@ btreeleaf_t* BuildBaseCell(
 	}
 	btreeedge_t* te[12];
 	for (int i = 0; i < 12; i++) {
-		te[i] = AllocTreeedge(numobjects, true);
+		te[i] = AllocTreeedge(arena, true);
 	}
 	SetEdgePoints(te[0], tp[1], tp[0]);
 	SetEdgePoints(te[1], tp[3], tp[2]);
@@ -373,7 +382,7 @@ btreeleaf_t* BuildBaseCell(
 	SetEdgePoints(te[11], tp[7], tp[3]);
 	btreeface_t* tf[6];
 	for (int i = 0; i < 6; i++) {
-		tf[i] = AllocTreeface(numobjects, true);
+		tf[i] = AllocTreeface(arena, true);
 	}
 	AttachEdgeToFace(tf[0], te[4], true);
 	AttachEdgeToFace(tf[0], te[6], false);
@@ -400,7 +409,7 @@ btreeleaf_t* BuildBaseCell(
 	AttachEdgeToFace(tf[5], te[6], true);
 	AttachEdgeToFace(tf[5], te[7], false);
 	btreeleaf_t* tl;
-	tl = AllocTreeleaf(numobjects, false);
+	tl = AllocTreeleaf(arena, false);
 	for (int i = 0; i < 6; i++) {
 		SetFaceLeafs(tf[i], tl, leaf_outside);
 	}
@@ -442,14 +451,14 @@ void RemovePointFromEdge(
 	RemoveEdgeFromList(tp->edges, te, side);
 }
 
-void DeletePoint(int& numobjects, btreepoint_t* tp) {
+void DeletePoint(btree_arena& arena, btreepoint_t* tp) {
 	if (!tp->edges->empty()) {
 		PrintOnce("DeletePoint: internal error: point used by edge.");
 		hlassume(false, assume_msg::first);
 	}
-	delete tp->edges;
-	delete tp;
-	numobjects--;
+	arena.allocator.delete_object(tp->edges);
+	arena.allocator.delete_object(tp);
+	arena.numobjects--;
 }
 
 void RemoveFaceFromList(btreeface_l* fl, btreeface_t* tf, bool side) {
@@ -470,7 +479,7 @@ void RemoveEdgeFromFace(btreeface_t* tf, btreeedge_t* te, bool side) {
 }
 
 void DeleteEdge(
-	int& numobjects, btreeedge_t* te
+	btree_arena& arena, btreeedge_t* te
 ) // warning: points in this edge could be freed if not reference by any
   // other edges
 {
@@ -479,19 +488,19 @@ void DeleteEdge(
 		hlassume(false, assume_msg::first);
 	}
 	if (!te->infinite) {
-		delete te->brink;
+		arena.allocator.delete_object(te->brink);
 	}
 	for (int side = 0; side < 2; side++) {
 		btreepoint_t* tp;
 		tp = GetPointFromEdge(te, side);
 		RemovePointFromEdge(te, tp, side);
 		if (tp->edges->empty()) {
-			DeletePoint(numobjects, tp);
+			DeletePoint(arena, tp);
 		}
 	}
-	delete te->faces;
-	delete te;
-	numobjects--;
+	arena.allocator.delete_object(te->faces);
+	arena.allocator.delete_object(te);
+	arena.numobjects--;
 }
 
 btreeleaf_t* GetLeafFromFace(btreeface_t* tf, bool side) {
@@ -513,7 +522,7 @@ void RemoveFaceFromLeaf(btreeleaf_t* tl, btreeface_t* tf, bool side) {
 }
 
 void DeleteFace(
-	int& numobjects, btreeface_t* tf
+	btree_arena& arena, btreeface_t* tf
 ) // warning: edges in this face could be freed if not reference by any
   // other faces
 {
@@ -523,7 +532,7 @@ void DeleteFace(
 		RemoveFaceFromList(te->faces, tf, ei->side);
 		tf->edges->erase(ei);
 		if (te->faces->empty()) {
-			DeleteEdge(numobjects, te);
+			DeleteEdge(arena, te);
 		}
 	}
 	for (int side = 0; side < 2; side++) {
@@ -532,27 +541,27 @@ void DeleteFace(
 			hlassume(false, assume_msg::first);
 		}
 	}
-	delete tf->edges;
-	delete tf;
-	numobjects--;
+	arena.allocator.delete_object(tf->edges);
+	arena.allocator.delete_object(tf);
+	arena.numobjects--;
 }
 
-void DeleteLeaf(int& numobjects, btreeleaf_t* tl) {
+void DeleteLeaf(btree_arena& arena, btreeleaf_t* tl) {
 	btreeface_l::iterator fi;
 	while ((fi = tl->faces->begin()) != tl->faces->end()) {
 		btreeface_t* tf = fi->f;
 		RemoveFaceFromLeaf(tl, tf, fi->side);
 		if (!tf->leafs[false].l && !tf->leafs[true].l) {
-			DeleteFace(numobjects, tf);
+			DeleteFace(arena, tf);
 		}
 	}
-	delete tl->faces;
-	delete tl;
-	numobjects--;
+	arena.allocator.delete_object(tl->faces);
+	arena.allocator.delete_object(tl);
+	arena.numobjects--;
 }
 
 void SplitTreeLeaf(
-	int& numobjects,
+	btree_arena& arena,
 	btreeleaf_t* tl,
 	mapplane_t const * plane,
 	int planenum,
@@ -638,7 +647,7 @@ void SplitTreeLeaf(
 				btreepoint_t* tp0 = GetPointFromEdge(te, false);
 				btreepoint_t* tp1 = GetPointFromEdge(te, true);
 				btreepoint_t* tpmid = AllocTreepoint(
-					numobjects, te->infinite
+					arena, te->infinite
 				);
 				tpmid->tmp_tested = true;
 				tpmid->tmp_dist = 0;
@@ -649,21 +658,25 @@ void SplitTreeLeaf(
 					tpmid->v[k] = tp0->v[k]
 						+ frac * (tp1->v[k] - tp0->v[k]);
 				}
-				btreeedge_t* te0 = AllocTreeedge(numobjects, te->infinite);
+				btreeedge_t* te0 = AllocTreeedge(arena, te->infinite);
 				SetEdgePoints(te0, tp0, tpmid);
 				te0->tmp_tested = true;
 				te0->tmp_side = tp0->tmp_side;
 				if (!te0->infinite) {
-					te0->brink = new bbrink_t{ CopyBrink(*te->brink) };
+					te0->brink = arena.allocator.new_object<bbrink_t>(
+						CopyBrink(*te->brink)
+					);
 					te0->brink->start = tpmid->v;
 					te0->brink->stop = tp0->v;
 				}
-				btreeedge_t* te1 = AllocTreeedge(numobjects, te->infinite);
+				btreeedge_t* te1 = AllocTreeedge(arena, te->infinite);
 				SetEdgePoints(te1, tpmid, tp1);
 				te1->tmp_tested = true;
 				te1->tmp_side = tp1->tmp_side;
 				if (!te1->infinite) {
-					te1->brink = new bbrink_t(CopyBrink(*te->brink));
+					te1->brink = arena.allocator.new_object<bbrink_t>(
+						CopyBrink(*te->brink)
+					);
 					te1->brink->start = tp1->v;
 					te1->brink->stop = tpmid->v;
 				}
@@ -673,7 +686,7 @@ void SplitTreeLeaf(
 					AttachEdgeToFace(fj->f, te1, fj->side);
 					RemoveEdgeFromFace(fj->f, te, fj->side);
 				}
-				DeleteEdge(numobjects, te);
+				DeleteEdge(arena, te);
 				restart = true;
 			}
 		}
@@ -698,7 +711,7 @@ void SplitTreeLeaf(
 		}
 		if (tf->tmp_side == face_side::cross) {
 			btreeface_t *frontface, *backface;
-			frontface = AllocTreeface(numobjects, tf->infinite);
+			frontface = AllocTreeface(arena, tf->infinite);
 			if (!tf->infinite) {
 				frontface->plane = tf->plane;
 				frontface->planenum = tf->planenum;
@@ -711,7 +724,7 @@ void SplitTreeLeaf(
 			);
 			frontface->tmp_tested = true;
 			frontface->tmp_side = face_side::front;
-			backface = AllocTreeface(numobjects, tf->infinite);
+			backface = AllocTreeface(arena, tf->infinite);
 			if (!tf->infinite) {
 				backface->plane = tf->plane;
 				backface->planenum = tf->planenum;
@@ -791,12 +804,12 @@ void SplitTreeLeaf(
 				}
 
 				btreeedge_t* te;
-				te = AllocTreeedge(numobjects, tf->infinite);
+				te = AllocTreeedge(arena, tf->infinite);
 				SetEdgePoints(te, vertex->first, vertex2->first);
 				if (!te->infinite) {
-					te->brink = new bbrink_t{
+					te->brink = arena.allocator.new_object<bbrink_t>(
 						CreateBrink(vertex2->first->v, vertex->first->v)
-					};
+					);
 					if (GetLeafFromFace(tf, tf->planeside)->infinite
 					    || GetLeafFromFace(tf, !tf->planeside)->infinite) {
 						PrintOnce(
@@ -825,7 +838,7 @@ void SplitTreeLeaf(
 			for (int side = 0; side < 2; side++) {
 				RemoveFaceFromLeaf(GetLeafFromFace(tf, side), tf, side);
 			}
-			DeleteFace(numobjects, tf);
+			DeleteFace(arena, tf);
 			restart = true;
 		}
 	}
@@ -838,8 +851,8 @@ void SplitTreeLeaf(
 			);
 			hlassume(false, assume_msg::first);
 		}
-		front = AllocTreeleaf(numobjects, tl->infinite);
-		back = AllocTreeleaf(numobjects, tl->infinite);
+		front = AllocTreeleaf(arena, tl->infinite);
+		back = AllocTreeleaf(arena, tl->infinite);
 		front->clipnode = c0;
 		back->clipnode = c1;
 
@@ -888,7 +901,7 @@ void SplitTreeLeaf(
 
 		if (tmp_side == face_side::cross) {
 			btreeface_t* tf;
-			tf = AllocTreeface(numobjects, tl->infinite);
+			tf = AllocTreeface(arena, tl->infinite);
 			if (!tf->infinite) {
 				tf->plane = plane;
 				tf->planenum = planenum;
@@ -980,18 +993,18 @@ void SplitTreeLeaf(
 				}
 			}
 		}
-		DeleteLeaf(numobjects, tl);
+		DeleteLeaf(arena, tl);
 	}
 }
 
-void BuildTreeCells_r(int& numobjects, bclipnode_t* c) {
+void BuildTreeCells_r(btree_arena& arena, bclipnode_t* c) {
 	if (c->isleaf) {
 		return;
 	}
 	btreeleaf_t *tl, *front, *back;
 	tl = c->treeleaf;
 	SplitTreeLeaf(
-		numobjects,
+		arena,
 		tl,
 		c->plane,
 		c->planenum,
@@ -1004,8 +1017,8 @@ void BuildTreeCells_r(int& numobjects, bclipnode_t* c) {
 	c->treeleaf = nullptr;
 	c->children[0]->treeleaf = front;
 	c->children[1]->treeleaf = back;
-	BuildTreeCells_r(numobjects, c->children[0]);
-	BuildTreeCells_r(numobjects, c->children[1]);
+	BuildTreeCells_r(arena, c->children[0]);
+	BuildTreeCells_r(arena, c->children[1]);
 }
 
 #define MAXCLIPNODES (MAX_MAP_CLIPNODES * 8)
@@ -1028,7 +1041,7 @@ bclipnode_t* ExpandClipnodes_r(
 	} else {
 		c->isleaf = false;
 		c->planenum = clipnodes[headnode].planenum;
-		c->plane = &g_mapPlanes[c->planenum];
+		c->plane = &g_bspMapPlanes[c->planenum];
 		for (int k = 0; k < 2; k++) {
 			c->children[k] = ExpandClipnodes_r(
 				bclipnodes,
@@ -1065,34 +1078,33 @@ void ExpandClipnodes(
 	delete[] bclipnodes;
 }
 
-void BuildTreeCells(bbrinkinfo_t* info) {
-	info->numobjects = 0;
-	info->leaf_outside = BuildOutside(info->numobjects);
+void BuildTreeCells(bbrinkinfo_t* info, btree_arena& arena) {
+	info->leaf_outside = BuildOutside(arena);
 	info->clipnodes[0].treeleaf = BuildBaseCell(
-		info->numobjects,
+		arena,
 		&info->clipnodes[0],
 		hlbsp_bogus_range,
 		info->leaf_outside
 	);
-	BuildTreeCells_r(info->numobjects, &info->clipnodes[0]);
+	BuildTreeCells_r(arena, &info->clipnodes[0]);
 }
 
-void DeleteTreeCells_r(int& numobjects, bclipnode_t* node) {
+void DeleteTreeCells_r(btree_arena& arena, bclipnode_t* node) {
 	if (node->treeleaf) {
-		DeleteLeaf(numobjects, node->treeleaf);
+		DeleteLeaf(arena, node->treeleaf);
 		node->treeleaf = nullptr;
 	}
 	if (!node->isleaf) {
-		DeleteTreeCells_r(numobjects, node->children[0]);
-		DeleteTreeCells_r(numobjects, node->children[1]);
+		DeleteTreeCells_r(arena, node->children[0]);
+		DeleteTreeCells_r(arena, node->children[1]);
 	}
 }
 
-void DeleteTreeCells(bbrinkinfo_t* info) {
-	DeleteLeaf(info->numobjects, info->leaf_outside);
+void DeleteTreeCells(bbrinkinfo_t* info, btree_arena& arena) {
+	DeleteLeaf(arena, info->leaf_outside);
 	info->leaf_outside = nullptr;
-	DeleteTreeCells_r(info->numobjects, &info->clipnodes[0]);
-	if (info->numobjects != 0) {
+	DeleteTreeCells_r(arena, &info->clipnodes[0]);
+	if (arena.numobjects != 0) {
 		PrintOnce("DeleteTreeCells: internal error: numobjects != 0");
 		hlassume(false, assume_msg::first);
 	}
@@ -1327,12 +1339,8 @@ void PrintCircle(bcircle_t const * c) {
 	}
 }
 
-bool AddPartition(
-	bclipnode_t* clipnode,
-	int planenum,
-	bool planeside,
-	contents_t content,
-	bbrinklevel brinktype
+static bool CanAddPartition(
+	bclipnode_t const * clipnode, int planenum, bool planeside
 ) {
 	// make sure we won't do any harm
 	btreeface_l::iterator fi;
@@ -1348,7 +1356,7 @@ bool AddPartition(
 		for (ei = fi->f->edges->begin(); ei != fi->f->edges->end(); ei++) {
 			for (side = 0; side < 2; side++) {
 				btreepoint_t* tp = GetPointFromEdge(ei->e, side);
-				mapplane_t const & plane = g_mapPlanes[planenum];
+				mapplane_t const & plane = g_bspMapPlanes[planenum];
 				double dist = dot_product(tp->v, plane.normal) - plane.dist;
 				if (planeside ? dist < -ON_EPSILON : dist > ON_EPSILON) {
 					return false;
@@ -1363,6 +1371,16 @@ bool AddPartition(
 		return false; // the whole leaf is on the plane, or the leaf doesn't
 		              // consist of any vertex
 	}
+	return true;
+}
+
+static void AddPartition(
+	bclipnode_t* clipnode,
+	int planenum,
+	bool planeside,
+	contents_t content,
+	bbrinklevel brinktype
+) {
 	bpartition_t* p = new bpartition_t{};
 	hlassume(p != nullptr, assume_msg::NoMemory);
 	p->next = clipnode->partitions;
@@ -1371,259 +1389,304 @@ bool AddPartition(
 	p->content = content;
 	p->type = brinktype;
 	clipnode->partitions = p;
-	return true;
 }
 
-void AnalyzeBrinks(bbrinkinfo_t* info) {
-	int countgood = 0;
-	int countinvalid = 0;
-	int countskipped = 0;
-	int countfixed = 0;
-	int i, j, side;
-	for (i = 0; i < info->numbrinks; i++) {
-		bbrink_t& b = *info->brinks[i];
-		if (b.numnodes <= 5) // quickly reject the most trivial brinks
-		{
-			if (b.numnodes != 3 && b.numnodes != 5) {
-				PrintOnce("AnalyzeBrinks: internal error 1");
-				hlassume(false, assume_msg::first);
-			}
-			// because a brink won't necessarily be split twice after its
-			// creation
-			if (b.numnodes == 3) {
-				if (g_developer >= developer_level::fluff) {
-					Developer(
-						developer_level::fluff,
-						"Brink wasn't split by the second plane:\n"
-					);
-					PrintBrink(b);
-				}
-				countinvalid++;
-			} else {
-				countgood++;
-			}
-			continue;
-		}
+enum class brink_analysis {
+	good,
+	skipped,
+	fixed,
+	invalid
+};
 
-		if (b.numnodes > 2 * MAXBRINKWEDGES - 1) {
-			if (g_developer >= developer_level::megaspam) {
-				Developer(
-					developer_level::megaspam,
-					"Skipping complicated brink:\n"
-				);
-				PrintBrink(b);
-			}
-			countskipped++;
-			continue;
+// A partition that AnalyzeBrink() wants to add to a clipnode. They are
+// added once all the brinks have been analyzed, in the order of the
+// brinks, so the brinks can be analyzed at the same time
+struct pending_partition final {
+	bclipnode_t* clipnode;
+	int planenum;
+	bool planeside;
+	bbrinklevel type;
+};
+
+static brink_analysis
+AnalyzeBrink(bbrink_t& b, std::vector<pending_partition>& partitions) {
+	int j, side;
+	if (b.numnodes <= 5) // quickly reject the most trivial brinks
+	{
+		if (b.numnodes != 3 && b.numnodes != 5) {
+			PrintOnce("AnalyzeBrinks: internal error 1");
+			hlassume(false, assume_msg::first);
 		}
-		bcircle_t c;
-		// build the circle to find out the planes a player may move along
-		if (!CalculateCircle(&b, &c)) {
+		// because a brink won't necessarily be split twice after its
+		// creation
+		if (b.numnodes == 3) {
 			if (g_developer >= developer_level::fluff) {
 				Developer(
 					developer_level::fluff,
-					"CalculateCircle failed for brink:\n"
+					"Brink wasn't split by the second plane:\n"
 				);
 				PrintBrink(b);
 			}
-			countinvalid++;
-			continue;
+			return brink_analysis::invalid;
 		}
+		return brink_analysis::good;
+	}
 
-		int transitionfound[2];
-		bsurface_t* transitionpos[2];
-		bool transitionside[2];
-		for (side = 0; side < 2; side++) {
-			transitionfound[side] = 0;
-			for (j = 1; j < c.numwedges[side];
-			     j++) // we will later consider the surfaces on the first
-			          // split
-			{
-				bsurface_t* s = &c.surfaces[side][j];
-				if ((s->prev->content == contents_t::SOLID)
-				    != (s->next->content == contents_t::SOLID)) {
-					transitionfound[side]++;
-					transitionpos[side] = s;
-					transitionside[side]
-						= (s->prev->content == contents_t::SOLID);
-				}
-			}
+	if (b.numnodes > 2 * MAXBRINKWEDGES - 1) {
+		if (g_developer >= developer_level::megaspam) {
+			Developer(
+				developer_level::megaspam,
+				"Skipping complicated brink:\n"
+			);
+			PrintBrink(b);
 		}
-
-		if (transitionfound[0] == 0 || transitionfound[1] == 0) {
-			// at least one side of the first split is completely SOLID or
-			// EMPTY. no bugs in this case
-			countgood++;
-			continue;
+		return brink_analysis::skipped;
+	}
+	bcircle_t c;
+	// build the circle to find out the planes a player may move along
+	if (!CalculateCircle(&b, &c)) {
+		if (g_developer >= developer_level::fluff) {
+			Developer(
+				developer_level::fluff,
+				"CalculateCircle failed for brink:\n"
+			);
+			PrintBrink(b);
 		}
+		return brink_analysis::invalid;
+	}
 
-		if (transitionfound[0] > 1 || transitionfound[1] > 1
-		    || (c.surfaces[0][0].prev->content == contents_t::SOLID)
-		        != (c.surfaces[0][0].next->content == contents_t::SOLID)
-		    || (c.surfaces[1][0].prev->content == contents_t::SOLID)
-		        != (c.surfaces[1][0].next->content == contents_t::SOLID)) {
-			// there must at least 3 transition surfaces now, which is too
-			// complicated. just leave it unfixed
-			if (g_developer >= developer_level::megaspam) {
-				Developer(
-					developer_level::megaspam,
-					"Skipping complicated brink:\n"
-				);
-				PrintBrink(b);
-				PrintCircle(&c);
+	int transitionfound[2];
+	bsurface_t* transitionpos[2];
+	bool transitionside[2];
+	for (side = 0; side < 2; side++) {
+		transitionfound[side] = 0;
+		for (j = 1; j < c.numwedges[side];
+		     j++) // we will later consider the surfaces on the first
+		          // split
+		{
+			bsurface_t* s = &c.surfaces[side][j];
+			if ((s->prev->content == contents_t::SOLID)
+			    != (s->next->content == contents_t::SOLID)) {
+				transitionfound[side]++;
+				transitionpos[side] = s;
+				transitionside[side]
+					= (s->prev->content == contents_t::SOLID);
 			}
-			countskipped++;
-			continue;
 		}
+	}
 
-		if (transitionside[1] != !transitionside[0]) {
-			PrintOnce("AnalyzeBrinks: internal error 2");
-			hlassume(false, assume_msg::first);
+	if (transitionfound[0] == 0 || transitionfound[1] == 0) {
+		// at least one side of the first split is completely SOLID or
+		// EMPTY. no bugs in this case
+		return brink_analysis::good;
+	}
+
+	if (transitionfound[0] > 1 || transitionfound[1] > 1
+	    || (c.surfaces[0][0].prev->content == contents_t::SOLID)
+	        != (c.surfaces[0][0].next->content == contents_t::SOLID)
+	    || (c.surfaces[1][0].prev->content == contents_t::SOLID)
+	        != (c.surfaces[1][0].next->content == contents_t::SOLID)) {
+		// there must at least 3 transition surfaces now, which is too
+		// complicated. just leave it unfixed
+		if (g_developer >= developer_level::megaspam) {
+			Developer(
+				developer_level::megaspam,
+				"Skipping complicated brink:\n"
+			);
+			PrintBrink(b);
+			PrintCircle(&c);
 		}
-		bool bfix = false;
-		bool berror = false;
-		double3_array vup = { 0, 0, 1 };
-		bool isfloor;
-		bool onfloor;
-		bool blocking;
-		{
-			isfloor = false;
-			for (int side2 = 0; side2 < 2; side2++) {
-				double3_array normal = vector_scale(
-					transitionpos[side2]->normal,
-					transitionside[side2] ? -1.0 : 1.0
-				); // pointing from SOLID to EMPTY
-				if (dot_product(normal, vup) > BRINK_FLOOR_THRESHOLD) {
-					isfloor = true;
-				}
+		return brink_analysis::skipped;
+	}
+
+	if (transitionside[1] != !transitionside[0]) {
+		PrintOnce("AnalyzeBrinks: internal error 2");
+		hlassume(false, assume_msg::first);
+	}
+	bool bfix = false;
+	bool berror = false;
+	double3_array vup = { 0, 0, 1 };
+	bool isfloor;
+	bool onfloor;
+	bool blocking;
+	{
+		isfloor = false;
+		for (int side2 = 0; side2 < 2; side2++) {
+			double3_array normal = vector_scale(
+				transitionpos[side2]->normal,
+				transitionside[side2] ? -1.0 : 1.0
+			); // pointing from SOLID to EMPTY
+			if (dot_product(normal, vup) > BRINK_FLOOR_THRESHOLD) {
+				isfloor = true;
 			}
 		}
-		{
-			onfloor = false;
-			for (int side2 = 0; side2 < 2; side2++) {
-				btreepoint_t* tp = GetPointFromEdge(b.edge, side2);
-				if (tp->infinite) {
-					continue;
-				}
-				for (btreeedge_l::iterator ei = tp->edges->begin();
-				     ei != tp->edges->end();
-				     ei++) {
-					for (btreeface_l::iterator fi = ei->e->faces->begin();
-					     fi != ei->e->faces->end();
-					     fi++) {
-						if (fi->f->infinite
-						    || GetLeafFromFace(fi->f, false)->infinite
-						    || GetLeafFromFace(fi->f, true)->infinite) {
-							PrintOnce(
-								"AnalyzeBrinks: internal error: an infinite object contains a finite object"
-							);
-							hlassume(false, assume_msg::first);
-						}
-						for (int side3 = 0; side3 < 2; side3++) {
-							double3_array normal = vector_scale(
-								fi->f->plane->normal,
-								(fi->f->planeside != (bool) side3) ? -1.0
-																   : 1.0
-							);
-							if (dot_product(normal, vup)
-							        > BRINK_FLOOR_THRESHOLD
-							    && GetLeafFromFace(fi->f, side3)
-							            ->clipnode->content
-							        == contents_t::SOLID
-							    && GetLeafFromFace(fi->f, !side3)
-							            ->clipnode->content
-							        != contents_t::SOLID) {
-								onfloor = true;
-							}
+	}
+	{
+		onfloor = false;
+		for (int side2 = 0; side2 < 2; side2++) {
+			btreepoint_t* tp = GetPointFromEdge(b.edge, side2);
+			if (tp->infinite) {
+				continue;
+			}
+			for (btreeedge_l::iterator ei = tp->edges->begin();
+			     ei != tp->edges->end();
+			     ei++) {
+				for (btreeface_l::iterator fi = ei->e->faces->begin();
+				     fi != ei->e->faces->end();
+				     fi++) {
+					if (fi->f->infinite
+					    || GetLeafFromFace(fi->f, false)->infinite
+					    || GetLeafFromFace(fi->f, true)->infinite) {
+						PrintOnce(
+							"AnalyzeBrinks: internal error: an infinite object contains a finite object"
+						);
+						hlassume(false, assume_msg::first);
+					}
+					for (int side3 = 0; side3 < 2; side3++) {
+						double3_array normal = vector_scale(
+							fi->f->plane->normal,
+							(fi->f->planeside != (bool) side3) ? -1.0
+															   : 1.0
+						);
+						if (dot_product(normal, vup)
+						        > BRINK_FLOOR_THRESHOLD
+						    && GetLeafFromFace(fi->f, side3)
+						            ->clipnode->content
+						        == contents_t::SOLID
+						    && GetLeafFromFace(fi->f, !side3)
+						            ->clipnode->content
+						        != contents_t::SOLID) {
+							onfloor = true;
 						}
 					}
 				}
 			}
 		}
-		// this code does not fix all the bugs, it only aims to fix most of
-		// the bugs
-		for (side = 0; side < 2; side++) {
-			bsurface_t* smovement = transitionpos[side];
-			bsurface_t* s;
-			for (s = transitionside[!side] ? &c.surfaces[!side][0]
-			                               : &c.surfaces[side][0];
-			     ;
-			     s = transitionside[!side] ? s->next->next
-			                               : s->prev->prev) {
-				bwedge_t* w = transitionside[!side] ? s->next : s->prev;
-				bsurface_t* snext = transitionside[!side] ? w->next
-														  : w->prev;
-				double dot = dot_product(
-					cross_product(smovement->normal, snext->normal), c.axis
+	}
+	// this code does not fix all the bugs, it only aims to fix most of
+	// the bugs
+	for (side = 0; side < 2; side++) {
+		bsurface_t* smovement = transitionpos[side];
+		bsurface_t* s;
+		for (s = transitionside[!side] ? &c.surfaces[!side][0]
+		                               : &c.surfaces[side][0];
+		     ;
+		     s = transitionside[!side] ? s->next->next
+		                               : s->prev->prev) {
+			bwedge_t* w = transitionside[!side] ? s->next : s->prev;
+			bsurface_t* snext = transitionside[!side] ? w->next
+													  : w->prev;
+			double dot = dot_product(
+				cross_product(smovement->normal, snext->normal), c.axis
+			);
+			if (transitionside[!side] ? dot < 0.01 : dot > -0.01) {
+				break;
+			}
+			if (w->content != contents_t::SOLID) {
+				break;
+			}
+			if (snext
+			    == (transitionside[!side] ? &c.surfaces[side][0]
+			                              : &c.surfaces[!side][0])) {
+				Developer(
+					developer_level::error,
+					"AnalyzeBrinks: surface past 0\n"
 				);
-				if (transitionside[!side] ? dot < 0.01 : dot > -0.01) {
-					break;
-				}
-				if (w->content != contents_t::SOLID) {
-					break;
-				}
-				if (snext
-				    == (transitionside[!side] ? &c.surfaces[side][0]
-				                              : &c.surfaces[!side][0])) {
-					Developer(
-						developer_level::error,
-						"AnalyzeBrinks: surface past 0\n"
-					);
-					break;
-				}
-				bfix = true;
-				{
-					if (dot_product(smovement->normal, s->normal) > 0.01) {
-						blocking = false;
-					} else {
-						blocking = true;
-					}
-				}
-				bclipnode_t* clipnode = b.nodes[w->nodenum].clipnode;
-				int planenum = b.nodes[smovement->nodenum].planenum;
-				bool planeside = transitionside[!side]
-					? smovement->nodeside
-					: !smovement->nodeside;
-				bbrinklevel brinktype;
-				brinktype = isfloor
-					? (blocking ? bbrinklevel::floor_blocking
-				                : bbrinklevel::floor)
-					: onfloor ? (blocking ? bbrinklevel::wall_blocking
-				                          : bbrinklevel::wall)
-							  : bbrinklevel::any;
-				if (!AddPartition(
-						clipnode,
-						planenum,
-						planeside,
-						contents_t::EMPTY,
-						brinktype
-					)) {
-					berror = true;
+				break;
+			}
+			bfix = true;
+			{
+				if (dot_product(smovement->normal, s->normal) > 0.01) {
+					blocking = false;
+				} else {
+					blocking = true;
 				}
 			}
+			bclipnode_t* clipnode = b.nodes[w->nodenum].clipnode;
+			int planenum = b.nodes[smovement->nodenum].planenum;
+			bool planeside = transitionside[!side]
+				? smovement->nodeside
+				: !smovement->nodeside;
+			bbrinklevel brinktype;
+			brinktype = isfloor
+				? (blocking ? bbrinklevel::floor_blocking
+			                : bbrinklevel::floor)
+				: onfloor ? (blocking ? bbrinklevel::wall_blocking
+			                          : bbrinklevel::wall)
+						  : bbrinklevel::any;
+			if (CanAddPartition(clipnode, planenum, planeside)) {
+				partitions.emplace_back(pending_partition{
+					.clipnode = clipnode,
+					.planenum = planenum,
+					.planeside = planeside,
+					.type = brinktype });
+			} else {
+				berror = true;
+			}
 		}
-		if (berror) {
-			if (g_developer >= developer_level::fluff) {
-				Developer(
-					developer_level::fluff,
-					"AddPartition failed for brink:\n"
+	}
+	if (berror) {
+		if (g_developer >= developer_level::fluff) {
+			Developer(
+				developer_level::fluff,
+				"AddPartition failed for brink:\n"
+			);
+			PrintBrink(b);
+		}
+		return brink_analysis::invalid;
+	} else if (!bfix) {
+		return brink_analysis::good;
+	} else {
+		return brink_analysis::fixed;
+	}
+}
+
+// Brinks analyzed by one task
+constexpr int brinksPerTask = 256;
+
+void AnalyzeBrinks(bbrinkinfo_t* info) {
+	int const numTasks = (info->numbrinks + brinksPerTask - 1)
+		/ brinksPerTask;
+	std::vector<std::vector<pending_partition>> partitions(numTasks);
+	std::array<std::atomic<int>, 4> counts{};
+	{
+		task_group tasks;
+		for (int task = 0; task < numTasks; task++) {
+			tasks.spawn([info, task, &partitions, &counts]() {
+				int const begin = task * brinksPerTask;
+				int const end = std::min(
+					begin + brinksPerTask, info->numbrinks
 				);
-				PrintBrink(b);
-			}
-			countinvalid++;
-		} else if (!bfix) {
-			countgood++;
-		} else {
-			countfixed++;
+				for (int i = begin; i < end; i++) {
+					brink_analysis const result = AnalyzeBrink(
+						*info->brinks[i], partitions[task]
+					);
+					counts[std::to_underlying(result)]++;
+				}
+			});
+		}
+		tasks.wait();
+	}
+
+	for (std::vector<pending_partition> const & taskPartitions :
+	     partitions) {
+		for (pending_partition const & pending : taskPartitions) {
+			AddPartition(
+				pending.clipnode,
+				pending.planenum,
+				pending.planeside,
+				contents_t::EMPTY,
+				pending.type
+			);
 		}
 	}
 	Developer(
 		developer_level::message,
 		"brinks: good = %d skipped = %d fixed = %d invalid = %d\n",
-		countgood,
-		countskipped,
-		countfixed,
-		countinvalid
+		counts[std::to_underlying(brink_analysis::good)].load(),
+		counts[std::to_underlying(brink_analysis::skipped)].load(),
+		counts[std::to_underlying(brink_analysis::fixed)].load(),
+		counts[std::to_underlying(brink_analysis::invalid)].load()
 	);
 }
 
@@ -1725,11 +1788,12 @@ bbrinkinfo_t* CreateBrinkinfo(dclipnode_t const * clipnodes, int headnode) {
 	try {
 		info = new bbrinkinfo_t{};
 		ExpandClipnodes(info, clipnodes, headnode);
-		BuildTreeCells(info);
+		btree_arena arena;
+		BuildTreeCells(info, arena);
 		CollectBrinks(info);
 		AnalyzeBrinks(info);
 		FreeBrinks(info);
-		DeleteTreeCells(info);
+		DeleteTreeCells(info, arena);
 		SortPartitions(info);
 	} catch (std::bad_alloc const &) {
 		hlassume(false, assume_msg::NoMemory);
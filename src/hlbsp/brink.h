@@ -3,6 +3,7 @@
 #include "hlbsp.h"
 
 #include <list>
+#include <memory_resource>
 
 struct btreepoint_t; // 0d object
 struct btreeedge_t;  // 1d object
@@ -49,8 +50,8 @@ struct btreeleaf_r final {
 	bool side;
 };
 
-using btreeedge_l = std::list<btreeedge_r>;
-using btreeface_l = std::list<btreeface_r>;
+using btreeedge_l = std::pmr::list<btreeedge_r>;
+using btreeface_l = std::pmr::list<btreeface_r>;
 
 struct btreeleaf_t final {
 	btreeface_l* faces;
@@ -89,7 +90,6 @@ struct bbrinkinfo_t final {
 	btreeleaf_t* leaf_outside;
 	bbrink_t** brinks;
 	int numclipnodes;
-	int numobjects;
 	int numbrinks;
 };
 
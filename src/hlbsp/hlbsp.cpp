@@ -5,21 +5,28 @@
 #include "cmdlinecfg.h"
 #include "external_types/external_types.h"
 #include "filelib.h"
+#include "hull_file.h"
 #include "hull_size.h"
+#include "intermediate_files.h"
 #include "log.h"
 #include "mathtypes.h"
+#include "object_pool.h"
+#include "phase_trace.h"
+#include "threads.h"
 #include "time_counter.h"
 #include "utf8.h"
 #include "winding.h"
 
 #include <algorithm>
+#include <array>
 #include <cstring>
 #include <filesystem>
+#include <optional>
 #include <utility>
 
 using namespace std::literals;
 
-hull_sizes g_hull_size{ standard_hull_sizes };
+hull_sizes g_bspHullSizes{ standard_hull_sizes };
 
 std::filesystem::path g_bspfilename;
 std::filesystem::path g_pointfilename;
@@ -42,22 +49,19 @@ bool g_nofill = DEFAULT_NOFILL; // dont fill "-nofill"
 bool g_noinsidefill = DEFAULT_NOINSIDEFILL;
 bool g_notjunc = DEFAULT_NOTJUNC;
 bool g_nobrink = DEFAULT_NOBRINK;
-bool g_noclip = DEFAULT_NOCLIP;            // no clipping hull "-noclip"
-bool g_chart = cli_option_defaults::chart; // print out chart? "-chart"
-bool g_estimate
-	= cli_option_defaults::estimate; // estimate mode "-estimate"
-bool g_info = cli_option_defaults::info;
+bool g_bspNoclip = DEFAULT_NOCLIP;   // no clipping hull "-noclip"
 bool g_bLeakOnly = DEFAULT_LEAKONLY; // leakonly mode "-leakonly"
 bool g_bLeaked = false;
 int g_subdivide_size = DEFAULT_SUBDIVIDE_SIZE;
 
-bool g_bUseNullTex = cli_option_defaults::nulltex; // "-nonulltex"
+bool g_bspUseNullTex = cli_option_defaults::nulltex; // "-nonulltex"
 
 bool g_nohull2 = false;
 
 bool g_viewportal = false;
+bool g_binaryportals = false;
 
-vector_inplace<mapplane_t, MAX_INTERNAL_MAP_PLANES> g_mapPlanes;
+vector_inplace<mapplane_t, MAX_INTERNAL_MAP_PLANES> g_bspMapPlanes;
 
 // =====================================================================================
 //  GetParamsFromEnt
@@ -65,7 +69,7 @@ vector_inplace<mapplane_t, MAX_INTERNAL_MAP_PLANES> g_mapPlanes;
 //      info_compile_parameters entity. each tool should have its own
 //      version of this to handle its own specific settings.
 // =====================================================================================
-void GetParamsFromEnt(entity_t* mapent) {
+static void GetParamsFromEnt(entity_t* mapent) {
 	Log("\nCompile Settings detected from info_compile_parameters entity\n"
 	);
 
@@ -143,13 +147,13 @@ void GetParamsFromEnt(entity_t* mapent) {
 	*/
 	iTmp = IntForKey(mapent, u8"nocliphull");
 	if (iTmp == 0) {
-		g_noclip = false;
+		g_bspNoclip = false;
 	} else if (iTmp == 1) {
-		g_noclip = true;
+		g_bspNoclip = true;
 	}
 	Log("%30s [ %-9s ]\n",
 	    "Clipping Hull Generation",
-	    g_noclip ? "off" : "on");
+	    g_bspNoclip ? "off" : "on");
 
 	//////////////////
 	Verbose("\n");
@@ -195,7 +199,7 @@ void SplitFace(
 
 	if (in->detailLevel) {
 		// Put front face in front node, and back face in back node.
-		mapplane_t const & faceplane = g_mapPlanes[in->planenum];
+		mapplane_t const & faceplane = g_bspMapPlanes[in->planenum];
 		distOverrideForFuncDetail = dot_product(
 			faceplane.normal, split->normal
 		);
@@ -210,10 +214,12 @@ void SplitFace(
 	if (frontWinding) {
 		if (backWinding) {
 			// The winding is split
-			*back = new face_t{ NewFaceFromFace(*in) };
-			*front = new face_t{ NewFaceFromFace(*in) };
+			*back = AllocFace();
+			**back = NewFaceFromFace(*in);
+			*front = AllocFace();
+			**front = NewFaceFromFace(*in);
 
-			delete in;
+			FreeFace(in);
 			(*back)->pts.assign_range(backWinding.points());
 			(*front)->pts.assign_range(frontWinding.points());
 		} else {
@@ -228,24 +234,35 @@ void SplitFace(
 //  AllocFace
 // =====================================================================================
 face_t* AllocFace() {
-	face_t* f;
+	return object_pool<face_t>::allocate();
+}
 
-	f = (face_t*) calloc(1, sizeof(face_t));
-	*f = {};
+// =====================================================================================
+//  FreeFace
+// =====================================================================================
+void FreeFace(face_t* f) {
+	object_pool<face_t>::deallocate(f);
+}
 
-	return f;
+// =====================================================================================
+//  AllocNode
+// =====================================================================================
+node_t* AllocNode() {
+	return object_pool<node_t>::allocate();
+}
+
+// =====================================================================================
+//  FreeNode
+// =====================================================================================
+void FreeNode(node_t* n) {
+	object_pool<node_t>::deallocate(n);
 }
 
 // =====================================================================================
 //  AllocPortal
 // =====================================================================================
 bsp_portal_t* AllocPortal() {
-	bsp_portal_t* p;
-
-	p = (bsp_portal_t*) malloc(sizeof(bsp_portal_t));
-	*p = {};
-
-	return p;
+	return object_pool<bsp_portal_t>::allocate();
 }
 
 // =====================================================================================
@@ -253,40 +270,50 @@ bsp_portal_t* AllocPortal() {
 // =====================================================================================
 void FreePortal(bsp_portal_t* p) // consider: inline
 {
-	free(p);
+	object_pool<bsp_portal_t>::deallocate(p);
+}
+
+// =====================================================================================
+//  ReleaseModelObjects
+//      Whatever the trees of the model still hold is freed along with the
+//      rest, except for the sides of brushes and the windings of portals,
+//      which aren't pooled
+// =====================================================================================
+void ReleaseModelObjects() {
+	object_pool<face_t>::release();
+	object_pool<node_t>::release();
+	object_pool<bsp_portal_t>::release();
+	object_pool<bsp_brush>::release();
 }
 
-side_t* NewSideFromSide(side_t const * s) {
-	side_t* news;
-	news = new side_t{};
+bsp_side* NewSideFromSide(bsp_side const * s) {
+	bsp_side* news;
+	news = new bsp_side{};
 	news->plane = s->plane;
 	news->wind = accurate_winding(s->wind);
 	return news;
 }
 
-brush_t* AllocBrush() {
-	brush_t* b;
-	b = (brush_t*) malloc(sizeof(brush_t));
-	*b = {};
-	return b;
+bsp_brush* AllocBrush() {
+	return object_pool<bsp_brush>::allocate();
 }
 
-void FreeBrush(brush_t* b) {
+void FreeBrush(bsp_brush* b) {
 	if (b->sides) {
-		side_t *s, *next;
+		bsp_side *s, *next;
 		for (s = b->sides; s; s = next) {
 			next = s->next;
 			delete s;
 		}
 	}
-	free(b);
+	object_pool<bsp_brush>::deallocate(b);
 	return;
 }
 
-brush_t* NewBrushFromBrush(brush_t const * b) {
-	brush_t* newb;
+bsp_brush* NewBrushFromBrush(bsp_brush const * b) {
+	bsp_brush* newb;
 	newb = AllocBrush();
-	side_t *s, **pnews;
+	bsp_side *s, **pnews;
 	for (s = b->sides, pnews = &newb->sides; s;
 	     s = s->next, pnews = &(*pnews)->next) {
 		*pnews = NewSideFromSide(s);
@@ -294,8 +321,8 @@ brush_t* NewBrushFromBrush(brush_t const * b) {
 	return newb;
 }
 
-void ClipBrush(brush_t** b, mapplane_t const * split, double epsilon) {
-	side_t *s{}, **pnext{};
+void ClipBrush(bsp_brush** b, mapplane_t const * split, double epsilon) {
+	bsp_side *s{}, **pnext{};
 	for (pnext = &(*b)->sides, s = *pnext; s; s = *pnext) {
 		if (s->wind.mutating_clip(
 				split->normal, split->dist, false, epsilon
@@ -320,7 +347,7 @@ void ClipBrush(brush_t** b, mapplane_t const * split, double epsilon) {
 		}
 	}
 	if (!wind.empty()) {
-		s = new side_t{};
+		s = new bsp_side{};
 		s->plane = *split;
 		s->wind = std::move(wind);
 		s->next = (*b)->sides;
@@ -330,7 +357,10 @@ void ClipBrush(brush_t** b, mapplane_t const * split, double epsilon) {
 }
 
 void SplitBrush(
-	brush_t* in, mapplane_t const * split, brush_t** front, brush_t** back
+	bsp_brush* in,
+	mapplane_t const * split,
+	bsp_brush** front,
+	bsp_brush** back
 )
 // 'in' will be freed
 {
@@ -339,7 +369,7 @@ void SplitBrush(
 	bool onback;
 	onfront = false;
 	onback = false;
-	side_t* s;
+	bsp_side* s;
 	for (s = in->sides; s; s = s->next) {
 		switch (s->wind.WindingOnPlaneSide(
 			split->normal, split->dist, 2 * ON_EPSILON
@@ -388,9 +418,9 @@ void SplitBrush(
 	return;
 }
 
-brush_t*
+bsp_brush*
 BrushFromBox(double3_array const & mins, double3_array const & maxs) {
-	brush_t* b = AllocBrush();
+	bsp_brush* b = AllocBrush();
 	mapplane_t planes[6];
 	for (int k = 0; k < 3; k++) {
 		planes[k].normal.fill(0.0);
@@ -400,7 +430,7 @@ BrushFromBox(double3_array const & mins, double3_array const & maxs) {
 		planes[k + 3].normal[k] = -1.0;
 		planes[k + 3].dist = -maxs[k];
 	}
-	b->sides = new side_t{};
+	b->sides = new bsp_side{};
 	b->sides->plane = planes[0];
 	b->sides->wind = accurate_winding(planes[0]);
 	for (int k = 1; k < 6; k++) {
@@ -413,11 +443,11 @@ BrushFromBox(double3_array const & mins, double3_array const & maxs) {
 }
 
 void CalcBrushBounds(
-	brush_t const * b, double3_array& mins, double3_array& maxs
+	bsp_brush const * b, double3_array& mins, double3_array& maxs
 ) {
 	mins.fill(hlbsp_bogus_range);
 	maxs.fill(-hlbsp_bogus_range);
-	for (side_t* s = b->sides; s; s = s->next) {
+	for (bsp_side* s = b->sides; s; s = s->next) {
 		bounding_box const bounds = s->wind.getBounds();
 		mins = vector_minimums(mins, bounds.mins);
 		maxs = vector_maximums(maxs, bounds.maxs);
@@ -534,10 +564,10 @@ bool should_face_have_facestyle_null(
 			return true;
 		}
 	}
-	if (g_bUseNullTex) {
+	if (g_bspUseNullTex) {
 		// NULL faces are only of facetype face_null if we are using NULL
 		// texture stripping
-		return g_bUseNullTex && textureName.is_ordinary_null();
+		return g_bspUseNullTex && textureName.is_ordinary_null();
 	}
 	// Otherwise, under normal cases, NULL-textured faces should have
 	// facestyle face_normal
@@ -563,11 +593,127 @@ static facestyle_e which_style_for_face(face_t const & f) {
 	return style;
 }
 
+// A .p0-.p3 or .b0-.b3 file from HLCSG, in either the text or the binary
+// format
+struct hull_file_input final {
+	std::optional<hull_file_reader> binary;
+	FILE* text{ nullptr };
+};
+
+static hull_file_input open_hull_file(
+	std::filesystem::path const & filePath,
+	std::array<char, 8> const & binaryMagic
+) {
+	std::optional<hull_file_reader> binary{
+		hull_file_reader::open(filePath, binaryMagic)
+	};
+	if (binary.has_value()) {
+		return { .binary = std::move(binary) };
+	}
+
+	FILE* text = open_intermediate_file(filePath, "r");
+	if (!text) {
+		Error("Can't open %s", filePath.c_str());
+	}
+	return { .text = text };
+}
+
+// =====================================================================================
+//  read_surfaces_binary
+// =====================================================================================
+static surfchain_t* read_surfaces_binary(hull_file_reader& file) {
+	double inaccuracy_count = 0.0, inaccuracy_total = 0.0,
+		   inaccuracy_max = 0.0;
+
+	std::vector<face_t*> validFacesByPlane; // Index type: plane_count
+	validFacesByPlane.resize(g_numplanes, nullptr);
+
+	for (int faceNum = 0;; ++faceNum) {
+		if (file.at_end()) {
+			return nullptr;
+		}
+		poly_file_face const face{ file.read_record<poly_file_face>() };
+		if (face.planenum == -1) // end of model
+		{
+			Developer(
+				developer_level::megaspam,
+				"inaccuracy: average %.8f max %.8f\n",
+				inaccuracy_total / inaccuracy_count,
+				inaccuracy_max
+			);
+			break;
+		}
+		if (face.numPoints > MAXPOINTS) {
+			Error(
+				"read_surfaces (face %i): %u > MAXPOINTS\nThis is caused by a face with too many verticies (typically found on end-caps of high-poly cylinders)\n",
+				faceNum,
+				face.numPoints
+			);
+		}
+		if (face.planenum < 0 || face.planenum >= g_numplanes) {
+			Error(
+				"read_surfaces (face %i): %i >= g_numplanes\n",
+				faceNum,
+				face.planenum
+			);
+		}
+		if (face.texinfo != no_texinfo && face.texinfo >= g_numtexinfo) {
+			Error(
+				"read_surfaces (face %i): %i >= g_numtexinfo",
+				faceNum,
+				face.texinfo
+			);
+		}
+		std::span<double3_array const> const points{
+			file.read_points(face.numPoints)
+		};
+
+		if ((get_texture_by_number(face.texinfo)).is_skip()) {
+			Verbose(
+				"read_surfaces (face %i): skipping a surface", faceNum
+			);
+			continue;
+		}
+
+		face_t* f = AllocFace();
+		f->detailLevel = face.detailLevel;
+		f->planenum = face.planenum;
+		f->texturenum = face.texinfo;
+		f->contents = contents_t{ face.contents };
+		f->facestyle = which_style_for_face(*f);
+
+		f->next = validFacesByPlane[face.planenum];
+		validFacesByPlane[face.planenum] = f;
+
+		for (double3_array const & point : points) {
+			f->pts.emplace_back(point);
+		}
+		if (developer_level::megaspam <= g_developer) {
+			mapplane_t const & plane = g_bspMapPlanes[f->planenum];
+			for (double3_array const & point : points) {
+				double const inaccuracy = fabs(
+					dot_product(point, plane.normal) - plane.dist
+				);
+				inaccuracy_count++;
+				inaccuracy_total += inaccuracy;
+				inaccuracy_max = std::max(inaccuracy, inaccuracy_max);
+			}
+		}
+	}
+
+	return SurflistFromValidFaces(validFacesByPlane);
+}
+
 // =====================================================================================
 //  read_surfaces
 // =====================================================================================
-static surfchain_t* read_surfaces(std::optional<FILE*> fileUnlessSkippedHull
-) {
+static surfchain_t*
+read_surfaces(std::optional<hull_file_input>& fileUnlessSkippedHull) {
+	if (fileUnlessSkippedHull.has_value()
+	    && fileUnlessSkippedHull->binary.has_value()) {
+		return read_surfaces_binary(fileUnlessSkippedHull->binary.value());
+	}
+
 	detail_level detailLevel;
 	int planenum, numpoints;
 	texinfo_count g_texinfo;
@@ -583,7 +729,7 @@ static surfchain_t* read_surfaces(std::optional<FILE*> fileUnlessSkippedHull
 
 	// read in the polygons
 	if (fileUnlessSkippedHull.has_value()) {
-		FILE* file = fileUnlessSkippedHull.value();
+		FILE* file = fileUnlessSkippedHull->text;
 		while (1) {
 			line++;
 			int r = fscanf(
@@ -653,7 +799,7 @@ static surfchain_t* read_surfaces(std::optional<FILE*> fileUnlessSkippedHull
 				continue;
 			}
 
-			face_t* f = new face_t{};
+			face_t* f = AllocFace();
 			f->detailLevel = detailLevel;
 			f->planenum = planenum;
 			f->texturenum = g_texinfo;
@@ -674,7 +820,7 @@ static surfchain_t* read_surfaces(std::optional<FILE*> fileUnlessSkippedHull
 				}
 				f->pts.emplace_back(v);
 				if (developer_level::megaspam <= g_developer) {
-					mapplane_t const & plane = g_mapPlanes[f->planenum];
+					mapplane_t const & plane = g_bspMapPlanes[f->planenum];
 					inaccuracy = fabs(
 						dot_product(f->pts[i], plane.normal) - plane.dist
 					);
@@ -690,13 +836,60 @@ static surfchain_t* read_surfaces(std::optional<FILE*> fileUnlessSkippedHull
 	return SurflistFromValidFaces(validFacesByPlane);
 }
 
-static brush_t* ReadBrushes(std::optional<FILE*> fileUnlessSkippedHull) {
-	brush_t* brushes = nullptr;
+static bsp_brush* ReadBrushesBinary(hull_file_reader& file) {
+	bsp_brush* brushes = nullptr;
+	while (1) {
+		brush_file_brush const brush{ file.read_record<brush_file_brush>() };
+		if (brush.brushinfo == -1) {
+			break;
+		}
+		bsp_brush* b;
+		b = AllocBrush();
+		b->next = brushes;
+		brushes = b;
+		bsp_side** psn;
+		psn = &b->sides;
+		while (1) {
+			brush_file_side const side{ file.read_record<brush_file_side>(
+			) };
+			if (side.planenum == -1) {
+				break;
+			}
+			if (side.planenum < 0 || side.planenum >= g_numplanes) {
+				Error(
+					"ReadBrushes: plane %i >= g_numplanes", side.planenum
+				);
+			}
+			std::span<double3_array const> const points{
+				file.read_points(side.numPoints)
+			};
+			bsp_side* s = new bsp_side{};
+			s->plane = g_bspMapPlanes[side.planenum ^ 1];
+			s->wind = accurate_winding{};
+			s->wind.reserve_point_storage(points.size());
+			for (double3_array const & point : points) {
+				s->wind.push_point(point);
+			}
+			s->wind.reverse_points();
+			s->next = nullptr;
+			*psn = s;
+			psn = &s->next;
+		}
+	}
+	return brushes;
+}
+
+static bsp_brush*
+ReadBrushes(std::optional<hull_file_input>& fileUnlessSkippedHull) {
+	bsp_brush* brushes = nullptr;
 	if (!fileUnlessSkippedHull.has_value()) {
 		return brushes;
 	}
+	if (fileUnlessSkippedHull->binary.has_value()) {
+		return ReadBrushesBinary(fileUnlessSkippedHull->binary.value());
+	}
 
-	FILE* file = fileUnlessSkippedHull.value();
+	FILE* file = fileUnlessSkippedHull->text;
 	while (1) {
 		int r;
 		int brushinfo;
@@ -711,11 +904,11 @@ static brush_t* ReadBrushes(std::optional<FILE*> fileUnlessSkippedHull) {
 		if (brushinfo == -1) {
 			break;
 		}
-		brush_t* b;
+		bsp_brush* b;
 		b = AllocBrush();
 		b->next = brushes;
 		brushes = b;
-		side_t** psn;
+		bsp_side** psn;
 		psn = &b->sides;
 		while (1) {
 			int planenum;
@@ -727,8 +920,8 @@ static brush_t* ReadBrushes(std::optional<FILE*> fileUnlessSkippedHull) {
 			if (planenum == -1) {
 				break;
 			}
-			side_t* s = new side_t{};
-			s->plane = g_mapPlanes[planenum ^ 1];
+			bsp_side* s = new bsp_side{};
+			s->plane = g_bspMapPlanes[planenum ^ 1];
 			s->wind = accurate_winding{};
 			s->wind.reserve_point_storage(numpoints);
 			for (int x = 0; x < numpoints; x++) {
@@ -750,20 +943,97 @@ static brush_t* ReadBrushes(std::optional<FILE*> fileUnlessSkippedHull) {
 	return brushes;
 }
 
+// One hull of a model, from its surfaces to its finished tree
+struct hull_build final {
+	surfchain_t* surfs{ nullptr };
+	bsp_brush* detailbrushes{ nullptr };
+	node_t* nodes{ nullptr };
+	node_t outsideNode{};
+	std::optional<leak_trail> leak{};
+};
+
+// =====================================================================================
+//  AddHullToModelBounds
+// =====================================================================================
+static void AddHullToModelBounds(
+	dmodel_t* model, surfchain_t const * surfs, int modnum, hull_count hullNum
+) {
+	if (surfs->mins[0] > surfs->maxs[0]) {
+		Developer(
+			hullNum == 0 ? developer_level::fluff : developer_level::message,
+			"model %d hull %d empty\n",
+			modnum,
+			hullNum
+		);
+		return;
+	}
+
+	double3_array mins = vector_subtract(
+		surfs->mins, g_bspHullSizes[hullNum][0]
+	);
+	double3_array maxs = vector_subtract(
+		surfs->maxs, g_bspHullSizes[hullNum][1]
+	);
+	for (std::size_t i = 0; i < 3; ++i) {
+		if (mins[i] > maxs[i]) {
+			double tmp;
+			tmp = (mins[i] + maxs[i]) / 2;
+			mins[i] = tmp;
+			maxs[i] = tmp;
+		}
+	}
+	for (std::size_t i = 0; i < 3; ++i) {
+		model->maxs[i] = std::max(model->maxs[i], (float) maxs[i]);
+		model->mins[i] = std::min(model->mins[i], (float) mins[i]);
+	}
+}
+
+// =====================================================================================
+//  BuildHull
+//      Everything up to writing the hull to the BSP data, which has to be
+//      done in hull order. The hulls of a model are built at the same time
+// =====================================================================================
+static void
+BuildHull(hull_build& hull, hull_count hullNum, int modnum, bool fill) {
+	// SolidBSP generates a node tree
+	hull.nodes = SolidBSP(
+		hull.surfs,
+		hull.detailbrushes,
+		modnum == 0,
+		hullNum,
+		&hull.outsideNode
+	);
+
+	// build all the portals in the bsp tree
+	// some portals are solid polygons, and some are paths to other leafs
+	if (fill) {
+		if (hullNum == 0 && !g_noinsidefill) {
+			FillInside(hull.nodes, &hull.outsideNode);
+		}
+		hull.nodes = FillOutside(
+			hull.nodes, &hull.outsideNode, hullNum, hull.leak
+		);
+	}
+
+	FreePortals(hull.nodes);
+}
+
 // =====================================================================================
 //  ProcessModel
 // =====================================================================================
 static bool ProcessModel(
 	bsp_data& bspData,
-	std::span<std::optional<FILE*>, NUM_HULLS> brushFiles,
-	std::span<std::optional<FILE*>, NUM_HULLS> polyFiles
+	std::span<std::optional<hull_file_input>, NUM_HULLS> brushFiles,
+	std::span<std::optional<hull_file_input>, NUM_HULLS> polyFiles
 ) {
-	surfchain_t* surfs = read_surfaces(polyFiles[0]);
+	std::array<hull_build, NUM_HULLS> hulls{};
+	hulls[0].surfs = read_surfaces(polyFiles[0]);
 
-	if (!surfs) {
+	if (!hulls[0].surfs) {
 		return false; // all models are done
 	}
-	brush_t* detailbrushes = ReadBrushes(brushFiles[0]);
+	trace_phase phase{ "ProcessModel" };
+	hulls[0].detailbrushes = ReadBrushes(brushFiles[0]);
 
 	hlassume(
 		bspData.mapModelsLength < MAX_MAP_MODELS,
@@ -777,57 +1047,51 @@ static bool ProcessModel(
 
 	//    Log("ProcessModel: %i (%i f)\n", modnum, model->numfaces);
 
-	hull_count hullNum = 0;
+	// the clipping hulls are simpler
+	hull_count const numHulls = g_bspNoclip ? 1 : NUM_HULLS;
+	for (hull_count hullNum = 1; hullNum < numHulls; hullNum++) {
+		hulls[hullNum].surfs = read_surfaces(polyFiles[hullNum]);
+		hulls[hullNum].detailbrushes = ReadBrushes(brushFiles[hullNum]);
+	}
 
 	model->mins.fill(99999);
 	model->maxs.fill(-99999);
-	{
-		if (surfs->mins[0] > surfs->maxs[0]) {
-			Developer(
-				developer_level::fluff,
-				"model %d hull %d empty\n",
-				modnum,
-				hullNum
-			);
-		} else {
-			double3_array mins = vector_subtract(
-				surfs->mins, g_hull_size[hullNum][0]
-			);
-			double3_array maxs = vector_subtract(
-				surfs->maxs, g_hull_size[hullNum][1]
-			);
-			for (std::size_t i = 0; i < 3; ++i) {
-				if (mins[i] > maxs[i]) {
-					double tmp;
-					tmp = (mins[i] + maxs[i]) / 2;
-					mins[i] = tmp;
-					maxs[i] = tmp;
-				}
-			}
-			for (std::size_t i = 0; i < 3; ++i) {
-				model->maxs[i] = std::max(model->maxs[i], (float) maxs[i]);
-				model->mins[i] = std::min(model->mins[i], (float) mins[i]);
-			}
-		}
+	for (hull_count hullNum = 0; hullNum < numHulls; hullNum++) {
+		AddHullToModelBounds(model, hulls[hullNum].surfs, modnum, hullNum);
 	}
 
-	// SolidBSP generates a node tree
-	node_t* nodes = SolidBSP(surfs, detailbrushes, modnum == 0, hullNum);
+	// The hulls don't depend on each other until they're written, which
+	// is done in hull order below
+	bool const fill = bspData.mapModelsLength == 1
+		&& !g_nofill; // assume non-world bmodels are simple
+	RunTasks(
+		[&hulls, numHulls, modnum, fill]() {
+			task_group tasks;
+			for (hull_count hullNum = 1; hullNum < numHulls; hullNum++) {
+				tasks.spawn([&hulls, hullNum, modnum, fill]() {
+					BuildHull(hulls[hullNum], hullNum, modnum, fill);
+				});
+			}
+			BuildHull(hulls[0], 0, modnum, fill);
+			tasks.wait();
+		},
+		"BuildHulls"
+	);
 
-	// build all the portals in the bsp tree
-	// some portals are solid polygons, and some are paths to other leafs
-	if (bspData.mapModelsLength == 1
-	    && !g_nofill) // assume non-world bmodels are simple
-	{
-		if (!g_noinsidefill) {
-			FillInside(nodes);
+	if (fill) {
+		bool leaked = false;
+		for (hull_count hullNum = 0; hullNum < numHulls; hullNum++) {
+			if (hulls[hullNum].leak) {
+				ReportLeak(hulls[hullNum].leak.value(), hullNum);
+				leaked = true;
+			}
+		}
+		if (!leaked) {
+			RemoveLeakFiles();
 		}
-		nodes = FillOutside(
-			nodes, (g_bLeaked != true), 0
-		); // make a leakfile if bad
 	}
 
-	FreePortals(nodes);
+	node_t* nodes = hulls[0].nodes;
 
 	// fix tjunctions
 	tjunc(nodes);
@@ -848,7 +1112,7 @@ static bool ProcessModel(
 			Error("No valid planes.\n");
 		}
 		nodes->planenum = 0; // arbitrary plane
-		nodes->children[0] = new node_t{};
+		nodes->children[0] = AllocNode();
 		nodes->children[0]->planenum = -1;
 		nodes->children[0]->contents = contents_t::EMPTY;
 		nodes->children[0]->isdetail = false;
@@ -860,7 +1124,7 @@ static bool ProcessModel(
 		);
 		nodes->children[0]->mins = {};
 		nodes->children[0]->maxs = {};
-		nodes->children[1] = new node_t{};
+		nodes->children[1] = AllocNode();
 		nodes->children[1]->planenum = -1;
 		nodes->children[1]->contents = contents_t::EMPTY;
 		nodes->children[1]->isdetail = false;
@@ -884,81 +1148,36 @@ static bool ProcessModel(
 	model->numfaces = g_numfaces - model->firstface;
 	model->visleafs = g_numleafs - startleafs;
 
-	bool skipClip = false;
-	if (g_noclip) {
+	if (g_bspNoclip) {
 		// Store empty content type in headnode pointers to
 		//  signify lack of clipping information in a way that doesn't crash
 		// the game engine at runtime
 		model->headnode[1] = std::to_underlying(contents_t::EMPTY);
 		model->headnode[2] = std::to_underlying(contents_t::EMPTY);
 		model->headnode[3] = std::to_underlying(contents_t::EMPTY);
-		skipClip = true;
 	}
 
-	if (!skipClip) {
-		// the clipping hulls are simpler
-		for (hullNum = 1; hullNum < NUM_HULLS; hullNum++) {
-			surfs = read_surfaces(polyFiles[hullNum]);
-			detailbrushes = ReadBrushes(brushFiles[hullNum]);
-			{
-				if (surfs->mins[0] > surfs->maxs[0]) {
-					Developer(
-						developer_level::message,
-						"model %d hull %d empty\n",
-						modnum,
-						hullNum
-					);
-				} else {
-					double3_array mins = vector_subtract(
-						surfs->mins, g_hull_size[hullNum][0]
-					);
-					double3_array maxs = vector_subtract(
-						surfs->maxs, g_hull_size[hullNum][1]
-					);
-					for (std::size_t i = 0; i < 3; ++i) {
-						if (mins[i] > maxs[i]) {
-							double tmp;
-							tmp = (mins[i] + maxs[i]) / 2;
-							mins[i] = tmp;
-							maxs[i] = tmp;
-						}
-					}
-					for (std::size_t i = 0; i < 3; ++i) {
-						model->maxs[i] = std::max(
-							model->maxs[i], (float) maxs[i]
-						);
-						model->mins[i] = std::min(
-							model->mins[i], (float) mins[i]
-						);
-					}
-				}
-			}
-			nodes = SolidBSP(surfs, detailbrushes, modnum == 0, hullNum);
-			if (g_nummodels == 1
-			    && !g_nofill) // assume non-world bmodels are simple
-			{
-				nodes = FillOutside(nodes, (g_bLeaked != true), hullNum);
-			}
-			FreePortals(nodes);
-			/*
-			    KGP 12/31/03 - need to test that the head clip node isn't
-			empty; if it is we need to set model->headnode equal to the
-			content type of the head, or create a trivial single-node case
-			where the content type is the same for both leaves if setting
-			the content type is invalid.
-			*/
-			if (nodes->is_leaf_node()) // empty!
-			{
-				model->headnode[hullNum] = std::to_underlying(
-					nodes->contents
-				);
-			} else {
-				model->headnode[hullNum] = g_numclipnodes;
-				WriteClipNodes(nodes);
-			}
+	for (hull_count hullNum = 1; hullNum < numHulls; hullNum++) {
+		nodes = hulls[hullNum].nodes;
+		/*
+		    KGP 12/31/03 - need to test that the head clip node isn't
+		empty; if it is we need to set model->headnode equal to the
+		content type of the head, or create a trivial single-node case
+		where the content type is the same for both leaves if setting
+		the content type is invalid.
+		*/
+		if (nodes->is_leaf_node()) // empty!
+		{
+			model->headnode[hullNum] = std::to_underlying(nodes->contents);
+		} else {
+			model->headnode[hullNum] = g_numclipnodes;
+			WriteClipNodes(nodes);
 		}
 	}
 
+	// The trees have been written, so what's left of them can go at once
+	ReleaseModelObjects();
+
 	{
 		entity_t* ent;
 		ent = EntityForModel(modnum);
@@ -1063,6 +1282,8 @@ static void Usage() {
 	Log("    -texdata #     : Alter maximum texture memory limit (in kb)\n"
 	);
 	Log("    -chart         : display bsp statitics\n");
+	Log("    -trace         : write a Chrome trace of the compile phases to mapname.bsp.trace.json\n"
+	);
 	Log("    -low | -high   : run program an altered priority level\n");
 	Log("    -nolog         : don't generate the compile logfiles\n");
 	Log("    -threads #     : manually specify the number of threads to run\n"
@@ -1082,6 +1303,8 @@ static void Usage() {
 
 	Log("    -viewportal    : Show portal boundaries in 'mapname_portal.pts' file\n"
 	);
+	Log("    -binaryportals : Write the .prt for HLVIS in a faster binary format that map editors can't read\n"
+	);
 
 	Log("    -verbose       : compile with verbose messages\n");
 	Log("    -noinfo        : Do not show tool configuration information\n"
@@ -1147,7 +1370,7 @@ static void Settings() {
 
 	// HLBSP Specific Settings
 	Log("noclip              [ %7s ] [ %7s ]\n",
-	    g_noclip ? "on" : "off",
+	    g_bspNoclip ? "on" : "off",
 	    DEFAULT_NOCLIP ? "on" : "off");
 	Log("nofill              [ %7s ] [ %7s ]\n",
 	    g_nofill ? "on" : "off",
@@ -1165,7 +1388,7 @@ static void Settings() {
 	    g_noclipnodemerge ? "on" : "off",
 	    DEFAULT_NOCLIPNODEMERGE ? "on" : "off");
 	Log("null tex. stripping [ %7s ] [ %7s ]\n",
-	    g_bUseNullTex ? "on" : "off",
+	    g_bspUseNullTex ? "on" : "off",
 	    cli_option_defaults::nulltex ? "on" : "off");
 	Log("notjunc             [ %7s ] [ %7s ]\n",
 	    g_notjunc ? "on" : "off",
@@ -1186,6 +1409,9 @@ static void Settings() {
 	Log("remove hull 2       [ %7s ] [ %7s ]\n",
 	    g_nohull2 ? "on" : "off",
 	    "off");
+	Log("binary portals      [ %7s ] [ %7s ]\n",
+	    g_binaryportals ? "on" : "off",
+	    "off");
 	Log("\n\n");
 }
 
@@ -1198,7 +1424,7 @@ ProcessFile(std::filesystem::path const & mapBasePath, bsp_data& bspData) {
 	g_portfilename = path_to_temp_file_with_extension(
 		mapBasePath, u8".prt"
 	);
-	std::filesystem::remove(g_portfilename);
+	remove_intermediate_file(g_portfilename);
 
 	g_pointfilename = path_to_temp_file_with_extension(
 		mapBasePath, u8".pts"
@@ -1216,8 +1442,8 @@ ProcessFile(std::filesystem::path const & mapBasePath, bsp_data& bspData) {
 	std::filesystem::remove(g_extentfilename);
 	// open the hull files
 
-	std::array<std::optional<FILE*>, NUM_HULLS> brushFiles;
-	std::array<std::optional<FILE*>, NUM_HULLS> polyFiles;
+	std::array<std::optional<hull_file_input>, NUM_HULLS> brushFiles;
+	std::array<std::optional<hull_file_input>, NUM_HULLS> polyFiles;
 
 	for (hull_count i = 0; i < NUM_HULLS; ++i) {
 		if (g_nohull2 && i == 2) {
@@ -1229,30 +1455,20 @@ ProcessFile(std::filesystem::path const & mapBasePath, bsp_data& bspData) {
 				mapBasePath, brushFileExtensions[i]
 			)
 		};
-		FILE* brushFile = fopen(brushFilePath.c_str(), "r");
-		if (!brushFile) {
-			Error("Can't open %s", brushFilePath.c_str());
-		}
-		brushFiles[i] = brushFile;
+		brushFiles[i] = open_hull_file(brushFilePath, brushFileMagic);
 
 		std::filesystem::path polyFilePath{
 			path_to_temp_file_with_extension(
 				mapBasePath, polyFileExtensions[i]
 			)
 		};
-
-		FILE* polyFile = fopen(polyFilePath.c_str(), "r");
-		if (!polyFile) {
-			Error("Can't open %s", polyFilePath.c_str());
-		}
-
-		polyFiles[i] = polyFile;
+		polyFiles[i] = open_hull_file(polyFilePath, polyFileMagic);
 	}
 	{
 		std::filesystem::path filePath{
 			path_to_temp_file_with_extension(mapBasePath, u8".hsz")
 		};
-		FILE* f = fopen(filePath.c_str(), "r");
+		FILE* f = open_intermediate_file(filePath, "r");
 		if (!f) {
 			Warning("Couldn't open %s", filePath.c_str());
 		} else {
@@ -1265,12 +1481,12 @@ ProcessFile(std::filesystem::path const & mapBasePath, bsp_data& bspData) {
 				if (count != 6) {
 					Error("Load hull size (line %i): scanf failure", i + 1);
 				}
-				g_hull_size[i][0][0] = x1;
-				g_hull_size[i][0][1] = y1;
-				g_hull_size[i][0][2] = z1;
-				g_hull_size[i][1][0] = x2;
-				g_hull_size[i][1][1] = y2;
-				g_hull_size[i][1][2] = z2;
+				g_bspHullSizes[i][0][0] = x1;
+				g_bspHullSizes[i][0][1] = y1;
+				g_bspHullSizes[i][0][2] = z1;
+				g_bspHullSizes[i][1][0] = x2;
+				g_bspHullSizes[i][1][1] = y2;
+				g_bspHullSizes[i][1][2] = z2;
 			}
 			fclose(f);
 		}
@@ -1279,7 +1495,7 @@ ProcessFile(std::filesystem::path const & mapBasePath, bsp_data& bspData) {
 	g_bspfilename = path_to_temp_file_with_extension(mapBasePath, u8".bsp");
 	// load the output of csg
 	LoadBSPFile(g_bspfilename.c_str());
-	parse_entities_from_bsp_file();
+	parse_entities_from_bsp_file(GetParamsFromEnt);
 
 	Settings();
 
@@ -1287,13 +1503,13 @@ ProcessFile(std::filesystem::path const & mapBasePath, bsp_data& bspData) {
 		std::filesystem::path planeFilePath{
 			path_to_temp_file_with_extension(mapBasePath, u8".pln")
 		};
-		FILE* planefile = fopen(planeFilePath.c_str(), "rb");
+		FILE* planefile = open_intermediate_file(planeFilePath, "rb");
 		if (!planefile) {
 			Warning("Couldn't open %s", planeFilePath.c_str());
-			g_mapPlanes.clear(); // Unnecessary?
+			g_bspMapPlanes.clear(); // Unnecessary?
 
 			for (int i = 0; i < g_numplanes; i++) {
-				mapplane_t& mp = g_mapPlanes.emplace_back();
+				mapplane_t& mp = g_bspMapPlanes.emplace_back();
 				dplane_t const & dp = g_dplanes[i];
 				mp.normal = to_double3(dp.normal);
 				mp.dist = dp.dist;
@@ -1305,10 +1521,10 @@ ProcessFile(std::filesystem::path const & mapBasePath, bsp_data& bspData) {
 			// actually necessary, as the values are overwritten right
 			// after. Consider adding a version of resize that doesn't
 			// initialize values unless the element type requires it
-			g_mapPlanes.resize(g_numplanes, {});
+			g_bspMapPlanes.resize(g_numplanes, {});
 			SafeRead(
 				planefile,
-				g_mapPlanes.data(),
+				g_bspMapPlanes.data(),
 				g_numplanes * sizeof(mapplane_t)
 			);
 			fclose(planefile);
@@ -1329,36 +1545,38 @@ ProcessFile(std::filesystem::path const & mapBasePath, bsp_data& bspData) {
 	// Because the bsp file has been updated, these polyfiles are no longer
 	// valid.
 	for (int i = 0; i < NUM_HULLS; i++) {
-		if (polyFiles[i].has_value()) {
-			fclose(polyFiles[i].value());
-			polyFiles[i] = std::nullopt;
+		if (polyFiles[i].has_value() && polyFiles[i]->text) {
+			fclose(polyFiles[i]->text);
 		}
-		std::filesystem::remove(path_to_temp_file_with_extension(
+		polyFiles[i] = std::nullopt;
+		remove_intermediate_file(path_to_temp_file_with_extension(
 			mapBasePath, polyFileExtensions[i]
 		));
 
-		if (brushFiles[i].has_value()) {
-			fclose(brushFiles[i].value());
-			brushFiles[i] = std::nullopt;
+		if (brushFiles[i].has_value() && brushFiles[i]->text) {
+			fclose(brushFiles[i]->text);
 		}
-		std::filesystem::remove(path_to_temp_file_with_extension(
+		brushFiles[i] = std::nullopt;
+		remove_intermediate_file(path_to_temp_file_with_extension(
 			mapBasePath, brushFileExtensions[i]
 		));
 	}
-	std::filesystem::remove(
+	remove_intermediate_file(
 		path_to_temp_file_with_extension(mapBasePath, u8".hsz")
 	);
-	std::filesystem::remove(
+	remove_intermediate_file(
 		path_to_temp_file_with_extension(mapBasePath, u8".pln")
 	);
 }
 
 // =====================================================================================
-//  main
+//  hlbsp_main
+//      The main() of hlbsp, and the BSP stage of HLCOMPILE
 // =====================================================================================
-int main(int const argc, char** argv) {
+int hlbsp_main(int const argc, char** argv) {
 	int i;
 	char const * mapname_from_arg = nullptr;
+	bool trace = false;
 
 	g_Program = u8"HLBSP";
 
@@ -1404,7 +1622,7 @@ int main(int const argc, char** argv) {
 				} else if (strings_equal_with_ascii_case_insensitivity(
 							   argv[i], u8"-noclip"
 						   )) {
-					g_noclip = true;
+					g_bspNoclip = true;
 				} else if (strings_equal_with_ascii_case_insensitivity(
 							   argv[i], u8"-nofill"
 						   )) {
@@ -1457,6 +1675,10 @@ int main(int const argc, char** argv) {
 							   argv[i], u8"-chart"
 						   )) {
 					g_chart = true;
+				} else if (strings_equal_with_ascii_case_insensitivity(
+							   argv[i], u8"-trace"
+						   )) {
+					trace = true;
 				} else if (strings_equal_with_ascii_case_insensitivity(
 							   argv[i], u8"-low"
 						   )) {
@@ -1475,7 +1697,7 @@ int main(int const argc, char** argv) {
 				else if (strings_equal_with_ascii_case_insensitivity(
 							 argv[i], u8"-nonulltex"
 						 )) {
-					g_bUseNullTex = false;
+					g_bspUseNullTex = false;
 				}
 
 				else if (strings_equal_with_ascii_case_insensitivity(
@@ -1550,6 +1772,10 @@ int main(int const argc, char** argv) {
 							   argv[i], u8"-viewportal"
 						   )) {
 					g_viewportal = true;
+				} else if (strings_equal_with_ascii_case_insensitivity(
+							   argv[i], u8"-binaryportals"
+						   )) {
+					g_binaryportals = true;
 				} else if (strings_equal_with_ascii_case_insensitivity(
 							   argv[i], u8"-texdata"
 						   )) {
@@ -1584,6 +1810,11 @@ int main(int const argc, char** argv) {
 
 			OpenLog();
 			atexit(CloseLog);
+			if (trace) {
+				start_tracing(path_to_temp_file_with_extension(
+					g_Mapname, u8".bsp.trace.json"
+				));
+			}
 			ThreadSetDefault();
 			ThreadSetPriority(g_threadpriority);
 			LogStart(argcold, argvold);
@@ -6,8 +6,10 @@
 #include "winding.h"
 
 #include <filesystem>
+#include <optional>
+#include <vector>
 
-extern vector_inplace<mapplane_t, MAX_INTERNAL_MAP_PLANES> g_mapPlanes;
+extern vector_inplace<mapplane_t, MAX_INTERNAL_MAP_PLANES> g_bspMapPlanes;
 
 constexpr std::u8string_view entitiesVoidFilename(u8"entities.void");
 constexpr std::u8string_view entitiesVoidExt(u8".void");
@@ -90,16 +92,15 @@ struct surfchain_t final {
 	surface_t* surfaces;
 };
 
-struct side_t final {
-	side_t* next;
+struct bsp_side final {
+	bsp_side* next;
 	mapplane_t plane; // Facing inside (reversed when loading brush file)
 	accurate_winding wind; // (Also reversed)
 };
 
-struct brush_t
-	final { // TODO: Rename this, since we have a brush_t in HLCSG too
-	brush_t* next;
-	side_t* sides;
+struct bsp_brush final {
+	bsp_brush* next;
+	bsp_side* sides;
 };
 
 //
@@ -112,11 +113,12 @@ struct brush_t
 	    // away the entire boundsbrush making the func_detail invisible.
 
 struct bsp_portal_t;
+struct midsplit_choice;
 
 struct node_t final {
 	surface_t* surfaces;
-	brush_t* detailbrushes;
-	brush_t* boundsbrush;
+	bsp_brush* detailbrushes;
+	bsp_brush* boundsbrush;
 	double3_array loosemins,
 		loosemaxs; // all leafs and nodes have this, while 'mins' and 'maxs'
 	               // are only valid for nondetail leafs and nodes.
@@ -141,10 +143,15 @@ struct node_t final {
 	contents_t contents; // leaf nodes (0 for decision nodes)
 	face_t** markfaces;  // leaf nodes only, point to node faces
 	bsp_portal_t* portals;
-	int visleafnum; // -1 = solid
-	int valid;      // for flood filling
-	int occupied;   // light number in leaf for outside filling
+	int visleafnum;   // -1 = solid
+	int valid;        // for ClearOutFaces_r
+	int floodLeafNum; // for flood filling
+	int occupied;     // light number in leaf for outside filling
 	int empty;
+
+	// How BuildBspTree_r chose the partition, for MakeTreePortals_r to
+	// check against the bounds of the portals. Owned by the node
+	midsplit_choice* midsplitChoice;
 };
 
 //=============================================================================
@@ -152,9 +159,10 @@ struct node_t final {
 extern void SubdivideFace(face_t* f, face_t** prevptr);
 extern node_t* SolidBSP(
 	surfchain_t const * const surfhead,
-	brush_t* detailbrushes,
+	bsp_brush* detailbrushes,
 	bool report_progress,
-	hull_count hullNum
+	hull_count hullNum,
+	node_t* outsideNode
 );
 
 //=============================================================================
@@ -165,8 +173,7 @@ extern void MergeAll(surface_t* surfhead);
 //=============================================================================
 // surfaces.c
 extern void MakeFaceEdges();
-extern int
-GetEdge(double3_array const & p1, double3_array const & p2, face_t* f);
+extern void OutputFaceEdges(std::vector<face_t*> const & faces);
 
 //=============================================================================
 // portals.c
@@ -179,14 +186,16 @@ struct bsp_portal_t final {
 	accurate_winding* winding;
 };
 
-extern node_t g_outside_node; // portals outside the world face this
-
 extern void AddPortalToNodes(bsp_portal_t* p, node_t* front, node_t* back);
 extern void RemovePortalFromNode(bsp_portal_t* portal, node_t* l);
 extern void MakeHeadnodePortals(
-	node_t* node, double3_array const & mins, double3_array const & maxs
+	node_t* node,
+	node_t* outsideNode,
+	double3_array const & mins,
+	double3_array const & maxs
 );
 
+extern void FreeNodePortals(node_t* node);
 extern void FreePortals(node_t* node);
 extern void WritePortalfile(node_t* headnode);
 
@@ -204,29 +213,53 @@ extern void FinishBSPFile(bsp_data const & bspData);
 
 //=============================================================================
 // outside.c
-extern node_t* FillOutside(node_t* node, bool leakfile, unsigned hullnum);
+
+// The path from an entity to the outside that FillOutside() found. The
+// hulls are filled at the same time, so the leaks are reported afterwards
+// in hull order
+struct leak_trail final {
+	entity_count entity;
+	std::vector<double3_array> portalCenters;
+};
+
+extern node_t* FillOutside(
+	node_t* node,
+	node_t* outsideNode,
+	hull_count hullnum,
+	std::optional<leak_trail>& leak
+);
+extern void ReportLeak(leak_trail const & leak, hull_count hullnum);
+extern void RemoveLeakFiles();
 extern void LoadAllowableOutsideList(char const * const filename);
 extern void FreeAllowableOutsideList();
-extern void FillInside(node_t* node);
+extern void FillInside(node_t* node, node_t* outsideNode);
 
 //=============================================================================
 // misc functions
-extern void GetParamsFromEnt(entity_t* mapent);
 
+extern face_t* AllocFace();
+extern void FreeFace(face_t* f);
+extern node_t* AllocNode();
+extern void FreeNode(node_t* n);
 extern bsp_portal_t* AllocPortal();
 extern void FreePortal(struct bsp_portal_t* p);
+// Frees all the faces, nodes, portals and brushes of the model at once
+extern void ReleaseModelObjects();
 
-extern side_t* NewSideFromSide(side_t const * s);
-extern brush_t* AllocBrush();
-extern void FreeBrush(brush_t* b);
-extern brush_t* NewBrushFromBrush(brush_t const * b);
+extern bsp_side* NewSideFromSide(bsp_side const * s);
+extern bsp_brush* AllocBrush();
+extern void FreeBrush(bsp_brush* b);
+extern bsp_brush* NewBrushFromBrush(bsp_brush const * b);
 extern void SplitBrush(
-	brush_t* in, mapplane_t const * split, brush_t** front, brush_t** back
+	bsp_brush* in,
+	mapplane_t const * split,
+	bsp_brush** front,
+	bsp_brush** back
 );
-extern brush_t*
+extern bsp_brush*
 BrushFromBox(double3_array const & mins, double3_array const & maxs);
 extern void CalcBrushBounds(
-	brush_t const * b, double3_array& mins, double3_array& maxs
+	bsp_brush const * b, double3_array& mins, double3_array& maxs
 );
 
 extern bool should_face_have_facestyle_null(
@@ -255,8 +288,6 @@ extern bool g_notjunc;
 extern bool g_nobrink;
 extern bool g_noclipnodemerge;
 extern bool g_watervis;
-extern bool g_chart;
-extern bool g_estimate;
 extern int g_maxnode_size;
 extern int g_subdivide_size;
 extern bool g_bLeakOnly;
@@ -267,7 +298,7 @@ extern std::filesystem::path g_linefilename;
 extern std::filesystem::path g_bspfilename;
 extern std::filesystem::path g_extentfilename;
 
-extern bool g_bUseNullTex;
+extern bool g_bspUseNullTex;
 
 extern bool g_nohull2;
 
@@ -278,3 +309,6 @@ extern void SplitFace(
 	face_t** front,
 	face_t** back
 );
+
+// main.cpp and HLCOMPILE run the tool through this
+extern int hlbsp_main(int argc, char** argv);
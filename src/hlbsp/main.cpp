@@ -0,0 +1,5 @@
+#include "hlbsp.h"
+
+int main(int const argc, char** argv) {
+	return hlbsp_main(argc, argv);
+}
@@ -1,9 +1,18 @@
 #include "hlbsp.h"
 #include "log.h"
+#include "threads.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
 
 //  TryMerge
+//  AddFaceToList
+//  FindMergeCandidates
 //  MergeFaceToList
-//  FreeMergeListScraps
 //  MergePlaneFaces
 //  MergeAll
 
@@ -86,7 +95,7 @@ static face_t* TryMerge(face_t* f1, face_t* f2) {
 	// check slope of connected lines
 	// if the slopes are colinear, the point can be removed
 	//
-	mapplane_t const * const plane = &g_mapPlanes[f1->planenum];
+	mapplane_t const * const plane = &g_bspMapPlanes[f1->planenum];
 	planenormal = plane->normal;
 
 	double3_array back{
@@ -125,7 +134,8 @@ static face_t* TryMerge(face_t* f1, face_t* f2) {
 		return nullptr;
 	}
 
-	newf = new face_t{ NewFaceFromFace(*f1) };
+	newf = AllocFace();
+	*newf = NewFaceFromFace(*f1);
 
 	// copy first polygon
 	for (k = (i + 1) % f1->pts.size(); k != i;
@@ -149,48 +159,122 @@ static face_t* TryMerge(face_t* f1, face_t* f2) {
 	return newf;
 }
 
+// The faces of a plane merged so far, in the order they were added, and
+// which of them have a vertex in each cell of a grid. Faces can only
+// merge if they share an edge, so only the faces with a vertex near one
+// of a face's vertices are worth trying
+struct merge_list final {
+	using vertex_cell = std::array<std::int64_t, 3>;
+
+	struct vertex_cell_hash final {
+		std::size_t operator()(vertex_cell const & cell) const noexcept {
+			return std::size_t(
+				cell[0] * 73856093 ^ cell[1] * 19349663 ^ cell[2] * 83492791
+			);
+		}
+	};
+
+	std::vector<face_t*> faces;
+	std::unordered_map<
+		vertex_cell,
+		std::vector<std::uint32_t>,
+		vertex_cell_hash>
+		facesByVertexCell;
+};
+
+// Vertices closer than ON_EPSILON are at most one cell apart
+constexpr double mergeCellSize = 1.0;
+
+static std::int64_t merge_cell_coordinate(double coordinate) {
+	return std::int64_t(std::floor(coordinate / mergeCellSize));
+}
+
 // =====================================================================================
-//  MergeFaceToList
+//  AddFaceToList
 // =====================================================================================
-static face_t* MergeFaceToList(face_t* face, face_t* list) {
-	face_t* newf;
-	face_t* f;
-
-	for (f = list; f; f = f->next) {
-		// CheckColinear (f);
-		newf = TryMerge(face, f);
-		if (!newf) {
-			continue;
+static void AddFaceToList(face_t* face, merge_list& list) {
+	std::uint32_t const faceNum = list.faces.size();
+	list.faces.emplace_back(face);
+	for (double3_array const & point : face->pts) {
+		merge_list::vertex_cell const cell{
+			merge_cell_coordinate(point[0]),
+			merge_cell_coordinate(point[1]),
+			merge_cell_coordinate(point[2])
+		};
+		std::vector<std::uint32_t>& cellFaces = list.facesByVertexCell[cell];
+		if (cellFaces.empty() || cellFaces.back() != faceNum) {
+			cellFaces.emplace_back(faceNum);
 		}
-		delete face;
-		f->freed = true; // merged out
-		return MergeFaceToList(newf, list);
 	}
-
-	// didn't merge, so add at start
-	face->next = list;
-	return face;
 }
 
 // =====================================================================================
-//  FreeMergeListScraps
+//  FindMergeCandidates
+//      The faces in the list that have a vertex near one of the face's,
+//      newest first
 // =====================================================================================
-static face_t* FreeMergeListScraps(face_t* merged) {
-	face_t* head;
-	face_t* next;
+static void FindMergeCandidates(
+	face_t const * face,
+	merge_list const & list,
+	std::vector<std::uint32_t>& candidates
+) {
+	candidates.clear();
+	for (double3_array const & point : face->pts) {
+		std::array<std::int64_t, 3> low;
+		std::array<std::int64_t, 3> high;
+		for (std::size_t k = 0; k < 3; ++k) {
+			low[k] = merge_cell_coordinate(point[k] - ON_EPSILON);
+			high[k] = merge_cell_coordinate(point[k] + ON_EPSILON);
+		}
+		for (std::int64_t x = low[0]; x <= high[0]; ++x) {
+			for (std::int64_t y = low[1]; y <= high[1]; ++y) {
+				for (std::int64_t z = low[2]; z <= high[2]; ++z) {
+					auto const cellFaces = list.facesByVertexCell.find(
+						{ x, y, z }
+					);
+					if (cellFaces != list.facesByVertexCell.end()) {
+						candidates.insert(
+							candidates.end(),
+							cellFaces->second.begin(),
+							cellFaces->second.end()
+						);
+					}
+				}
+			}
+		}
+	}
+	std::ranges::sort(candidates, std::ranges::greater{});
+	auto const duplicates = std::ranges::unique(candidates);
+	candidates.erase(duplicates.begin(), duplicates.end());
+}
 
-	head = nullptr;
-	for (; merged; merged = next) {
-		next = merged->next;
-		if (merged->freed) {
-			delete merged;
-		} else {
-			merged->next = head;
-			head = merged;
+// =====================================================================================
+//  MergeFaceToList
+//      Tries the faces in the list from the newest to the oldest, and
+//      starts over with the merged face after each merge
+// =====================================================================================
+static void MergeFaceToList(face_t* face, merge_list& list) {
+	std::vector<std::uint32_t> candidates;
+	bool merged = true;
+	while (merged) {
+		merged = false;
+		FindMergeCandidates(face, list, candidates);
+		for (std::uint32_t faceNum : candidates) {
+			face_t* f = list.faces[faceNum];
+			face_t* newf = TryMerge(face, f);
+			if (!newf) {
+				continue;
+			}
+			FreeFace(face);
+			f->freed = true; // merged out
+			face = newf;
+			merged = true;
+			break;
 		}
 	}
 
-	return head;
+	// didn't merge, so add it
+	AddFaceToList(face, list);
 }
 
 // =====================================================================================
@@ -199,21 +283,30 @@ static face_t* FreeMergeListScraps(face_t* merged) {
 void MergePlaneFaces(surface_t* plane) {
 	face_t* f1;
 	face_t* next;
-	face_t* merged;
-
-	merged = nullptr;
+	merge_list merged;
 
 	for (f1 = plane->faces; f1; f1 = next) {
 		next = f1->next;
-		merged = MergeFaceToList(f1, merged);
+		MergeFaceToList(f1, merged);
 	}
 
-	// chain all of the non-empty faces to the plane
-	plane->faces = FreeMergeListScraps(merged);
+	// chain all of the non-empty faces to the plane, freeing the scraps
+	face_t** prevptr = &plane->faces;
+	for (face_t* f : merged.faces) {
+		if (f->freed) {
+			FreeFace(f);
+		} else {
+			*prevptr = f;
+			prevptr = &f->next;
+		}
+	}
+	*prevptr = nullptr;
 }
 
 // =====================================================================================
 //  MergeAll
+//      The planes don't share any faces, so they're merged at the same
+//      time
 // =====================================================================================
 void MergeAll(surface_t* surfhead) {
 	surface_t* surf;
@@ -222,9 +315,19 @@ void MergeAll(surface_t* surfhead) {
 
 	Verbose("---- MergeAll ----\n");
 
+	RunTasks(
+		[surfhead]() {
+			task_group tasks;
+			for (surface_t* surf = surfhead; surf; surf = surf->next) {
+				tasks.spawn([surf]() { MergePlaneFaces(surf); });
+			}
+			tasks.wait();
+		},
+		"MergeAll"
+	);
+
 	mergefaces = 0;
 	for (surf = surfhead; surf; surf = surf->next) {
-		MergePlaneFaces(surf);
 		for (f = surf->faces; f; f = f->next) {
 			mergefaces++;
 		}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Allocates the small objects that the BSP trees of a model are made of,
+// like faces and nodes. The objects are carved out of big blocks, and a
+// thread reuses the objects it has freed before taking new ones, which
+// is what splitting faces and brushes over and over needs.
+// When the model is done, release() makes all the blocks reusable at
+// once, so the objects left in the trees don't have to be freed one by
+// one. There is one pool per type
+template <class T>
+class object_pool final {
+	static_assert(
+		std::is_trivially_destructible_v<T>,
+		"release() doesn't call the destructors of the objects left"
+	);
+
+  private:
+	union slot final {
+		slot* nextFree;
+		alignas(T) std::byte storage[sizeof(T)];
+	};
+
+	static constexpr std::size_t slotsPerBlock = std::max<std::size_t>(
+		64, (std::size_t{ 1 } << 16) / sizeof(slot)
+	);
+
+	// The objects a thread is handing out. It's thrown away when the
+	// generation changes, since its slots may be in use by then
+	struct thread_cache final {
+		std::uint64_t generation{ 0 };
+		slot* freeList{ nullptr };
+		slot* next{ nullptr };
+		slot* end{ nullptr };
+	};
+
+	static inline std::mutex mutex;
+	static inline std::vector<std::unique_ptr<slot[]>> blocks;
+	static inline std::size_t numUsedBlocks{ 0 };
+	static inline std::atomic<std::uint64_t> generation{ 1 };
+	static inline thread_local thread_cache threadCache;
+
+	static thread_cache& current_cache() noexcept {
+		std::uint64_t const currentGeneration = generation.load(
+			std::memory_order_acquire
+		);
+		if (threadCache.generation != currentGeneration) {
+			threadCache = { .generation = currentGeneration };
+		}
+		return threadCache;
+	}
+
+	static void take_block(thread_cache& cache) {
+		std::unique_lock lock{ mutex };
+		if (numUsedBlocks == blocks.size()) {
+			blocks.push_back(std::make_unique_for_overwrite<slot[]>(
+				slotsPerBlock
+			));
+		}
+		slot* block = blocks[numUsedBlocks++].get();
+		cache.next = block;
+		cache.end = block + slotsPerBlock;
+	}
+
+  public:
+	object_pool() = delete;
+
+	// The object is value-initialized
+	static T* allocate() {
+		thread_cache& cache = current_cache();
+		slot* s = cache.freeList;
+		if (s) {
+			cache.freeList = s->nextFree;
+		} else {
+			if (cache.next == cache.end) {
+				take_block(cache);
+			}
+			s = cache.next++;
+		}
+		return ::new (static_cast<void*>(s->storage)) T{};
+	}
+
+	static void deallocate(T* object) noexcept {
+		std::destroy_at(object);
+		slot* s = reinterpret_cast<slot*>(object);
+		thread_cache& cache = current_cache();
+		s->nextFree = cache.freeList;
+		cache.freeList = s;
+	}
+
+	// Frees every object at once. None of them may be used afterwards,
+	// and no other thread may be using the pool while it's called
+	static void release() {
+		std::unique_lock lock{ mutex };
+		numUsedBlocks = 0;
+		generation.fetch_add(1, std::memory_order_release);
+	}
+};
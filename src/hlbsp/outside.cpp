@@ -1,45 +1,71 @@
 #include "filelib.h"
 #include "hlbsp.h"
 #include "log.h"
+#include "phase_trace.h"
 
 #include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <ranges> // IWYU pragma: keep as long as we're using cartesian_product behind an #ifdef __cpp_lib_ranges_cartesian_product
 #include <vector>
 
 //  PointInLeaf
 //  PlaceOccupant
-//  MarkLeakTrail
-//  RecursiveFillOutside
+//  NumberFloodLeaves_r
+//  FloodOutside
+//  WriteLeakTrail
 //  ClearOutFaces_r
 //  isClassnameAllowableOutside
 //  FreeAllowableOutsideList
 //  LoadAllowableOutsideList
 //  FillOutside
-
-static int outleafs;
-static int valid;
-static int c_falsenodes;
-static int c_free_faces;
-static int c_keep_faces;
+//  ReportLeak
+
+// The hulls are filled at the same time, so everything a fill keeps track
+// of is in here
+struct fill_state final {
+	int outleafs{ 0 };
+	int c_falsenodes{ 0 };
+	int c_free_faces{ 0 };
+	int c_keep_faces{ 0 };
+};
+
+// How many portals of a leak, counted from the entity, are written to the
+// pointfile and linefile
+constexpr std::size_t maxLeakTrailPortals = 1000;
+
+// Which of the numbered leaves of a tree a flood fill has reached
+class leaf_bitset final {
+  public:
+	explicit leaf_bitset(std::size_t numLeaves) :
+		words((numLeaves + 63) / 64) { }
+
+	// Returns whether the leaf was already set
+	bool test_and_set(std::size_t leafNum) noexcept {
+		std::uint64_t const bit = std::uint64_t{ 1 } << (leafNum % 64);
+		std::uint64_t& word = words[leafNum / 64];
+		bool const wasSet = word & bit;
+		word |= bit;
+		return wasSet;
+	}
+
+  private:
+	std::vector<std::uint64_t> words;
+};
 
 // =====================================================================================
 //  PointInLeaf
 // =====================================================================================
 static node_t* PointInLeaf(node_t* node, double3_array const & point) {
-	if (node->isportalleaf) {
-		// Log("PointInLeaf::node->contents == %i\n", node->contents);
-		return node;
-	}
+	while (!node->isportalleaf) {
+		double const d = dot_product(
+							 g_bspMapPlanes[node->planenum].normal, point
+						 )
+			- g_bspMapPlanes[node->planenum].dist;
 
-	double const d = dot_product(g_mapPlanes[node->planenum].normal, point)
-		- g_mapPlanes[node->planenum].dist;
-
-	if (d > 0) {
-		return PointInLeaf(node->children[0], point);
+		node = node->children[d > 0 ? 0 : 1];
 	}
-
-	return PointInLeaf(node->children[1], point);
+	return node;
 }
 
 // =====================================================================================
@@ -59,23 +85,85 @@ static bool PlaceOccupant(
 }
 
 // =====================================================================================
-//  MarkLeakTrail
+//  NumberFloodLeaves_r
+//      Gives the leaves of the tree the numbers the flood fills use
 // =====================================================================================
-static bsp_portal_t* prevleaknode;
-static FILE* pointfile;
-static FILE* linefile;
+static void
+NumberFloodLeaves_r(node_t* node, std::vector<node_t*>& leaves) {
+	if (node->isportalleaf) {
+		node->floodLeafNum = leaves.size();
+		leaves.emplace_back(node);
+		return;
+	}
+	NumberFloodLeaves_r(node->children[0], leaves);
+	NumberFloodLeaves_r(node->children[1], leaves);
+}
 
-static void MarkLeakTrail(bsp_portal_t* n2) {
-	bsp_portal_t* n1 = prevleaknode;
-	prevleaknode = n2;
+// =====================================================================================
+//  FloodOutside
+//      Floods the leaves reachable from the outside, breadth first.
+//      Returns the first occupied leaf it reaches, whose shortest path to
+//      the outside can be followed back through cameFrom. If there's none,
+//      flooded has all the leaves the outside reaches
+// =====================================================================================
+static node_t* FloodOutside(
+	node_t* outsideNode,
+	std::size_t numLeaves,
+	std::vector<node_t*>& flooded,
+	std::vector<bsp_portal_t*>& cameFrom
+) {
+	leaf_bitset reached{ numLeaves };
+	cameFrom.assign(numLeaves, nullptr);
+
+	// Returns true if the leaf is occupied
+	auto const reach = [&](node_t* l, bsp_portal_t* through) {
+		if (l->contents == contents_t::SOLID
+		    || l->contents == contents_t::SKY) {
+			return false;
+		}
+		if (reached.test_and_set(l->floodLeafNum)) {
+			return false;
+		}
+		cameFrom[l->floodLeafNum] = through;
+		if (l->occupied) {
+			return true;
+		}
+		flooded.emplace_back(l);
+		return false;
+	};
 
-	if (!n1) {
-		return;
+	// Every leaf next to the outside is a place to start from
+	for (bsp_portal_t* p = outsideNode->portals; p;) {
+		int s = (p->nodes[0] == outsideNode);
+		if (reach(p->nodes[s], nullptr)) {
+			return p->nodes[s];
+		}
+		p = p->next[!s];
 	}
 
-	double3_array p1 = n1->winding->getCenter();
-	double3_array p2 = n2->winding->getCenter();
+	for (std::size_t i = 0; i < flooded.size(); ++i) {
+		node_t* l = flooded[i];
+		for (bsp_portal_t* p = l->portals; p;) {
+			int s = (p->nodes[0] == l);
+			if (reach(p->nodes[s], p)) {
+				return p->nodes[s];
+			}
+			p = p->next[!s];
+		}
+	}
+	return nullptr;
+}
 
+// =====================================================================================
+//  WriteLeakTrail
+//      Writes the line between two consecutive portals of the trail
+// =====================================================================================
+static void WriteLeakTrail(
+	FILE* pointfile,
+	FILE* linefile,
+	double3_array p1,
+	double3_array const & p2
+) {
 	// Linefile
 	fprintf(
 		linefile,
@@ -104,11 +192,6 @@ static void MarkLeakTrail(bsp_portal_t* n2) {
 	}
 }
 
-// =====================================================================================
-//  RecursiveFillOutside
-//      Returns true if an occupied leaf is reached
-//      If fill is false, just check, don't fill
-// =====================================================================================
 static void FreeDetailNode_r(node_t* n) {
 	if (n->planenum == -1) {
 		if (!(n->isportalleaf && n->contents == contents_t::SOLID)) {
@@ -120,13 +203,13 @@ static void FreeDetailNode_r(node_t* n) {
 
 	for (std::size_t i = 0; i < 2; ++i) {
 		FreeDetailNode_r(n->children[i]);
-		delete n->children[i];
+		FreeNode(n->children[i]);
 		n->children[i] = nullptr;
 	}
 	face_t* next;
 	for (face_t* f = n->faces; f; f = next) {
 		next = f->next;
-		delete f;
+		FreeFace(f);
 	}
 	n->faces = nullptr;
 }
@@ -145,54 +228,6 @@ static void FillLeaf(node_t* l) {
 	l->planenum = -1;
 }
 
-static int hit_occupied;
-static int backdraw;
-
-static bool RecursiveFillOutside(node_t* l, bool const fill) {
-	if ((l->contents == contents_t::SOLID)
-	    || (l->contents == contents_t::SKY)) {
-		/*if (l->contents != contents_t::SOLID)
-		    Log("RecursiveFillOutside::l->contents == %i \n",
-		   l->contents);*/
-
-		return false;
-	}
-
-	if (l->valid == valid) {
-		return false;
-	}
-
-	if (l->occupied) {
-		hit_occupied = l->occupied;
-		backdraw = 1000;
-		return true;
-	}
-
-	l->valid = valid;
-
-	// fill it and it's neighbors
-	if (fill) {
-		FillLeaf(l);
-	}
-	outleafs++;
-
-	for (bsp_portal_t* p = l->portals; p;) {
-		int s = (p->nodes[0] == l);
-
-		if (RecursiveFillOutside(
-				p->nodes[s], fill
-			)) { // leaked, so stop filling
-			if (backdraw-- > 0) {
-				MarkLeakTrail(p);
-			}
-			return true;
-		}
-		p = p->next[!s];
-	}
-
-	return false;
-}
-
 // =====================================================================================
 //  ClearOutFaces_r
 //      Removes unused nodes
@@ -208,7 +243,7 @@ static void MarkFacesInside_r(node_t* node) {
 	}
 }
 
-static node_t* ClearOutFaces_r(node_t* node) {
+static node_t* ClearOutFaces_r(fill_state& state, node_t* node) {
 	// mark the node and all it's faces, so they
 	// can be removed if no children use them
 
@@ -222,8 +257,8 @@ static node_t* ClearOutFaces_r(node_t* node) {
 		//
 		// decision node
 		//
-		node->children[0] = ClearOutFaces_r(node->children[0]);
-		node->children[1] = ClearOutFaces_r(node->children[1]);
+		node->children[0] = ClearOutFaces_r(state, node->children[0]);
+		node->children[1] = ClearOutFaces_r(state, node->children[1]);
 
 		// free any faces not in open child leafs
 		face_t* f = node->faces;
@@ -232,10 +267,10 @@ static node_t* ClearOutFaces_r(node_t* node) {
 		for (face_t* fnext; f; f = fnext) {
 			fnext = f->next;
 			if (f->outputnumber == -1) { // never referenced, so free it
-				c_free_faces++;
-				delete f;
+				state.c_free_faces++;
+				FreeFace(f);
 			} else {
-				c_keep_faces++;
+				state.c_keep_faces++;
 				f->next = node->faces;
 				node->faces = f;
 			}
@@ -262,7 +297,7 @@ static node_t* ClearOutFaces_r(node_t* node) {
 				return node->children[0];
 			}
 
-			c_falsenodes++;
+			state.c_falsenodes++;
 		}
 		return node;
 	}
@@ -365,9 +400,16 @@ auto cartesian_product(ContainerType const & a, ContainerType const & b) {
 
 // =====================================================================================
 //  FillOutside
+//      If a leak is found, it's returned in 'leak' for ReportLeak() and the
+//      hull is left unfilled
 // =====================================================================================
-node_t*
-FillOutside(node_t* node, bool const leakfile, unsigned const hullnum) {
+node_t* FillOutside(
+	node_t* node,
+	node_t* outsideNode,
+	hull_count const hullnum,
+	std::optional<leak_trail>& leak
+) {
+	trace_phase phase{ "FillOutside" };
 	Verbose("----- FillOutside ----\n");
 
 	if (g_nofill) {
@@ -422,7 +464,7 @@ FillOutside(node_t* node, bool const leakfile, unsigned const hullnum) {
 		return node;
 	}
 
-	if (!g_outside_node.portals) {
+	if (!outsideNode->portals) {
 		Warning(
 			"No outside node portal found in hull %i, no filling performed for this hull",
 			hullnum
@@ -430,100 +472,123 @@ FillOutside(node_t* node, bool const leakfile, unsigned const hullnum) {
 		return node;
 	}
 
-	int s = !(g_outside_node.portals->nodes[1] == &g_outside_node);
+	std::vector<node_t*> leaves;
+	NumberFloodLeaves_r(node, leaves);
 
 	// first check to see if an occupied leaf is hit
-	outleafs = 0;
-	valid++;
-
-	prevleaknode = nullptr;
+	std::vector<node_t*> flooded;
+	std::vector<bsp_portal_t*> cameFrom;
+	node_t* const occupiedLeaf = FloodOutside(
+		outsideNode, leaves.size(), flooded, cameFrom
+	);
 
-	if (leakfile) {
-		pointfile = fopen(g_pointfilename.c_str(), "w");
-		if (!pointfile) {
-			Error("Couldn't open pointfile %s\n", g_pointfilename.c_str());
+	if (occupiedLeaf) {
+		std::vector<double3_array> portalCenters;
+		for (node_t* l = occupiedLeaf;
+		     cameFrom[l->floodLeafNum]
+		     && portalCenters.size() < maxLeakTrailPortals;) {
+			bsp_portal_t* p = cameFrom[l->floodLeafNum];
+			portalCenters.emplace_back(p->winding->getCenter());
+			l = p->nodes[p->nodes[0] == l];
 		}
+		leak = leak_trail{ .entity = entity_count(occupiedLeaf->occupied),
+			               .portalCenters = std::move(portalCenters) };
+		return node;
+	}
 
-		linefile = fopen(g_linefilename.c_str(), "w");
-		if (!linefile) {
-			Error("Couldn't open linefile %s\n", g_linefilename.c_str());
-		}
+	// now go back and fill things in
+	fill_state state;
+	for (node_t* l : flooded) {
+		FillLeaf(l);
 	}
+	state.outleafs = flooded.size();
 
-	bool ret = RecursiveFillOutside(
-		g_outside_node.portals->nodes[s], false
-	);
+	// remove faces and nodes from filled in leafs
+	node = ClearOutFaces_r(state, node);
 
-	if (leakfile) {
-		fclose(pointfile);
-		fclose(linefile);
+	Verbose("%5i outleafs\n", state.outleafs);
+	Verbose("%5i freed faces\n", state.c_free_faces);
+	Verbose("%5i keep faces\n", state.c_keep_faces);
+	Verbose("%5i falsenodes\n", state.c_falsenodes);
+
+	// save portal file for vis tracing
+	if (hullnum == 0) {
+		WritePortalfile(node);
 	}
 
-	if (ret) {
-		double3_array origin = get_double3_for_key(
-			g_entities[hit_occupied], u8"origin"
+	return node;
+}
+
+// =====================================================================================
+//  ReportLeak
+//      The first leak reported also writes the pointfile and linefile
+// =====================================================================================
+void ReportLeak(leak_trail const & leak, hull_count const hullnum) {
+	double3_array origin = get_double3_for_key(
+		g_entities[leak.entity], u8"origin"
+	);
+	{
+		Warning(
+			"=== LEAK in hull %i ===\nEntity %s @ (%4.0f,%4.0f,%4.0f)",
+			hullnum,
+			(char const *) get_classname(g_entities[leak.entity]).data(),
+			origin[0],
+			origin[1],
+			origin[2]
 		);
-		{
-			Warning(
-				"=== LEAK in hull %i ===\nEntity %s @ (%4.0f,%4.0f,%4.0f)",
-				hullnum,
-				(char const *) get_classname(g_entities[hit_occupied])
-					.data(),
-				origin[0],
-				origin[1],
-				origin[2]
-			);
-			PrintOnce(
-				"\n  A LEAK is a hole in the map, where the inside of it is exposed to the\n"
-				"(unwanted) outside region.  The entity listed in the error is just a helpful\n"
-				"indication of where the beginning of the leak pointfile starts, so the\n"
-				"beginning of the line can be quickly found and traced to until reaching the\n"
-				"outside. Unless this entity is accidentally on the outside of the map, it\n"
-				"probably should not be deleted.  Some complex rotating objects entities need\n"
-				"their origins outside the map.  To deal with these, just enclose the origin\n"
-				"brush with a solid world brush\n"
-			);
+		PrintOnce(
+			"\n  A LEAK is a hole in the map, where the inside of it is exposed to the\n"
+			"(unwanted) outside region.  The entity listed in the error is just a helpful\n"
+			"indication of where the beginning of the leak pointfile starts, so the\n"
+			"beginning of the line can be quickly found and traced to until reaching the\n"
+			"outside. Unless this entity is accidentally on the outside of the map, it\n"
+			"probably should not be deleted.  Some complex rotating objects entities need\n"
+			"their origins outside the map.  To deal with these, just enclose the origin\n"
+			"brush with a solid world brush\n"
+		);
+	}
+
+	if (!g_bLeaked) {
+		FILE* pointfile = fopen(g_pointfilename.c_str(), "w");
+		if (!pointfile) {
+			Error("Couldn't open pointfile %s\n", g_pointfilename.c_str());
 		}
 
-		if (!g_bLeaked) {
-			// First leak spits this out
-			Log("Leak pointfile generated\n\n");
+		FILE* linefile = fopen(g_linefilename.c_str(), "w");
+		if (!linefile) {
+			Error("Couldn't open linefile %s\n", g_linefilename.c_str());
 		}
 
-		if (g_bLeakOnly) {
-			Error("Stopped by leak.");
+		for (std::size_t i = 1; i < leak.portalCenters.size(); ++i) {
+			WriteLeakTrail(
+				pointfile,
+				linefile,
+				leak.portalCenters[i - 1],
+				leak.portalCenters[i]
+			);
 		}
 
-		g_bLeaked = true;
+		fclose(pointfile);
+		fclose(linefile);
 
-		return node;
+		// First leak spits this out
+		Log("Leak pointfile generated\n\n");
 	}
-	if (leakfile && !ret) {
-		std::filesystem::remove(g_linefilename);
-		std::filesystem::remove(g_pointfilename);
-	}
-
-	// now go back and fill things in
-	valid++;
-	RecursiveFillOutside(g_outside_node.portals->nodes[s], true);
 
-	// remove faces and nodes from filled in leafs
-	c_falsenodes = 0;
-	c_free_faces = 0;
-	c_keep_faces = 0;
-	node = ClearOutFaces_r(node);
-
-	Verbose("%5i outleafs\n", outleafs);
-	Verbose("%5i freed faces\n", c_free_faces);
-	Verbose("%5i keep faces\n", c_keep_faces);
-	Verbose("%5i falsenodes\n", c_falsenodes);
-
-	// save portal file for vis tracing
-	if ((hullnum == 0) && leakfile) {
-		WritePortalfile(node);
+	if (g_bLeakOnly) {
+		Error("Stopped by leak.");
 	}
 
-	return node;
+	g_bLeaked = true;
+}
+
+// =====================================================================================
+//  RemoveLeakFiles
+//      Removes the files of a leak from an earlier compile
+// =====================================================================================
+void RemoveLeakFiles() {
+	std::filesystem::remove(g_linefilename);
+	std::filesystem::remove(g_pointfilename);
 }
 
 void ResetMark_r(node_t* node) {
@@ -540,13 +605,18 @@ void ResetMark_r(node_t* node) {
 	}
 }
 
-void MarkOccupied_r(node_t* node) {
-	if (node->empty == 1) {
-		node->empty = 0;
+// Marks the leaves reachable from the occupied leaves in the queue,
+// breadth first
+static void MarkOccupied(std::vector<node_t*>& queue) {
+	for (std::size_t i = 0; i < queue.size(); ++i) {
+		node_t* node = queue[i];
 		int s;
 		for (bsp_portal_t* p = node->portals; p; p = p->next[!s]) {
 			s = (p->nodes[0] == node);
-			MarkOccupied_r(p->nodes[s]);
+			if (p->nodes[s]->empty == 1) {
+				p->nodes[s]->empty = 0;
+				queue.emplace_back(p->nodes[s]);
+			}
 		}
 	}
 }
@@ -562,21 +632,29 @@ void RemoveUnused_r(node_t* node) {
 	}
 }
 
-void FillInside(node_t* node) {
-	g_outside_node.empty = 0;
+void FillInside(node_t* node, node_t* outsideNode) {
+	outsideNode->empty = 0;
 	ResetMark_r(node);
+
+	// All the entities are flooded from at once
+	std::vector<node_t*> queue;
+	auto const occupy = [&queue](node_t* innode) {
+		if (innode->empty == 1) {
+			innode->empty = 0;
+			queue.emplace_back(innode);
+		}
+	};
 	for (entity_count i = 1; i < g_numentities; i++) {
 		if (has_key_value(&g_entities[i], u8"origin")) {
 			double3_array origin = get_double3_for_key(
 				g_entities[i], u8"origin"
 			);
 			origin[2] += 1;
-			node_t* innode = PointInLeaf(node, origin);
-			MarkOccupied_r(innode);
+			occupy(PointInLeaf(node, origin));
 			origin[2] -= 2;
-			innode = PointInLeaf(node, origin);
-			MarkOccupied_r(innode);
+			occupy(PointInLeaf(node, origin));
 		}
 	}
+	MarkOccupied(queue);
 	RemoveUnused_r(node);
 }
@@ -1,9 +1,10 @@
 #include "hlbsp.h"
+#include "hull_file.h"
+#include "intermediate_files.h"
 #include "log.h"
 
 #include <cstring>
-
-node_t g_outside_node; // portals outside the world face this
+#include <string>
 
 //=============================================================================
 
@@ -71,11 +72,15 @@ void RemovePortalFromNode(bsp_portal_t* portal, node_t* l) {
  * ================
  * MakeHeadnodePortals
  *
- * The created portals will face the global g_outside_node
+ * The created portals will face outsideNode. Each tree has its own, so
+ * the hulls can be built at the same time
  * ================
  */
 void MakeHeadnodePortals(
-	node_t* node, double3_array const & mins, double3_array const & maxs
+	node_t* node,
+	node_t* outsideNode,
+	double3_array const & mins,
+	double3_array const & maxs
 ) {
 	std::array<double3_array, 2> bounds;
 	bsp_portal_t* p;
@@ -88,8 +93,8 @@ void MakeHeadnodePortals(
 		bounds[1][i] = maxs[i] + SIDESPACE;
 	}
 
-	g_outside_node.contents = contents_t::SOLID;
-	g_outside_node.portals = nullptr;
+	outsideNode->contents = contents_t::SOLID;
+	outsideNode->portals = nullptr;
 
 	for (std::size_t i = 0; i < 3; ++i) {
 		for (std::size_t j = 0; j < 2; ++j) {
@@ -109,7 +114,7 @@ void MakeHeadnodePortals(
 			}
 			p->plane = pl;
 			p->winding = new accurate_winding(pl);
-			AddPortalToNodes(p, node, &g_outside_node);
+			AddPortalToNodes(p, node, outsideNode);
 		}
 	}
 
@@ -137,9 +142,31 @@ void MakeHeadnodePortals(
 static FILE* pf;
 static FILE* pf_view;
 extern bool g_viewportal;
+extern bool g_binaryportals;
 static int num_visleafs; // leafs the player can be in
 static int num_visportals;
 
+static void
+WritePortal(accurate_winding const & w, int frontLeaf, int backLeaf) {
+	if (g_binaryportals) {
+		std::string portal;
+		append_hull_file_record(
+			portal,
+			portal_file_portal{ .numPoints = std::uint32_t(w.size()),
+		                        .leafs = { frontLeaf, backLeaf } }
+		);
+		append_hull_file_points(portal, w.points());
+		fwrite(portal.data(), 1, portal.size(), pf);
+		return;
+	}
+
+	fprintf(pf, "%zu %i %i ", w.size(), frontLeaf, backLeaf);
+	for (double3_array const & point : w.points()) {
+		fprintf(pf, "(%f %f %f) ", point[0], point[1], point[2]);
+	}
+	fprintf(pf, "\n");
+}
+
 static void WritePortalFile_r(node_t const * const node) {
 	int i;
 	bsp_portal_t* p;
@@ -177,33 +204,15 @@ static void WritePortalFile_r(node_t const * const node) {
 						Warning("Backward portal @");
 						w->Print();
 					}
-					fprintf(
-						pf,
-						"%zu %i %i ",
-						w->size(),
-						p->nodes[1]->visleafnum,
-						p->nodes[0]->visleafnum
+					WritePortal(
+						*w, p->nodes[1]->visleafnum, p->nodes[0]->visleafnum
 					);
 				} else {
-					fprintf(
-						pf,
-						"%zu %i %i ",
-						w->size(),
-						p->nodes[0]->visleafnum,
-						p->nodes[1]->visleafnum
+					WritePortal(
+						*w, p->nodes[0]->visleafnum, p->nodes[1]->visleafnum
 					);
 				}
 
-				for (i = 0; i < w->size(); i++) {
-					fprintf(
-						pf,
-						"(%f %f %f) ",
-						w->point(i)[0],
-						w->point(i)[1],
-						w->point(i)[2]
-					);
-				}
-				fprintf(pf, "\n");
 				if (g_viewportal) {
 					double3_array center1, center2;
 					double3_array from = { 0.0, 0.0, -65536 };
@@ -330,7 +339,15 @@ static void WriteLeafCount_r(node_t* node) {
 		WriteLeafCount_r(node->children[1]);
 	} else if (node->contents != contents_t::SOLID) {
 		int count = CountChildLeafs_r(node);
-		fprintf(pf, "%i\n", count);
+		if (g_binaryportals) {
+			std::string leaf;
+			append_hull_file_record(
+				leaf, portal_file_leaf{ .numBspLeafs = count }
+			);
+			fwrite(leaf.data(), 1, leaf.size(), pf);
+		} else {
+			fprintf(pf, "%i\n", count);
+		}
 	}
 }
 
@@ -347,7 +364,9 @@ void WritePortalfile(node_t* headnode) {
 	NumberLeafs_r(headnode);
 
 	// write the file
-	pf = fopen(g_portfilename.c_str(), "w");
+	pf = open_intermediate_file(
+		g_portfilename, g_binaryportals ? "wb" : "w"
+	);
 	if (!pf) {
 		Error("Error writing portal file %s", g_portfilename.c_str());
 	}
@@ -363,8 +382,19 @@ void WritePortalfile(node_t* headnode) {
 		Log("Writing '%s' ...\n", viewPortalFilePath.c_str());
 	}
 
-	fprintf(pf, "%i\n", num_visleafs);
-	fprintf(pf, "%i\n", num_visportals);
+	if (g_binaryportals) {
+		std::string header;
+		append_hull_file_header(header, portalFileMagic);
+		append_hull_file_record(
+			header,
+			portal_file_counts{ .numLeafs = std::uint32_t(num_visleafs),
+		                        .numPortals = std::uint32_t(num_visportals) }
+		);
+		fwrite(header.data(), 1, header.size(), pf);
+	} else {
+		fprintf(pf, "%i\n", num_visleafs);
+		fprintf(pf, "%i\n", num_visportals);
+	}
 
 	WriteLeafCount_r(headnode);
 	WritePortalFile_r(headnode);
@@ -378,16 +408,12 @@ void WritePortalfile(node_t* headnode) {
 
 //===================================================
 
-void FreePortals(node_t* node) {
+// Frees the portals of one node, unlinking them from the nodes on their
+// other sides too
+void FreeNodePortals(node_t* node) {
 	bsp_portal_t* p;
 	bsp_portal_t* nextp;
 
-	if (!node->isportalleaf) {
-		FreePortals(node->children[0]);
-		FreePortals(node->children[1]);
-		return;
-	}
-
 	for (p = node->portals; p; p = nextp) {
 		if (p->nodes[0] == node) {
 			nextp = p->next[0];
@@ -400,3 +426,12 @@ void FreePortals(node_t* node) {
 		FreePortal(p);
 	}
 }
+
+void FreePortals(node_t* node) {
+	if (!node->isportalleaf) {
+		FreePortals(node->children[0]);
+		FreePortals(node->children[1]);
+		return;
+	}
+	FreeNodePortals(node);
+}
@@ -3,12 +3,22 @@
 #include "hlbsp.h"
 #include "log.h"
 #include "mathtypes.h"
+#include "phase_trace.h"
+#include "threads.h"
 #include "time_counter.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
 
 //  FaceSide
-//  ChooseMidPlaneFromList
+//  ChooseMidPlane
 //  ChoosePlaneFromList
 //  SelectPartition
 
@@ -23,8 +33,10 @@
 //  MakeNodePortal
 //  SplitNodePortals
 //  CalcNodeBounds
+//  CalcCellBounds
 //  CopyFacesToNode
 //  BuildBspTree_r
+//  MakeTreePortals_r
 //  SolidBSP
 
 //  Each node or leaf will have a set of portals that completely enclose
@@ -34,23 +46,25 @@
 
 int g_maxnode_size = DEFAULT_MAXNODE_SIZE;
 
-static bool g_reportProgress = false;
-static int g_numProcessed = 0;
-static int g_numReported = 0;
+// Subtrees with fewer surfaces than this are built by the thread that
+// split their parent, since they're cheaper than a task
+constexpr int minSurfacesForTask = 64;
 
-static void ResetStatus(bool report_progress) {
-	g_reportProgress = report_progress;
-	g_numProcessed = g_numReported = 0;
+// ChoosePlaneFromList() scores the candidate planes of a node on several
+// threads when there are at least this many candidate-face pairs per
+// thread
+constexpr std::size_t minScoringWorkForTasks = 1 << 16;
+
+// The hulls are built at the same time, so each one counts its own nodes
+// and they're reported when the hull is done
+static std::array<std::atomic<int>, NUM_HULLS> g_numProcessed{};
+
+static void ResetStatus(hull_count hullNum) {
+	g_numProcessed[hullNum] = 0;
 }
 
-static void UpdateStatus(void) {
-	if (g_reportProgress) {
-		++g_numProcessed;
-		if ((g_numProcessed / 500) > g_numReported) {
-			g_numReported = (g_numProcessed / 500);
-			Log("%d...", g_numProcessed);
-		}
-	}
+static void UpdateStatus(hull_count hullNum) {
+	++g_numProcessed[hullNum];
 }
 
 // =====================================================================================
@@ -129,49 +143,67 @@ struct surfacetreenode_t final {
 	double3_array maxs;
 	bool isleaf;
 	// node
-	surfacetreenode_t* children[2];
-	std::vector<face_t*>* nodefaces;
-	int nodefaces_discardablesize;
-	// leaf
-	std::vector<face_t*>* leaffaces;
-};
-
-struct surfacetree_result_t final {
-	int frontsize;
-	int backsize;
-	std::vector<face_t*>* middle; // may contain coplanar faces and
-	                              // discardable(SOLIDHINT) faces
+	std::array<std::uint32_t, 2> children; // Indices into the tree's nodes
+	// The node faces of a node or the leaf faces of a leaf, as a range in
+	// the tree's faces
+	std::uint32_t firstFace;
+	std::uint32_t numFaces;
 };
 
+// The tree is rebuilt for every node of the BSP tree, so it's kept in
+// flat arrays that keep their capacity from one build to the next
 struct surfacetree_t final {
 	bool dontbuild;
 	double epsilon; // if a face is not epsilon far from the splitting
 	                // plane, put it in result.middle
-	surfacetreenode_t* headnode;
+	std::vector<surfacetreenode_t> nodes;
+	std::vector<face_t*> faces;
+
+	// Where the faces of the node being built are sorted into the node
+	// and its children
+	std::vector<face_t*> pending;
+	std::vector<face_t*> sorted;
+	std::vector<std::uint8_t> placement;
+};
 
-	surfacetree_result_t result;
+// What TestSurfaceTree() found. Each candidate plane being scored at the
+// same time has its own
+struct surfacetree_result_t final {
+	int frontsize;
+	int backsize;
+	std::vector<face_t*> middle; // may contain coplanar faces and
+	                             // discardable(SOLIDHINT) faces
 };
 
-void BuildSurfaceTree_r(surfacetree_t* tree, surfacetreenode_t* node) {
-	node->size = node->leaffaces->size();
-	node->size_discardable = 0;
-	if (node->size == 0) {
-		node->isleaf = true;
+// The faces of the node are pending[begin, end)
+static void BuildSurfaceTree_r(
+	surfacetree_t* tree,
+	std::uint32_t nodeIndex,
+	std::size_t begin,
+	std::size_t end
+) {
+	surfacetreenode_t node{};
+	node.size = end - begin;
+	node.size_discardable = 0;
+	node.isleaf = true;
+	node.firstFace = tree->faces.size();
+	node.numFaces = node.size;
+	std::span<face_t*> const faces{ tree->pending.data() + begin,
+		                            tree->pending.data() + end };
+	if (node.size == 0) {
+		tree->nodes[nodeIndex] = node;
 		return;
 	}
 
-	node->mins.fill(hlbsp_bogus_range);
-	node->maxs.fill(-hlbsp_bogus_range);
-	for (std::vector<face_t*>::iterator i = node->leaffaces->begin();
-	     i != node->leaffaces->end();
-	     ++i) {
-		face_t* f = *i;
+	node.mins.fill(hlbsp_bogus_range);
+	node.maxs.fill(-hlbsp_bogus_range);
+	for (face_t* f : faces) {
 		for (int x = 0; x < f->pts.size(); x++) {
-			node->mins = vector_minimums(node->mins, f->pts[x]);
-			node->maxs = vector_maximums(node->maxs, f->pts[x]);
+			node.mins = vector_minimums(node.mins, f->pts[x]);
+			node.maxs = vector_maximums(node.maxs, f->pts[x]);
 		}
 		if (f->facestyle == facestyle_e::face_discardable) {
-			node->size_discardable++;
+			node.size_discardable++;
 		}
 	}
 
@@ -179,93 +211,101 @@ void BuildSurfaceTree_r(surfacetree_t* tree, surfacetreenode_t* node) {
 	{
 		double bestdelta = 0;
 		for (int k = 0; k < 3; k++) {
-			if (node->maxs[k] - node->mins[k] > bestdelta + ON_EPSILON) {
+			if (node.maxs[k] - node.mins[k] > bestdelta + ON_EPSILON) {
 				bestaxis = k;
-				bestdelta = node->maxs[k] - node->mins[k];
+				bestdelta = node.maxs[k] - node.mins[k];
 			}
 		}
 	}
-	if (node->size <= 5 || tree->dontbuild == true || bestaxis == -1) {
-		node->isleaf = true;
+	if (node.size <= 5 || tree->dontbuild == true || bestaxis == -1) {
+		tree->faces.insert(tree->faces.end(), faces.begin(), faces.end());
+		tree->nodes[nodeIndex] = node;
 		return;
 	}
 
-	node->isleaf = false;
 	double dist, dist1, dist2;
-	dist = (node->mins[bestaxis] + node->maxs[bestaxis]) / 2;
-	dist1 = (3 * node->mins[bestaxis] + node->maxs[bestaxis]) / 4;
-	dist2 = (node->mins[bestaxis] + 3 * node->maxs[bestaxis]) / 4;
+	dist = (node.mins[bestaxis] + node.maxs[bestaxis]) / 2;
+	dist1 = (3 * node.mins[bestaxis] + node.maxs[bestaxis]) / 4;
+	dist2 = (node.mins[bestaxis] + 3 * node.maxs[bestaxis]) / 4;
 	// Each child node is at most 3/4 the size of the parent node.
 	// Most faces should be passed to a child node, faces left in the parent
 	// node are the ones whose dimensions are large enough to be comparable
 	// to the dimension of the parent node.
-	node->nodefaces = new std::vector<face_t*>;
-	node->nodefaces_discardablesize = 0;
-	node->children[0] = (surfacetreenode_t*) malloc(sizeof(surfacetreenode_t
-	));
-	node->children[0]->leaffaces = new std::vector<face_t*>;
-	node->children[1] = (surfacetreenode_t*) malloc(sizeof(surfacetreenode_t
-	));
-	node->children[1]->leaffaces = new std::vector<face_t*>;
-	for (std::vector<face_t*>::iterator i = node->leaffaces->begin();
-	     i != node->leaffaces->end();
-	     ++i) {
-		face_t* f = *i;
+	std::array<std::size_t, 3> placementSizes{};
+	tree->placement.resize(faces.size());
+	for (std::size_t i = 0; i < faces.size(); ++i) {
+		face_t* f = faces[i];
 		double low = hlbsp_bogus_range;
 		double high = -hlbsp_bogus_range;
 		for (int x = 0; x < f->pts.size(); x++) {
 			low = std::min(low, f->pts[x][bestaxis]);
 			high = std::max(high, f->pts[x][bestaxis]);
 		}
+		// 0 = this node, 1 = children[0], 2 = children[1]
+		std::uint8_t placement;
 		if (low < dist1 + ON_EPSILON && high > dist2 - ON_EPSILON) {
-			node->nodefaces->push_back(f);
-			if (f->facestyle == facestyle_e::face_discardable) {
-				node->nodefaces_discardablesize++;
-			}
+			placement = 0;
 		} else if (low >= dist1 && high <= dist2) {
-			if ((low + high) / 2 > dist) {
-				node->children[0]->leaffaces->push_back(f);
-			} else {
-				node->children[1]->leaffaces->push_back(f);
-			}
+			placement = (low + high) / 2 > dist ? 1 : 2;
 		} else if (low >= dist1) {
-			node->children[0]->leaffaces->push_back(f);
-		} else if (high <= dist2) {
-			node->children[1]->leaffaces->push_back(f);
+			placement = 1;
+		} else {
+			placement = 2;
 		}
+		tree->placement[i] = placement;
+		++placementSizes[placement];
 	}
-	if (node->children[0]->leaffaces->size() == node->leaffaces->size()
-	    || node->children[1]->leaffaces->size()
-	        == node->leaffaces->size()) {
+	if (placementSizes[1] == faces.size()
+	    || placementSizes[2] == faces.size()) {
 		Warning(
 			"BuildSurfaceTree_r: didn't split node with bound (%f,%f,%f)-(%f,%f,%f)",
-			node->mins[0],
-			node->mins[1],
-			node->mins[2],
-			node->maxs[0],
-			node->maxs[1],
-			node->maxs[2]
+			node.mins[0],
+			node.mins[1],
+			node.mins[2],
+			node.maxs[0],
+			node.maxs[1],
+			node.maxs[2]
 		);
-		delete node->children[0]->leaffaces;
-		delete node->children[1]->leaffaces;
-		free(node->children[0]);
-		free(node->children[1]);
-		delete node->nodefaces;
-		node->isleaf = true;
+		tree->faces.insert(tree->faces.end(), faces.begin(), faces.end());
+		tree->nodes[nodeIndex] = node;
 		return;
 	}
-	delete node->leaffaces;
-	BuildSurfaceTree_r(tree, node->children[0]);
-	BuildSurfaceTree_r(tree, node->children[1]);
+
+	// Sort the faces by placement, keeping their order, since the order of
+	// TestSurfaceTree()'s result affects the scores
+	tree->sorted.clear();
+	for (std::uint8_t placement = 0; placement < 3; ++placement) {
+		for (std::size_t i = 0; i < faces.size(); ++i) {
+			if (tree->placement[i] == placement) {
+				tree->sorted.push_back(faces[i]);
+			}
+		}
+	}
+	std::ranges::copy(tree->sorted, faces.begin());
+
+	node.isleaf = false;
+	node.numFaces = placementSizes[0];
+	tree->faces.insert(
+		tree->faces.end(), faces.begin(), faces.begin() + node.numFaces
+	);
+	node.children[0] = tree->nodes.size();
+	node.children[1] = tree->nodes.size() + 1;
+	tree->nodes.resize(tree->nodes.size() + 2);
+	tree->nodes[nodeIndex] = node;
+
+	std::size_t const childBegin = begin + placementSizes[0];
+	std::size_t const childMid = childBegin + placementSizes[1];
+	BuildSurfaceTree_r(tree, node.children[0], childBegin, childMid);
+	BuildSurfaceTree_r(tree, node.children[1], childMid, end);
 }
 
-surfacetree_t* BuildSurfaceTree(surface_t* surfaces, double epsilon) {
-	surfacetree_t* tree;
-	tree = (surfacetree_t*) malloc(sizeof(surfacetree_t));
+static void BuildSurfaceTree(
+	surfacetree_t* tree, surface_t* surfaces, double epsilon
+) {
 	tree->epsilon = epsilon;
-	tree->result.middle = new std::vector<face_t*>;
-	tree->headnode = (surfacetreenode_t*) malloc(sizeof(surfacetreenode_t));
-	tree->headnode->leaffaces = new std::vector<face_t*>;
+	tree->nodes.clear();
+	tree->faces.clear();
+	tree->pending.clear();
 	{
 		surface_t* p2;
 		face_t* f;
@@ -274,108 +314,86 @@ surfacetree_t* BuildSurfaceTree(surface_t* surfaces, double epsilon) {
 				continue;
 			}
 			for (f = p2->faces; f; f = f->next) {
-				tree->headnode->leaffaces->push_back(f);
+				tree->pending.push_back(f);
 			}
 		}
 	}
-	tree->dontbuild = tree->headnode->leaffaces->size() < 20;
-	BuildSurfaceTree_r(tree, tree->headnode);
-	if (tree->dontbuild) {
-		*tree->result.middle = *tree->headnode->leaffaces;
-		tree->result.backsize = 0;
-		tree->result.frontsize = 0;
-	}
-	return tree;
+	tree->dontbuild = tree->pending.size() < 20;
+	tree->nodes.resize(1);
+	BuildSurfaceTree_r(tree, 0, 0, tree->pending.size());
 }
 
-void TestSurfaceTree_r(
-	surfacetree_t* tree,
-	surfacetreenode_t const * node,
-	mapplane_t const * split
+static void TestSurfaceTree_r(
+	surfacetree_t const * tree,
+	surfacetreenode_t const & node,
+	mapplane_t const * split,
+	surfacetree_result_t& result
 ) {
-	if (node->size == 0) {
+	if (node.size == 0) {
 		return;
 	}
 	double low, high;
 	low = high = -split->dist;
 	for (int k = 0; k < 3; k++) {
 		if (split->normal[k] >= 0) {
-			high += split->normal[k] * node->maxs[k];
-			low += split->normal[k] * node->mins[k];
+			high += split->normal[k] * node.maxs[k];
+			low += split->normal[k] * node.mins[k];
 		} else {
-			high += split->normal[k] * node->mins[k];
-			low += split->normal[k] * node->maxs[k];
+			high += split->normal[k] * node.mins[k];
+			low += split->normal[k] * node.maxs[k];
 		}
 	}
 	if (low > tree->epsilon) {
-		tree->result.frontsize += node->size;
-		tree->result.frontsize -= node->size_discardable;
+		result.frontsize += node.size;
+		result.frontsize -= node.size_discardable;
 		return;
 	}
 	if (high < -tree->epsilon) {
-		tree->result.backsize += node->size;
-		tree->result.backsize -= node->size_discardable;
+		result.backsize += node.size;
+		result.backsize -= node.size_discardable;
 		return;
 	}
-	if (node->isleaf) {
-		for (std::vector<face_t*>::iterator i = node->leaffaces->begin();
-		     i != node->leaffaces->end();
-		     ++i) {
-			tree->result.middle->push_back(*i);
-		}
-	} else {
-		for (std::vector<face_t*>::iterator i = node->nodefaces->begin();
-		     i != node->nodefaces->end();
-		     ++i) {
-			tree->result.middle->push_back(*i);
-		}
-		TestSurfaceTree_r(tree, node->children[0], split);
-		TestSurfaceTree_r(tree, node->children[1], split);
+	result.middle.insert(
+		result.middle.end(),
+		tree->faces.begin() + node.firstFace,
+		tree->faces.begin() + node.firstFace + node.numFaces
+	);
+	if (!node.isleaf) {
+		TestSurfaceTree_r(
+			tree, tree->nodes[node.children[0]], split, result
+		);
+		TestSurfaceTree_r(
+			tree, tree->nodes[node.children[1]], split, result
+		);
 	}
 }
 
-void TestSurfaceTree(surfacetree_t* tree, mapplane_t const * split) {
+static void TestSurfaceTree(
+	surfacetree_t const * tree,
+	mapplane_t const * split,
+	surfacetree_result_t& result
+) {
+	result.middle.clear();
+	result.backsize = 0;
+	result.frontsize = 0;
 	if (tree->dontbuild) {
+		result.middle = tree->faces;
 		return;
 	}
-	tree->result.middle->clear();
-	tree->result.backsize = 0;
-	tree->result.frontsize = 0;
-	TestSurfaceTree_r(tree, tree->headnode, split);
-}
-
-void DeleteSurfaceTree_r(surfacetreenode_t* node) {
-	if (node->isleaf) {
-		delete node->leaffaces;
-	} else {
-		DeleteSurfaceTree_r(node->children[0]);
-		free(node->children[0]);
-		DeleteSurfaceTree_r(node->children[1]);
-		free(node->children[1]);
-		delete node->nodefaces;
-	}
-}
-
-void DeleteSurfaceTree(surfacetree_t* tree) {
-	DeleteSurfaceTree_r(tree->headnode);
-	free(tree->headnode);
-	delete tree->result.middle;
-	free(tree);
+	TestSurfaceTree_r(tree, tree->nodes[0], split, result);
 }
 
 // =====================================================================================
-//  ChooseMidPlaneFromList
+//  ChooseMidPlane
 //      When there are a huge number of planes, just choose one closest
-//      to the middle.
+//      to the middle. Takes the axial candidates and returns the index of
+//      the chosen one
 // =====================================================================================
-static surface_t* ChooseMidPlaneFromList(
-	surface_t* surfaces,
+static std::optional<std::size_t> ChooseMidPlane(
+	std::span<int const> candidatePlanes,
 	double3_array const & mins,
-	double3_array const & maxs,
-	detail_level detailLevel
+	double3_array const & maxs
 ) {
-	surface_t* p;
-	surface_t* bestsurface;
 	double bestvalue;
 	double value;
 	double dist;
@@ -384,23 +402,11 @@ static surface_t* ChooseMidPlaneFromList(
 	// pick the plane that splits the least
 	//
 	bestvalue = 6.0 * hlbsp_bogus_range * hlbsp_bogus_range;
-	bestsurface = nullptr;
+	std::optional<std::size_t> best;
 
-	for (p = surfaces; p; p = p->next) {
-		if (p->onnode) {
-			continue;
-		}
-		if (p->detailLevel != detailLevel) {
-			continue;
-		}
-
-		mapplane_t const & plane = g_mapPlanes[p->planenum];
-
-		// check for axis aligned surfaces
+	for (std::size_t i = 0; i < candidatePlanes.size(); ++i) {
+		mapplane_t const & plane = g_bspMapPlanes[candidatePlanes[i]];
 		planetype l{ plane.type };
-		if (l > last_axial) {
-			continue;
-		}
 
 		//
 		// calculate the split metric along axis l, smaller values are
@@ -438,83 +444,93 @@ static surface_t* ChooseMidPlaneFromList(
 		// currently the best!
 		//
 		bestvalue = value;
-		bestsurface = p;
-	}
-
-	if (!bestsurface) {
-		return nullptr;
+		best = i;
 	}
 
-	return bestsurface;
+	return best;
 }
 
+// What the midsplit of a node was chosen from. The cell of a node that
+// BuildBspTree_r bounds it with may differ from its portals in the last
+// bits, so MakeTreePortals_r makes the choice again with the bounds of the
+// portals, which is what a serial build would have used
+struct midsplit_choice final {
+	std::vector<int> candidatePlanes;
+	std::optional<std::size_t> chosen; // Not set if midsplit wasn't used
+};
+
+// How close to g_maxnode_size the extents of a cell must be for its
+// midsplit choice to be recorded. The portals bound the node to well
+// within this
+constexpr double midsplitBoundsMargin = 1.0;
+
 // =====================================================================================
 //  ChoosePlaneFromList
 //      Choose the plane that splits the least faces
 // =====================================================================================
-static surface_t* ChoosePlaneFromList(
-	surface_t* surfaces,
-	double3_array const & mins,
-	double3_array const & maxs
-	// mins and maxs are invalid when detailLevel > 0
-	,
-	detail_level detailLevel
-) {
-	surface_t* p;
-	surface_t* bestsurface;
-	double bestvalue;
-	double value;
-	face_t* f;
-	double planecount;
-	double totalsplit;
-	double avesplit;
-	double(*tmpvalue)[2];
-	surfacetree_t* surfacetree;
-	std::vector<face_t*>::iterator it;
-
-	planecount = 0;
-	totalsplit = 0;
-	tmpvalue = (double(*)[2]) malloc(g_numplanes * sizeof(double[2]));
-	surfacetree = BuildSurfaceTree(surfaces, ON_EPSILON);
 
-	//
-	// pick the plane that splits the least
-	//
-	bestvalue = 9e30;
-	bestsurface = nullptr;
+// What ChoosePlaneFromList() needs to score the candidates. They're pooled
+// rather than per thread, since a thread waiting for its scoring tasks
+// may start on another node in the meantime
+struct partition_scratch final {
+	surfacetree_t surfacetree;
+	surfacetree_result_t result;
+	std::vector<surface_t*> candidates;
+	std::vector<std::array<double, 2>> tmpvalue; // Index: candidate
+	std::vector<int> splits;                     // Index: candidate
+};
 
-	for (p = surfaces; p; p = p->next) {
-		if (p->onnode) {
-			continue;
-		}
-		if (p->detailLevel != detailLevel) {
-			continue;
-		}
-		planecount++;
+static std::mutex g_partitionScratchMutex;
+static std::vector<std::unique_ptr<partition_scratch>> g_partitionScratch;
+
+static std::unique_ptr<partition_scratch> AcquirePartitionScratch() {
+	std::unique_lock lock{ g_partitionScratchMutex };
+	if (g_partitionScratch.empty()) {
+		return std::make_unique<partition_scratch>();
+	}
+	std::unique_ptr<partition_scratch> scratch{
+		std::move(g_partitionScratch.back())
+	};
+	g_partitionScratch.pop_back();
+	return scratch;
+}
 
+static void ReleasePartitionScratch(std::unique_ptr<partition_scratch> scratch
+) {
+	std::unique_lock lock{ g_partitionScratchMutex };
+	g_partitionScratch.push_back(std::move(scratch));
+}
+
+// Scores candidates[begin, end) of 'scratch' against its surface tree
+static void ScoreCandidates(
+	partition_scratch& scratch,
+	surfacetree_result_t& result,
+	std::size_t begin,
+	std::size_t end
+) {
+	for (std::size_t candidate = begin; candidate < end; ++candidate) {
+		surface_t const * p = scratch.candidates[candidate];
 		double crosscount = 0; // use double here because we need to perform
 		                       // "crosscount++"
 		double frontcount = 0;
 		double backcount = 0;
 		double coplanarcount = 0;
 		double epsilonsplit = 0;
+		int splits = 0;
 
-		mapplane_t const & plane = g_mapPlanes[p->planenum];
+		mapplane_t const & plane = g_bspMapPlanes[p->planenum];
 
-		for (f = p->faces; f; f = f->next) {
+		for (face_t const * f = p->faces; f; f = f->next) {
 			if (f->facestyle == facestyle_e::face_discardable) {
 				continue;
 			}
 			coplanarcount++;
 		}
-		TestSurfaceTree(surfacetree, &plane);
+		TestSurfaceTree(&scratch.surfacetree, &plane, result);
 		{
-			frontcount += surfacetree->result.frontsize;
-			backcount += surfacetree->result.backsize;
-			for (it = surfacetree->result.middle->begin();
-			     it != surfacetree->result.middle->end();
-			     ++it) {
-				f = *it;
+			frontcount += result.frontsize;
+			backcount += result.backsize;
+			for (face_t* f : result.middle) {
 				if (f->planenum == p->planenum
 				    || f->planenum == (p->planenum ^ 1)) {
 					continue;
@@ -531,7 +547,7 @@ static surface_t* ChoosePlaneFromList(
 						backcount++;
 						break;
 					case face_side::on:
-						totalsplit++;
+						splits++;
 						crosscount++;
 						break;
 					case face_side::cross:
@@ -541,7 +557,7 @@ static surface_t* ChoosePlaneFromList(
 			}
 		}
 
-		value = crosscount
+		double value = crosscount
 			- std::sqrt(coplanarcount); // Not optimized. --vluzacn
 		if (coplanarcount == 0) {
 			crosscount += 1;
@@ -556,32 +572,95 @@ static surface_t* ChoosePlaneFromList(
 			? (-frac * log(frac) / log(2.0)
 		       - (1 - frac) * log(1 - frac) / log(2.0))
 			: 0.0; // the formula tends to 0 when frac=0,1
-		tmpvalue[p->planenum][1] = crosscount * (1 - ent);
+		scratch.tmpvalue[candidate][1] = crosscount * (1 - ent);
 		value += epsilonsplit * 10000;
 
-		tmpvalue[p->planenum][0] = value;
+		scratch.tmpvalue[candidate][0] = value;
+		scratch.splits[candidate] = splits;
 	}
-	avesplit = totalsplit / planecount;
-	for (p = surfaces; p; p = p->next) {
+}
+
+static surface_t* ChoosePlaneFromList(
+	surface_t* surfaces,
+	double3_array const & mins,
+	double3_array const & maxs
+	// mins and maxs are invalid when detailLevel > 0
+	,
+	detail_level detailLevel
+) {
+	std::unique_ptr<partition_scratch> scratch{ AcquirePartitionScratch() };
+	BuildSurfaceTree(&scratch->surfacetree, surfaces, ON_EPSILON);
+
+	scratch->candidates.clear();
+	for (surface_t* p = surfaces; p; p = p->next) {
 		if (p->onnode) {
 			continue;
 		}
 		if (p->detailLevel != detailLevel) {
 			continue;
 		}
-		value = tmpvalue[p->planenum][0]
-			+ avesplit * tmpvalue[p->planenum][1];
+		scratch->candidates.push_back(p);
+	}
+	std::size_t const numCandidates = scratch->candidates.size();
+	scratch->tmpvalue.resize(numCandidates);
+	scratch->splits.resize(numCandidates);
+
+	// Each candidate's score only depends on the surface tree, so big
+	// lists are scored in chunks on the other threads
+	std::size_t const work = numCandidates
+		* scratch->surfacetree.faces.size();
+	if (work < minScoringWorkForTasks || numCandidates < 2) {
+		ScoreCandidates(*scratch, scratch->result, 0, numCandidates);
+	} else {
+		std::size_t const numChunks = std::min(
+			{ numCandidates,
+		      work / minScoringWorkForTasks,
+		      std::size_t(g_numthreads) * 4 }
+		);
+		task_group tasks;
+		for (std::size_t chunk = 1; chunk < numChunks; ++chunk) {
+			tasks.spawn([&scratch, chunk, numChunks, numCandidates]() {
+				std::unique_ptr<partition_scratch> chunkScratch{
+					AcquirePartitionScratch()
+				};
+				ScoreCandidates(
+					*scratch,
+					chunkScratch->result,
+					numCandidates * chunk / numChunks,
+					numCandidates * (chunk + 1) / numChunks
+				);
+				ReleasePartitionScratch(std::move(chunkScratch));
+			});
+		}
+		ScoreCandidates(
+			*scratch, scratch->result, 0, numCandidates / numChunks
+		);
+		tasks.wait();
+	}
+
+	//
+	// pick the plane that splits the least
+	//
+	double totalsplit = 0;
+	for (int splits : scratch->splits) {
+		totalsplit += splits;
+	}
+	double const avesplit = totalsplit / numCandidates;
+	double bestvalue = 9e30;
+	surface_t* bestsurface = nullptr;
+	for (std::size_t candidate = 0; candidate < numCandidates; ++candidate) {
+		double const value = scratch->tmpvalue[candidate][0]
+			+ avesplit * scratch->tmpvalue[candidate][1];
 		if (value < bestvalue) {
 			bestvalue = value;
-			bestsurface = p;
+			bestsurface = scratch->candidates[candidate];
 		}
 	}
 
 	if (!bestsurface) {
 		Error("ChoosePlaneFromList: no valid planes");
 	}
-	free(tmpvalue);
-	DeleteSurfaceTree(surfacetree);
+	ReleasePartitionScratch(std::move(scratch));
 	return bestsurface;
 }
 
@@ -616,16 +695,39 @@ static surface_t* SelectPartition(
 	bool const usemidsplit,
 	detail_level splitDetailLevel,
 	double3_array const & validmins,
-	double3_array const & validmaxs
+	double3_array const & validmaxs,
+	midsplit_choice* choice
 ) {
 	// We must choose a surface of this detail level
 
-	if (usemidsplit) {
-		surface_t* s = ChooseMidPlaneFromList(
-			surfaces, validmins, validmaxs, splitDetailLevel
-		);
-		if (s != nullptr) {
-			return s;
+	if (usemidsplit || choice) {
+		std::vector<surface_t*> candidates;
+		std::vector<int> candidatePlanes;
+		for (surface_t* p = surfaces; p; p = p->next) {
+			if (p->onnode) {
+				continue;
+			}
+			if (p->detailLevel != splitDetailLevel) {
+				continue;
+			}
+			// check for axis aligned surfaces
+			if (g_bspMapPlanes[p->planenum].type > last_axial) {
+				continue;
+			}
+			candidates.push_back(p);
+			candidatePlanes.push_back(p->planenum);
+		}
+
+		std::optional<std::size_t> chosen;
+		if (usemidsplit) {
+			chosen = ChooseMidPlane(candidatePlanes, validmins, validmaxs);
+		}
+		if (choice) {
+			choice->candidatePlanes = std::move(candidatePlanes);
+			choice->chosen = chosen;
+		}
+		if (chosen) {
+			return candidates[chosen.value()];
 		}
 	}
 	return ChoosePlaneFromList(
@@ -686,7 +788,7 @@ static void FixDetaillevelForDiscardable(
 		for (pfnext = &s->faces; f = *pfnext, f != nullptr;) {
 			if (!detailLevel.has_value() || f->detailLevel < detailLevel) {
 				*pfnext = f->next;
-				delete f;
+				FreeFace(f);
 			} else {
 				pfnext = &f->next;
 			}
@@ -717,7 +819,7 @@ static void DivideSurface(
 	face_t* frontlist = nullptr;
 	face_t* backlist = nullptr;
 
-	mapplane_t const * const inplane = &g_mapPlanes[in->planenum];
+	mapplane_t const * const inplane = &g_bspMapPlanes[in->planenum];
 
 	// parallel case is easy
 
@@ -814,7 +916,7 @@ SplitNodeSurfaces(surface_t* surfaces, node_t const * const node) {
 	surface_t* frontfrag;
 	surface_t* backfrag;
 
-	mapplane_t const * const splitplane = &g_mapPlanes[node->planenum];
+	mapplane_t const * const splitplane = &g_bspMapPlanes[node->planenum];
 
 	frontlist = nullptr;
 	backlist = nullptr;
@@ -843,13 +945,13 @@ SplitNodeSurfaces(surface_t* surfaces, node_t const * const node) {
 	node->children[1]->surfaces = backlist;
 }
 
-static void SplitNodeBrushes(brush_t* brushes, node_t const * node) {
-	brush_t *frontlist, *frontfrag;
-	brush_t *backlist, *backfrag;
-	brush_t *b, *next;
+static void SplitNodeBrushes(bsp_brush* brushes, node_t const * node) {
+	bsp_brush *frontlist, *frontfrag;
+	bsp_brush *backlist, *backfrag;
+	bsp_brush *b, *next;
 	frontlist = nullptr;
 	backlist = nullptr;
-	mapplane_t const & splitplane = g_mapPlanes[node->planenum];
+	mapplane_t const & splitplane = g_bspMapPlanes[node->planenum];
 	for (b = brushes; b; b = next) {
 		next = b->next;
 		SplitBrush(b, &splitplane, &frontfrag, &backfrag);
@@ -965,30 +1067,37 @@ static contents_t ContentsForRank(std::int32_t rank) {
 // =====================================================================================
 //  FreeLeafSurfs
 // =====================================================================================
-static void FreeLeafSurfs(node_t* leaf) {
+static void FreeSurfaces(surface_t* surfaces) {
 	surface_t* surf;
 	surface_t* snext;
 	face_t* f;
 	face_t* fnext;
 
-	for (surf = leaf->surfaces; surf; surf = snext) {
+	for (surf = surfaces; surf; surf = snext) {
 		snext = surf->next;
 		for (f = surf->faces; f; f = fnext) {
 			fnext = f->next;
-			delete f;
+			FreeFace(f);
 		}
 		delete surf;
 	}
+}
 
+static void FreeLeafSurfs(node_t* leaf) {
+	FreeSurfaces(leaf->surfaces);
 	leaf->surfaces = nullptr;
 }
 
-static void FreeLeafBrushes(node_t* leaf) {
-	brush_t *b, *next;
-	for (b = leaf->detailbrushes; b; b = next) {
+static void FreeBrushes(bsp_brush* brushes) {
+	bsp_brush *b, *next;
+	for (b = brushes; b; b = next) {
 		next = b->next;
 		FreeBrush(b);
 	}
+}
+
+static void FreeLeafBrushes(node_t* leaf) {
+	FreeBrushes(leaf->detailbrushes);
 	leaf->detailbrushes = nullptr;
 }
 
@@ -1070,9 +1179,9 @@ LinkLeafFaces(surface_t* planelist, node_t* leafnode, hull_count hullNum) {
 					"content = %d plane = %d normal = (%g,%g,%g)\n",
 					std::to_underlying(f2->contents),
 					f2->planenum,
-					g_mapPlanes[f2->planenum].normal[0],
-					g_mapPlanes[f2->planenum].normal[1],
-					g_mapPlanes[f2->planenum].normal[2]
+					g_bspMapPlanes[f2->planenum].normal[0],
+					g_bspMapPlanes[f2->planenum].normal[1],
+					g_bspMapPlanes[f2->planenum].normal[2]
 				);
 				for (int i = 0; i < f2->pts.size(); i++) {
 					Developer(
@@ -1164,7 +1273,7 @@ static void MakeNodePortal(node_t* node) {
 	accurate_winding* w;
 	int side = 0;
 
-	plane = &g_mapPlanes[node->planenum];
+	plane = &g_bspMapPlanes[node->planenum];
 	w = new accurate_winding(*plane);
 
 	new_portal = AllocPortal();
@@ -1218,7 +1327,7 @@ static void SplitNodePortals(node_t* node) {
 	int side = 0;
 	mapplane_t* plane;
 
-	plane = &g_mapPlanes[node->planenum];
+	plane = &g_bspMapPlanes[node->planenum];
 	f = node->children[0];
 	b = node->children[1];
 
@@ -1283,18 +1392,15 @@ static void SplitNodePortals(node_t* node) {
 // =====================================================================================
 //  CalcNodeBounds
 //      Determines the boundaries of a node by minmaxing all the portal
-//      points, whcih completely enclose the node. Returns true if the node
-//      should be midsplit.(very large)
+//      points, whcih completely enclose the node
 // =====================================================================================
-static bool CalcNodeBounds(
-	node_t* node, double3_array& validmins, double3_array& validmaxs
-) {
+static void CalcNodeBounds(node_t* node) {
 	bsp_portal_t* p;
 	bsp_portal_t* next_portal;
 	int side = 0;
 
 	if (node->isdetail) {
-		return false;
+		return;
 	}
 	node->mins[0] = node->mins[1] = node->mins[2] = hlbsp_bogus_range;
 	node->maxs[0] = node->maxs[1] = node->maxs[2] = -hlbsp_bogus_range;
@@ -1321,10 +1427,16 @@ static bool CalcNodeBounds(
 			}
 		}
 	}
+}
 
-	if (node->isportalleaf) {
-		return false;
-	}
+// =====================================================================================
+//  CalcValidBounds
+//      Clamps the bounds of a node to the range it can be midsplit in.
+//      Returns true if the node should be midsplit.(very large)
+// =====================================================================================
+static bool CalcValidBounds(
+	node_t const * node, double3_array& validmins, double3_array& validmaxs
+) {
 	for (std::size_t i = 0; i < 3; ++i) {
 		validmins[i] = std::max(
 			node->mins[i], -(ENGINE_ENTITY_RANGE + g_maxnode_size)
@@ -1346,6 +1458,44 @@ static bool CalcNodeBounds(
 	return false;
 }
 
+// =====================================================================================
+//  CalcCellBounds
+//      Determines the boundaries of a node from its cell, the volume its
+//      portals will enclose once MakeTreePortals_r has built them. Returns
+//      true if the node should be midsplit, and sets nearMidsplit if the
+//      bounds of the portals might decide otherwise
+// =====================================================================================
+static bool CalcCellBounds(
+	node_t* node,
+	bsp_brush const * cell,
+	double3_array& validmins,
+	double3_array& validmaxs,
+	bool& nearMidsplit
+) {
+	nearMidsplit = false;
+	if (node->isdetail) {
+		return false;
+	}
+	if (cell) {
+		CalcBrushBounds(cell, node->mins, node->maxs);
+	} else {
+		node->mins.fill(hlbsp_bogus_range);
+		node->maxs.fill(-hlbsp_bogus_range);
+	}
+
+	if (node->isportalleaf) {
+		return false;
+	}
+	bool const midsplit = CalcValidBounds(node, validmins, validmaxs);
+	for (std::size_t i = 0; i < 3; ++i) {
+		if (validmaxs[i] - validmins[i]
+		    > g_maxnode_size + ON_EPSILON - midsplitBoundsMargin) {
+			nearMidsplit = true;
+		}
+	}
+	return midsplit;
+}
+
 // =====================================================================================
 //  CopyFacesToNode
 //      Do a final merge attempt, then subdivide the faces to surface cache
@@ -1381,7 +1531,7 @@ static void CopyFacesToNode(node_t* node, surface_t* surf) {
 			continue;
 		}
 		if (f->contents != contents_t::SOLID) {
-			newf = new face_t{};
+			newf = AllocFace();
 			*newf = *f;
 			f->original = newf;
 			newf->next = node->faces;
@@ -1390,15 +1540,47 @@ static void CopyFacesToNode(node_t* node, surface_t* surf) {
 	}
 }
 
+// =====================================================================================
+//  HasSurfacesForTask
+//      Whether a subtree is worth handing to another thread
+// =====================================================================================
+static bool HasSurfacesForTask(node_t const * node) {
+	int count = 0;
+	for (surface_t const * surf = node->surfaces; surf; surf = surf->next) {
+		if (++count >= minSurfacesForTask) {
+			return true;
+		}
+	}
+	return false;
+}
+
 // =====================================================================================
 //  BuildBspTree_r
+//      The subtrees don't share anything but the read-only planes, so the
+//      back child is built as a task when it's big enough. 'cell' is the
+//      volume of the node and will be freed. The portals are made
+//      afterwards by MakeTreePortals_r, since they link nodes across
+//      subtrees.
+//      Without 'tasks', the tree is built on this thread and the portals
+//      are made along the way, bounding each node before it's split
 // =====================================================================================
-static void BuildBspTree_r(node_t* node, hull_count hullNum) {
+static void BuildBspTree_r(
+	node_t* node, bsp_brush* cell, hull_count hullNum, task_group* tasks
+) {
 	bool midsplit;
+	bool nearMidsplit = false;
 	surface_t* allsurfs;
 	double3_array validmins, validmaxs;
 
-	midsplit = CalcNodeBounds(node, validmins, validmaxs);
+	if (tasks) {
+		midsplit = CalcCellBounds(
+			node, cell, validmins, validmaxs, nearMidsplit
+		);
+	} else {
+		CalcNodeBounds(node);
+		midsplit = !node->isdetail && !node->isportalleaf
+			&& CalcValidBounds(node, validmins, validmaxs);
+	}
 	if (node->boundsbrush) {
 		CalcBrushBounds(
 			node->boundsbrush, node->loosemins, node->loosemaxs
@@ -1412,14 +1594,19 @@ static void BuildBspTree_r(node_t* node, hull_count hullNum) {
 	);
 	FixDetaillevelForDiscardable(node, splitDetailLevel);
 	surface_t* split{};
+	std::unique_ptr<midsplit_choice> midsplitChoice;
 	if (splitDetailLevel) {
+		if (nearMidsplit) {
+			midsplitChoice = std::make_unique<midsplit_choice>();
+		}
 		split = SelectPartition(
 			node->surfaces,
 			node,
 			midsplit,
 			splitDetailLevel.value(),
 			validmins,
-			validmaxs
+			validmaxs,
+			midsplitChoice.get()
 		);
 	}
 	if (!node->isdetail && (!split || split->detailLevel > 0)) {
@@ -1432,19 +1619,23 @@ static void BuildBspTree_r(node_t* node, hull_count hullNum) {
 		node->isportalleaf = false;
 	}
 	if (!split) { // this is a leaf node
+		if (cell) {
+			FreeBrush(cell);
+		}
 		MakeLeaf(node);
 		return;
 	}
 
 	// these are final polygons
+	node->midsplitChoice = midsplitChoice.release();
 	split->onnode = node; // can't use again
 	allsurfs = node->surfaces;
 	node->planenum = split->planenum;
 	node->faces = nullptr;
 	CopyFacesToNode(node, split);
 
-	node->children[0] = new node_t{};
-	node->children[1] = new node_t{};
+	node->children[0] = AllocNode();
+	node->children[1] = AllocNode();
 	node->children[0]->isdetail = split->detailLevel > 0;
 	node->children[1]->isdetail = split->detailLevel > 0;
 
@@ -1454,16 +1645,16 @@ static void BuildBspTree_r(node_t* node, hull_count hullNum) {
 	if (node->boundsbrush) {
 		for (int k = 0; k < 2; k++) {
 			mapplane_t p;
-			brush_t *copy, *front, *back;
+			bsp_brush *copy, *front, *back;
 			if (k == 0) { // front child
-				p.normal = g_mapPlanes[split->planenum].normal;
-				p.dist = g_mapPlanes[split->planenum].dist
+				p.normal = g_bspMapPlanes[split->planenum].normal;
+				p.dist = g_bspMapPlanes[split->planenum].dist
 					- BOUNDS_EXPANSION;
 			} else { // back child
 				p.normal = vector_subtract(
-					0.0f, g_mapPlanes[split->planenum].normal
+					0.0f, g_bspMapPlanes[split->planenum].normal
 				);
-				p.dist = -g_mapPlanes[split->planenum].dist
+				p.dist = -g_bspMapPlanes[split->planenum].dist
 					- BOUNDS_EXPANSION;
 			}
 			copy = NewBrushFromBrush(node->boundsbrush);
@@ -1488,15 +1679,151 @@ static void BuildBspTree_r(node_t* node, hull_count hullNum) {
 	}
 	node->boundsbrush = nullptr;
 
-	if (!split->detailLevel) {
+	std::array<bsp_brush*, 2> childCells{};
+	if (cell) {
+		if (!split->detailLevel) {
+			SplitBrush(
+				cell,
+				&g_bspMapPlanes[split->planenum],
+				&childCells[0],
+				&childCells[1]
+			);
+		} else {
+			FreeBrush(cell);
+		}
+	}
+
+	// recursively do the children
+	if (!tasks) {
+		if (!split->detailLevel) {
+			MakeNodePortal(node);
+			SplitNodePortals(node);
+		}
+		BuildBspTree_r(node->children[0], nullptr, hullNum, nullptr);
+		BuildBspTree_r(node->children[1], nullptr, hullNum, nullptr);
+		UpdateStatus(hullNum);
+		return;
+	}
+	node_t* const backChild = node->children[1];
+	if (HasSurfacesForTask(backChild)) {
+		tasks->spawn([backChild, backCell = childCells[1], hullNum, tasks]() {
+			BuildBspTree_r(backChild, backCell, hullNum, tasks);
+		});
+	} else {
+		BuildBspTree_r(backChild, childCells[1], hullNum, tasks);
+	}
+	BuildBspTree_r(node->children[0], childCells[0], hullNum, tasks);
+	UpdateStatus(hullNum);
+}
+
+// =====================================================================================
+//  SameMidsplitChoice
+//      Whether the partition of a node would have been chosen with the
+//      bounds of its portals too
+// =====================================================================================
+static bool SameMidsplitChoice(
+	node_t const * node, midsplit_choice const * choice
+) {
+	double3_array validmins, validmaxs;
+	bool const midsplit = CalcValidBounds(node, validmins, validmaxs);
+	if (!choice) {
+		return !midsplit;
+	}
+	std::optional<std::size_t> chosen;
+	if (midsplit) {
+		chosen = ChooseMidPlane(
+			choice->candidatePlanes, validmins, validmaxs
+		);
+	}
+	return chosen == choice->chosen;
+}
+
+// =====================================================================================
+//  MakeTreePortals_r
+//      Makes the portals of a built tree, visiting the nodes in the same
+//      order as a serial build would so they come out the same every time.
+//      Returns false if a node was split differently from how the serial
+//      build would have split it
+// =====================================================================================
+static bool MakeTreePortals_r(node_t* node) {
+	CalcNodeBounds(node);
+	if (node->planenum == -1) {
+		return true;
+	}
+
+	std::unique_ptr<midsplit_choice> const midsplitChoice{
+		std::exchange(node->midsplitChoice, nullptr)
+	};
+	if (!node->isdetail
+	    && !SameMidsplitChoice(node, midsplitChoice.get())) {
+		return false;
+	}
+
+	if (!node->children[0]->isdetail) {
 		MakeNodePortal(node);
 		SplitNodePortals(node);
 	}
 
-	// recursively do the children
-	BuildBspTree_r(node->children[0], hullNum);
-	BuildBspTree_r(node->children[1], hullNum);
-	UpdateStatus();
+	return MakeTreePortals_r(node->children[0])
+		&& MakeTreePortals_r(node->children[1]);
+}
+
+// =====================================================================================
+//  FreeTree_r
+//      Frees a tree that MakeTreePortals_r has rejected
+// =====================================================================================
+static void FreeTree_r(node_t* node) {
+	FreeNodePortals(node);
+	delete node->midsplitChoice;
+	if (node->planenum == -1) {
+		free(node->markfaces);
+	} else {
+		FreeTree_r(node->children[0]);
+		FreeTree_r(node->children[1]);
+		face_t* next;
+		for (face_t* f = node->faces; f; f = next) {
+			next = f->next;
+			FreeFace(f);
+		}
+	}
+	FreeNode(node);
+}
+
+// =====================================================================================
+//  CopySurfaces
+// =====================================================================================
+static surface_t* CopySurfaces(surface_t const * surfaces) {
+	surface_t* copies = nullptr;
+	surface_t** surfTail = &copies;
+	for (surface_t const * surf = surfaces; surf; surf = surf->next) {
+		surface_t* newSurf = new surface_t{ *surf };
+		face_t** faceTail = &newSurf->faces;
+		for (face_t const * f = surf->faces; f; f = f->next) {
+			face_t* newf = AllocFace();
+			*newf = *f;
+			*faceTail = newf;
+			faceTail = &newf->next;
+		}
+		*faceTail = nullptr;
+		*surfTail = newSurf;
+		surfTail = &newSurf->next;
+	}
+	*surfTail = nullptr;
+	return copies;
+}
+
+// =====================================================================================
+//  CopyBrushes
+// =====================================================================================
+static bsp_brush* CopyBrushes(bsp_brush const * brushes) {
+	bsp_brush* copies = nullptr;
+	bsp_brush** tail = &copies;
+	for (bsp_brush const * b = brushes; b; b = b->next) {
+		*tail = NewBrushFromBrush(b);
+		tail = &(*tail)->next;
+	}
+	*tail = nullptr;
+	return copies;
 }
 
 // =====================================================================================
@@ -1507,34 +1834,82 @@ static void BuildBspTree_r(node_t* node, hull_count hullNum) {
 // =====================================================================================
 node_t* SolidBSP(
 	surfchain_t const * const surfhead,
-	brush_t* detailbrushes,
+	bsp_brush* detailbrushes,
 	bool report_progress,
-	hull_count hullNum
+	hull_count hullNum,
+	node_t* outsideNode
 ) {
-	ResetStatus(report_progress);
+	trace_phase phase{ "SolidBSP" };
+	ResetStatus(hullNum);
 	time_counter timeCounter;
-	if (report_progress) {
-		Log("SolidBSP [hull %u] ", hullNum);
-	} else {
+	if (!report_progress) {
 		Verbose("----- SolidBSP -----\n");
 	}
 
-	node_t* headnode = new node_t{};
+	node_t* headnode = AllocNode();
 	headnode->surfaces = surfhead->surfaces;
 	headnode->detailbrushes = detailbrushes;
 	headnode->isdetail = false;
 	double3_array brushmins = vector_add(surfhead->mins, -SIDESPACE);
 	double3_array brushmaxs = vector_add(surfhead->maxs, SIDESPACE);
 	headnode->boundsbrush = BrushFromBox(brushmins, brushmaxs);
+	// The same box the headnode portals enclose
+	bsp_brush* cell = BrushFromBox(brushmins, brushmaxs);
 
-	// generate six portals that enclose the entire world
-	MakeHeadnodePortals(headnode, surfhead->mins, surfhead->maxs);
+	// In case the tree has to be built again
+	surface_t* surfacesCopy = CopySurfaces(surfhead->surfaces);
+	bsp_brush* detailbrushesCopy = CopyBrushes(detailbrushes);
 
 	// recursively partition everything
-	BuildBspTree_r(headnode, hullNum);
+	RunTasks(
+		[headnode, cell, hullNum]() {
+			task_group tasks;
+			BuildBspTree_r(headnode, cell, hullNum, &tasks);
+			tasks.wait();
+		},
+		"BuildBspTree"
+	);
+
+	// generate six portals that enclose the entire world
+	MakeHeadnodePortals(
+		headnode, outsideNode, surfhead->mins, surfhead->maxs
+	);
+	if (MakeTreePortals_r(headnode)) {
+		FreeSurfaces(surfacesCopy);
+		FreeBrushes(detailbrushesCopy);
+	} else {
+		// A node was midsplit differently from how its portals bound
+		// it, so the tree is built again the way the portals decide
+		Developer(
+			developer_level::message,
+			"SolidBSP [hull %u]: rebuilding the tree on one thread\n",
+			hullNum
+		);
+		FreeTree_r(headnode);
+		ResetStatus(hullNum);
+
+		headnode = AllocNode();
+		headnode->surfaces = surfacesCopy;
+		headnode->detailbrushes = detailbrushesCopy;
+		headnode->isdetail = false;
+		headnode->boundsbrush = BrushFromBox(brushmins, brushmaxs);
+		MakeHeadnodePortals(
+			headnode, outsideNode, surfhead->mins, surfhead->maxs
+		);
+		RunTasks(
+			[headnode, hullNum]() {
+				BuildBspTree_r(headnode, nullptr, hullNum, nullptr);
+			},
+			"BuildBspTree"
+		);
+	}
 
 	if (report_progress) {
-		Log("%d (%.2f seconds)\n", ++g_numProcessed, timeCounter.get_total()
+		Log(
+			"SolidBSP [hull %u] %d (%.2f seconds)\n",
+			hullNum,
+			++g_numProcessed[hullNum],
+			timeCounter.get_total()
 		);
 	}
 
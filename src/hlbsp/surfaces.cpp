@@ -1,10 +1,18 @@
 #include "hlassert.h"
 #include "hlbsp.h"
 #include "log.h"
+#include "phase_trace.h"
+#include "threads.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <cstring>
+#include <numeric>
+#include <unordered_map>
+#include <vector>
 
-static int subdivides;
+static std::atomic<int> subdivides;
 
 /* a surface has all of the faces that could be drawn on a given plane
    the outside filling stage can remove some of them so a better bsp can be
@@ -100,31 +108,53 @@ void SubdivideFace(face_t* f, face_t** prevptr) {
 
 //===========================================================================
 
+// The vertices of the faces are welded in two passes. First the points
+// of all the faces are gathered, and the ones at exactly the same place
+// are grouped by sorting them. Most points are only at the same place as
+// themselves, and they become a vertex where they are first seen. The few
+// that are close to other points are welded one at a time, in the order
+// they're seen, the way each point used to be welded. So the vertices and
+// their numbers don't depend on how the work is split up
+
 struct hashvert_t final {
-	hashvert_t* next;
+	int next; // -1 at the end of the chain
 	double3_array point;
-	int num;
-	int numplanes; // for corner determination
-	int planenums[2];
-	int numedges;
+	std::uint32_t firstPoint; // The point that made the vertex
 };
 
-// #define      POINT_EPSILON   0.01
 #define POINT_EPSILON \
 	(ON_EPSILON / 2) // #define POINT_EPSILON	ON_EPSILON //--vluzacn
 
-static hashvert_t hvertex[MAX_MAP_VERTS];
-static hashvert_t* hvert_p;
-
 static face_t* edgefaces[MAX_MAP_EDGES][2];
 static int firstmodeledge = 1;
-static int firstmodelface;
+
+// The faces getting edges. Each edge of a face has two points,
+// facePoints[firstPointOfFace[i] + 2 * edge] and the one after it
+static std::vector<face_t*> outputFaces;
+static std::vector<std::size_t> firstPointOfFace;
+static std::vector<double3_array> facePoints;
+
+// The points at different places, ordered by place, and which of them
+// each point is at
+static std::vector<double3_array> uniquePoints;
+static std::vector<std::uint32_t> firstPointOfUnique;
+static std::vector<std::uint32_t> uniqueOfPoint;
+static std::vector<std::uint8_t> uniqueIsNearOthers;
+
+// To find the unique points near a place, by the cells of a grid that's
+// POINT_EPSILON wide
+using point_cell = std::array<std::int64_t, 3>;
+static std::vector<std::pair<point_cell, std::uint32_t>> uniquesByCell;
+
+static std::vector<hashvert_t> hashvertexes;
+static std::vector<int> vertexOfPoint;
 
 //============================================================================
 
 #define NUM_HASH 4096
 
-static std::array<hashvert_t*, NUM_HASH> hashverts;
+// The elements are indices of hashvertexes
+static std::array<int, NUM_HASH> hashverts;
 
 constexpr double hash_min{ -8000 };
 static double3_array hash_scale;
@@ -140,7 +170,7 @@ static int hash_numslots[3];
 static void InitHash() {
 	constexpr double size{ 16000.0 };
 
-	hashverts = {};
+	hashverts.fill(-1);
 
 	double const volume = size * size;
 
@@ -160,7 +190,7 @@ static void InitHash() {
 	hash_scale[0] = hash_numslots[0] / size;
 	hash_scale[1] = hash_numslots[1] / size;
 
-	hvert_p = hvertex;
+	hashvertexes.clear();
 }
 
 // =====================================================================================
@@ -222,15 +252,9 @@ static int HashVec(
 	return h;
 }
 
-static int GetVertex(double3_array const & in, int const planenum) {
-	int h;
-	int i;
-	hashvert_t* hv;
+static double3_array RoundVertex(double3_array const & in) {
 	double3_array vert;
-	int num_hashneighbors;
-	int hashneighbors[MAX_HASH_NEIGHBORS];
-
-	for (i = 0; i < 3; i++) {
+	for (int i = 0; i < 3; i++) {
 		double const rounded = std::floor(in[i] + 0.5);
 		if (fabs(in[i] - rounded) < 0.001) {
 			vert[i] = rounded;
@@ -238,80 +262,214 @@ static int GetVertex(double3_array const & in, int const planenum) {
 			vert[i] = in[i];
 		}
 	}
+	return vert;
+}
 
-	h = HashVec(vert, &num_hashneighbors, hashneighbors);
+static bool points_near(double3_array const & a, double3_array const & b) {
+	return fabs(a[0] - b[0]) < POINT_EPSILON
+		&& fabs(a[1] - b[1]) < POINT_EPSILON
+		&& fabs(a[2] - b[2]) < POINT_EPSILON;
+}
 
-	for (i = 0; i < num_hashneighbors; i++) {
-		for (hv = hashverts[hashneighbors[i]]; hv; hv = hv->next) {
-			if (fabs(hv->point[0] - vert[0]) < POINT_EPSILON
-			    && fabs(hv->point[1] - vert[1]) < POINT_EPSILON
-			    && fabs(hv->point[2] - vert[2]) < POINT_EPSILON) {
-				hv->numedges++;
-				if (hv->numplanes == 3) {
-					return hv->num; // allready known to be a corner
-				}
-				for (i = 0; i < hv->numplanes; i++) {
-					if (hv->planenums[i] == planenum) {
-						return hv->num; // allready know this plane
+static point_cell PointCell(double3_array const & point) {
+	point_cell cell;
+	for (int i = 0; i < 3; i++) {
+		cell[i] = (std::int64_t) std::floor(point[i] / POINT_EPSILON);
+	}
+	return cell;
+}
+
+// =====================================================================================
+//  GetFacePoints
+// =====================================================================================
+static void GetFacePoints(int faceIndex) {
+	face_t const * const f = outputFaces[faceIndex];
+	double3_array* points = facePoints.data() + firstPointOfFace[faceIndex];
+	for (std::size_t i = 0; i < f->pts.size(); i++) {
+		*points++ = RoundVertex(f->pts[i]);
+		*points++ = RoundVertex(f->pts[(i + 1) % f->pts.size()]);
+	}
+}
+
+// =====================================================================================
+//  FindNearUniquePoints
+//      Points closer than POINT_EPSILON are in the same or in neighbouring
+//      cells
+// =====================================================================================
+static void FindNearUniquePoints(int uniqueIndex) {
+	double3_array const & point = uniquePoints[uniqueIndex];
+	point_cell const cell = PointCell(point);
+	for (std::int64_t x = -1; x <= 1; x++) {
+		for (std::int64_t y = -1; y <= 1; y++) {
+			for (std::int64_t z = -1; z <= 1; z++) {
+				point_cell const neighbour{ cell[0] + x,
+					                       cell[1] + y,
+					                       cell[2] + z };
+				auto it = std::lower_bound(
+					uniquesByCell.begin(),
+					uniquesByCell.end(),
+					std::pair{ neighbour, std::uint32_t{ 0 } }
+				);
+				for (; it != uniquesByCell.end() && it->first == neighbour;
+				     ++it) {
+					if (it->second != std::uint32_t(uniqueIndex)
+					    && points_near(uniquePoints[it->second], point)) {
+						uniqueIsNearOthers[uniqueIndex] = true;
+						return;
 					}
 				}
-				if (hv->numplanes != 2) {
-					hv->planenums[hv->numplanes] = planenum;
-				}
-				hv->numplanes++;
-				return hv->num;
 			}
 		}
 	}
+}
 
-	hv = hvert_p;
-	hv->numedges = 1;
-	hv->numplanes = 1;
-	hv->planenums[0] = planenum;
-	hv->next = hashverts[h];
+// =====================================================================================
+//  GetVertex
+//      Only used for points near other points, one at a time in the order
+//      they're seen. Returns an index of hashvertexes
+// =====================================================================================
+static int GetVertex(std::uint32_t pointIndex) {
+	double3_array const & vert = facePoints[pointIndex];
+	int num_hashneighbors;
+	int hashneighbors[MAX_HASH_NEIGHBORS];
+
+	int const h = HashVec(vert, &num_hashneighbors, hashneighbors);
+
+	for (int i = 0; i < num_hashneighbors; i++) {
+		for (int hv = hashverts[hashneighbors[i]]; hv != -1;
+		     hv = hashvertexes[hv].next) {
+			if (points_near(hashvertexes[hv].point, vert)) {
+				return hv;
+			}
+		}
+	}
+
+	int const hv = hashvertexes.size();
+	hashvertexes.emplace_back(hashvert_t{
+		.next = hashverts[h], .point = vert, .firstPoint = pointIndex });
 	hashverts[h] = hv;
-	hv->point = vert;
-	hv->num = g_numvertexes;
-	hlassume(hv->num != MAX_MAP_VERTS, assume_msg::exceeded_MAX_MAP_VERTS);
-	hvert_p++;
+	return hv;
+}
 
-	// emit a vertex
-	hlassume(
-		g_numvertexes < MAX_MAP_VERTS, assume_msg::exceeded_MAX_MAP_VERTS
+// =====================================================================================
+//  WeldFacePoints
+//      Fills vertexOfPoint and emits the new vertices
+// =====================================================================================
+static void WeldFacePoints() {
+	std::size_t const numPoints = facePoints.size();
+
+	// Group the points at exactly the same place. Sorting by index
+	// second makes the first point of a group the first one seen
+	std::vector<std::uint32_t> sortedPoints(numPoints);
+	std::iota(sortedPoints.begin(), sortedPoints.end(), 0);
+	std::ranges::sort(sortedPoints, [](std::uint32_t a, std::uint32_t b) {
+		if (facePoints[a] != facePoints[b]) {
+			return facePoints[a] < facePoints[b];
+		}
+		return a < b;
+	});
+
+	uniquePoints.clear();
+	firstPointOfUnique.clear();
+	uniqueOfPoint.resize(numPoints);
+	for (std::size_t i = 0; i < numPoints; i++) {
+		std::uint32_t const pointIndex = sortedPoints[i];
+		if (i == 0
+		    || facePoints[pointIndex] != facePoints[sortedPoints[i - 1]]) {
+			uniquePoints.emplace_back(facePoints[pointIndex]);
+			firstPointOfUnique.emplace_back(pointIndex);
+		}
+		uniqueOfPoint[pointIndex] = uniquePoints.size() - 1;
+	}
+
+	uniquesByCell.resize(uniquePoints.size());
+	for (std::uint32_t i = 0; i < uniquePoints.size(); i++) {
+		uniquesByCell[i] = { PointCell(uniquePoints[i]), i };
+	}
+	std::ranges::sort(uniquesByCell);
+	uniqueIsNearOthers.assign(uniquePoints.size(), false);
+	RunThreadsOnIndividual(
+		uniquePoints.size(),
+		false,
+		FindNearUniquePoints,
+		"FindNearUniquePoints"
 	);
 
-	g_dvertexes[g_numvertexes].point[0] = vert[0];
-	g_dvertexes[g_numvertexes].point[1] = vert[1];
-	g_dvertexes[g_numvertexes].point[2] = vert[2];
-	g_numvertexes++;
+	// A vertex is made by the first point of a unique point that isn't
+	// near any other, or by the point GetVertex() made it for
+	InitHash();
+	std::vector<int> hashvertOfPoint(numPoints, -1);
+	for (std::uint32_t i = 0; i < numPoints; i++) {
+		if (uniqueIsNearOthers[uniqueOfPoint[i]]) {
+			hashvertOfPoint[i] = GetVertex(i);
+		}
+	}
+
+	std::vector<std::uint32_t> newVertexPoints;
+	for (std::uint32_t i = 0; i < uniquePoints.size(); i++) {
+		if (!uniqueIsNearOthers[i]) {
+			newVertexPoints.emplace_back(firstPointOfUnique[i]);
+		}
+	}
+	for (hashvert_t const & hv : hashvertexes) {
+		newVertexPoints.emplace_back(hv.firstPoint);
+	}
+	std::ranges::sort(newVertexPoints);
+
+	hlassume(
+		g_numvertexes + newVertexPoints.size() <= MAX_MAP_VERTS,
+		assume_msg::exceeded_MAX_MAP_VERTS
+	);
+	vertexOfPoint.assign(numPoints, -1);
+	for (std::uint32_t pointIndex : newVertexPoints) {
+		// emit a vertex
+		double3_array const & vert = facePoints[pointIndex];
+		g_dvertexes[g_numvertexes].point[0] = vert[0];
+		g_dvertexes[g_numvertexes].point[1] = vert[1];
+		g_dvertexes[g_numvertexes].point[2] = vert[2];
+		vertexOfPoint[pointIndex] = g_numvertexes++;
+	}
 
-	return hv->num;
+	for (std::uint32_t i = 0; i < numPoints; i++) {
+		if (hashvertOfPoint[i] != -1) {
+			vertexOfPoint[i]
+				= vertexOfPoint[hashvertexes[hashvertOfPoint[i]].firstPoint];
+		} else {
+			vertexOfPoint[i]
+				= vertexOfPoint[firstPointOfUnique[uniqueOfPoint[i]]];
+		}
+	}
 }
 
 //===========================================================================
 
+// The edges of the model with the same first and second vertex, in the
+// order they were emitted
+static std::unordered_map<std::uint64_t, int> firstEdgeWithVertexes;
+static std::unordered_map<std::uint64_t, int> lastEdgeWithVertexes;
+static std::vector<int> nextEdgeWithVertexes;
+
+static std::uint64_t edge_key(int v0, int v1) {
+	return (std::uint64_t(std::uint32_t(v0)) << 32) | std::uint32_t(v1);
+}
+
 // =====================================================================================
 //  GetEdge
 //      Don't allow four way edges
 // =====================================================================================
-int GetEdge(double3_array const & p1, double3_array const & p2, face_t* f) {
-	int v1;
-	int v2;
-	dedge_t* edge;
-	int i;
-
+static int GetEdge(int v1, int v2, face_t* f) {
 	hlassert(std::to_underlying(f->contents));
 
-	v1 = GetVertex(p1, f->planenum);
-	v2 = GetVertex(p2, f->planenum);
-	for (i = firstmodeledge; i < g_numedges; i++) {
-		edge = &g_dedges[i];
-		if (v1 == edge->v[1] && v2 == edge->v[0] && !edgefaces[i][1]
-		    && edgefaces[i][0]->contents == f->contents
-		    && edgefaces[i][0]->planenum != (f->planenum ^ 1)
-		    && edgefaces[i][0]->contents == f->contents) {
-			edgefaces[i][1] = f;
-			return -i;
+	auto const sameVertexes = firstEdgeWithVertexes.find(edge_key(v2, v1));
+	if (sameVertexes != firstEdgeWithVertexes.end()) {
+		for (int i = sameVertexes->second; i != -1;
+		     i = nextEdgeWithVertexes[i - firstmodeledge]) {
+			if (!edgefaces[i][1]
+			    && edgefaces[i][0]->contents == f->contents
+			    && edgefaces[i][0]->planenum != (f->planenum ^ 1)) {
+				edgefaces[i][1] = f;
+				return -i;
+			}
 		}
 	}
 
@@ -319,20 +477,68 @@ int GetEdge(double3_array const & p1, double3_array const & p2, face_t* f) {
 	hlassume(
 		g_numedges < MAX_MAP_EDGES, assume_msg::exceeded_MAX_MAP_EDGES
 	);
-	edge = &g_dedges[g_numedges];
+	int const i = g_numedges;
+	dedge_t* edge = &g_dedges[g_numedges];
 	g_numedges++;
 	edge->v[0] = v1;
 	edge->v[1] = v2;
 	edgefaces[i][0] = f;
 
+	std::uint64_t const key = edge_key(v1, v2);
+	nextEdgeWithVertexes.emplace_back(-1);
+	auto const [last, isFirst] = lastEdgeWithVertexes.try_emplace(key, i);
+	if (isFirst) {
+		firstEdgeWithVertexes.emplace(key, i);
+	} else {
+		nextEdgeWithVertexes[last->second - firstmodeledge] = i;
+		last->second = i;
+	}
 	return i;
 }
 
+// =====================================================================================
+//  OutputFaceEdges
+//      Gives each face its outputedges. Edges are shared with the faces
+//      before them
+// =====================================================================================
+void OutputFaceEdges(std::vector<face_t*> const & faces) {
+	trace_phase phase{ "OutputFaceEdges" };
+	outputFaces = faces;
+	firstPointOfFace.assign(1, 0);
+	for (face_t const * f : outputFaces) {
+		firstPointOfFace.emplace_back(
+			firstPointOfFace.back() + f->pts.size() * 2
+		);
+	}
+	facePoints.resize(firstPointOfFace.back());
+	RunThreadsOnIndividual(
+		outputFaces.size(), false, GetFacePoints, "GetFacePoints"
+	);
+
+	WeldFacePoints();
+
+	for (std::size_t faceIndex = 0; faceIndex < outputFaces.size();
+	     faceIndex++) {
+		face_t* f = outputFaces[faceIndex];
+		int const * const vertexes = vertexOfPoint.data()
+			+ firstPointOfFace[faceIndex];
+		f->outputedges = (int*) malloc(f->pts.size() * sizeof(int));
+		hlassume(f->outputedges != nullptr, assume_msg::NoMemory);
+		for (std::size_t i = 0; i < f->pts.size(); i++) {
+			f->outputedges[i] = GetEdge(
+				vertexes[i * 2], vertexes[i * 2 + 1], f
+			);
+		}
+	}
+}
+
 // =====================================================================================
 //  MakeFaceEdges
 // =====================================================================================
 void MakeFaceEdges() {
-	InitHash();
+	trace_phase phase{ "MakeFaceEdges" };
 	firstmodeledge = g_numedges;
-	firstmodelface = g_numfaces;
+	firstEdgeWithVertexes.clear();
+	lastEdgeWithVertexes.clear();
+	nextEdgeWithVertexes.clear();
 }
@@ -1,31 +1,73 @@
 #include "hlbsp.h"
 #include "log.h"
+#include "phase_trace.h"
+#include "threads.h"
 
+#include <algorithm>
 #include <cstring>
 #include <optional>
 #include <vector>
 
-using wvert_count = std::uint32_t;
 using wedge_count = std::uint32_t;
+using edge_count = std::uint32_t;
 
-struct wvert_t final {
-	double t;
-	wvert_count prevWvert;
-	wvert_count nextWvert;
+// An edge of a face, as the range [t1, t2] of the line through origin
+struct edge_line final {
+	double3_array dir;
+	double3_array origin;
+	double t1;
+	double t2;
 };
 
 struct wedge_t final {
 	std::optional<wedge_count> nextWedge;
 	double3_array dir;
 	double3_array origin;
-	wvert_count headWvert;
+	// The points on the edge are the sorted t values
+	// wedgePoints[firstPoint, firstPoint + numPoints)
+	std::size_t firstPoint;
+	std::size_t numPoints;
+};
+
+// The faces of a node, after their edges have been fixed. They are
+// linked in the order they'd have been added to the node serially
+struct fixed_face final {
+	face_t* head{ nullptr };
+	face_t* tail{ nullptr };
+	std::size_t tjuncs{ 0 };
+	std::size_t tjuncfaces{ 0 };
+};
+
+struct tjunc_node final {
+	node_t* node;
+	std::size_t firstFace;
+	std::size_t numFaces;
 };
 
+// Where a t past the last point of an edge would be
+constexpr double wedge_end_t = 99999;
+
 static std::size_t tjuncs;
 static std::size_t tjuncfaces;
 
-static std::vector<wvert_t> wverts;
 static std::vector<wedge_t> wedges;
+static std::vector<double> wedgePoints;
+
+// The faces of the decision nodes, in the order the tree is walked
+static std::vector<tjunc_node> tjuncNodes;
+static std::vector<face_t*> tjuncFaces;
+static std::vector<fixed_face> fixedFaces;
+
+// The edges of tjuncFaces[i] are faceEdges[firstEdgeOfFace[i],
+// firstEdgeOfFace[i + 1])
+static std::vector<std::size_t> firstEdgeOfFace;
+static std::vector<edge_line> faceEdges;
+static std::vector<wedge_count> edgeWedges;
+
+// The edges on wedges[i] are wedgeEdges[firstEdgeOfWedge[i],
+// firstEdgeOfWedge[i + 1]), in the same order as faceEdges
+static std::vector<std::size_t> firstEdgeOfWedge;
+static std::vector<edge_count> wedgeEdges;
 
 //============================================================================
 
@@ -148,14 +190,11 @@ static bool CanonicalVector(double3_array& vec) {
 	return false;
 }
 
-static wedge_t* FindEdge(
-	double3_array const & p1,
-	double3_array const & p2,
-	double* t1,
-	double* t2
-) {
-	double3_array dir = vector_subtract(p2, p1);
-	if (!CanonicalVector(dir)) {
+static edge_line
+MakeEdgeLine(double3_array const & p1, double3_array const & p2) {
+	edge_line line;
+	line.dir = vector_subtract(p2, p1);
+	if (!CanonicalVector(line.dir)) {
 #if _DEBUG
 		Warning(
 			"CanonicalVector: degenerate @ (%4.3f %4.3f %4.3f )\n",
@@ -166,41 +205,59 @@ static wedge_t* FindEdge(
 #endif
 	}
 
-	*t1 = dot_product(p1, dir);
-	*t2 = dot_product(p2, dir);
+	line.t1 = dot_product(p1, line.dir);
+	line.t2 = dot_product(p2, line.dir);
 
-	double3_array const origin = vector_fma(dir, -*t1, p1);
+	line.origin = vector_fma(line.dir, -line.t1, p1);
 
-	if (*t1 > *t2) {
+	if (line.t1 > line.t2) {
 		using std::swap;
-		swap(*t1, *t2);
+		swap(line.t1, line.t2);
 	}
+	return line;
+}
 
-	vector_inplace<int, MAX_HASH_NEIGHBORS> hashneighbors;
-
-	int h = HashVec(origin, hashneighbors);
-
+static std::optional<wedge_count> FindEdge(
+	edge_line const & line,
+	vector_inplace<int, MAX_HASH_NEIGHBORS> const & hashneighbors
+) {
 	for (int neighbour : hashneighbors) {
 		for (std::optional<wedge_count> maybeWedgeIndex
 		     = wedge_hash[neighbour];
 		     maybeWedgeIndex.has_value();
 		     maybeWedgeIndex = wedges[maybeWedgeIndex.value()].nextWedge) {
-			wedge_t& wedge = wedges[maybeWedgeIndex.value()];
+			wedge_t const & wedge = wedges[maybeWedgeIndex.value()];
 
-			if (fabs(wedge.origin[0] - origin[0]) > EQUAL_EPSILON
-			    || fabs(wedge.origin[1] - origin[1]) > EQUAL_EPSILON
-			    || fabs(wedge.origin[2] - origin[2]) > EQUAL_EPSILON) {
+			if (fabs(wedge.origin[0] - line.origin[0]) > EQUAL_EPSILON
+			    || fabs(wedge.origin[1] - line.origin[1]) > EQUAL_EPSILON
+			    || fabs(wedge.origin[2] - line.origin[2]) > EQUAL_EPSILON) {
 				continue;
 			}
-			if (fabs(wedge.dir[0] - dir[0]) > NORMAL_EPSILON
-			    || fabs(wedge.dir[1] - dir[1]) > NORMAL_EPSILON
-			    || fabs(wedge.dir[2] - dir[2]) > NORMAL_EPSILON) {
+			if (fabs(wedge.dir[0] - line.dir[0]) > NORMAL_EPSILON
+			    || fabs(wedge.dir[1] - line.dir[1]) > NORMAL_EPSILON
+			    || fabs(wedge.dir[2] - line.dir[2]) > NORMAL_EPSILON) {
 				continue;
 			}
 
-			return &wedge;
+			return maybeWedgeIndex;
 		}
 	}
+	return std::nullopt;
+}
+
+// Which edge a line belongs to is decided by the edges added before it,
+// so the edges are added one at a time, in the order the tree is walked
+static wedge_count AddEdge(edge_line const & line) {
+	vector_inplace<int, MAX_HASH_NEIGHBORS> hashneighbors;
+
+	int h = HashVec(line.origin, hashneighbors);
+
+	std::optional<wedge_count> const existingWedge = FindEdge(
+		line, hashneighbors
+	);
+	if (existingWedge) {
+		return existingWedge.value();
+	}
 
 	wedge_count const wedgeIndex = wedges.size();
 	wedge_t& wedge = wedges.emplace_back();
@@ -208,56 +265,29 @@ static wedge_t* FindEdge(
 	wedge.nextWedge = wedge_hash[h];
 	wedge_hash[h] = wedgeIndex;
 
-	wedge.origin = origin;
-	wedge.dir = dir;
-
-	wvert_count const headWvertIndex = wverts.size();
-	wvert_t& head = wverts.emplace_back();
-	head.nextWvert = head.prevWvert = headWvertIndex;
-	head.t = 99999;
-
-	wedge.headWvert = headWvertIndex;
-	return &wedge;
+	wedge.origin = line.origin;
+	wedge.dir = line.dir;
+	return wedgeIndex;
 }
 
-static void AddVert(wedge_t const * const w, double const t) {
-	wvert_count wvertIndex = wverts[w->headWvert].nextWvert;
-	while (true) {
-		wvert_t const & wvert = wverts[wvertIndex];
-		if (fabs(wvert.t - t) < ON_EPSILON) {
-			return;
-		}
-		if (wvert.t > t) {
-			break;
-		}
-		wvertIndex = wvert.nextWvert;
-	};
-
-	// Insert a new wvert_t before v
+static void AddVert(wedge_t& w, double const t) {
+	double* const points = wedgePoints.data() + w.firstPoint;
+	double* const pointsEnd = points + w.numPoints;
 
-	wvert_count newvIndex = wverts.size();
-	wvert_t& newv = wverts.emplace_back();
-	wvert_t& v = wverts[wvertIndex];
-
-	newv.t = t;
-	newv.nextWvert = wvertIndex;
-	newv.prevWvert = v.prevWvert;
-	wverts[v.prevWvert].nextWvert = newvIndex;
-	v.prevWvert = newvIndex;
-}
-
-/*
- * ===============
- * AddEdge
- * ===============
- */
-static void AddEdge(double3_array const & p1, double3_array const & p2) {
-	double t1;
-	double t2;
+	// Insert t before the first point past it, unless a point is already
+	// at almost the same place
+	double* const next = std::upper_bound(points, pointsEnd, t);
+	double const nextT = next == pointsEnd ? wedge_end_t : *next;
+	if (fabs(nextT - t) < ON_EPSILON) {
+		return;
+	}
+	if (next != points && fabs(next[-1] - t) < ON_EPSILON) {
+		return;
+	}
 
-	wedge_t* w = FindEdge(p1, p2, &t1, &t2);
-	AddVert(w, t1);
-	AddVert(w, t2);
+	std::copy_backward(next, pointsEnd, pointsEnd + 1);
+	*next = t;
+	++w.numPoints;
 }
 
 /*
@@ -266,25 +296,48 @@ static void AddEdge(double3_array const & p1, double3_array const & p2) {
  *
  * ===============
  */
-static void AddFaceEdges(face_t const * const f) {
+static void AddFaceEdges(int faceIndex) {
+	face_t const * const f = tjuncFaces[faceIndex];
+	edge_line* const lines = faceEdges.data() + firstEdgeOfFace[faceIndex];
 	for (int i = 0; i < f->pts.size(); i++) {
 		int j = (i + 1) % f->pts.size();
-		AddEdge(f->pts[i], f->pts[j]);
+		lines[i] = MakeEdgeLine(f->pts[i], f->pts[j]);
+	}
+}
+
+// Each edge only gets the points of its own lines, so the edges can be
+// filled in at the same time
+static void AddWedgeVerts(int wedgeIndex) {
+	wedge_t& w = wedges[wedgeIndex];
+	for (std::size_t i = firstEdgeOfWedge[wedgeIndex];
+	     i < firstEdgeOfWedge[wedgeIndex + 1];
+	     ++i) {
+		edge_line const & line = faceEdges[wedgeEdges[i]];
+		AddVert(w, line.t1);
+		AddVert(w, line.t2);
 	}
 }
 
 //============================================================================
 
-static byte superfacebuf[1024 * 16];
-static face_t* superface = (face_t*) superfacebuf;
-static std::size_t MAX_SUPERFACEEDGES = (sizeof(superfacebuf)
-                                         - sizeof(face_t)
-                                         + sizeof(superface->pts))
+// Each thread builds the faces it's fixing in its own buffer
+alignas(face_t) static thread_local byte superfacebuf[1024 * 16];
+constexpr std::size_t MAX_SUPERFACEEDGES = (sizeof(superfacebuf)
+                                            - sizeof(face_t)
+                                            + sizeof(face_t::pts))
 	/ sizeof(double3_array);
-static face_t* newlist;
+
+static void AddFixedFace(fixed_face& fixed, face_t* f) {
+	f->next = fixed.head;
+	fixed.head = f;
+	if (!fixed.tail) {
+		fixed.tail = f;
+	}
+}
 
 //// TODO: IS THIS SPLITTING NECESSARY??????
-static void SplitFaceForTjunc(face_t* f, face_t* original) {
+static void
+SplitFaceForTjunc(face_t* f, face_t* original, fixed_face& fixed) {
 	face_t* chain{ nullptr };
 	while (true) {
 		hlassume(
@@ -296,12 +349,11 @@ static void SplitFaceForTjunc(face_t* f, face_t* original) {
 			// so copy it back to the original
 			*original = *f;
 			original->original = chain;
-			original->next = newlist;
-			newlist = original;
+			AddFixedFace(fixed, original);
 			return;
 		}
 
-		++tjuncfaces;
+		++fixed.tjuncfaces;
 
 	restart:
 		// find the last corner
@@ -348,7 +400,8 @@ static void SplitFaceForTjunc(face_t* f, face_t* original) {
 		// cut off as big a piece as possible, less than MAXPOINTS, and not
 		// past lastcorner
 
-		face_t* const newface = new face_t{ NewFaceFromFace(*f) };
+		face_t* const newface = AllocFace();
+		*newface = NewFaceFromFace(*f);
 
 		hlassume(
 			f->original == nullptr, assume_msg::ValidPointer
@@ -356,8 +409,7 @@ static void SplitFaceForTjunc(face_t* f, face_t* original) {
 
 		newface->original = chain;
 		chain = newface;
-		newface->next = newlist;
-		newlist = newface;
+		AddFixedFace(fixed, newface);
 		std::size_t pointsToMoveToNewFace;
 		if (f->pts.size() - firstcorner <= MAXPOINTS) {
 			pointsToMoveToNewFace = firstcorner + 2;
@@ -385,33 +437,44 @@ static void SplitFaceForTjunc(face_t* f, face_t* original) {
  *
  * ===============
  */
-static void FixFaceEdges(face_t* f) {
+// The edges are only looked up here, never added, so any number of faces
+// can be fixed at the same time
+static void FixFaceEdges(int faceIndex) {
+	face_t* const f = tjuncFaces[faceIndex];
+	fixed_face& fixed = fixedFaces[faceIndex];
+	face_t* const superface = (face_t*) superfacebuf;
 	*superface = *f;
 
 restart:
 	for (int i = 0; i < superface->pts.size(); i++) {
 		int j = (i + 1) % superface->pts.size();
 
-		double t1;
-		double t2;
-		wedge_t const * const w = FindEdge(
-			superface->pts[i], superface->pts[j], &t1, &t2
+		edge_line const line = MakeEdgeLine(
+			superface->pts[i], superface->pts[j]
 		);
+		vector_inplace<int, MAX_HASH_NEIGHBORS> hashneighbors;
+		HashVec(line.origin, hashneighbors);
+		std::optional<wedge_count> const wedgeIndex = FindEdge(
+			line, hashneighbors
+		);
+		if (!wedgeIndex) {
+			// No face has this edge, so there's nothing on it
+			continue;
+		}
+		wedge_t const & w = wedges[wedgeIndex.value()];
 
-		wvert_count vIndex;
-		for (vIndex = wverts[w->headWvert].nextWvert;
-		     wverts[vIndex].t < t1 + ON_EPSILON;
-		     vIndex = wverts[vIndex].nextWvert)
-			;
-
-		wvert_t const & v = wverts[vIndex];
+		double const * const points = wedgePoints.data() + w.firstPoint;
+		double const * const pointsEnd = points + w.numPoints;
+		double const * const v = std::lower_bound(
+			points, pointsEnd, line.t1 + ON_EPSILON
+		);
 
-		if (v.t < t2 - ON_EPSILON) {
-			++tjuncs;
+		if (v != pointsEnd && *v < line.t2 - ON_EPSILON) {
+			++fixed.tjuncs;
 			// insert a new vertex here
 			superface->pts.emplace(
 				superface->pts.begin() + j,
-				vector_fma(w->dir, v.t, w->origin)
+				vector_fma(w.dir, *v, w.origin)
 			);
 			hlassume(
 				superface->pts.size() < MAX_SUPERFACEEDGES,
@@ -423,48 +486,94 @@ restart:
 
 	if (superface->pts.size() <= MAXPOINTS) {
 		*f = *superface;
-		f->next = newlist;
-		newlist = f;
+		AddFixedFace(fixed, f);
 		return;
 	}
 
 	// the face needs to be split into multiple faces because of too many
 	// edges
 
-	SplitFaceForTjunc(superface, f);
+	SplitFaceForTjunc(superface, f, fixed);
 }
 
 //============================================================================
 
-static void tjunc_find_r(node_t* node) {
+static void tjunc_collect_r(node_t* node) {
 	if (node->planenum == PLANENUM_LEAF) {
 		return;
 	}
 
+	tjunc_node& collected = tjuncNodes.emplace_back();
+	collected.node = node;
+	collected.firstFace = tjuncFaces.size();
 	for (face_t* f = node->faces; f; f = f->next) {
-		AddFaceEdges(f);
+		tjuncFaces.emplace_back(f);
+		firstEdgeOfFace.emplace_back(
+			firstEdgeOfFace.back() + f->pts.size()
+		);
 	}
+	collected.numFaces = tjuncFaces.size() - collected.firstFace;
 
-	tjunc_find_r(node->children[0]);
-	tjunc_find_r(node->children[1]);
+	tjunc_collect_r(node->children[0]);
+	tjunc_collect_r(node->children[1]);
 }
 
-static void tjunc_fix_r(node_t* node) {
-	if (node->planenum == PLANENUM_LEAF) {
-		return;
+static void tjunc_find() {
+	faceEdges.resize(firstEdgeOfFace.back());
+	RunThreadsOnIndividual(
+		tjuncFaces.size(), false, AddFaceEdges, "AddFaceEdges"
+	);
+
+	edgeWedges.resize(faceEdges.size());
+	for (std::size_t i = 0; i < faceEdges.size(); ++i) {
+		edgeWedges[i] = AddEdge(faceEdges[i]);
 	}
 
-	newlist = nullptr;
-	face_t* next;
-	for (face_t* f = node->faces; f; f = next) {
-		next = f->next;
-		FixFaceEdges(f);
+	// Group the edges by wedge, keeping their order. Each edge can add
+	// two points to its wedge
+	firstEdgeOfWedge.assign(wedges.size() + 1, 0);
+	for (wedge_count w : edgeWedges) {
+		++firstEdgeOfWedge[w + 1];
+	}
+	for (std::size_t w = 0; w < wedges.size(); ++w) {
+		firstEdgeOfWedge[w + 1] += firstEdgeOfWedge[w];
+		wedges[w].firstPoint = firstEdgeOfWedge[w] * 2;
+		wedges[w].numPoints = 0;
+	}
+	wedgeEdges.resize(faceEdges.size());
+	std::vector<std::size_t> nextEdgeOfWedge{ firstEdgeOfWedge.begin(),
+		                                      firstEdgeOfWedge.end() - 1 };
+	for (std::size_t i = 0; i < edgeWedges.size(); ++i) {
+		wedgeEdges[nextEdgeOfWedge[edgeWedges[i]]++] = i;
 	}
 
-	node->faces = newlist;
+	wedgePoints.resize(faceEdges.size() * 2);
+	RunThreadsOnIndividual(
+		wedges.size(), false, AddWedgeVerts, "AddWedgeVerts"
+	);
+}
+
+static void tjunc_fix() {
+	fixedFaces.assign(tjuncFaces.size(), {});
+	RunThreadsOnIndividual(
+		tjuncFaces.size(), false, FixFaceEdges, "FixFaceEdges"
+	);
 
-	tjunc_fix_r(node->children[0]);
-	tjunc_fix_r(node->children[1]);
+	// Link the fixed faces of each node the way they used to be linked
+	// when the faces were fixed one by one
+	for (tjunc_node const & collected : tjuncNodes) {
+		face_t* newlist = nullptr;
+		for (std::size_t i = collected.firstFace;
+		     i < collected.firstFace + collected.numFaces;
+		     ++i) {
+			fixed_face const & fixed = fixedFaces[i];
+			fixed.tail->next = newlist;
+			newlist = fixed.head;
+			tjuncs += fixed.tjuncs;
+			tjuncfaces += fixed.tjuncfaces;
+		}
+		collected.node->faces = newlist;
+	}
 }
 
 /*
@@ -474,6 +583,7 @@ static void tjunc_fix_r(node_t* node) {
  * ===========
  */
 void tjunc(node_t* headnode) {
+	trace_phase phase{ "tjunc" };
 	Verbose("---- tjunc ----\n");
 
 	if (g_notjunc) {
@@ -500,20 +610,25 @@ void tjunc(node_t* headnode) {
 	InitHash(mins, maxs);
 
 	wedges.clear();
-	wverts.clear();
+	tjuncNodes.clear();
+	tjuncFaces.clear();
+	firstEdgeOfFace.assign(1, 0);
 
-	tjunc_find_r(headnode);
+	tjunc_collect_r(headnode);
+	tjunc_find();
 
-	Verbose(
-		"%zu world edges %zu edge points\n", wverts.size(), wverts.size()
-	);
+	std::size_t numPoints = 0;
+	for (wedge_t const & w : wedges) {
+		numPoints += w.numPoints;
+	}
+	Verbose("%zu world edges %zu edge points\n", wedges.size(), numPoints);
 
 	//
 	// add extra vertexes on edges where needed
 	//
 	tjuncs = tjuncfaces = 0;
 
-	tjunc_fix_r(headnode);
+	tjunc_fix();
 
 	Verbose("%zu edges added by tjunctions\n", tjuncs);
 	Verbose("%zu faces added by tjunctions\n", tjuncfaces);
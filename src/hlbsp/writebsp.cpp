@@ -3,10 +3,14 @@
 #include "hlbsp.h"
 #include "log.h"
 #include "messages.h"
+#include "phase_trace.h"
+#include "threads.h"
 
 #include <cstring>
 #include <map>
+#include <optional>
 #include <utility>
+#include <vector>
 
 using PlaneMap = std::map<int, int>;
 static PlaneMap gPlaneMap;
@@ -49,7 +53,7 @@ static int WritePlane(int planenum) {
 		gNumMappedPlanes < MAX_MAP_PLANES,
 		assume_msg::exceeded_MAX_MAP_PLANES
 	);
-	gMappedPlanes[gNumMappedPlanes] = g_mapPlanes[planenum];
+	gMappedPlanes[gNumMappedPlanes] = g_bspMapPlanes[planenum];
 	gPlaneMap.insert(PlaneMap::value_type(planenum, gNumMappedPlanes));
 
 	return gNumMappedPlanes++;
@@ -91,7 +95,7 @@ static int WriteClipNodes_r(
 ) {
 	if (node->isportalleaf) {
 		if (node->contents == contents_t::SOLID) {
-			delete node;
+			FreeNode(node);
 			return std::to_underlying(contents_t::SOLID);
 		} else {
 			portalleaf = node;
@@ -105,7 +109,7 @@ static int WriteClipNodes_r(
 			num = std::to_underlying(portalleaf->contents);
 		}
 		free(node->markfaces);
-		delete node;
+		FreeNode(node);
 		return num;
 	}
 
@@ -141,7 +145,7 @@ static int WriteClipNodes_r(
 		c = output->second; // use existing clipnode
 	}
 
-	delete node;
+	FreeNode(node);
 	return c;
 }
 
@@ -151,6 +155,7 @@ static int WriteClipNodes_r(
 //      format representation and frees the original memory.
 // =====================================================================================
 void WriteClipNodes(node_t* nodes) {
+	trace_phase phase{ "WriteClipNodes" };
 	// we only merge among the clipnodes of the same hull of the same model
 	clipnodemap_t outputmap;
 	WriteClipNodes_r(nodes, nullptr, &outputmap);
@@ -370,10 +375,10 @@ static void FreeDrawNodes_r(node_t* node) {
 	face_t* next;
 	for (face_t* f = node->faces; f; f = next) {
 		next = f->next;
-		delete f;
+		FreeFace(f);
 	}
 
-	delete node;
+	FreeNode(node);
 }
 
 // =====================================================================================
@@ -381,28 +386,24 @@ static void FreeDrawNodes_r(node_t* node) {
 //      Called after a drawing hull is completed
 //      Frees all nodes and faces
 // =====================================================================================
-void OutputEdges_face(face_t* f) {
+static bool should_output_edges(face_t const * f) {
 	wad_texture_name const textureName{ get_texture_by_number(f->texturenum
 	) };
 
-	if (textureName.is_ordinary_hint() || textureName.is_skip()
-	    || should_face_have_facestyle_null(textureName, f->contents)
-	    || textureName.marks_discardable_faces()
-	    || f->texturenum == no_texinfo || f->referenced == 0
-	    || textureName.is_env_sky()) {
-		return;
-	}
-	f->outputedges = (int*) malloc(f->pts.size() * sizeof(int));
-	hlassume(f->outputedges != nullptr, assume_msg::NoMemory);
-	int i;
-	for (i = 0; i < f->pts.size(); i++) {
-		int e = GetEdge(f->pts[i], f->pts[(i + 1) % f->pts.size()], f);
-		f->outputedges[i] = e;
-	}
+	return !(
+		textureName.is_ordinary_hint() || textureName.is_skip()
+		|| should_face_have_facestyle_null(textureName, f->contents)
+		|| textureName.marks_discardable_faces()
+		|| f->texturenum == no_texinfo || f->referenced == 0
+		|| textureName.is_env_sky()
+	);
 }
 
-std::optional<detail_level>
-OutputEdges_r(node_t* node, detail_level detailLevel) {
+static std::optional<detail_level> OutputEdges_r(
+	node_t* node,
+	detail_level detailLevel,
+	std::vector<face_t*>& outputFaces
+) {
 	if (node->is_leaf_node()) {
 		return std::nullopt;
 	}
@@ -414,13 +415,13 @@ OutputEdges_r(node_t* node, detail_level detailLevel) {
 				next = f->detailLevel;
 			}
 		}
-		if (f->detailLevel == detailLevel) {
-			OutputEdges_face(f);
+		if (f->detailLevel == detailLevel && should_output_edges(f)) {
+			outputFaces.emplace_back(f);
 		}
 	}
 	for (std::size_t i = 0; i < 2; ++i) {
 		std::optional<detail_level> r = OutputEdges_r(
-			node->children[i], detailLevel
+			node->children[i], detailLevel, outputFaces
 		);
 		if (!next.has_value()
 		    || (r.has_value() && r.value() < next.value())) {
@@ -463,16 +464,19 @@ static void RemoveCoveredFaces_r(node_t* node) {
 }
 
 void WriteDrawNodes(node_t* headnode) {
+	trace_phase phase{ "WriteDrawNodes" };
 	RemoveCoveredFaces_r(headnode); // fill "referenced" value
 	// higher detail level should not compete for edge pairing with lower
 	// detail level.
 
+	std::vector<face_t*> outputFaces;
 	std::optional<detail_level> nextDetailLevel = 0;
-	while (
-		(nextDetailLevel = OutputEdges_r(headnode, nextDetailLevel.value()))
-			.has_value()
-	)
+	while ((nextDetailLevel = OutputEdges_r(
+				headnode, nextDetailLevel.value(), outputFaces
+			))
+	           .has_value())
 		;
+	OutputFaceEdges(outputFaces);
 
 	WriteDrawNodes_r(headnode, nullptr);
 }
@@ -676,9 +680,9 @@ void FinishBSPFile(bsp_data const & bspData) {
 			free(Map);
 		}
 		Log("Reduced %d planes to %d\n", g_numplanes, gNumMappedPlanes);
-		g_mapPlanes.clear();
+		g_bspMapPlanes.clear();
 		for (int counter = 0; counter < gNumMappedPlanes; counter++) {
-			g_mapPlanes.emplace_back(gMappedPlanes[counter]);
+			g_bspMapPlanes.emplace_back(gMappedPlanes[counter]);
 		}
 		g_numplanes = gNumMappedPlanes;
 	} else {
@@ -711,16 +715,26 @@ void FinishBSPFile(bsp_data const & bspData) {
 		) malloc(MAX_MAP_MODELS * sizeof(int[NUM_HULLS]));
 		hlassume(headnode != nullptr, assume_msg::NoMemory);
 
+		// The clip hulls are independent, so their brinks are analyzed
+		// at the same time
+		RunTasks(
+			[brinkinfo]() {
+				task_group tasks;
+				for (int i = 0; i < g_nummodels; i++) {
+					for (int j = 1; j < NUM_HULLS; j++) {
+						tasks.spawn([brinkinfo, i, j]() {
+							brinkinfo[i][j] = CreateBrinkinfo(
+								g_dclipnodes.data(),
+								g_dmodels[i].headnode[j]
+							);
+						});
+					}
+				}
+				tasks.wait();
+			},
+			"CreateBrinkinfo"
+		);
 		int i, j;
-		for (i = 0; i < g_nummodels; i++) {
-			dmodel_t* m = &g_dmodels[i];
-			Developer(developer_level::message, " model %d\n", i);
-			for (j = 1; j < NUM_HULLS; j++) {
-				brinkinfo[i][j] = CreateBrinkinfo(
-					g_dclipnodes.data(), m->headnode[j]
-				);
-			}
-		}
 		bbrinklevel level;
 		for (level = bbrinklevel::any; level > bbrinklevel::none;
 		     level = bbrinklevel(std::to_underlying(level) - 1)) {
@@ -796,7 +810,7 @@ void FinishBSPFile(bsp_data const & bspData) {
 	}
 
 	for (int i = 0; i < g_numplanes; i++) {
-		mapplane_t const & mp = g_mapPlanes[i];
+		mapplane_t const & mp = g_bspMapPlanes[i];
 		dplane_t& dp = g_dplanes[i];
 		dp = {};
 		dp.normal = to_float3(mp.normal);
@@ -0,0 +1,207 @@
+#include "bspfile.h"
+#include "cli_option_defaults.h"
+#include "intermediate_files.h"
+#include "log.h"
+#include "phase_trace.h"
+#include "threads.h"
+#include "utf8.h"
+
+#include <array>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+// HLCOMPILE runs HLCSG, HLBSP, HLVIS and HLRAD one after another in one
+// process. The files the stages pass to each other are kept in memory,
+// and only the .bsp and the .prt are written to disk, unless -keeptemp is
+// used. The BSP data goes from one stage to the next in bspGlobals, but
+// the planes, hull files and portals are still read back from the
+// in-memory files.
+//
+// All four tools are linked into this executable. Before each stage, the
+// state in the common code is reset to what a freshly started tool sees
+
+// The tool headers can't be included together, since the tools define
+// different types with the same names
+extern int hlcsg_main(int argc, char** argv);
+extern int hlbsp_main(int argc, char** argv);
+extern int hlvis_main(int argc, char** argv);
+extern int hlrad_main(int argc, char** argv);
+
+using stage_main_function = int (*)(int argc, char** argv);
+
+struct compile_stage final {
+	std::u8string_view option;
+	char const * program;
+	stage_main_function stageMain;
+	bool run{ true };
+	std::vector<char*> arguments{};
+};
+
+static bool g_keeptemp = false;
+
+static void Usage() {
+	Banner();
+
+	Log("\n-= %s Options =-\n\n", (char const *) g_Program.data());
+	Log("    -keeptemp      : Also write the intermediate files to disk\n");
+	Log("    -nocsg         : Skip HLCSG\n");
+	Log("    -nobsp         : Skip HLBSP\n");
+	Log("    -novis         : Skip HLVIS\n");
+	Log("    -norad         : Skip HLRAD\n\n");
+	Log("    -csg ...       : Pass the options after it to HLCSG\n");
+	Log("    -bsp ...       : Pass the options after it to HLBSP\n");
+	Log("    -vis ...       : Pass the options after it to HLVIS\n");
+	Log("    -rad ...       : Pass the options after it to HLRAD\n\n");
+	Log("    The options above can be used anywhere on the command line.\n"
+	    "    The other options go to the stage selected before them.\n\n");
+	Log("    mapfile        : The mapfile to compile\n\n");
+
+	exit(1);
+}
+
+static bool is_output_file(std::filesystem::path const & filePath) {
+	// The .prt is used by map editors too
+	return filePath.extension() == ".bsp" || filePath.extension() == ".prt";
+}
+
+static void write_files_to_disk() {
+	bool const success = write_intermediate_files_to_disk(
+		[](std::filesystem::path const & filePath) {
+			return g_keeptemp || is_output_file(filePath);
+		}
+	);
+	if (!success) {
+		Log("Error: Failed to write the compiled files to disk\n");
+	}
+}
+
+// The settings of the previous stage would otherwise carry over, since
+// every tool parses its options into the same common globals
+static void reset_common_state() {
+	g_developer = cli_option_defaults::developer;
+	g_verbose = cli_option_defaults::verbose;
+	g_log = cli_option_defaults::log;
+	g_chart = cli_option_defaults::chart;
+	g_estimate = cli_option_defaults::estimate;
+	g_info = cli_option_defaults::info;
+	g_numthreads = cli_option_defaults::numberOfThreads;
+	g_threadpriority = cli_option_defaults::threadPriority;
+	g_max_map_miptex = cli_option_defaults::max_map_miptex;
+	g_Mapname.clear();
+	g_Wadpath.clear();
+
+	// The BSP data the previous stage wrote stays in bspGlobals for the
+	// next one. Otherwise it's rebuilt in place, since the g_num* and g_d*
+	// references point into it
+	if (!hand_bsp_data_to_next_stage()) {
+		std::destroy_at(&bspGlobals);
+		std::construct_at(&bspGlobals);
+	}
+}
+
+static int run_stage(compile_stage& stage, char* mapfile) {
+	std::vector<char*> argv;
+	argv.push_back(const_cast<char*>(stage.program));
+	argv.insert(argv.end(), stage.arguments.begin(), stage.arguments.end());
+	argv.push_back(mapfile);
+	argv.push_back(nullptr);
+
+	reset_common_state();
+	int const result = stage.stageMain(int(argv.size() - 1), argv.data());
+
+	// A separate process would do these when exiting
+	finish_tracing();
+	CloseLog();
+	g_Program = u8"HLCOMPILE";
+	return result;
+}
+
+// Matches "-csg", or "-nocsg" when negated is true
+static bool is_stage_option(
+	std::u8string_view arg, compile_stage const & stage, bool negated
+) {
+	std::u8string_view const prefix{ negated ? u8"-no" : u8"-" };
+	return arg.size() > prefix.size()
+	    && strings_equal_with_ascii_case_insensitivity(
+			   arg.substr(0, prefix.size()), prefix
+		   )
+	    && strings_equal_with_ascii_case_insensitivity(
+			   arg.substr(prefix.size()), stage.option
+		   );
+}
+
+int main(int argc, char** argv) {
+	g_Program = u8"HLCOMPILE";
+
+	std::array<compile_stage, 4> stages{
+		compile_stage{ .option = u8"csg",
+	                   .program = "hlcsg",
+	                   .stageMain = hlcsg_main },
+		compile_stage{ .option = u8"bsp",
+	                   .program = "hlbsp",
+	                   .stageMain = hlbsp_main },
+		compile_stage{ .option = u8"vis",
+	                   .program = "hlvis",
+	                   .stageMain = hlvis_main },
+		compile_stage{ .option = u8"rad",
+	                   .program = "hlrad",
+	                   .stageMain = hlrad_main }
+	};
+
+	if (argc < 2) {
+		Usage();
+	}
+
+	// The driver's own options are recognized anywhere, so that
+	// "-bsp -leakonly -novis" still skips HLVIS
+	compile_stage* currentStage = nullptr;
+	for (int i = 1; i < argc - 1; ++i) {
+		std::u8string_view const arg{ (char8_t const *) argv[i] };
+		compile_stage* selectedStage = nullptr;
+		compile_stage* skippedStage = nullptr;
+		for (compile_stage& stage : stages) {
+			if (is_stage_option(arg, stage, false)) {
+				selectedStage = &stage;
+			} else if (is_stage_option(arg, stage, true)) {
+				skippedStage = &stage;
+			}
+		}
+
+		if (selectedStage) {
+			currentStage = selectedStage;
+		} else if (skippedStage) {
+			skippedStage->run = false;
+		} else if (strings_equal_with_ascii_case_insensitivity(
+					   arg, u8"-keeptemp"
+				   )) {
+			g_keeptemp = true;
+		} else if (currentStage) {
+			currentStage->arguments.push_back(argv[i]);
+		} else {
+			Log("Unknown option \"%s\"\n", argv[i]);
+			Usage();
+		}
+	}
+	char* const mapfile = argv[argc - 1];
+
+	if (!keep_intermediate_files_in_memory()) {
+		Log("The intermediate files can't be kept in memory on this "
+		    "system, so they go through the disk\n");
+	}
+	// A stage that fails calls exit(), and the files written so far
+	// should still be on disk then, like with the separate tools
+	atexit(write_files_to_disk);
+
+	for (compile_stage& stage : stages) {
+		if (!stage.run) {
+			continue;
+		}
+		int const result = run_stage(stage, mapfile);
+		if (result != 0) {
+			return result;
+		}
+	}
+	return 0;
+}
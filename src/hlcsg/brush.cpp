@@ -8,6 +8,16 @@
 #include "util.h"
 #include "vector_inplace.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
 vector_inplace<mapplane_t, MAX_INTERNAL_MAP_PLANES> g_mapPlanes;
 
 std::array<hullshape_t, NUM_HULLS> g_defaulthulls{};
@@ -21,49 +31,158 @@ void init_default_hulls() {
 
 constexpr float FLOOR_Z = 0.7f; // Quake default
 
+// =====================================================================================
+//  map_plane_index
+// Lets find_int_plane find matching planes without scanning all of
+// g_mapPlanes. Planes are bucketed by their normal, quantized to
+// PLANE_NORMAL_EPSILON, and their distance, so a lookup only has to
+// check the few buckets that could hold a match
+// =====================================================================================
+
+class map_plane_index final {
+  private:
+	struct bucket_key final {
+		std::array<std::int64_t, 3> normal;
+		std::int64_t dist;
+
+		constexpr bool operator==(bucket_key const &) const noexcept
+			= default;
+	};
+
+	struct bucket_key_hash final {
+		std::size_t operator()(bucket_key const & key) const noexcept {
+			return hash_multiple(key.normal, key.dist);
+		}
+	};
+
+	static constexpr double distCellSize = 1.0;
+
+	std::unordered_map<bucket_key, std::vector<int>, bucket_key_hash>
+		buckets;
+
+	static std::int64_t normal_cell(double component) noexcept {
+		return std::int64_t(std::floor(component / PLANE_NORMAL_EPSILON));
+	}
+
+	static std::int64_t dist_cell(double dist) noexcept {
+		return std::int64_t(std::floor(dist / distCellSize));
+	}
+
+	static bool plane_matches(
+		mapplane_t const & plane,
+		double3_array const & normal,
+		double3_array const & origin
+	) noexcept {
+		double3_array const absDiffs = vector_abs(
+			vector_subtract(normal, plane.normal)
+		);
+		return vector_max_element(absDiffs) < PLANE_NORMAL_EPSILON
+			&& std::abs(dot_product(origin, plane.normal) - plane.dist)
+			< PLANE_DIST_EPSILON;
+	}
+
+  public:
+	void clear() noexcept {
+		buckets.clear();
+	}
+
+	void add(int planeNum) {
+		mapplane_t const & plane = g_mapPlanes[planeNum];
+		bucket_key const key{ { normal_cell(plane.normal[0]),
+			                    normal_cell(plane.normal[1]),
+			                    normal_cell(plane.normal[2]) },
+			                  dist_cell(plane.dist) };
+		// Plane numbers only grow, so each bucket stays sorted
+		buckets[key].push_back(planeNum);
+	}
+
+	// Returns the lowest-numbered matching plane, just like a linear
+	// scan of g_mapPlanes would, or -1 if there is none
+	int find(double3_array const & normal, double3_array const & origin)
+		const {
+		// A matching plane's normal differs by less than
+		// PLANE_NORMAL_EPSILON in each component, so the distance of
+		// origin along the two normals differs by less than
+		// |origin|_1 * PLANE_NORMAL_EPSILON. The small constant covers
+		// rounding errors
+		double const originL1 = std::abs(origin[0]) + std::abs(origin[1])
+			+ std::abs(origin[2]);
+		double const distSlack = PLANE_DIST_EPSILON
+			+ originL1 * PLANE_NORMAL_EPSILON + 0.001;
+		double const dist = dot_product(origin, normal);
+
+		// Slightly wider than PLANE_NORMAL_EPSILON for the same reason
+		constexpr double normalSlack = PLANE_NORMAL_EPSILON * 1.01;
+		std::array<std::int64_t, 3> minNormalCell;
+		std::array<std::int64_t, 3> maxNormalCell;
+		for (std::size_t i = 0; i < 3; ++i) {
+			minNormalCell[i] = normal_cell(normal[i] - normalSlack);
+			maxNormalCell[i] = normal_cell(normal[i] + normalSlack);
+		}
+		std::int64_t const minDistCell = dist_cell(dist - distSlack);
+		std::int64_t const maxDistCell = dist_cell(dist + distSlack);
+
+		int best = -1;
+		bucket_key key;
+		for (key.normal[0] = minNormalCell[0];
+		     key.normal[0] <= maxNormalCell[0];
+		     ++key.normal[0]) {
+			for (key.normal[1] = minNormalCell[1];
+			     key.normal[1] <= maxNormalCell[1];
+			     ++key.normal[1]) {
+				for (key.normal[2] = minNormalCell[2];
+				     key.normal[2] <= maxNormalCell[2];
+				     ++key.normal[2]) {
+					for (key.dist = minDistCell; key.dist <= maxDistCell;
+					     ++key.dist) {
+						auto const it = buckets.find(key);
+						if (it == buckets.end()) {
+							continue;
+						}
+						for (int planeNum : it->second) {
+							if (best != -1 && planeNum >= best) {
+								break;
+							}
+							if (plane_matches(
+									g_mapPlanes[planeNum], normal, origin
+								)) {
+								best = planeNum;
+								break;
+							}
+						}
+					}
+				}
+			}
+		}
+		return best;
+	}
+};
+
+static map_plane_index mapPlaneIndex;
+// Lookups share the lock, creating planes takes it exclusively
+static std::shared_mutex mapPlanesMutex;
+
 // =====================================================================================
 //  find_int_plane
-// This process could be optimized by placing the planes in a (non hash-)
-// set and using half of the inner loop check below as the comparator;
-// I'd expect the speed gain to be very large given the change from O(N^2)
-// to O(NlogN) to build the set of planes.
 // =====================================================================================
 
 static int
 find_int_plane(double3_array const & normal, double3_array const & origin) {
-	int returnval = 0;
-
-	bool mapPlanesWasUpdated;
-	do {
-		// Can I use the "Always put axial planes facing positive first"
-		// rule to my advantage?? And only check every other???
-
-		for (; returnval < g_mapPlanes.size(); returnval++) {
-			// BUG: there might be some multithread issue --vluzacn
-
-			// Instead of comparing like this here........I can round
-			// the values and see if the values are equal????
-			// Pros: MUCH easier logic for reducing duplicates
-			// Cons MAYBE: Very close points not matching sometimes,
-			// preventing deduplication round_to_dir_epsilon
-			double3_array const absDiffs = vector_abs(
-				vector_subtract(normal, g_mapPlanes[returnval].normal)
-			);
-			if (vector_max_element(absDiffs) < PLANE_NORMAL_EPSILON
-			    && std::abs(
-					   dot_product(origin, g_mapPlanes[returnval].normal)
-					   - g_mapPlanes[returnval].dist
-				   ) < PLANE_DIST_EPSILON) {
-				return returnval;
-			}
+	{
+		std::shared_lock lock{ mapPlanesMutex };
+		int const existing = mapPlaneIndex.find(normal, origin);
+		if (existing != -1) {
+			return existing;
 		}
+	}
 
-		ThreadLock(); // make sure we don't race
-		mapPlanesWasUpdated = returnval
-			!= g_mapPlanes.size(
-			); // check to see if other thread added plane we need
-		ThreadUnlock();
-	} while (mapPlanesWasUpdated);
+	std::unique_lock lock{ mapPlanesMutex };
+	// Check again, since another thread may have added the plane
+	// while we didn't hold the lock
+	int returnval = mapPlaneIndex.find(normal, origin);
+	if (returnval != -1) {
+		return returnval;
+	}
 
 	// create new planes - double check that we have room for 2 planes
 	hlassume(
@@ -122,17 +241,37 @@ find_int_plane(double3_array const & normal, double3_array const & origin) {
 		returnval = pAIndex;
 	}
 
-	ThreadUnlock();
+	mapPlaneIndex.add(pAIndex);
+	mapPlaneIndex.add(pBIndex);
 	return returnval;
 }
 
-static int PlaneFromPoints(std::array<double3_array, 3> const & points) {
+// Removes the planes from firstPlane on
+static void truncate_map_planes(std::size_t firstPlane) {
+	std::unique_lock lock{ mapPlanesMutex };
+	g_mapPlanes.shrink_to(firstPlane);
+	mapPlaneIndex.clear();
+	for (std::size_t i = 0; i < firstPlane; ++i) {
+		mapPlaneIndex.add(i);
+	}
+}
+
+static std::optional<double3_array>
+normal_from_points(std::array<double3_array, 3> const & points) {
 	double3_array v1 = vector_subtract(points[0], points[1]);
 	double3_array v2 = vector_subtract(points[2], points[1]);
 	double3_array normal = cross_product(v1, v2);
 
 	if (normalize_vector(normal)) {
-		return find_int_plane(normal, points[0]);
+		return normal;
+	}
+	return std::nullopt;
+}
+
+static int PlaneFromPoints(std::array<double3_array, 3> const & points) {
+	std::optional<double3_array> const normal = normal_from_points(points);
+	if (normal) {
+		return find_int_plane(normal.value(), points[0]);
 	}
 	return -1;
 }
@@ -148,31 +287,50 @@ char const * GetClipTypeString(cliptype ct) {
 // =====================================================================================
 //  AddHullPlane (subroutine for replacement of expand_brush)
 //  Called to add any and all clip hull planes by the new expand_brush.
+//  The planes are only looked up later, by add_hull_planes, so that
+//  expand_brush can run on many brushes at once
 // =====================================================================================
 
+struct hull_plane_request final {
+	double3_array normal;
+	double3_array origin;
+	bool checkPlanenum;
+};
+
+using hull_plane_requests = std::vector<hull_plane_request>;
+
 static void AddHullPlane(
-	brushhull_t* hull,
+	hull_plane_requests& requests,
 	double3_array const & normal,
 	double3_array const & origin,
 	bool const check_planenum
 ) {
-	int planenum = find_int_plane(normal, origin);
-	// check to see if this plane is already in the brush (optional to speed
-	// up cases where we know the plane hasn't been added yet, like axial
-	// case)
-	if (check_planenum) {
-		for (bface_t const & current_face : hull->faces) {
-			if (current_face.planenum == planenum) {
-				return;
-			} // don't add a plane twice
-		}
-	}
-	bface_t new_face{};
-	new_face.planenum = planenum;
-	new_face.plane = &g_mapPlanes[planenum];
-	new_face.contents = contents_t::EMPTY;
-	new_face.texinfo = no_texinfo;
-	hull->faces.emplace_back(std::move(new_face));
+	requests.emplace_back(normal, origin, check_planenum);
+}
+
+static void
+add_hull_planes(brushhull_t& hull, hull_plane_requests const & requests) {
+	for (hull_plane_request const & request : requests) {
+		int planenum = find_int_plane(request.normal, request.origin);
+		// check to see if this plane is already in the brush (optional to
+		// speed up cases where we know the plane hasn't been added yet,
+		// like axial case)
+		if (request.checkPlanenum
+		    && std::ranges::any_of(
+				hull.faces,
+				[planenum](bface_t const & current_face) {
+					return current_face.planenum == planenum;
+				}
+			)) {
+			continue; // don't add a plane twice
+		}
+		bface_t new_face{};
+		new_face.planenum = planenum;
+		new_face.plane = &g_mapPlanes[planenum];
+		new_face.contents = contents_t::EMPTY;
+		new_face.texinfo = no_texinfo;
+		hull.faces.emplace_back(std::move(new_face));
+	}
 }
 
 // =====================================================================================
@@ -217,7 +375,7 @@ static void expand_brush_with_hullbrush(
 	csg_brush const * brush,
 	brushhull_t const * hull0,
 	hullbrush_t const & hb,
-	brushhull_t* hull
+	hull_plane_requests& requests
 ) {
 	auto axialbevel = std::make_unique<bool[]>(hb.faces.size());
 
@@ -280,7 +438,7 @@ static void expand_brush_with_hullbrush(
 		if (!f.bevel) {
 			origin = vector_subtract(origin, bestvertex);
 		}
-		AddHullPlane(hull, normal, origin, true);
+		AddHullPlane(requests, normal, origin, true);
 	}
 
 	bool warned = false;
@@ -365,7 +523,7 @@ static void expand_brush_with_hullbrush(
 				double3_array origin = vector_subtract(
 					brushedge.point, hbe.point
 				);
-				AddHullPlane(hull, normal, origin, true);
+				AddHullPlane(requests, normal, origin, true);
 			}
 		}
 	}
@@ -399,11 +557,13 @@ static void expand_brush_with_hullbrush(
 		} else {
 			origin = vector_subtract(bestvertex, hbf.point);
 		}
-		AddHullPlane(hull, normal, origin, true);
+		AddHullPlane(requests, normal, origin, true);
 	}
 }
 
-void expand_brush(csg_brush* brush, int const hullnum) {
+static void expand_brush(
+	csg_brush const * brush, int const hullnum, hull_plane_requests& requests
+) {
 	hullshape_t const * hs = &g_defaulthulls[hullnum];
 	{ // look up the name of its hull shape in g_hullshapes[]
 		std::u8string const & name = brush->hullshapes[hullnum];
@@ -442,7 +602,7 @@ void expand_brush(csg_brush* brush, int const hullnum) {
 			brush,
 			&brush->hulls[0],
 			hs->hullBrush.value(),
-			&brush->hulls[hullnum]
+			requests
 		);
 
 		return;
@@ -455,10 +615,8 @@ void expand_brush(csg_brush* brush, int const hullnum) {
 		                                                { false, false },
 		                                                { false, false } };
 
-	brushhull_t* hull = &brush->hulls[hullnum];
-
 	// step 1: for collision between player vertex and brush face. --vluzacn
-	for (bface_t& current_face : brush->hulls[0].faces) {
+	for (bface_t const & current_face : brush->hulls[0].faces) {
 		mapplane_t* current_plane = current_face.plane;
 
 		// don't bother adding axial planes,
@@ -538,7 +696,7 @@ void expand_brush(csg_brush* brush, int const hullnum) {
 			origin[2] += g_hull_size[hullnum][(normal[2] > 0 ? 1 : 0)][2];
 		}
 
-		AddHullPlane(hull, normal, origin, false);
+		AddHullPlane(requests, normal, origin, false);
 	} // end for loop over all faces
 
 	// step 2: for collision between player edge and brush edge. --vluzacn
@@ -550,7 +708,7 @@ void expand_brush(csg_brush* brush, int const hullnum) {
 
 	// only executes if cliptype is simple, normalized or precise
 	if (g_cliptype == clip_precise || g_cliptype == clip_normalized) {
-		for (bface_t& current_face : brush->hulls[0].faces) {
+		for (bface_t const & current_face : brush->hulls[0].faces) {
 			mapplane_t* current_plane = current_face.plane;
 
 			// test to see if the plane is completely non-axial (if it is,
@@ -709,7 +867,7 @@ void expand_brush(csg_brush* brush, int const hullnum) {
 
 						// add the bevel plane to the expanded hull
 						AddHullPlane(
-							hull, normal, origin, true
+							requests, normal, origin, true
 						); // double check that this edge hasn't been added
 						   // yet
 					}
@@ -729,7 +887,7 @@ void expand_brush(csg_brush* brush, int const hullnum) {
 	};
 	double3_array normal{ -1, 0, 0 };
 	AddHullPlane(
-		hull,
+		requests,
 		normal,
 		(axialbevel[std::size_t(planetype::plane_x)][0]
 	         ? brush->hulls[0].bounds.mins
@@ -739,7 +897,7 @@ void expand_brush(csg_brush* brush, int const hullnum) {
 	normal[0] = 0;
 	normal[1] = -1;
 	AddHullPlane(
-		hull,
+		requests,
 		normal,
 		(axialbevel[std::size_t(planetype::plane_y)][0]
 	         ? brush->hulls[0].bounds.mins
@@ -749,7 +907,7 @@ void expand_brush(csg_brush* brush, int const hullnum) {
 	normal[1] = 0;
 	normal[2] = -1;
 	AddHullPlane(
-		hull,
+		requests,
 		normal,
 		(axialbevel[std::size_t(planetype::plane_z)][0]
 	         ? brush->hulls[0].bounds.mins
@@ -765,7 +923,7 @@ void expand_brush(csg_brush* brush, int const hullnum) {
 	);
 	normal[0] = 1;
 	AddHullPlane(
-		hull,
+		requests,
 		normal,
 		(axialbevel[std::size_t(planetype::plane_x)][1]
 	         ? brush->hulls[0].bounds.maxs
@@ -775,7 +933,7 @@ void expand_brush(csg_brush* brush, int const hullnum) {
 	normal[0] = 0;
 	normal[1] = 1;
 	AddHullPlane(
-		hull,
+		requests,
 		normal,
 		(axialbevel[std::size_t(planetype::plane_y)][1]
 	         ? brush->hulls[0].bounds.maxs
@@ -785,7 +943,7 @@ void expand_brush(csg_brush* brush, int const hullnum) {
 	normal[1] = 0;
 	normal[2] = 1;
 	AddHullPlane(
-		hull,
+		requests,
 		normal,
 		(axialbevel[std::size_t(planetype::plane_z)][1]
 	         ? brush->hulls[0].bounds.maxs
@@ -881,14 +1039,24 @@ restart:
 // =====================================================================================
 //  MakeBrushPlanes
 // =====================================================================================
+// =====================================================================================
+//  OffsetBrushSides
+//      If the origin key is set (by an origin brush), offset all of the
+//      values. Done before MakeBrushPlanes, which may run twice
+// =====================================================================================
+static void OffsetBrushSides(csg_brush& b, csg_entity const & entity) {
+	double3_array const origin = get_double3_for_key(entity, u8"origin");
+	for (side_count i = 0; i < b.numSides; ++i) {
+		side_t* s = &g_brushsides[b.firstSide + i];
+		for (std::size_t j = 0; j < 3; ++j) {
+			s->planepts[j] = vector_subtract(s->planepts[j], origin);
+		}
+	}
+}
+
 static bool MakeBrushPlanes(csg_brush& b, csg_entity const & entity) {
-	int j;
 	int planenum;
 
-	//
-	// if the origin key is set (by an origin brush), offset all of the
-	// values
-	//
 	double3_array const origin = get_double3_for_key(entity, u8"origin");
 
 	//
@@ -897,9 +1065,6 @@ static bool MakeBrushPlanes(csg_brush& b, csg_entity const & entity) {
 	// for each side in this brush
 	for (side_count i = 0; i < b.numSides; ++i) {
 		side_t* s = &g_brushsides[b.firstSide + i];
-		for (std::size_t j = 0; j < 3; ++j) {
-			s->planepts[j] = vector_subtract(s->planepts[j], origin);
-		}
 		planenum = PlaneFromPoints(s->planepts);
 		if (planenum == -1) {
 			Fatal(
@@ -911,11 +1076,40 @@ static bool MakeBrushPlanes(csg_brush& b, csg_entity const & entity) {
 			);
 		}
 
-		//
-		// see if the plane has been used already
-		//
-		for (bface_t const & f : b.hulls[0].faces) {
-			if (f.planenum == planenum || f.planenum == (planenum ^ 1)) {
+		bface_t new_face{};
+		new_face.planenum = planenum;
+		new_face.plane = &g_mapPlanes[planenum];
+		new_face.texinfo = g_onlyents
+			? 0
+			: TexinfoForBrushTexture(new_face.plane, &s->td, origin);
+		new_face.bevel = b.bevel || s->bevel;
+		b.hulls[0].faces.emplace_back(std::move(new_face));
+	}
+
+	return true;
+}
+
+// =====================================================================================
+//  CheckCoplanarSides
+//      Sees if a plane is used by more than one side. Takes the planes of
+//      the sides in order
+// =====================================================================================
+static void CheckCoplanarSides(
+	csg_brush const & b,
+	csg_entity const & entity,
+	std::span<int const> sidePlanenums
+) {
+	double3_array const origin = get_double3_for_key(entity, u8"origin");
+
+	for (side_count i = 0; i < b.numSides; ++i) {
+		side_t const * s = &g_brushsides[b.firstSide + i];
+		int const planenum = sidePlanenums[i];
+		if (planenum == -1) {
+			continue;
+		}
+		for (side_count j = 0; j < i; ++j) {
+			if (sidePlanenums[j] == planenum
+			    || sidePlanenums[j] == (planenum ^ 1)) {
 				Fatal(
 					assume_msg::BRUSH_WITH_COPLANAR_FACES,
 					"Entity %i, Brush %i, Side %i: has a coplanar plane at (%.0f, %.0f, %.0f), texture %s",
@@ -929,18 +1123,7 @@ static bool MakeBrushPlanes(csg_brush& b, csg_entity const & entity) {
 				);
 			}
 		}
-
-		bface_t new_face{};
-		new_face.planenum = planenum;
-		new_face.plane = &g_mapPlanes[planenum];
-		new_face.texinfo = g_onlyents
-			? 0
-			: TexinfoForBrushTexture(new_face.plane, &s->td, origin);
-		new_face.bevel = b.bevel || s->bevel;
-		b.hulls[0].faces.emplace_back(std::move(new_face));
 	}
-
-	return true;
 }
 
 // =====================================================================================
@@ -1153,51 +1336,255 @@ contents_t CheckBrushContents(csg_brush const * const b) {
 	return contents;
 }
 
-void create_brush(csg_brush& b, csg_entity const & ent) {
-	contents_t contents = b.contents;
+// =====================================================================================
+//  create_brush
+//  Split into steps so create_brushes can run the expensive ones, making
+//  and expanding the hulls, on all threads. The other steps number new
+//  planes and texinfos, so they run in brush order to give the same
+//  output no matter how many threads are used
+// =====================================================================================
+
+using brush_hull_plane_requests
+	= std::array<hull_plane_requests, NUM_HULLS>;
+
+static bool has_hulls(csg_brush const & b) {
+	return b.contents != contents_t::ORIGIN
+		&& b.contents != contents_t::BOUNDINGBOX;
+}
+
+// Whether only hulls in b.cliphull get faces
+static bool is_cliphull_brush(csg_brush const & b) {
+	return has_hulls(b) && b.contents != contents_t::HINT
+		&& b.contents != contents_t::TOEMPTY && !g_noclip && b.cliphull;
+}
+
+// Which hulls other than hull 0 are expanded from hull 0
+static bool expands_hull(csg_brush const & b, std::size_t hullnum) {
+	if (!has_hulls(b) || b.contents == contents_t::HINT
+	    || b.contents == contents_t::TOEMPTY || g_noclip) {
+		return false;
+	}
+	if (b.cliphull) {
+		return b.cliphull & (1 << hullnum);
+	}
+	return !b.noclip;
+}
+
+static void offset_brush_sides(csg_brush& b, csg_entity const & ent) {
+	if (has_hulls(b)) {
+		OffsetBrushSides(b, ent);
+	}
+}
+
+// Must be called in brush order
+static void create_brush_planes(csg_brush& b, csg_entity const & ent) {
+	if (has_hulls(b)) {
+		// HULL 0
+		MakeBrushPlanes(b, ent);
+	}
+}
 
-	if (contents == contents_t::ORIGIN) {
+// Must be called right after create_brush_planes, while the faces of
+// hull 0 are still in side order
+static void
+check_brush_planes(csg_brush const & b, csg_entity const & ent) {
+	if (!has_hulls(b)) {
 		return;
 	}
-	if (contents == contents_t::BOUNDINGBOX) {
+	std::vector<int> sidePlanenums;
+	for (bface_t const & f : b.hulls[0].faces) {
+		// A side without a plane has planenum -1 truncated
+		bool const hasPlane = f.planenum != std::uint16_t(-1);
+		sidePlanenums.push_back(hasPlane ? f.planenum : -1);
+	}
+	CheckCoplanarSides(b, ent, sidePlanenums);
+}
+
+static void create_brush_hull0(
+	csg_brush& b, brush_hull_plane_requests& hullPlaneRequests
+) {
+	if (!has_hulls(b)) {
 		return;
 	}
 
-	// HULL 0
-	MakeBrushPlanes(b, ent);
 	make_hullfaces(b, b.hulls[0]);
 
-	if (contents == contents_t::HINT) {
-		return;
+	if (g_noclip && b.cliphull && b.contents != contents_t::HINT
+	    && b.contents != contents_t::TOEMPTY) {
+		// Is this necessary?
+		b.hulls[0].faces.clear();
 	}
-	if (contents == contents_t::TOEMPTY) {
-		return;
+
+	for (std::size_t h = 1; h < NUM_HULLS; ++h) {
+		if (expands_hull(b, h)) {
+			expand_brush(&b, h, hullPlaneRequests[h]);
+		}
 	}
+}
 
-	if (g_noclip) {
-		if (b.cliphull) {
-			// Is this necessary?
-			b.hulls[0].faces.clear();
+// Must be called in brush order
+static void add_brush_hull_planes(
+	csg_brush& b, brush_hull_plane_requests const & hullPlaneRequests
+) {
+	for (std::size_t h = 1; h < NUM_HULLS; ++h) {
+		if (expands_hull(b, h)) {
+			add_hull_planes(b.hulls[h], hullPlaneRequests[h]);
 		}
-		return;
 	}
+}
 
-	if (b.cliphull) {
-		for (std::size_t h = 1; h < NUM_HULLS; ++h) {
-			if (b.cliphull & (1 << h)) {
-				expand_brush(&b, h);
-				make_hullfaces(b, b.hulls[h]);
-			}
+static void create_brush_hulls(csg_brush& b) {
+	for (std::size_t h = 1; h < NUM_HULLS; ++h) {
+		if (expands_hull(b, h)) {
+			make_hullfaces(b, b.hulls[h]);
 		}
+	}
+
+	if (is_cliphull_brush(b)) {
 		b.contents = contents_t::SOLID;
 		// Is this necessary?
 		b.hulls[0].faces.clear();
-	} else if (!b.noclip) {
-		for (std::size_t h = 1; h < NUM_HULLS; ++h) {
-			expand_brush(&b, h);
-			make_hullfaces(b, b.hulls[h]);
+	}
+}
+
+void create_brush(csg_brush& b, csg_entity const & ent) {
+	brush_hull_plane_requests hullPlaneRequests;
+	offset_brush_sides(b, ent);
+	create_brush_planes(b, ent);
+	check_brush_planes(b, ent);
+	create_brush_hull0(b, hullPlaneRequests);
+	add_brush_hull_planes(b, hullPlaneRequests);
+	create_brush_hulls(b);
+}
+
+static std::vector<brush_hull_plane_requests> hullPlaneRequestsByBrush;
+
+static void CreateBrushHull0(int brushIndex) {
+	create_brush_hull0(
+		g_mapbrushes[brushIndex], hullPlaneRequestsByBrush[brushIndex]
+	);
+}
+
+static void CreateBrushHulls(int brushIndex) {
+	create_brush_hulls(g_mapbrushes[brushIndex]);
+}
+
+// =====================================================================================
+//  remake_planes_in_brush_order
+//  create_brushes looks up the hull 0 planes of all brushes before any
+//  hull is expanded, while create_brush looks up the planes of one brush
+//  at a time. The plane numbers, and which of two nearly equal planes is
+//  kept, depend on that order, so the planes are looked up again in
+//  create_brush's order. A brush whose hull 0 planes come out different
+//  has its hull 0 made and expanded again
+// =====================================================================================
+static void remake_planes_in_brush_order(std::size_t firstNewPlane) {
+	// The lowest-numbered match is the plane a side got the first time,
+	// since the planes made after it have higher numbers
+	std::vector<std::vector<int>> oldSidePlanenums(g_nummapbrushes);
+	for (brush_count i = 0; i != g_nummapbrushes; ++i) {
+		csg_brush const & b{ g_mapbrushes[i] };
+		if (!has_hulls(b)) {
+			continue;
+		}
+		for (side_count j = 0; j < b.numSides; ++j) {
+			side_t const & s = g_brushsides[b.firstSide + j];
+			std::optional<double3_array> const normal = normal_from_points(
+				s.planepts
+			);
+			oldSidePlanenums[i].push_back(
+				normal ? mapPlaneIndex.find(normal.value(), s.planepts[0])
+					   : -1
+			);
 		}
 	}
+	std::vector<mapplane_t> const oldPlanes(
+		g_mapPlanes.begin(), g_mapPlanes.end()
+	);
+	truncate_map_planes(firstNewPlane);
+
+	std::vector<int> sidePlanenums;
+	for (brush_count i = 0; i != g_nummapbrushes; ++i) {
+		csg_brush& b{ g_mapbrushes[i] };
+		csg_entity const & ent{ g_entities[b.entitynum] };
+		brush_hull_plane_requests& hullPlaneRequests{
+			hullPlaneRequestsByBrush[i]
+		};
+		if (!has_hulls(b)) {
+			continue;
+		}
+
+		sidePlanenums.clear();
+		for (side_count j = 0; j < b.numSides; ++j) {
+			sidePlanenums.push_back(
+				PlaneFromPoints(g_brushsides[b.firstSide + j].planepts)
+			);
+		}
+		CheckCoplanarSides(b, ent, sidePlanenums);
+
+		// The hulls were made from the old planes, which are fine if
+		// they're the same as the new ones and no two sides shared one
+		std::vector<int> const & oldPlanenums{ oldSidePlanenums[i] };
+		bool sameHull0 = true;
+		for (side_count j = 0; j < b.numSides && sameHull0; ++j) {
+			int const oldPlanenum = oldPlanenums[j];
+			int const newPlanenum = sidePlanenums[j];
+			if (oldPlanenum == -1 || newPlanenum == -1) {
+				sameHull0 = oldPlanenum == newPlanenum;
+				continue;
+			}
+			mapplane_t const & oldPlane = oldPlanes[oldPlanenum];
+			mapplane_t const & newPlane = g_mapPlanes[newPlanenum];
+			sameHull0 = oldPlane.normal == newPlane.normal
+				&& oldPlane.dist == newPlane.dist
+				&& oldPlane.type == newPlane.type;
+			for (side_count k = 0; k < j && sameHull0; ++k) {
+				sameHull0 = (oldPlanenums[k] >> 1) != (oldPlanenum >> 1)
+					&& (sidePlanenums[k] >> 1) != (newPlanenum >> 1);
+			}
+		}
+
+		if (sameHull0) {
+			for (bface_t& f : b.hulls[0].faces) {
+				if (f.planenum == std::uint16_t(-1)) {
+					continue;
+				}
+				std::size_t const side = std::ranges::find(
+											 oldPlanenums, f.planenum
+										 )
+					- oldPlanenums.begin();
+				f.planenum = sidePlanenums[side];
+				f.plane = &g_mapPlanes[f.planenum];
+			}
+		} else {
+			b.hulls = {};
+			hullPlaneRequests = {};
+			create_brush_planes(b, ent);
+			create_brush_hull0(b, hullPlaneRequests);
+		}
+		add_brush_hull_planes(b, hullPlaneRequests);
+	}
+}
+
+void create_brushes() {
+	std::size_t const firstNewPlane = g_mapPlanes.size();
+	for (brush_count i = 0; i != g_nummapbrushes; ++i) {
+		csg_brush& b{ g_mapbrushes[i] };
+		offset_brush_sides(b, g_entities[b.entitynum]);
+		create_brush_planes(b, g_entities[b.entitynum]);
+	}
+
+	hullPlaneRequestsByBrush.resize(g_nummapbrushes);
+	NamedRunThreadsOnIndividual(
+		g_nummapbrushes, g_estimate, CreateBrushHull0
+	);
+
+	remake_planes_in_brush_order(firstNewPlane);
+	hullPlaneRequestsByBrush = {};
+
+	NamedRunThreadsOnIndividual(
+		g_nummapbrushes, g_estimate, CreateBrushHulls
+	);
 }
 
 hullbrush_t CreateHullBrush(csg_brush const & b) {
@@ -0,0 +1,101 @@
+#include "brush_bounds_tree.h"
+
+#include "mathlib.h"
+
+#include <algorithm>
+
+constexpr std::uint32_t maxBrushesPerLeaf = 4;
+
+void brush_bounds_tree::build(
+	std::vector<bounding_box> bounds, std::vector<std::uint32_t> brushList
+) {
+	brushBounds = std::move(bounds);
+	brushes = std::move(brushList);
+	nodes.clear();
+	if (brushes.empty()) {
+		return;
+	}
+	nodes.reserve(brushes.size() / maxBrushesPerLeaf * 4 + 1);
+	nodes.emplace_back();
+	build_node(0, 0, brushes.size());
+}
+
+void brush_bounds_tree::build_node(
+	std::uint32_t nodeIndex, std::uint32_t first, std::uint32_t count
+) {
+	bounding_box bounds{ empty_bounding_box };
+	bounding_box centers{ empty_bounding_box };
+	for (std::uint32_t i = first; i < first + count; ++i) {
+		bounding_box& brush = brushBounds[brushes[i]];
+		add_to_bounding_box(bounds, brush);
+		add_to_bounding_box(
+			centers, midpoint_between(brush.mins, brush.maxs)
+		);
+	}
+	nodes[nodeIndex].bounds = bounds;
+
+	if (count <= maxBrushesPerLeaf) {
+		nodes[nodeIndex].first = first;
+		nodes[nodeIndex].count = count;
+		return;
+	}
+
+	// Split at the median center along the longest axis
+	std::size_t axis = 0;
+	for (std::size_t i = 1; i < 3; ++i) {
+		if (centers.maxs[i] - centers.mins[i]
+		    > centers.maxs[axis] - centers.mins[axis]) {
+			axis = i;
+		}
+	}
+	std::uint32_t const half = count / 2;
+	std::nth_element(
+		brushes.begin() + first,
+		brushes.begin() + first + half,
+		brushes.begin() + first + count,
+		[this, axis](std::uint32_t a, std::uint32_t b) {
+			double const centerA = brushBounds[a].mins[axis]
+				+ brushBounds[a].maxs[axis];
+			double const centerB = brushBounds[b].mins[axis]
+				+ brushBounds[b].maxs[axis];
+			return centerA < centerB;
+		}
+	);
+
+	std::uint32_t const children = nodes.size();
+	nodes.emplace_back();
+	nodes.emplace_back();
+	nodes[nodeIndex].first = children;
+	nodes[nodeIndex].count = 0;
+	build_node(children, first, half);
+	build_node(children + 1, first + half, count - half);
+}
+
+void brush_bounds_tree::find_overlapping(
+	bounding_box const & box, std::vector<std::uint32_t>& overlapping
+) const {
+	overlapping.clear();
+	if (nodes.empty()) {
+		return;
+	}
+
+	std::vector<std::uint32_t> stack{ 0 };
+	while (!stack.empty()) {
+		node const & n = nodes[stack.back()];
+		stack.pop_back();
+		if (test_disjoint(box, n.bounds)) {
+			continue;
+		}
+		if (n.count == 0) {
+			stack.emplace_back(n.first);
+			stack.emplace_back(n.first + 1);
+			continue;
+		}
+		for (std::uint32_t i = n.first; i < n.first + n.count; ++i) {
+			if (!test_disjoint(box, brushBounds[brushes[i]])) {
+				overlapping.emplace_back(brushes[i]);
+			}
+		}
+	}
+	std::ranges::sort(overlapping);
+}
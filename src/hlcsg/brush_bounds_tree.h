@@ -0,0 +1,39 @@
+#pragma once
+
+#include "bounding_box.h"
+
+#include <cstdint>
+#include <vector>
+
+// A bounding volume hierarchy over the hull bounds of an entity's brushes,
+// so CSGBrush only has to look at the brushes that might overlap the one
+// being clipped instead of every brush in the entity
+class brush_bounds_tree final {
+  public:
+	// Brushes are identified by their index in brushBounds
+	void build(std::vector<bounding_box> brushBounds,
+	           std::vector<std::uint32_t> brushes);
+
+	// Sets overlapping to the brushes, in increasing order, whose bounds
+	// aren't disjoint from box according to test_disjoint()
+	void find_overlapping(
+		bounding_box const & box, std::vector<std::uint32_t>& overlapping
+	) const;
+
+  private:
+	struct node final {
+		bounding_box bounds;
+		// Leaves have count brushes starting at brushes[first], other
+		// nodes have their children at nodes[first] and nodes[first + 1]
+		std::uint32_t first;
+		std::uint32_t count;
+	};
+
+	void build_node(
+		std::uint32_t nodeIndex, std::uint32_t first, std::uint32_t count
+	);
+
+	std::vector<bounding_box> brushBounds;
+	std::vector<std::uint32_t> brushes;
+	std::vector<node> nodes;
+};
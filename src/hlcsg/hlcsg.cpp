@@ -1,5 +1,6 @@
 #include "hlcsg.h"
 
+#include "brush_bounds_tree.h"
 #include "bsp_file_sizes.h"
 #include "bspfile.h"
 #include "cli_option_defaults.h"
@@ -7,15 +8,23 @@
 #include "cmdlinecfg.h"
 #include "filelib.h"
 #include "hlcsg_settings.h"
+#include "hull_file.h"
+#include "intermediate_files.h"
 #include "internal_types/various.h"
 #include "legacy_character_encodings.h"
 #include "log.h"
 #include "map_entity_parser.h"
+#include "phase_trace.h"
 #include "threads.h"
 #include "time_counter.h"
 #include "utf8.h"
 
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <mutex>
 #include <numbers>
+#include <string>
 #include <string_view>
 #include <utility>
 using namespace std::literals;
@@ -26,20 +35,16 @@ static FILE* out[NUM_HULLS]; // pointer to each of the hull out files (.p0,
                              // .p1, ect.)
 static FILE* out_view[NUM_HULLS];
 static FILE* out_detailbrush[NUM_HULLS];
-static int c_outfaces;
-static int c_csgfaces;
+static std::atomic<int> c_outfaces;
+static std::atomic<int> c_csgfaces;
 bounding_box world_bounds;
 
 hull_sizes g_hull_size{ standard_hull_sizes };
 
-bool g_noclip = DEFAULT_NOCLIP;            // no clipping hull "-noclip"
-bool g_onlyents = DEFAULT_ONLYENTS;        // onlyents mode "-onlyents"
-bool g_wadtextures = DEFAULT_WADTEXTURES;  // "-nowadtextures"
-bool g_chart = cli_option_defaults::chart; // show chart "-chart"
-bool g_skyclip = DEFAULT_SKYCLIP;          // no sky clipping "-noskyclip"
-bool g_estimate
-	= cli_option_defaults::estimate;     // progress estimates "-estimate"
-bool g_info = cli_option_defaults::info; // "-info" ?
+bool g_noclip = DEFAULT_NOCLIP;           // no clipping hull "-noclip"
+bool g_onlyents = DEFAULT_ONLYENTS;       // onlyents mode "-onlyents"
+bool g_wadtextures = DEFAULT_WADTEXTURES; // "-nowadtextures"
+bool g_skyclip = DEFAULT_SKYCLIP;         // no sky clipping "-noskyclip"
 static std::filesystem::path
 	g_hullfile; // external hullfile "-hullfile sdfsd"
 static std::filesystem::path g_nullfile;
@@ -215,20 +220,101 @@ bface_t NewFaceFromFace(bface_t const & in) {
 	return newf;
 }
 
-static void WriteFace(
-	int const hull, bface_t const * const f, detail_level detailLevel
-) {
-	ThreadLock();
-	if (!hull) {
-		c_csgfaces++;
+// =====================================================================================
+//  brush_csg_output
+//      CSGBrush writes the faces of each brush into a buffer of its own.
+//      The buffers are appended to the hull files in brush order, so
+//      brushes can be CSG'd in parallel and the files still come out the
+//      same as when they're CSG'd one at a time
+// =====================================================================================
+struct brush_csg_output final {
+	std::array<std::string, NUM_HULLS> faces;
+	std::array<std::string, NUM_HULLS> detailBrushes;
+	// -viewsurface only writes every other face, so each face is kept
+	// separately until it's known whether it gets written
+	std::vector<std::pair<int, std::string>> viewSurfaces;
+	bool finished{ false };
+};
+
+static std::vector<brush_csg_output> csgOutputs;
+static int firstCsgOutputBrush;
+static std::size_t numWrittenCsgOutputs;
+static std::mutex csgOutputsMutex;
+
+static void FORMAT_PRINTF(2, 3)
+	append_printf(std::string& out, char const * const format, ...) {
+	va_list argptr;
+	va_list argptr2;
+	va_start(argptr, format);
+	va_copy(argptr2, argptr);
+
+	char line[256];
+	int const length = vsnprintf(line, sizeof(line), format, argptr);
+	if (std::size_t(length) < sizeof(line)) {
+		out.append(line, length);
+	} else {
+		std::size_t const oldSize = out.size();
+		out.resize(oldSize + length);
+		vsnprintf(out.data() + oldSize, length + 1, format, argptr2);
+	}
+
+	va_end(argptr2);
+	va_end(argptr);
+}
+
+static void begin_csg_output(int firstBrush, int numBrushes) {
+	firstCsgOutputBrush = firstBrush;
+	numWrittenCsgOutputs = 0;
+	csgOutputs.clear();
+	csgOutputs.resize(numBrushes);
+}
+
+static void write_csg_output(brush_csg_output const & output) {
+	for (int hull = 0; hull < NUM_HULLS; ++hull) {
+		fwrite(
+			output.faces[hull].data(), 1, output.faces[hull].size(), out[hull]
+		);
+		fwrite(
+			output.detailBrushes[hull].data(),
+			1,
+			output.detailBrushes[hull].size(),
+			out_detailbrush[hull]
+		);
+	}
+
+	static bool side = false;
+	for (auto const & [hull, viewSurface] : output.viewSurfaces) {
+		side = !side;
+		if (side) {
+			fwrite(viewSurface.data(), 1, viewSurface.size(), out_view[hull]);
+		}
+	}
+}
+
+// Writes the brush's output, and that of any brushes after it that were
+// waiting for it
+static void finish_csg_output(int brushnum, brush_csg_output&& output) {
+	std::unique_lock lock{ csgOutputsMutex };
+	csgOutputs[brushnum - firstCsgOutputBrush] = std::move(output);
+	csgOutputs[brushnum - firstCsgOutputBrush].finished = true;
+
+	while (numWrittenCsgOutputs < csgOutputs.size()
+	       && csgOutputs[numWrittenCsgOutputs].finished) {
+		write_csg_output(csgOutputs[numWrittenCsgOutputs]);
+		csgOutputs[numWrittenCsgOutputs] = { .finished = true };
+		++numWrittenCsgOutputs;
 	}
+}
 
+static void write_text_face(
+	std::string& faces, bface_t const * const f, detail_level detailLevel
+) {
 	// .p0 format
 	accurate_winding const & w = f->w;
 
 	// plane summary
-	fprintf(
-		out[hull],
+	append_printf(
+		faces,
 		"%i %i %i %i %zu\n",
 		detailLevel,
 		f->planenum,
@@ -240,8 +326,8 @@ static void WriteFace(
 	// for each of the points on the face
 	for (std::size_t i = 0; i < w.size(); i++) {
 		// write the co-ords
-		fprintf(
-			out[hull],
+		append_printf(
+			faces,
 			"%5.8f %5.8f %5.8f\n",
 			w.point(i)[0],
 			w.point(i)[1],
@@ -250,75 +336,111 @@ static void WriteFace(
 	}
 
 	// put in an extra line break
-	fprintf(out[hull], "\n");
+	faces += '\n';
+}
+
+static void WriteFace(
+	brush_csg_output& output,
+	int const hull,
+	bface_t const * const f,
+	detail_level detailLevel
+) {
+	if (!hull) {
+		c_csgfaces++;
+	}
+
+	accurate_winding const & w = f->w;
+	std::string& faces = output.faces[hull];
+
+	if (g_settings.binaryHullFiles) {
+		append_hull_file_record(
+			faces,
+			poly_file_face{
+				.planenum = f->planenum,
+				.numPoints = std::uint32_t(w.size()),
+				.detailLevel = detailLevel,
+				.texinfo = f->texinfo,
+				.contents = std::to_underlying(f->contents) }
+		);
+		append_hull_file_points(faces, w.points());
+	} else {
+		write_text_face(faces, f, detailLevel);
+	}
+
 	if (g_viewsurface) {
-		static bool side = false;
-		side = !side;
-		if (side) {
-			double3_array center = w.getCenter();
-			double3_array center2{ vector_add(center, f->plane->normal) };
-			fprintf(
-				out_view[hull],
-				"%5.2f %5.2f %5.2f\n",
-				center2[0],
-				center2[1],
-				center2[2]
-			);
-			for (std::size_t i = 0; i < w.size(); i++) {
-				double3_array const & p1{ w.point(i) };
-				double3_array const & p2{ w.point((i + 1) % w.size()) };
-
-				fprintf(
-					out_view[hull],
-					"%5.2f %5.2f %5.2f\n",
-					center[0],
-					center[1],
-					center[2]
-				);
-				fprintf(
-					out_view[hull],
-					"%5.2f %5.2f %5.2f\n",
-					p1[0],
-					p1[1],
-					p1[2]
-				);
-				fprintf(
-					out_view[hull],
-					"%5.2f %5.2f %5.2f\n",
-					p2[0],
-					p2[1],
-					p2[2]
-				);
-			}
-			fprintf(
-				out_view[hull],
+		std::string viewSurface;
+		double3_array center = w.getCenter();
+		double3_array center2{ vector_add(center, f->plane->normal) };
+		append_printf(
+			viewSurface,
+			"%5.2f %5.2f %5.2f\n",
+			center2[0],
+			center2[1],
+			center2[2]
+		);
+		for (std::size_t i = 0; i < w.size(); i++) {
+			double3_array const & p1{ w.point(i) };
+			double3_array const & p2{ w.point((i + 1) % w.size()) };
+
+			append_printf(
+				viewSurface,
 				"%5.2f %5.2f %5.2f\n",
 				center[0],
 				center[1],
 				center[2]
 			);
-			fprintf(
-				out_view[hull],
-				"%5.2f %5.2f %5.2f\n",
-				center2[0],
-				center2[1],
-				center2[2]
+			append_printf(
+				viewSurface, "%5.2f %5.2f %5.2f\n", p1[0], p1[1], p1[2]
+			);
+			append_printf(
+				viewSurface, "%5.2f %5.2f %5.2f\n", p2[0], p2[1], p2[2]
 			);
 		}
+		append_printf(
+			viewSurface,
+			"%5.2f %5.2f %5.2f\n",
+			center[0],
+			center[1],
+			center[2]
+		);
+		append_printf(
+			viewSurface,
+			"%5.2f %5.2f %5.2f\n",
+			center2[0],
+			center2[1],
+			center2[2]
+		);
+		output.viewSurfaces.emplace_back(hull, std::move(viewSurface));
 	}
-
-	ThreadUnlock();
 }
 
-static void WriteDetailBrush(int hull, std::vector<bface_t> const & faces) {
-	ThreadLock();
-	fprintf(out_detailbrush[hull], "0\n");
+static void WriteDetailBrush(
+	brush_csg_output& output, int hull, std::vector<bface_t> const & faces
+) {
+	std::string& detailBrush = output.detailBrushes[hull];
+	if (g_settings.binaryHullFiles) {
+		append_hull_file_record(detailBrush, brush_file_brush{});
+		for (bface_t const & f : faces) {
+			append_hull_file_record(
+				detailBrush,
+				brush_file_side{ .planenum = f.planenum,
+			                     .numPoints = std::uint32_t(f.w.size()) }
+			);
+			append_hull_file_points(detailBrush, f.w.points());
+		}
+		append_hull_file_record(
+			detailBrush, brush_file_side{ .planenum = -1 }
+		);
+		return;
+	}
+
+	detailBrush += "0\n";
 	for (bface_t const & f : faces) {
 		accurate_winding const & w{ f.w };
-		fprintf(out_detailbrush[hull], "%i %zu\n", f.planenum, w.size());
+		append_printf(detailBrush, "%i %zu\n", f.planenum, w.size());
 		for (int i = 0; i < w.size(); i++) {
-			fprintf(
-				out_detailbrush[hull],
+			append_printf(
+				detailBrush,
 				"%5.8f %5.8f %5.8f\n",
 				w.point(i)[0],
 				w.point(i)[1],
@@ -326,8 +448,7 @@ static void WriteDetailBrush(int hull, std::vector<bface_t> const & faces) {
 			);
 		}
 	}
-	fprintf(out_detailbrush[hull], "-1 -1\n");
-	ThreadUnlock();
+	detailBrush += "-1 -1\n";
 }
 
 // =====================================================================================
@@ -338,6 +459,7 @@ static void WriteDetailBrush(int hull, std::vector<bface_t> const & faces) {
 // =====================================================================================
 static void SaveOutside(
 	hlcsg_settings const & settings,
+	brush_csg_output& output,
 	csg_brush& b,
 	int hull,
 	std::vector<bface_t>& outside,
@@ -460,7 +582,12 @@ static void SaveOutside(
 			}
 		}
 
-		WriteFace(hull, &f, (hull ? b.clipNodeDetailLevel : b.detailLevel));
+		WriteFace(
+			output,
+			hull,
+			&f,
+			(hull ? b.clipNodeDetailLevel : b.detailLevel)
+		);
 
 		//              if (mirrorcontents != contents_t::SOLID)
 		{
@@ -472,7 +599,10 @@ static void SaveOutside(
 			// swap point orders
 			f.w.reverse_points();
 			WriteFace(
-				hull, &f, (hull ? b.clipNodeDetailLevel : b.detailLevel)
+				output,
+				hull,
+				&f,
+				(hull ? b.clipNodeDetailLevel : b.detailLevel)
 			);
 		}
 	}
@@ -523,6 +653,33 @@ static std::vector<bface_t> CopyFacesToOutside(brushhull_t const * bh) {
 	return outside;
 }
 
+// =====================================================================================
+//  BuildCsgBrushTrees
+//      Sorts the brushes of the entity by their bounds in each hull, for
+//      CSGBrush
+// =====================================================================================
+
+static std::array<brush_bounds_tree, NUM_HULLS> csgBrushTrees;
+
+static void BuildCsgBrushTrees(entity_t const & e) {
+	for (int hull = 0; hull < NUM_HULLS; hull++) {
+		std::vector<bounding_box> brushBounds;
+		std::vector<std::uint32_t> brushes;
+		brushBounds.reserve(e.numbrushes);
+		for (int bn = 0; bn < e.numbrushes; bn++) {
+			brushhull_t const & bh = g_mapbrushes[e.firstBrush + bn]
+										 .hulls[hull];
+			brushBounds.emplace_back(bh.bounds);
+			if (!bh.faces.empty()) {
+				brushes.emplace_back(bn);
+			}
+		}
+		csgBrushTrees[hull].build(
+			std::move(brushBounds), std::move(brushes)
+		);
+	}
+}
+
 // =====================================================================================
 //  CSGBrush
 // =====================================================================================
@@ -533,6 +690,7 @@ static void CSGBrush(int brushnum) {
 	csg_brush& b1 = g_mapbrushes[brushnum];
 	entity_t* e = &g_entities[b1.entitynum];
 	hlcsg_settings const & settings = g_settings;
+	brush_csg_output output;
 
 	// for each of the hulls
 	for (int hull = 0; hull < NUM_HULLS; hull++) {
@@ -554,7 +712,7 @@ static void CSGBrush(int brushnum) {
 					);
 					break;
 				case contents_t::SOLID:
-					WriteDetailBrush(hull, bh1->faces);
+					WriteDetailBrush(output, hull, bh1->faces);
 					break;
 			}
 		}
@@ -568,8 +726,10 @@ static void CSGBrush(int brushnum) {
 			}
 		}
 		bool overwrite{ false };
-		// for each brush in entity e
-		for (int bn = 0; bn < e->numbrushes; bn++) {
+		// for each brush in entity e that might overlap b1
+		std::vector<std::uint32_t> overlapping;
+		csgBrushTrees[hull].find_overlapping(bh1->bounds, overlapping);
+		for (int bn : overlapping) {
 			// see if b2 needs to clip a chunk out of b1
 			if (e->firstBrush + bn == brushnum) {
 				continue;
@@ -796,8 +956,10 @@ static void CSGBrush(int brushnum) {
 		}
 
 		// all of the faces left in outside are real surface faces
-		SaveOutside(settings, b1, hull, outside, b1.contents);
+		SaveOutside(settings, output, b1, hull, outside, b1.contents);
 	}
+
+	finish_csg_output(brushnum, std::move(output));
 }
 
 //
@@ -808,6 +970,7 @@ static void CSGBrush(int brushnum) {
 //  EmitPlanes
 // =====================================================================================
 static void EmitPlanes() {
+	trace_phase phase{ "EmitPlanes" };
 	mapplane_t* mp;
 
 	g_numplanes = g_mapPlanes.size();
@@ -817,7 +980,7 @@ static void EmitPlanes() {
 		std::filesystem::path planeFilePath{
 			path_to_temp_file_with_extension(g_Mapname, u8".pln")
 		};
-		FILE* planeout = fopen(planeFilePath.c_str(), "wb");
+		FILE* planeout = open_intermediate_file(planeFilePath, "wb");
 		if (!planeout) {
 			Error("Couldn't open %s", planeFilePath.c_str());
 		}
@@ -1243,6 +1406,7 @@ void LoadWadValue() {
 }
 
 void WriteBSP(char const * const name) {
+	trace_phase phase{ "WriteBSP" };
 	std::filesystem::path bspPath;
 	bspPath = name;
 	bspPath += u8".bsp";
@@ -1347,6 +1511,7 @@ static void CheckForNoClip() {
 // =====================================================================================
 
 static void ProcessModels() {
+	trace_phase phase{ "ProcessModels" };
 	contents_t contents;
 	csg_brush temp;
 
@@ -1392,14 +1557,13 @@ static void ProcessModels() {
 		}
 
 		// csg them in order
+		begin_csg_output(first, g_entities[i].numbrushes);
+		BuildCsgBrushTrees(g_entities[i]);
 		if (i == 0) // if its worldspawn....
 		{
-			int numT = g_numthreads;
-			g_numthreads = 1;
 			NamedRunThreadsOnIndividual(
 				g_entities[i].numbrushes, g_estimate, CSGBrush
 			);
-			g_numthreads = numT;
 			CheckFatal();
 		} else {
 			for (int j = 0; j < g_entities[i].numbrushes; j++) {
@@ -1409,8 +1573,26 @@ static void ProcessModels() {
 
 		// write end of model marker
 		for (int j = 0; j < NUM_HULLS; j++) {
-			fprintf(out[j], "-1 -1 -1 -1 -1\n");
-			fprintf(out_detailbrush[j], "-1\n");
+			if (g_settings.binaryHullFiles) {
+				std::string endOfModel;
+				append_hull_file_record(
+					endOfModel, poly_file_face{ .planenum = -1 }
+				);
+				fwrite(endOfModel.data(), 1, endOfModel.size(), out[j]);
+				endOfModel.clear();
+				append_hull_file_record(
+					endOfModel, brush_file_brush{ .brushinfo = -1 }
+				);
+				fwrite(
+					endOfModel.data(),
+					1,
+					endOfModel.size(),
+					out_detailbrush[j]
+				);
+			} else {
+				fprintf(out[j], "-1 -1 -1 -1 -1\n");
+				fprintf(out_detailbrush[j], "-1\n");
+			}
 		}
 	}
 }
@@ -1530,6 +1712,10 @@ static void Usage() {
 	Log("    -texdata #       : Alter maximum texture memory limit (in kb)\n"
 	);
 	Log("    -chart           : display bsp statitics\n");
+	Log("    -trace           : write a Chrome trace of the compile phases to mapname.csg.trace.json\n"
+	);
+	Log("    -binaryhulls     : write the hull files for HLBSP in a faster binary format\n"
+	);
 	Log("    -low | -high     : run program an altered priority level\n");
 	Log("    -nolog           : don't generate the compile logfiles\n");
 	Log("    -noresetlog      : Do not delete log file\n");
@@ -1667,6 +1853,9 @@ Settings(bsp_data const & bspData, hlcsg_settings const & settings) {
 	Log("onlyents              [ %7s ] [ %7s ]\n",
 	    g_onlyents ? "on" : "off",
 	    DEFAULT_ONLYENTS ? "on" : "off");
+	Log("binary hull files     [ %7s ] [ %7s ]\n",
+	    settings.binaryHullFiles ? "on" : "off",
+	    defaultSettings.binaryHullFiles ? "on" : "off");
 	Log("wadtextures           [ %7s ] [ %7s ]\n",
 	    g_wadtextures ? "on" : "off",
 	    DEFAULT_WADTEXTURES ? "on" : "off");
@@ -1726,7 +1915,11 @@ void CSGCleanup() {
 	FreeWadPaths();
 }
 
-int main(int const argc, char** argv) {
+// =====================================================================================
+//  hlcsg_main
+//      The main() of hlcsg, and the CSG stage of HLCOMPILE
+// =====================================================================================
+int hlcsg_main(int const argc, char** argv) {
 	hlcsg_settings& settings = g_settings;
 
 	bsp_data& bspData = bspGlobals;
@@ -1734,6 +1927,7 @@ int main(int const argc, char** argv) {
 	std::filesystem::path sourceFilePath; // The .map
 	char const * mapname_from_arg
 		= nullptr; // mapname path from passed argvar
+	bool trace = false;
 
 	g_Program = u8"HLCSG"; // Constructive Solid Geometry
 
@@ -1819,6 +2013,10 @@ int main(int const argc, char** argv) {
 							   argv[i], u8"-chart"
 						   )) {
 					g_chart = true;
+				} else if (strings_equal_with_ascii_case_insensitivity(
+							   argv[i], u8"-trace"
+						   )) {
+					trace = true;
 				} else if (strings_equal_with_ascii_case_insensitivity(
 							   argv[i], u8"-low"
 						   )) {
@@ -1983,6 +2181,10 @@ int main(int const argc, char** argv) {
 							   argv[i], u8"-viewsurface"
 						   )) {
 					g_viewsurface = true;
+				} else if (strings_equal_with_ascii_case_insensitivity(
+							   argv[i], u8"-binaryhulls"
+						   )) {
+					settings.binaryHullFiles = true;
 				} else if (strings_equal_with_ascii_case_insensitivity(
 							   argv[i], u8"-nonullifytrigger"
 						   )) {
@@ -2031,6 +2233,11 @@ int main(int const argc, char** argv) {
 			}
 			OpenLog();
 			atexit(CloseLog);
+			if (trace) {
+				start_tracing(path_to_temp_file_with_extension(
+					g_Mapname, u8".csg.trace.json"
+				));
+			}
 			LogStart(argcold, argvold);
 			log_arguments(argc, argv);
 			hlassume(CalcFaceExtents_test(), assume_msg::first);
@@ -2105,16 +2312,10 @@ int main(int const argc, char** argv) {
 			CheckForNoClip();
 
 			// createbrush
-			// TODO: Reimplement multi-threading here!
-			for (brush_count brushIndex = 0; brushIndex != g_nummapbrushes;
-			     ++brushIndex) {
-				csg_brush& brush{ g_mapbrushes[brushIndex] };
-				create_brush(brush, g_entities[brush.entitynum]);
+			{
+				trace_phase phase{ "create_brush" };
+				create_brushes();
 			}
-
-			// NamedRunThreadsOnIndividual(
-			//	g_nummapbrushes, g_estimate, CreateBrush
-			//);
 			CheckFatal();
 
 			// boundworld
@@ -2137,7 +2338,10 @@ int main(int const argc, char** argv) {
 					)
 				};
 
-				out[i] = fopen(polyFilePath.c_str(), "w");
+				char const * const hullFileMode{
+					settings.binaryHullFiles ? "wb" : "w"
+				};
+				out[i] = open_intermediate_file(polyFilePath, hullFileMode);
 				if (!out[i]) {
 					Error("Couldn't open %s", polyFilePath.c_str());
 				}
@@ -2148,11 +2352,24 @@ int main(int const argc, char** argv) {
 					)
 				};
 
-				out_detailbrush[i] = fopen(brushFilePath.c_str(), "w");
+				out_detailbrush[i] = open_intermediate_file(
+					brushFilePath, hullFileMode
+				);
 				if (!out_detailbrush[i]) {
 					Error("Couldn't open %s", brushFilePath.c_str());
 				}
 
+				if (settings.binaryHullFiles) {
+					std::string header;
+					append_hull_file_header(header, polyFileMagic);
+					fwrite(header.data(), 1, header.size(), out[i]);
+					header.clear();
+					append_hull_file_header(header, brushFileMagic);
+					fwrite(
+						header.data(), 1, header.size(), out_detailbrush[i]
+					);
+				}
+
 				if (g_viewsurface) {
 					std::filesystem::path const surfaceFilePath{
 						path_to_temp_file_with_extension(
@@ -2170,7 +2387,7 @@ int main(int const argc, char** argv) {
 					path_to_temp_file_with_extension(g_Mapname, u8".hsz")
 				};
 				FILE* f;
-				f = fopen(hullSizeFilePath.c_str(), "w");
+				f = open_intermediate_file(hullSizeFilePath, "w");
 				if (!f) {
 					Error("Couldn't open %s", hullSizeFilePath.c_str());
 				}
@@ -2190,8 +2407,8 @@ int main(int const argc, char** argv) {
 
 			ProcessModels();
 
-			Verbose("%5i csg faces\n", c_csgfaces);
-			Verbose("%5i used faces\n", c_outfaces);
+			Verbose("%5i csg faces\n", c_csgfaces.load());
+			Verbose("%5i used faces\n", c_outfaces.load());
 
 			// close hull files
 			for (i = 0; i < NUM_HULLS; i++) {
@@ -258,18 +258,17 @@ extern csg_brush* Brush_LoadEntity(entity_t* ent, int hullnum);
 extern contents_t CheckBrushContents(csg_brush const * const b);
 
 extern void create_brush(csg_brush& b, csg_entity const & ent);
+extern void create_brushes();
 extern void create_hullshape(csg_entity const & fromInfoHullshapeEntity);
 extern void init_default_hulls();
 
 //=============================================================================
 // csg.c
 
-extern bool g_chart;
 extern bool g_onlyents;
 extern bool g_noclip;
 extern bool g_wadtextures;
 extern bool g_skyclip;
-extern bool g_estimate;
 
 extern bool g_bUseNullTex;
 
@@ -300,6 +299,9 @@ CopyFaceList(std::vector<bface_t> const & faceList);
 
 extern void GetParamsFromEnt(entity_t* mapent);
 
+// main.cpp and HLCOMPILE run the tool through this
+extern int hlcsg_main(int argc, char** argv);
+
 //============================================================================
 // hullfile.cpp
 extern hull_sizes g_hull_size;
@@ -12,4 +12,7 @@ struct hlcsg_settings final {
 	double mapScale{ 1 };
 
 	double tinyTreshold = 0;
+
+	// Write .p0-.p3 and .b0-.b3 in the binary format from hull_file.h
+	bool binaryHullFiles{ false };
 };
@@ -0,0 +1,5 @@
+#include "hlcsg.h"
+
+int main(int const argc, char** argv) {
+	return hlcsg_main(argc, argv);
+}
@@ -4,6 +4,7 @@
 #include "hlcsg_settings.h"
 #include "log.h"
 #include "map_entity_parser.h"
+#include "phase_trace.h"
 #include "project_constants.h"
 
 #include <string_view>
@@ -764,6 +765,7 @@ unsigned int CountEngineEntities() {
 void LoadMapFile(
 	hlcsg_settings const & settings, char const * const filename
 ) {
+	trace_phase phase{ "LoadMapFile" };
 	g_numentities = 0;
 
 	std::optional<std::u8string> maybeMapFileContents = read_utf8_file(
@@ -1,5 +1,6 @@
 #include "cmdlib.h"
 #include "filelib.h"
+#include "hashing.h"
 #include "hlcsg.h"
 #include "log.h"
 #include "threads.h"
@@ -7,7 +8,11 @@
 #include "util.h"
 #include "wad_structs.h"
 
+#include <mutex>
+#include <shared_mutex>
 #include <tuple>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 using namespace std::literals;
@@ -29,6 +34,11 @@ std::deque<std::u8string> g_WadInclude;
 
 static int nummiptex = 0;
 static lumpinfo_with_wadfileindex miptex[MAX_MAP_TEXTURES];
+// Maps each texture name to its index in miptex, so FindMiptex doesn't
+// have to scan them. Lookups share miptexMutex, adding a texture takes
+// it exclusively
+static std::unordered_map<wad_texture_name, int> miptexLookup;
+static std::shared_mutex miptexMutex;
 static int nTexLumps = 0;
 static lumpinfo_with_wadfileindex* lumpinfo = nullptr;
 static int nTexFiles = 0;
@@ -45,8 +55,8 @@ static int numtexmap = 0;
 
 static int texmap_store(wad_texture_name texname)
 // This function should never be called unless a new entry in g_texinfo is
-// being allocated. Also, should be called between ThreadLock() and
-// ThreadUnlock()!!
+// being allocated. Also, should only be called while holding
+// texinfoMutex exclusively!!
 {
 	hlassume(
 		numtexmap < INITIAL_MAX_MAP_TEXINFO,
@@ -64,10 +74,43 @@ static wad_texture_name texmap_retrieve(int index) {
 	return texmap[index];
 }
 
+// Identifies a texinfo while g_texinfo[].miptex are texmap indices
+struct texinfo_key final {
+	wad_texture_name name;
+	texinfo_flags flags;
+	std::array<tex_vec, 2> vecs;
+
+	constexpr bool operator==(texinfo_key const &) const noexcept = default;
+};
+
+struct texinfo_key_hash final {
+	std::size_t operator()(texinfo_key const & key) const noexcept {
+		// Adding 0 turns -0 into 0, since they compare equal
+		std::array<float, 8> vecs;
+		for (std::size_t i = 0; i < 2; ++i) {
+			tex_vec const & vec = key.vecs[i];
+			vecs[i * 4 + 0] = vec.xyz[0] + 0.0f;
+			vecs[i * 4 + 1] = vec.xyz[1] + 0.0f;
+			vecs[i * 4 + 2] = vec.xyz[2] + 0.0f;
+			vecs[i * 4 + 3] = vec.offset + 0.0f;
+		}
+		return hash_multiple(
+			key.name, std::to_underlying(key.flags), vecs
+		);
+	}
+};
+
+// Maps each texinfo to its first index in g_texinfo, so
+// TexinfoForBrushTexture doesn't have to scan all of them.
+// Lookups share texinfoMutex, adding a texinfo takes it exclusively
+static std::unordered_map<texinfo_key, texinfo_count, texinfo_key_hash>
+	texinfoLookup;
+static std::shared_mutex texinfoMutex;
+
 static void texmap_clear() {
-	ThreadLock();
+	std::unique_lock lock{ texinfoMutex };
 	numtexmap = 0;
-	ThreadUnlock();
+	texinfoLookup.clear();
 }
 
 // =====================================================================================
@@ -106,21 +149,27 @@ static int lump_sorter_by_name(void const * lump1, void const * lump2) {
 //      Find and allocate a texture into the lump data
 // =====================================================================================
 static int FindMiptex(wad_texture_name name) {
-	ThreadLock();
-	for (std::size_t i = 0; i < nummiptex; i++) {
-		if (name == miptex[i].lump_info.name) {
-			ThreadUnlock();
-			return i;
+	{
+		std::shared_lock lock{ miptexMutex };
+		auto const it = miptexLookup.find(name);
+		if (it != miptexLookup.end()) {
+			return it->second;
 		}
 	}
 
+	std::unique_lock lock{ miptexMutex };
+	// Another thread may have added it while we didn't hold the lock
+	auto const [it, inserted] = miptexLookup.try_emplace(name, nummiptex);
+	if (!inserted) {
+		return it->second;
+	}
+
 	hlassume(
 		nummiptex < MAX_MAP_TEXTURES, assume_msg::exceeded_MAX_MAP_TEXTURES
 	);
 	int const new_miptex_num = nummiptex;
 	miptex[new_miptex_num].lump_info.name = name;
 	++nummiptex;
-	ThreadUnlock();
 	return new_miptex_num;
 }
 
@@ -640,6 +689,10 @@ void WriteMiptex(std::filesystem::path const & bspPath) {
 
 		// Sleazy Hack 104 Pt 2 - After sorting the miptex array, reset the
 		// texinfos to point to the right miptexs
+		miptexLookup.clear();
+		for (int i = 0; i < nummiptex; ++i) {
+			miptexLookup.try_emplace(miptex[i].lump_info.name, i);
+		}
 		for (int i = 0; i < g_numtexinfo; i++, tx++) {
 			wad_texture_name miptex_name{ texmap_retrieve(tx->miptex) };
 			tx->miptex = FindMiptex(miptex_name);
@@ -823,31 +876,33 @@ texinfo_count TexinfoForBrushTexture(
 	//
 	// find the g_texinfo
 	//
-	ThreadLock();
-
-	texinfo_t* tc = g_texinfo.data();
-	for (int i = 0; i < g_numtexinfo; ++i, ++tc) {
-		if (texmap_retrieve(tc->miptex) != bt->name) {
-			continue;
-		}
-		if (tc->flags != tx.flags) {
-			continue;
-		}
-		if (tc->vecs == tx.vecs) {
-			ThreadUnlock();
-			return i;
+	texinfo_key const key{ bt->name, tx.flags, tx.vecs };
+	{
+		std::shared_lock lock{ texinfoMutex };
+		auto const it = texinfoLookup.find(key);
+		if (it != texinfoLookup.end()) {
+			return it->second;
 		}
 	}
 
+	std::unique_lock lock{ texinfoMutex };
+	// Another thread may have added it while we didn't hold the lock
+	auto const [it, inserted] = texinfoLookup.try_emplace(
+		key, texinfo_count(g_numtexinfo)
+	);
+	if (!inserted) {
+		return it->second;
+	}
+
 	hlassume(
 		g_numtexinfo < INITIAL_MAX_MAP_TEXINFO,
 		assume_msg::exceeded_INITIAL_MAX_MAP_TEXINFO
 	);
 
-	*tc = tx;
-	tc->miptex = texmap_store(bt->name);
+	texinfo_t& tc = g_texinfo[g_numtexinfo];
+	tc = tx;
+	tc.miptex = texmap_store(bt->name);
 	texinfo_count const newTexinfo = g_numtexinfo++;
-	ThreadUnlock();
 	return newTexinfo;
 }
 
@@ -11,6 +11,7 @@
 #include "mathlib.h"
 #include "messages.h"
 #include "parsing.h"
+#include "phase_trace.h"
 #include "rad_cli_option_defaults.h"
 #include "time_counter.h"
 #include "utf8.h"
@@ -109,9 +110,6 @@ bool g_drawnudge = false;
 // Cosine of smoothing angle(in radians)
 float g_coring = DEFAULT_CORING; // Light threshold to force to
                                  // blackness(minimizes lightmaps)
-bool g_chart = cli_option_defaults::chart;
-bool g_estimate = cli_option_defaults::estimate;
-bool g_info = cli_option_defaults::info;
 
 // Patch creation and subdivision criteria
 bool g_subdivide = DEFAULT_SUBDIVIDE;
@@ -142,7 +140,7 @@ float3_array g_maxdiscardedpos{ 0, 0, 0 };
 //      info_compile_parameters entity. each tool should have its own
 //      version of this to handle its own specific settings.
 // =====================================================================================
-void GetParamsFromEnt(entity_t* mapent) {
+static void GetParamsFromEnt(entity_t* mapent) {
 	int iTmp;
 	float flTmp;
 	char szTmp[256]; // lightdata
@@ -1748,6 +1746,7 @@ static entity_t* FindTexlightEntity(int facenum) {
 }
 
 static void MakePatches() {
+	trace_phase phase{ "MakePatches" };
 	int j;
 	unsigned int k;
 	dface_t* f;
@@ -1929,6 +1928,7 @@ static void MakePatches() {
 //      compress even better
 // =====================================================================================
 static void SortPatches() {
+	trace_phase phase{ "SortPatches" };
 	// SortPatches is the ideal place to do this, because the address of the
 	// patches are going to be invalidated.
 	std::ranges::sort(
@@ -2336,6 +2336,7 @@ static void GatherRGBLight(int threadnum) {
 //  BounceLight
 // =====================================================================================
 static void BounceLight() {
+	trace_phase phase{ "BounceLight" };
 	// these arrays are only used in CollectLight, GatherLight and
 	// BounceLight
 	emitlight
@@ -2413,6 +2414,7 @@ static void CheckMaxPatches() {
 //  MakeScalesStub
 // =====================================================================================
 static void MakeScalesStub() {
+	trace_phase phase{ "MakeScalesStub" };
 	switch (g_method) {
 		case vis_method::vismatrix:
 			MakeScalesVismatrix();
@@ -2486,6 +2488,7 @@ std::array<float3_array, 15> const pos{
 //  RadWorld
 // =====================================================================================
 static void RadWorld() {
+	trace_phase phase{ "RadWorld" };
 	MakeBackplanes();
 	MakeParents(0, -1);
 	MakeTnodes();
@@ -2688,6 +2691,8 @@ static void Usage() {
 	Log("    -texdata #      : Alter maximum texture memory limit (in kb)\n"
 	);
 	Log("    -chart          : display bsp statitics\n");
+	Log("    -trace          : write a Chrome trace of the compile phases to mapname.rad.trace.json\n"
+	);
 	Log("    -low | -high    : run program an altered priority level\n");
 	Log("    -nolog          : Do not generate the compile logfiles\n");
 	Log("    -threads #      : manually specify the number of threads to run\n"
@@ -3170,14 +3175,16 @@ void LoadRadFiles(
 }
 
 // =====================================================================================
-//  main
+//  hlrad_main
+//      The main() of hlrad, and the RAD stage of HLCOMPILE
 // =====================================================================================
-int main(int const argc, char** argv) {
+int hlrad_main(int const argc, char** argv) {
 	g_opaque_face_list.reserve(1024
 	); // Just for the performance improvement
 
 	int i;
 	char const * mapname_from_arg = nullptr;
+	bool trace = false;
 	std::filesystem::path user_lights;
 	char temp[_MAX_PATH];
 
@@ -3397,6 +3404,10 @@ int main(int const argc, char** argv) {
 							   argv[i], u8"-chart"
 						   )) {
 					g_chart = true;
+				} else if (strings_equal_with_ascii_case_insensitivity(
+							   argv[i], u8"-trace"
+						   )) {
+					trace = true;
 				} else if (strings_equal_with_ascii_case_insensitivity(
 							   argv[i], u8"-low"
 						   )) {
@@ -3693,6 +3704,11 @@ int main(int const argc, char** argv) {
 			g_Wadpath = g_Mapname.parent_path().parent_path();
 			OpenLog();
 			atexit(CloseLog);
+			if (trace) {
+				start_tracing(path_to_temp_file_with_extension(
+					g_Mapname, u8".rad.trace.json"
+				));
+			}
 			ThreadSetDefault();
 			ThreadSetPriority(g_threadpriority);
 			LogStart(argcold, argvold);
@@ -3715,7 +3731,7 @@ int main(int const argc, char** argv) {
 				path_to_temp_file_with_extension(g_Mapname, u8".bsp")
 					.c_str()
 			);
-			parse_entities_from_bsp_file();
+			parse_entities_from_bsp_file(GetParamsFromEnt);
 			if (g_fastmode) {
 				g_numbounce = 0;
 				g_softsky = false;
@@ -341,7 +341,6 @@ extern float g_smoothing_value;
 extern float g_smoothing_threshold_2;
 extern float g_smoothing_value_2;
 extern float* g_smoothvalues; //[nummiptex]
-extern bool g_estimate;
 extern float g_fade;
 extern bool g_incremental;
 extern bool g_circus;
@@ -659,3 +658,6 @@ extern bool TestSegmentAgainstStudioList(
 	float3_array const & p1, float3_array const & p2
 );
 extern bool g_studioshadow;
+
+// main.cpp and HLCOMPILE run the tool through this
+extern int hlrad_main(int argc, char** argv);
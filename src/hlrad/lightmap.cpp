@@ -6,6 +6,7 @@
 #include "log.h"
 #include "mathlib.h"
 #include "mathtypes.h"
+#include "phase_trace.h"
 #include "threads.h"
 
 #include <algorithm>
@@ -290,6 +291,7 @@ static bool TranslateTexToTex(
 }
 
 void PairEdges() {
+	trace_phase phase{ "PairEdges" };
 	int i, j, k;
 	dface_t* f;
 	edgeshare_t* e;
@@ -1747,6 +1749,7 @@ static int numdlights;
 //  CreateDirectLights
 // =====================================================================================
 void CreateDirectLights() {
+	trace_phase phase{ "CreateDirectLights" };
 	int leafnum;
 	entity_t* e;
 	float3_array dest;
@@ -4511,6 +4514,7 @@ void BuildFacelights(int const facenum) {
 //  PrecompLightmapOffsets
 // =====================================================================================
 void PrecompLightmapOffsets() {
+	trace_phase phase{ "PrecompLightmapOffsets" };
 	int facenum;
 	dface_t* f;
 	facelight_t* fl;
@@ -4664,6 +4668,7 @@ void PrecompLightmapOffsets() {
 }
 
 void ReduceLightmap() {
+	trace_phase phase{ "ReduceLightmap" };
 	std::vector<int8_rgb> oldlightdata;
 	using std::swap;
 	swap(oldlightdata, g_dlightdata);
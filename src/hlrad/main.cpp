@@ -0,0 +1,5 @@
+#include "hlrad.h"
+
+int main(int const argc, char** argv) {
+	return hlrad_main(argc, argv);
+}
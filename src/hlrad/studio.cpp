@@ -2,6 +2,7 @@
 #include "hlrad.h"
 #include "log.h"
 #include "meshtrace.h"
+#include "phase_trace.h"
 
 constexpr std::size_t MAX_MODELS = 10000;
 
@@ -131,6 +132,7 @@ static void LoadStudioModel(
 //  LoadStudioModels
 // =====================================================================================
 void LoadStudioModels() {
+	trace_phase phase{ "LoadStudioModels" };
 	models.clear();
 
 	if (!g_studioshadow) {
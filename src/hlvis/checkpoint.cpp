@@ -0,0 +1,338 @@
+#include "filelib.h"
+#include "hlvis.h"
+#include "log.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+
+#ifdef SYSTEM_POSIX
+#include <unistd.h>
+#endif
+#ifdef SYSTEM_WIN32
+#include <io.h>
+#endif
+
+// The checkpoint of a vis in progress: a checkpoint_header, then for each
+// portal PortalFlow has finished, in the order they finished, a
+// checkpoint_record followed by the portal's visbits compressed with
+// CompressVis. Records are only ever appended, so a crash can at most cut
+// the last ones short, and the reader stops at the first record that
+// doesn't check out
+
+constexpr std::array<char, 8> checkpointMagic{ 'O', 'H', 'L', 'T',
+	                                           'V', 'C', 'K', 'P' };
+constexpr std::uint32_t checkpointVersion = 1;
+
+struct checkpoint_header final {
+	std::array<char, 8> magic;
+	std::uint32_t version;
+	std::uint32_t numPortals;
+	// Of the portals and the settings the flow depends on, so a
+	// checkpoint of another portal file isn't resumed
+	std::uint64_t fingerprint;
+};
+
+struct checkpoint_record final {
+	std::uint32_t portalNum;
+	std::int32_t numCanSee;
+	std::uint32_t compressedSize;
+	std::uint32_t checksum;
+};
+
+static std::mutex checkpointMutex;
+static FILE* checkpointFile = nullptr;
+static std::string pendingRecords;
+static std::chrono::steady_clock::duration checkpointInterval;
+static std::chrono::steady_clock::time_point lastCheckpoint;
+
+// =====================================================================================
+//  HashBytes
+//      64-bit FNV-1a, which is the same on every platform
+// =====================================================================================
+std::uint64_t
+HashBytes(std::span<std::byte const> bytes, std::uint64_t hash) {
+	for (std::byte b : bytes) {
+		hash ^= std::uint64_t(b);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+template <class T>
+static void HashValue(std::uint64_t& hash, T const & value) {
+	hash = HashBytes(std::as_bytes(std::span{ &value, 1 }), hash);
+}
+
+// =====================================================================================
+//  PortalsFingerprint
+// =====================================================================================
+static std::uint64_t PortalsFingerprint() {
+	std::uint64_t hash = HashBytes({});
+	HashValue(hash, g_portalleafs);
+	HashValue(hash, g_numportals);
+	HashValue(hash, g_bitbytes);
+	HashValue(hash, g_fullvis);
+	for (int i = 0; i < g_numportals * 2; i++) {
+		vis_portal_t const & p = g_portals[i];
+		HashValue(hash, p.leaf);
+		HashValue(hash, std::uint32_t(p.winding->numpoints));
+		for (std::size_t j = 0; j < p.winding->numpoints; j++) {
+			HashValue(hash, p.winding->points[j]);
+		}
+	}
+	return hash;
+}
+
+// =====================================================================================
+//  RecordChecksum
+// =====================================================================================
+static std::uint32_t RecordChecksum(
+	checkpoint_record record, std::span<byte const> compressed
+) {
+	record.checksum = 0;
+	std::uint64_t hash = HashBytes(std::as_bytes(std::span{ &record, 1 }));
+	hash = HashBytes(std::as_bytes(compressed), hash);
+	return std::uint32_t(hash ^ (hash >> 32));
+}
+
+// =====================================================================================
+//  DecompressVisBits
+//      The inverse of CompressVis. Returns false if the data doesn't
+//      decompress to exactly destLength bytes
+// =====================================================================================
+bool DecompressVisBits(
+	std::span<byte const> compressed, byte* dest, std::size_t destLength
+) {
+	std::size_t length = 0;
+	for (std::size_t i = 0; i < compressed.size(); i++) {
+		if (compressed[i]) {
+			if (length == destLength) {
+				return false;
+			}
+			dest[length++] = compressed[i];
+			continue;
+		}
+
+		// A zero is followed by the number of zeros in the run
+		if (++i == compressed.size()) {
+			return false;
+		}
+		std::size_t const run = compressed[i];
+		if (run > destLength - length) {
+			return false;
+		}
+		std::fill_n(dest + length, run, 0);
+		length += run;
+	}
+	return length == destLength;
+}
+
+// =====================================================================================
+//  LoadCheckpoint
+//      Marks the portals in the checkpoint done. Returns how many bytes of
+//      the file are valid, or 0 if it can't be resumed from
+// =====================================================================================
+static std::size_t LoadCheckpoint(std::filesystem::path const & filePath) {
+	auto [success, size, buffer] = read_binary_file(filePath);
+	if (!success) {
+		Log("No checkpoint found in '%s', starting from the beginning\n",
+		    filePath.c_str());
+		return 0;
+	}
+
+	checkpoint_header header;
+	if (size < sizeof(header)) {
+		Warning(
+			"The checkpoint '%s' is damaged, starting from the beginning",
+			filePath.c_str()
+		);
+		return 0;
+	}
+	std::memcpy(&header, buffer.get(), sizeof(header));
+	if (header.magic != checkpointMagic
+	    || header.version != checkpointVersion
+	    || header.numPortals != std::uint32_t(g_numportals * 2)
+	    || header.fingerprint != PortalsFingerprint()) {
+		Warning(
+			"The checkpoint '%s' is for other portals or settings, starting from the beginning",
+			filePath.c_str()
+		);
+		return 0;
+	}
+
+	std::size_t position = sizeof(header);
+	std::size_t numRestored = 0;
+	std::vector<byte> visbits(g_bitbytes);
+	while (size - position >= sizeof(checkpoint_record)) {
+		checkpoint_record record;
+		std::memcpy(&record, buffer.get() + position, sizeof(record));
+		std::size_t const dataPosition = position + sizeof(record);
+		if (record.compressedSize > size - dataPosition
+		    || record.portalNum >= header.numPortals) {
+			break;
+		}
+		std::span<byte const> const compressed{
+			reinterpret_cast<byte const *>(buffer.get() + dataPosition),
+			record.compressedSize
+		};
+		if (record.checksum != RecordChecksum(record, compressed)
+		    || !DecompressVisBits(
+				compressed, visbits.data(), g_bitbytes
+			)) {
+			break;
+		}
+
+		vis_portal_t& p = g_portals[record.portalNum];
+		if (p.status != vstatus_t::stat_done) {
+			p.visbits = (byte*) calloc(1, g_bitbytes);
+			std::ranges::copy(visbits, p.visbits);
+			p.numcansee = record.numCanSee;
+			p.status = vstatus_t::stat_done;
+			numRestored++;
+		}
+		position = dataPosition + record.compressedSize;
+	}
+
+	Log("Resuming from '%s': %zu of %i portals are done\n",
+	    filePath.c_str(),
+	    numRestored,
+	    g_numportals * 2);
+	return position;
+}
+
+// =====================================================================================
+//  WritePendingRecords
+//      The caller holds checkpointMutex
+// =====================================================================================
+static void WritePendingRecords() {
+	lastCheckpoint = std::chrono::steady_clock::now();
+	if (pendingRecords.empty()) {
+		return;
+	}
+
+	std::size_t const written = fwrite(
+		pendingRecords.data(), 1, pendingRecords.size(), checkpointFile
+	);
+	bool success = written == pendingRecords.size();
+	success = fflush(checkpointFile) == 0 && success;
+	// The records have to reach the disk, not just the OS, to survive
+	// a crash of the machine
+#ifdef SYSTEM_POSIX
+	success = fsync(fileno(checkpointFile)) == 0 && success;
+#endif
+#ifdef SYSTEM_WIN32
+	success = _commit(_fileno(checkpointFile)) == 0 && success;
+#endif
+	if (!success) {
+		Warning("Failed to write the vis checkpoint");
+	}
+	pendingRecords.clear();
+}
+
+// =====================================================================================
+//  OpenCheckpoint
+//      With resume, the portals in the existing checkpoint are marked done
+//      and the checkpoint is continued
+// =====================================================================================
+void OpenCheckpoint(
+	std::filesystem::path const & filePath,
+	unsigned intervalSeconds,
+	bool resume
+) {
+	std::size_t validLength = 0;
+	if (resume) {
+		validLength = LoadCheckpoint(filePath);
+	}
+
+	if (validLength) {
+		// Drop a record cut short by the interruption, so the new records
+		// follow the valid ones
+		std::error_code error;
+		std::filesystem::resize_file(filePath, validLength, error);
+		if (error) {
+			Error("Couldn't truncate '%s'", filePath.c_str());
+		}
+		checkpointFile = fopen(filePath.c_str(), "ab");
+	} else {
+		checkpointFile = fopen(filePath.c_str(), "wb");
+		if (checkpointFile) {
+			checkpoint_header const header{
+				.magic = checkpointMagic,
+				.version = checkpointVersion,
+				.numPortals = std::uint32_t(g_numportals * 2),
+				.fingerprint = PortalsFingerprint()
+			};
+			pendingRecords.append(
+				reinterpret_cast<char const *>(&header), sizeof(header)
+			);
+		}
+	}
+	if (!checkpointFile) {
+		Error("Couldn't open '%s' for writing", filePath.c_str());
+	}
+
+	checkpointInterval = std::chrono::seconds(intervalSeconds);
+	std::unique_lock lock{ checkpointMutex };
+	WritePendingRecords();
+}
+
+// =====================================================================================
+//  CheckpointPortal
+//      Called when PortalFlow has finished the portal
+// =====================================================================================
+void CheckpointPortal(vis_portal_t const * p) {
+	if (!checkpointFile) {
+		return;
+	}
+
+	// A zero byte can take two bytes compressed
+	thread_local std::vector<byte> compressed;
+	compressed.resize(g_bitbytes * 2);
+	std::size_t const compressedSize = CompressVis(
+		p->visbits, g_bitbytes, compressed.data(), compressed.size()
+	);
+
+	checkpoint_record record{
+		.portalNum = std::uint32_t(p - g_portals),
+		.numCanSee = p->numcansee,
+		.compressedSize = std::uint32_t(compressedSize)
+	};
+	record.checksum = RecordChecksum(
+		record, std::span{ compressed.data(), compressedSize }
+	);
+
+	std::unique_lock lock{ checkpointMutex };
+	pendingRecords.append(
+		reinterpret_cast<char const *>(&record), sizeof(record)
+	);
+	pendingRecords.append(
+		reinterpret_cast<char const *>(compressed.data()), compressedSize
+	);
+	if (std::chrono::steady_clock::now() - lastCheckpoint
+	    >= checkpointInterval) {
+		WritePendingRecords();
+	}
+}
+
+// =====================================================================================
+//  CloseCheckpoint
+// =====================================================================================
+void CloseCheckpoint() {
+	if (!checkpointFile) {
+		return;
+	}
+	{
+		std::unique_lock lock{ checkpointMutex };
+		WritePendingRecords();
+	}
+	fclose(checkpointFile);
+	checkpointFile = nullptr;
+}
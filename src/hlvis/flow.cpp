@@ -1,8 +1,50 @@
 #include "hlvis.h"
 #include "log.h"
 #include "threads.h"
+#include "vis_bitset.h"
 #include "winding.h"
 
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+// The buffers of a level of the portal flow recursion. They're kept off
+// the C stack, so a level of RecursiveLeafFlow only puts a few pointers
+// there. Each thread allocates a level the first time its flow gets that
+// deep and reuses it for its later portals
+struct flow_level final {
+	std::unique_ptr<byte[]> mightsee;
+	std::array<winding_t, 3> windings;
+	std::vector<hlvis_plane_t> clipPlanes;
+};
+
+static thread_local std::vector<std::unique_ptr<flow_level>> flowLevels;
+
+// =====================================================================================
+//  GetFlowLevel
+// =====================================================================================
+static flow_level& GetFlowLevel(std::size_t depth) {
+	while (flowLevels.size() <= depth) {
+		std::unique_ptr<flow_level>& level = flowLevels.emplace_back(
+			std::make_unique<flow_level>()
+		);
+		level->mightsee = std::make_unique<byte[]>(g_bitbytes);
+	}
+	return *flowLevels[depth];
+}
+
+// =====================================================================================
+//  SetupStack
+// =====================================================================================
+static void SetupStack(pstack_t* const stack, std::size_t depth) {
+	flow_level& level = GetFlowLevel(depth);
+	stack->depth = depth;
+	stack->mightsee = level.mightsee.get();
+	stack->windings = level.windings.data();
+}
+
 // =====================================================================================
 //  AllocStackWinding
 // =====================================================================================
@@ -24,11 +66,11 @@ inline static winding_t* AllocStackWinding(pstack_t* const stack) {
 // =====================================================================================
 static void
 FreeStackWinding(winding_t const * const w, pstack_t* const stack) {
-	if (w < stack->windings.begin() || w >= stack->windings.end()) {
+	if (w < stack->windings || w >= stack->windings + 3) {
 		return; // not from local
 	}
 
-	std::size_t i = w - stack->windings.data();
+	std::size_t i = w - stack->windings;
 
 	if (stack->freeWindings[i]) {
 		Error("FreeStackWinding: allready free");
@@ -44,8 +86,9 @@ inline winding_t* ChopWinding(
 	pstack_t* const stack,
 	hlvis_plane_t const * const split
 ) {
-	float dists[128];
-	face_side sides[128];
+	// One more for the first point repeated at the end
+	float dists[MAX_POINTS_ON_FIXED_WINDING + 1];
+	face_side sides[MAX_POINTS_ON_FIXED_WINDING + 1];
 	std::array<int, 3> counts;
 	float dot;
 	int i;
@@ -54,7 +97,7 @@ inline winding_t* ChopWinding(
 
 	counts[0] = counts[1] = counts[2] = 0;
 
-	if (in->numpoints > (sizeof(sides) / sizeof(*sides))) {
+	if (in->numpoints >= std::size(sides)) {
 		Error("Winding with too many sides!");
 	}
 
@@ -332,6 +375,7 @@ inline static void RecursiveLeafFlow(
 		}
 	}
 
+	SetupStack(&stack, prevstack->depth + 1);
 	stack.head = prevstack->head;
 	stack.leaf = leaf;
 	stack.portal = nullptr;
@@ -360,42 +404,26 @@ inline static void RecursiveLeafFlow(
 		// if the portal can't see anything we haven't allready seen, skip
 		// it
 		{
-			long* test;
+			byte const * test;
 
-			if (p->status == vstatus_t::stat_done) {
-				test = (long*) p->visbits;
+			// Another thread may be finishing the portal
+			vstatus_t const status = std::atomic_ref{ p->status }.load(
+				std::memory_order_acquire
+			);
+			if (status == vstatus_t::stat_done) {
+				test = p->visbits;
 			} else {
-				test = (long*) p->mightsee;
+				test = p->mightsee;
 			}
 
-			{
-				int const bitlongs = g_bitlongs;
-
-				{
-					long* prevmight = (long*) prevstack->mightsee;
-					long* might = (long*) stack.mightsee;
-
-					unsigned j;
-					for (j = 0; j < bitlongs;
-					     j++, test++, might++, prevmight++) {
-						(*might) = (*prevmight) & (*test);
-					}
-				}
-
-				{
-					long* might = (long*) stack.mightsee;
-					long* vis = (long*) thread->leafvis;
-					unsigned j;
-					for (j = 0; j < bitlongs; j++, might++, vis++) {
-						if ((*might) & ~(*vis)) {
-							break;
-						}
-					}
-
-					if (j == g_bitlongs) { // can't see anything new
-						continue;
-					}
-				}
+			if (!and_bits_has_new(
+					stack.mightsee,
+					prevstack->mightsee,
+					test,
+					thread->leafvis,
+					g_bitbytes
+				)) {
+				continue; // can't see anything new
 			}
 		}
 
@@ -441,11 +469,14 @@ inline static void RecursiveLeafFlow(
 		}
 
 		if (stack.clipPlaneCount == -1) {
+			std::vector<hlvis_plane_t>& clipPlanes
+				= GetFlowLevel(stack.depth).clipPlanes;
+			clipPlanes.resize(std::max(
+				clipPlanes.size(),
+				prevstack->source->numpoints * prevstack->pass->numpoints
+			));
 			stack.clipPlaneCount = 0;
-			stack.clipPlane = (hlvis_plane_t*) alloca(
-				sizeof(hlvis_plane_t) * prevstack->source->numpoints
-				* prevstack->pass->numpoints
-			);
+			stack.clipPlane = clipPlanes.data();
 
 			ClipToSeperators(
 				prevstack->source, prevstack->pass, NULL, false, &stack
@@ -504,16 +535,18 @@ void PortalFlow(vis_portal_t* p) {
 	data.leafvis = p->visbits;
 	data.base = p;
 
+	SetupStack(&data.pstack_head, 0);
 	data.pstack_head.head = &data.pstack_head;
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = &p->plane;
-	for (std::size_t i = 0; i < g_bitlongs; ++i) {
-		((long*) data.pstack_head.mightsee)[i] = ((long*) p->mightsee)[i];
-	}
+	std::copy_n(p->mightsee, g_bitbytes, data.pstack_head.mightsee);
 	RecursiveLeafFlow(p->leaf, &data, &data.pstack_head);
 
-	p->status = vstatus_t::stat_done;
+	// Publishes visbits to the threads flowing through the portal
+	std::atomic_ref{ p->status }.store(
+		vstatus_t::stat_done, std::memory_order_release
+	);
 }
 
 // =====================================================================================
@@ -522,10 +555,7 @@ void PortalFlow(vis_portal_t* p) {
 //      reject some of the final calculations.
 // =====================================================================================
 static void SimpleFlood(
-	byte* const srcmightsee,
-	int const leafnum,
-	byte* const portalsee,
-	unsigned int* const c_leafsee
+	byte* const srcmightsee, int const leafnum, byte* const portalsee
 ) {
 	unsigned i;
 	leaf_t* leaf;
@@ -542,7 +572,6 @@ static void SimpleFlood(
 		}
 	}
 
-	(*c_leafsee)++;
 	leaf = &g_leafs[leafnum];
 
 	for (i = 0; i < leaf->numportals; i++) {
@@ -550,7 +579,7 @@ static void SimpleFlood(
 		if (!portalsee[p - g_portals]) {
 			continue;
 		}
-		SimpleFlood(srcmightsee, p->leaf, portalsee, c_leafsee);
+		SimpleFlood(srcmightsee, p->leaf, portalsee);
 	}
 }
 
@@ -611,7 +640,9 @@ void BasePortalVis(int unused) {
 			portalsee[j] = 1;
 		}
 
-		SimpleFlood(p->mightsee, p->leaf, portalsee, &p->nummightsee);
+		SimpleFlood(p->mightsee, p->leaf, portalsee);
+		// Each leaf is flooded once, so the leafs are counted afterwards
+		p->nummightsee = count_bits(p->mightsee, g_bitbytes);
 		Verbose("portal:%4i  nummightsee:%4i \n", i, p->nummightsee);
 	}
 }
@@ -847,6 +878,12 @@ float WindingDist(winding_t const * w[2]) {
 //  MaxDistVis
 // =====================================================================================
 void MaxDistVis(int unused_threadnum) {
+	// The leafs that any portal of leaf i sees. Only this thread changes
+	// the bits after i in those portals, so it's built once per leaf
+	std::unique_ptr<byte[]> const leafVisBits{ std::make_unique<byte[]>(
+		g_bitbytes
+	) };
+
 	while (1) {
 		int i = GetThreadWork();
 		if (i == -1) {
@@ -855,6 +892,11 @@ void MaxDistVis(int unused_threadnum) {
 
 		leaf_t* l = &g_leafs[i];
 
+		std::fill_n(leafVisBits.get(), g_bitbytes, 0);
+		for (int k = 0; k < l->numportals; k++) {
+			or_bits(leafVisBits.get(), l->portals[k]->visbits, g_bitbytes);
+		}
+
 		for (int j = i + 1; j < g_portalleafs; j++) {
 			leaf_t* tl = g_leafs + j;
 
@@ -865,12 +907,7 @@ void MaxDistVis(int unused_threadnum) {
 			unsigned bit_tl = (1 << (j & 7));
 
 			{
-				bool visible = false;
-				for (int k = 0; k < l->numportals; k++) {
-					if (l->portals[k]->visbits[offset_tl] & bit_tl) {
-						visible = true;
-					}
-				}
+				bool visible = (leafVisBits[offset_tl] & bit_tl) != 0;
 				for (int k = 0; k < tl->numportals; k++) {
 					if (tl->portals[k]->visbits[offset_l] & bit_l) {
 						visible = true;
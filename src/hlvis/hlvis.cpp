@@ -4,15 +4,21 @@
 #include "cli_option_defaults.h"
 #include "cmdlinecfg.h"
 #include "filelib.h"
+#include "hull_file.h"
+#include "intermediate_files.h"
 #include "log.h"
 #include "mathlib.h"
 #include "messages.h"
+#include "phase_trace.h"
 #include "threads.h"
 #include "time_counter.h"
+#include "vis_bitset.h"
 
 #include <algorithm>
-#include <fstream>
+#include <atomic>
 #include <iostream>
+#include <span>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
@@ -35,6 +41,9 @@ static byte* vismap_end; // past visfile
 static int originalvismapsize;
 
 static std::vector<std::uint8_t> g_uncompressed; // [bitbytes*portalleafs]
+// The leafs every leaf sees, because they contain an info_overview_point
+// with reverse set
+static std::vector<byte> skyboxLeafBits; // [bitbytes]
 
 unsigned g_bitbytes; // (portalleafs+63)>>3
 unsigned g_bitlongs;
@@ -42,9 +51,9 @@ unsigned g_bitlongs;
 bool g_fastvis = DEFAULT_FASTVIS;
 bool g_fullvis = DEFAULT_FULLVIS;
 bool g_nofixprt = DEFAULT_NOFIXPRT;
-bool g_estimate = cli_option_defaults::estimate;
-bool g_chart = cli_option_defaults::chart;
-bool g_info = cli_option_defaults::info;
+unsigned g_checkpointinterval = 0; // "-checkpoint #", 0 for none
+bool g_resume = false;
+bool g_incrementalvis = false;
 
 unsigned int g_maxdistance = DEFAULT_MAXDISTANCE_RANGE;
 
@@ -59,13 +68,16 @@ int g_room_count = 0;
 
 static int totalvis = 0;
 
+static std::vector<vis_portal_t*> portalsByComplexity;
+static std::atomic<std::size_t> nextPortal{ 0 };
+
 // =====================================================================================
 //  GetParamsFromEnt
 //      this function is called from parseentity when it encounters the
 //      info_compile_parameters entity. each tool should have its own
 //      version of this to handle its own specific settings.
 // =====================================================================================
-void GetParamsFromEnt(entity_t* mapent) {
+static void GetParamsFromEnt(entity_t* mapent) {
 	Log("\nCompile Settings detected from info_compile_parameters entity\n"
 	);
 
@@ -168,43 +180,42 @@ static winding_t* NewWinding(int const points) {
 
 //=============================================================================
 
+// =====================================================================================
+//  SortPortalsByComplexity
+//      The portals are handed out from the least complex, so the later
+//      ones can reuse the earlier information. nummightsee doesn't change
+//      during the flow, so the order is fixed up front. Portals restored
+//      from a checkpoint are left out
+// =====================================================================================
+static void SortPortalsByComplexity() {
+	portalsByComplexity.clear();
+	for (std::size_t i = 0; i < g_numportals * 2; i++) {
+		if (g_portals[i].status == vstatus_t::stat_none) {
+			portalsByComplexity.push_back(&g_portals[i]);
+		}
+	}
+	std::ranges::stable_sort(
+		portalsByComplexity, std::ranges::less{}, &vis_portal_t::nummightsee
+	);
+	nextPortal.store(0, std::memory_order_relaxed);
+}
+
 // =====================================================================================
 //  GetNextPortal
 //      Returns the next portal for a thread to work on
-//      Returns the portals from the least complex, so the later ones can
-//      reuse the earlier information.
 // =====================================================================================
 static vis_portal_t* GetNextPortal() {
-	int j;
-	vis_portal_t* p;
-	vis_portal_t* tp;
-	int min;
-
-	{
-		if (GetThreadWork() == -1) {
-			return nullptr;
-		}
-		ThreadLock();
-
-		min = 99999;
-		p = nullptr;
-
-		for (j = 0, tp = g_portals; j < g_numportals * 2; j++, tp++) {
-			if (tp->nummightsee < min
-			    && tp->status == vstatus_t::stat_none) {
-				min = tp->nummightsee;
-				p = tp;
-			}
-		}
-
-		if (p) {
-			p->status = vstatus_t::stat_working;
-		}
-
-		ThreadUnlock();
-
-		return p;
+	if (GetThreadWork() == -1) {
+		return nullptr;
 	}
+
+	vis_portal_t* p = portalsByComplexity[nextPortal.fetch_add(
+		1, std::memory_order_relaxed
+	)];
+	std::atomic_ref{ p->status }.store(
+		vstatus_t::stat_working, std::memory_order_relaxed
+	);
+	return p;
 }
 
 // =====================================================================================
@@ -220,6 +231,7 @@ static void LeafThread(int unused) {
 		}
 
 		PortalFlow(p);
+		CheckpointPortal(p);
 
 		Verbose(
 			"portal:%4i  mightsee:%4i  cansee:%4i\n",
@@ -288,13 +300,7 @@ static void LeafFlow(int const leafnum) {
 			Error("portal not done (leaf %d)", leafnum);
 		}
 
-		{
-			byte* dst = outbuffer;
-			byte* src = p->visbits;
-			for (j = 0; j < g_bitbytes; j++, dst++, src++) {
-				*dst |= *src;
-			}
-		}
+		or_bits(outbuffer, p->visbits, g_bitbytes);
 
 		if ((tmp == 0) && (outbuffer[offset] & bit)) {
 			tmp = 1;
@@ -315,22 +321,11 @@ static void LeafFlow(int const leafnum) {
 	outbuffer[offset] |= bit;
 
 	if (g_leafinfos[leafnum].isoverviewpoint) {
-		for (i = 0; i < g_portalleafs; i++) {
-			outbuffer[i >> 3] |= (1 << (i & 7));
-		}
-	}
-	for (i = 0; i < g_portalleafs; i++) {
-		if (g_leafinfos[i].isskyboxpoint) {
-			outbuffer[i >> 3] |= (1 << (i & 7));
-		}
+		set_bit_range(outbuffer, 0, g_portalleafs);
 	}
+	or_bits(outbuffer, skyboxLeafBits.data(), g_bitbytes);
 
-	numvis = 0;
-	for (i = 0; i < g_portalleafs; i++) {
-		if (outbuffer[i >> 3] & (1 << (i & 7))) {
-			numvis++;
-		}
-	}
+	numvis = count_bits(outbuffer, g_bitbytes);
 
 	//
 	// compress the bit string
@@ -341,17 +336,9 @@ static void LeafFlow(int const leafnum) {
 	byte buffer2[MAX_MAP_LEAFS / 8];
 	int diskbytes = (g_leafcount_all + 7) >> 3;
 	std::fill_n(buffer2, diskbytes, 0);
-	for (i = 0; i < g_portalleafs; i++) {
-		for (j = 0; j < g_leafcounts[i]; j++) {
-			int srcofs = i >> 3;
-			int srcbit = 1 << (i & 7);
-			int dstofs = (g_leafstarts[i] + j) >> 3;
-			int dstbit = 1 << ((g_leafstarts[i] + j) & 7);
-			if (outbuffer[srcofs] & srcbit) {
-				buffer2[dstofs] |= dstbit;
-			}
-		}
-	}
+	expand_portal_leaf_bits(
+		outbuffer, g_bitbytes, g_leafstarts, g_leafcounts, buffer2
+	);
 	i = CompressVis(buffer2, diskbytes, compressed, sizeof(compressed));
 
 	dest = vismap_p;
@@ -368,6 +355,14 @@ static void LeafFlow(int const leafnum) {
 	memcpy(dest, compressed, i);
 }
 
+static std::filesystem::path checkpoint_file_path() {
+	return path_to_temp_file_with_extension(g_Mapname, u8".vis.checkpoint");
+}
+
+static std::filesystem::path incremental_file_path() {
+	return path_to_temp_file_with_extension(g_Mapname, u8".vis.incremental");
+}
+
 // =====================================================================================
 //  CalcPortalVis
 // =====================================================================================
@@ -381,7 +376,23 @@ static void CalcPortalVis() {
 		return;
 	}
 
-	NamedRunThreadsOn(g_numportals * 2, g_estimate, LeafThread);
+	if (g_incrementalvis) {
+		ReuseUnchangedPortals(incremental_file_path());
+	}
+	if (g_checkpointinterval) {
+		OpenCheckpoint(
+			checkpoint_file_path(), g_checkpointinterval, g_resume
+		);
+	}
+
+	SortPortalsByComplexity();
+	NamedRunThreadsOn(portalsByComplexity.size(), g_estimate, LeafThread);
+
+	CloseCheckpoint();
+
+	if (g_incrementalvis) {
+		SaveIncrementalVis(incremental_file_path());
+	}
 }
 
 // =====================================================================================
@@ -411,6 +422,7 @@ void SaveVisData(char const * filename) {
 //  CalcVis
 // =====================================================================================
 static void CalcVis() {
+	trace_phase phase{ "CalcVis" };
 	std::filesystem::path const visDataFilePath{
 		path_to_temp_file_with_extension(g_Mapname, u8".vdt").c_str()
 	};
@@ -424,6 +436,13 @@ static void CalcVis() {
 
 	CalcPortalVis();
 
+	skyboxLeafBits.assign(g_bitbytes, 0);
+	for (unsigned i = 0; i < g_portalleafs; i++) {
+		if (g_leafinfos[i].isskyboxpoint) {
+			set_bit_range(skyboxLeafBits.data(), i, 1);
+		}
+	}
+
 	// Add additional leaves to the uncompressed vis.
 	for (unsigned i = 0; i < g_portalleafs; i++) {
 		if (!g_leafinfos[i].additional_leaves.empty()) {
@@ -437,8 +456,11 @@ static void CalcVis() {
 	//
 	// assemble the leaf vis lists by oring and compressing the portal lists
 	//
-	for (unsigned i = 0; i < g_portalleafs; i++) {
-		LeafFlow(i);
+	{
+		trace_phase leafFlowPhase{ "LeafFlow" };
+		for (unsigned i = 0; i < g_portalleafs; i++) {
+			LeafFlow(i);
+		}
 	}
 
 	Log("average leafs visible: %i\n", totalvis / g_portalleafs);
@@ -462,8 +484,11 @@ static void CalcVis() {
 		// after the initial VIS
 		// CalcPortalVis();
 
-		for (unsigned i = 0; i < g_portalleafs; i++) {
-			LeafFlow(i);
+		{
+			trace_phase leafFlowPhase{ "LeafFlow" };
+			for (unsigned i = 0; i < g_portalleafs; i++) {
+				LeafFlow(i);
+			}
 		}
 
 		Log("average maxdistance leafs visible: %i\n",
@@ -481,28 +506,10 @@ static inline void CheckNullToken(char const * const token) {
 }
 
 // =====================================================================================
-//  LoadPortals
+//  AllocPortals
+//      Once g_portalleafs and g_numportals are known
 // =====================================================================================
-static void LoadPortals(char* portal_image) {
-	leaf_t* l;
-	int numpoints;
-	winding_t* w;
-	std::array<int, 2> leafnums;
-	hlvis_plane_t plane;
-	char const * const seperators = " ()\r\n\t";
-
-	char const * token = strtok(portal_image, seperators);
-	CheckNullToken(token);
-	if (!sscanf(token, "%u", &g_portalleafs)) {
-		Error("LoadPortals: failed to read header: number of leafs");
-	}
-
-	token = strtok(nullptr, seperators);
-	CheckNullToken(token);
-	if (!sscanf(token, "%i", &g_numportals)) {
-		Error("LoadPortals: failed to read header: number of portals");
-	}
-
+static void AllocPortals() {
 	Log("%4i portalleafs\n", g_portalleafs);
 	Log("%4i numportals\n", g_numportals);
 
@@ -533,15 +540,15 @@ static void LoadPortals(char* portal_image) {
 			MAX_MAP_LEAFS
 		);
 	}
+}
+
+// =====================================================================================
+//  SetupLeafs
+//      Once g_leafcounts is read
+// =====================================================================================
+static void SetupLeafs() {
 	g_leafcount_all = 0;
 	for (int i = 0; i < g_portalleafs; i++) {
-		unsigned rval = 0;
-		token = strtok(nullptr, seperators);
-		CheckNullToken(token);
-		rval += sscanf(token, "%i", &g_leafcounts[i]);
-		if (rval != 1) {
-			Error("LoadPortals: read leaf %i failed", i);
-		}
 		g_leafstarts[i] = g_leafcount_all;
 		g_leafcount_all += g_leafcounts[i];
 	}
@@ -581,6 +588,105 @@ static void LoadPortals(char* portal_image) {
 			}
 		}
 	}
+}
+
+// =====================================================================================
+//  CheckPortal
+// =====================================================================================
+static void CheckPortal(
+	int portalnum, std::size_t numpoints, std::array<int, 2> leafnums
+) {
+	if (numpoints > MAX_POINTS_ON_FIXED_WINDING) {
+		Error("LoadPortals: portal %i has too many points", portalnum);
+	}
+	if (((unsigned) leafnums[0] > g_portalleafs)
+	    || ((unsigned) leafnums[1] > g_portalleafs)) {
+		Error("LoadPortals: reading portal %i", portalnum);
+	}
+}
+
+// =====================================================================================
+//  AddPortal
+//      Splits the file portal into a forward and a backward portal.
+//      Returns the portal after them
+// =====================================================================================
+static vis_portal_t*
+AddPortal(vis_portal_t* p, winding_t* w, std::array<int, 2> leafnums) {
+	leaf_t* l;
+	hlvis_plane_t plane;
+
+	// calc plane
+	PlaneFromWinding(w, &plane);
+
+	// create forward portal
+	l = &g_leafs[leafnums[0]];
+	hlassume(
+		l->numportals < MAX_PORTALS_ON_LEAF,
+		assume_msg::exceeded_MAX_PORTALS_ON_LEAF
+	);
+	l->portals[l->numportals] = p;
+	l->numportals++;
+
+	p->winding = w;
+	p->plane.normal = negate_vector(plane.normal);
+	p->plane.dist = -plane.dist;
+	p->leaf = leafnums[1];
+	p++;
+
+	// create backwards portal
+	l = &g_leafs[leafnums[1]];
+	hlassume(
+		l->numportals < MAX_PORTALS_ON_LEAF,
+		assume_msg::exceeded_MAX_PORTALS_ON_LEAF
+	);
+	l->portals[l->numportals] = p;
+	l->numportals++;
+
+	p->winding = NewWinding(w->numpoints);
+	p->winding->numpoints = w->numpoints;
+	for (int j = 0; j < w->numpoints; j++) {
+		p->winding->points[j] = w->points[w->numpoints - 1 - j];
+	}
+
+	p->plane = plane;
+	p->leaf = leafnums[0];
+	p++;
+	return p;
+}
+
+// =====================================================================================
+//  LoadPortals
+// =====================================================================================
+static void LoadPortals(char* portal_image) {
+	int numpoints;
+	winding_t* w;
+	std::array<int, 2> leafnums;
+	char const * const seperators = " ()\r\n\t";
+
+	char const * token = strtok(portal_image, seperators);
+	CheckNullToken(token);
+	if (!sscanf(token, "%u", &g_portalleafs)) {
+		Error("LoadPortals: failed to read header: number of leafs");
+	}
+
+	token = strtok(nullptr, seperators);
+	CheckNullToken(token);
+	if (!sscanf(token, "%i", &g_numportals)) {
+		Error("LoadPortals: failed to read header: number of portals");
+	}
+
+	AllocPortals();
+
+	for (int i = 0; i < g_portalleafs; i++) {
+		unsigned rval = 0;
+		token = strtok(nullptr, seperators);
+		CheckNullToken(token);
+		rval += sscanf(token, "%i", &g_leafcounts[i]);
+		if (rval != 1) {
+			Error("LoadPortals: read leaf %i failed", i);
+		}
+	}
+	SetupLeafs();
 
 	vis_portal_t* p = g_portals;
 	for (int i = 0; i < g_numportals; i++) {
@@ -599,15 +705,9 @@ static void LoadPortals(char* portal_image) {
 		if (rval != 3) {
 			Error("LoadPortals: reading portal %i", i);
 		}
-		if (numpoints > MAX_POINTS_ON_FIXED_WINDING) {
-			Error("LoadPortals: portal %i has too many points", i);
-		}
-		if (((unsigned) leafnums[0] > g_portalleafs)
-		    || ((unsigned) leafnums[1] > g_portalleafs)) {
-			Error("LoadPortals: reading portal %i", i);
-		}
+		CheckPortal(i, numpoints, leafnums);
 
-		w = p->winding = NewWinding(numpoints);
+		w = NewWinding(numpoints);
 		w->original = true;
 		w->numpoints = numpoints;
 
@@ -631,52 +731,79 @@ static void LoadPortals(char* portal_image) {
 			w->points[j] = v;
 		}
 
-		// calc plane
-		PlaneFromWinding(w, &plane);
+		p = AddPortal(p, w, leafnums);
+	}
+}
+
+// =====================================================================================
+//  LoadPortalsBinary
+//      The points are converted right out of the mapped file
+// =====================================================================================
+static void LoadPortalsBinary(hull_file_reader& file) {
+	portal_file_counts const counts{
+		file.read_record<portal_file_counts>()
+	};
+	g_portalleafs = counts.numLeafs;
+	g_numportals = counts.numPortals;
 
-		// create forward portal
-		l = &g_leafs[leafnums[0]];
-		hlassume(
-			l->numportals < MAX_PORTALS_ON_LEAF,
-			assume_msg::exceeded_MAX_PORTALS_ON_LEAF
-		);
-		l->portals[l->numportals] = p;
-		l->numportals++;
-
-		p->winding = w;
-		p->plane.normal = negate_vector(plane.normal);
-		p->plane.dist = -plane.dist;
-		p->leaf = leafnums[1];
-		p++;
-
-		// create backwards portal
-		l = &g_leafs[leafnums[1]];
-		hlassume(
-			l->numportals < MAX_PORTALS_ON_LEAF,
-			assume_msg::exceeded_MAX_PORTALS_ON_LEAF
-		);
-		l->portals[l->numportals] = p;
-		l->numportals++;
+	AllocPortals();
 
-		p->winding = NewWinding(w->numpoints);
-		p->winding->numpoints = w->numpoints;
-		for (int j = 0; j < w->numpoints; j++) {
-			p->winding->points[j] = w->points[w->numpoints - 1 - j];
+	for (int i = 0; i < g_portalleafs; i++) {
+		g_leafcounts[i] = file.read_record<portal_file_leaf>().numBspLeafs;
+	}
+	SetupLeafs();
+
+	vis_portal_t* p = g_portals;
+	for (int i = 0; i < g_numportals; i++) {
+		portal_file_portal const portal{
+			file.read_record<portal_file_portal>()
+		};
+		std::array<int, 2> const leafnums{ portal.leafs[0],
+			                               portal.leafs[1] };
+		CheckPortal(i, portal.numPoints, leafnums);
+
+		std::span<double3_array const> const points{
+			file.read_points(portal.numPoints)
+		};
+		winding_t* w = NewWinding(points.size());
+		w->original = true;
+		w->numpoints = points.size();
+		for (std::size_t j = 0; j < points.size(); j++) {
+			w->points[j] = to_float3(points[j]);
 		}
 
-		p->plane = plane;
-		p->leaf = leafnums[0];
-		p++;
+		p = AddPortal(p, w, leafnums);
 	}
 }
 
 // =====================================================================================
 //  LoadPortalsByFilename
 // =====================================================================================
+static std::optional<std::u8string>
+read_portal_file(char const * const filename) {
+	std::optional<std::span<std::byte const>> const inMemory{
+		find_intermediate_file(filename)
+	};
+	if (inMemory) {
+		return std::u8string(
+			reinterpret_cast<char8_t const *>(inMemory->data()),
+			inMemory->size()
+		);
+	}
+	return read_utf8_file(filename, true);
+}
+
 static void LoadPortalsByFilename(char const * const filename) {
-	std::optional<std::u8string> maybeContents = read_utf8_file(
-		filename, true
-	);
+	trace_phase phase{ "LoadPortals" };
+	std::optional<hull_file_reader> binary{
+		hull_file_reader::open(filename, portalFileMagic)
+	};
+	if (binary) {
+		LoadPortalsBinary(binary.value());
+		return;
+	}
+
+	std::optional<std::u8string> maybeContents = read_portal_file(filename);
 	if (!maybeContents) {
 		Error(
 			"Portal file '%s' could not be read, cannot VIS the map\n",
@@ -696,11 +823,19 @@ static void Usage() {
 	Log("\n-= %s Options =-\n\n", (char const *) g_Program.data());
 	Log("    -full           : Full vis\n");
 	Log("    -fast           : Fast vis\n\n");
-	Log("    -nofixprt       : Disables optimization of portal file for import to J.A.C.K. map editor\n\n"
+	Log("    -nofixprt       : Disables optimization of portal file for import to J.A.C.K. map editor\n"
+	);
+	Log("    -checkpoint #   : Save the finished portals every # seconds, for -resume\n"
+	);
+	Log("    -resume         : Continue an interrupted vis from its checkpoint\n"
+	);
+	Log("    -incremental    : Reuse the vis of the portals unchanged since the last run\n\n"
 	);
 	Log("    -texdata #      : Alter maximum texture memory limit (in kb)\n"
 	);
 	Log("    -chart          : display bsp statitics\n");
+	Log("    -trace          : write a Chrome trace of the compile phases to mapname.vis.trace.json\n"
+	);
 	Log("    -low | -high    : run program an altered priority level\n");
 	Log("    -nolog          : don't generate the compile logfiles\n");
 	Log("    -threads #      : manually specify the number of threads to run\n"
@@ -790,6 +925,13 @@ static void Settings() {
 	Log("nofixprt            [ %7s ] [ %7s ]\n",
 	    g_nofixprt ? "on" : "off",
 	    DEFAULT_NOFIXPRT ? "on" : "off");
+	Log("checkpoint interval [ %7u ] [ %7d ]\n", g_checkpointinterval, 0);
+	Log("resume              [ %7s ] [ %7s ]\n",
+	    g_resume ? "on" : "off",
+	    "off");
+	Log("incremental         [ %7s ] [ %7s ]\n",
+	    g_incrementalvis ? "on" : "off",
+	    "off");
 
 	Log("\n\n");
 }
@@ -823,16 +965,27 @@ int VisLeafnumForPoint(float3_array const & point) {
 void FixPrt(char const * portalfile) {
 	Log("\nReading portal file '%s'\n", portalfile);
 
+	if (hull_file_reader::open(portalfile, portalFileMagic)) {
+		Log("Portal file is binary, skipping optimization for J.A.C.K. map editor\n"
+		);
+		return;
+	}
+
 	std::vector<std::string> prtVector;
-	std::ifstream inputFileStream{ portalfile }; // Import from .prt file
+	std::optional<std::u8string> const portalFileContents{
+		read_portal_file(portalfile) // Import from .prt file
+	};
 
-	if (!inputFileStream) // If import fails
+	if (!portalFileContents) // If import fails
 	{
 		Log("Failed reading portal file '%s', skipping optimization for J.A.C.K. map editor\n",
 		    portalfile);
 		return;
 	}
 
+	std::istringstream inputFileStream{ std::string(
+		portalFileContents->begin(), portalFileContents->end()
+	) };
 	std::string strInput;
 
 	while (std::getline(inputFileStream, strInput)
@@ -842,7 +995,6 @@ void FixPrt(char const * portalfile) {
 			prtVector.push_back(strInput);
 		}
 	}
-	inputFileStream.close();
 
 	std::size_t portalFileLines = prtVector.size(
 	); // Count lines before optimization
@@ -902,16 +1054,16 @@ void FixPrt(char const * portalfile) {
 	    Log("%s\n", line.c_str());
 	*/
 
-	std::ofstream outputFileStream; // Output to .prt file
-
-	outputFileStream.open(portalfile);
+	FILE* outputFile = open_intermediate_file(
+		portalfile, "w"
+	); // Output to .prt file
 
-	if (outputFileStream.is_open()) {
+	if (outputFile) {
 		for (int i = 0; i < prtVector.size(); ++i) {
-			outputFileStream << prtVector[i]
-							 << "\n"; // Print each string as a new line
+			fputs(prtVector[i].c_str(), outputFile);
+			fputc('\n', outputFile); // Print each string as a new line
 		}
-		outputFileStream.close();
+		fclose(outputFile);
 
 		Log("Optimization for J.A.C.K. map editor successful, writing portal file '%s'\n",
 		    portalfile);
@@ -926,10 +1078,12 @@ void FixPrt(char const * portalfile) {
 }
 
 // =====================================================================================
-//  main
+//  hlvis_main
+//      The main() of hlvis, and the VIS stage of HLCOMPILE
 // =====================================================================================
-int main(int const argc, char** argv) {
+int hlvis_main(int const argc, char** argv) {
 	std::u8string_view mapname_from_arg;
+	bool trace = false;
 
 	g_Program = u8"HLVIS"; // Visible Information Set
 
@@ -971,6 +1125,16 @@ int main(int const argc, char** argv) {
 					g_fullvis = true;
 				} else if (arg == u8"-nofixprt") {
 					g_nofixprt = true;
+				} else if (arg == u8"-checkpoint") {
+					if (i + 1 < argc) {
+						g_checkpointinterval = std::max(atoi(argv[++i]), 1);
+					} else {
+						Usage();
+					}
+				} else if (arg == u8"-resume") {
+					g_resume = true;
+				} else if (arg == u8"-incremental") {
+					g_incrementalvis = true;
 				} else if (arg == u8"-dev") {
 					if (i + 1 < argc) {
 						std::optional<developer_level> dl{
@@ -994,6 +1158,8 @@ int main(int const argc, char** argv) {
 					g_info = false;
 				} else if (arg == u8"-chart") {
 					g_chart = true;
+				} else if (arg == u8"-trace") {
+					trace = true;
 				} else if (arg == u8"-low") {
 					g_threadpriority = q_threadpriority::eThreadPriorityLow;
 				} else if (arg == u8"-high") {
@@ -1036,8 +1202,17 @@ int main(int const argc, char** argv) {
 			);
 			g_Mapname.replace_extension(std::filesystem::path{});
 
+			if (g_resume && !g_checkpointinterval) {
+				g_checkpointinterval = DEFAULT_CHECKPOINT_INTERVAL;
+			}
+
 			OpenLog();
 			atexit(CloseLog);
+			if (trace) {
+				start_tracing(path_to_temp_file_with_extension(
+					g_Mapname, u8".vis.trace.json"
+				));
+			}
 			ThreadSetDefault();
 			ThreadSetPriority(g_threadpriority);
 			LogStart(argcold, argvold);
@@ -1055,7 +1230,7 @@ int main(int const argc, char** argv) {
 			LoadBSPFile(
 				path_to_temp_file_with_extension(g_Mapname, u8".bsp")
 			);
-			parse_entities_from_bsp_file();
+			parse_entities_from_bsp_file(GetParamsFromEnt);
 			{
 				for (std::size_t i = 0; i < g_numentities; i++) {
 					std::u8string_view current_entity_classname
@@ -1170,6 +1345,11 @@ int main(int const argc, char** argv) {
 					.c_str()
 			);
 
+			// The vis is done, so there's nothing left to resume
+			if (g_checkpointinterval) {
+				std::filesystem::remove(checkpoint_file_path());
+			}
+
 			LogTimeElapsed(timeCounter.get_total());
 
 			// END VIS
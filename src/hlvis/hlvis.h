@@ -2,6 +2,9 @@
 
 #include "bspfile.h"
 
+#include <cstdint>
+#include <filesystem>
+#include <span>
 #include <unordered_map>
 #include <vector>
 
@@ -11,6 +14,9 @@
 #define DEFAULT_NOFIXPRT false
 #define DEFAULT_FASTVIS  false
 
+// Seconds between checkpoints with -resume when -checkpoint isn't given
+#define DEFAULT_CHECKPOINT_INTERVAL 300
+
 constexpr std::size_t MAX_PORTALS = 32768;
 
 #define MAX_POINTS_ON_FIXED_WINDING 32
@@ -67,7 +73,7 @@ struct leaf_t final {
 };
 
 struct pstack_t final {
-	byte mightsee[MAX_MAP_LEAFS / 8]; // bit string
+	byte* mightsee; // bit string, g_bitbytes long
 	pstack_t* head;
 
 	leaf_t* leaf;
@@ -75,13 +81,15 @@ struct pstack_t final {
 	winding_t* source;
 	winding_t* pass;
 
-	std::array<winding_t, 3> windings; // source, pass, temp in any order
+	winding_t* windings; // [3] source, pass, temp in any order
 	std::array<bool, 3> freeWindings;
 
 	hlvis_plane_t const * portalplane;
 
 	int clipPlaneCount;
 	hlvis_plane_t* clipPlane;
+
+	std::size_t depth; // 0 for the head
 };
 
 struct threaddata_t final {
@@ -152,4 +160,26 @@ extern void MaxDistVis(int threadnum);
 // extern void		PostMaxDistVis(int threadnum);
 
 extern void PortalFlow(vis_portal_t* p);
+
+extern void OpenCheckpoint(
+	std::filesystem::path const & filePath,
+	unsigned intervalSeconds,
+	bool resume
+);
+extern void CheckpointPortal(vis_portal_t const * p);
+extern void CloseCheckpoint();
+extern std::uint64_t HashBytes(
+	std::span<std::byte const> bytes,
+	std::uint64_t hash = 14695981039346656037ull
+);
+// The inverse of CompressVis
+extern bool DecompressVisBits(
+	std::span<byte const> compressed, byte* dest, std::size_t destLength
+);
+
+extern void ReuseUnchangedPortals(std::filesystem::path const & filePath);
+extern void SaveIncrementalVis(std::filesystem::path const & filePath);
 extern void CalcAmbientSounds();
+
+// main.cpp and HLCOMPILE run the tool through this
+extern int hlvis_main(int argc, char** argv);
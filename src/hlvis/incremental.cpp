@@ -0,0 +1,352 @@
+#include "filelib.h"
+#include "hlvis.h"
+#include "log.h"
+#include "vis_bitset.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// The results of the last vis, for -incremental: an incremental_header,
+// the fingerprint of each leaf, then for each portal an incremental_portal
+// followed by its mightsee and its visbits, both compressed with
+// CompressVis.
+//
+// Portals and leafs are renumbered whenever the map changes, so they're
+// matched by fingerprint instead. A portal's fingerprint is of its winding
+// and plane, and a leaf's is of the fingerprints of its portals. The flow
+// of a portal only goes through the leafs in its mightsee, so if the
+// portal is unchanged, every leaf in its old mightsee is unchanged, and
+// its new mightsee is the old one, the flow would come out the same
+
+constexpr std::array<char, 8> incrementalMagic{ 'O', 'H', 'L', 'T',
+	                                            'V', 'I', 'N', 'C' };
+constexpr std::uint32_t incrementalVersion = 1;
+
+struct incremental_header final {
+	std::array<char, 8> magic;
+	std::uint32_t version;
+	std::uint32_t numLeafs;
+	std::uint32_t numPortals;
+	std::uint32_t bitBytes;
+	std::uint32_t fullvis;
+	std::uint32_t padding;
+};
+
+struct incremental_portal final {
+	std::uint64_t fingerprint;
+	std::int32_t numCanSee;
+	std::uint32_t mightseeSize;
+	std::uint32_t visbitsSize;
+	std::uint32_t padding;
+};
+
+// Maps a fingerprint to the only leaf or portal with it, or to -1 if
+// there are several
+using fingerprint_index = std::unordered_map<std::uint64_t, int>;
+
+// =====================================================================================
+//  PortalFingerprint
+// =====================================================================================
+static std::uint64_t PortalFingerprint(vis_portal_t const & p) {
+	std::uint64_t hash = HashBytes(std::as_bytes(std::span{
+		p.winding->points, p.winding->numpoints }));
+	hash = HashBytes(std::as_bytes(std::span{ &p.plane.normal, 1 }), hash);
+	return HashBytes(std::as_bytes(std::span{ &p.plane.dist, 1 }), hash);
+}
+
+// =====================================================================================
+//  LeafFingerprints
+// =====================================================================================
+static std::vector<std::uint64_t> LeafFingerprints() {
+	std::vector<std::uint64_t> leafFingerprints(g_portalleafs);
+	std::vector<std::uint64_t> portalFingerprints;
+	for (unsigned i = 0; i < g_portalleafs; i++) {
+		leaf_t const & leaf = g_leafs[i];
+		portalFingerprints.clear();
+		for (unsigned j = 0; j < leaf.numportals; j++) {
+			portalFingerprints.push_back(
+				PortalFingerprint(*leaf.portals[j])
+			);
+		}
+		// The order of a leaf's portals depends on the portal numbers
+		std::ranges::sort(portalFingerprints);
+		leafFingerprints[i] = HashBytes(
+			std::as_bytes(std::span{ portalFingerprints })
+		);
+	}
+	return leafFingerprints;
+}
+
+// =====================================================================================
+//  IndexFingerprints
+// =====================================================================================
+static fingerprint_index
+IndexFingerprints(std::span<std::uint64_t const> fingerprints) {
+	fingerprint_index index;
+	for (std::size_t i = 0; i < fingerprints.size(); i++) {
+		auto const [it, inserted] = index.try_emplace(fingerprints[i], i);
+		if (!inserted) {
+			it->second = -1;
+		}
+	}
+	return index;
+}
+
+// =====================================================================================
+//  RemapLeafBits
+//      Converts a bit string of the last vis's leafs to this vis's leafs.
+//      Returns false if one of the leafs changed
+// =====================================================================================
+static bool RemapLeafBits(
+	byte const * oldBits,
+	std::size_t oldBitBytes,
+	std::span<int const> newLeafForOldLeaf,
+	byte* newBits
+) {
+	std::fill_n(newBits, g_bitbytes, 0);
+	for (std::size_t i = 0; i < oldBitBytes; i += 8) {
+		std::uint64_t word = load_bit_word(oldBits + i);
+		while (word) {
+			std::size_t const oldLeaf = i * 8 + std::countr_zero(word);
+			word &= word - 1;
+			if (oldLeaf >= newLeafForOldLeaf.size()
+			    || newLeafForOldLeaf[oldLeaf] == -1) {
+				return false;
+			}
+			set_bit_range(newBits, newLeafForOldLeaf[oldLeaf], 1);
+		}
+	}
+	return true;
+}
+
+// =====================================================================================
+//  ReuseUnchangedPortals
+//      Marks the portals the last vis already has the result of done
+// =====================================================================================
+void ReuseUnchangedPortals(std::filesystem::path const & filePath) {
+	auto [success, size, buffer] = read_binary_file(filePath);
+	if (!success) {
+		Log("No previous vis in '%s', every portal will be flowed\n",
+		    filePath.c_str());
+		return;
+	}
+	byte const * const data = reinterpret_cast<byte const *>(buffer.get());
+
+	incremental_header header;
+	if (size < sizeof(header)) {
+		Warning("'%s' is damaged, not reusing it", filePath.c_str());
+		return;
+	}
+	std::memcpy(&header, data, sizeof(header));
+	if (header.magic != incrementalMagic
+	    || header.version != incrementalVersion
+	    || header.fullvis != std::uint32_t(g_fullvis)
+	    || header.bitBytes % 8 != 0) {
+		Log("'%s' is for other settings, not reusing it\n",
+		    filePath.c_str());
+		return;
+	}
+	std::size_t position = sizeof(header);
+
+	std::size_t const leafFingerprintsSize = header.numLeafs
+		* sizeof(std::uint64_t);
+	if (size - position < leafFingerprintsSize) {
+		Warning("'%s' is damaged, not reusing it", filePath.c_str());
+		return;
+	}
+	std::vector<std::uint64_t> oldLeafFingerprints(header.numLeafs);
+	std::memcpy(
+		oldLeafFingerprints.data(), data + position, leafFingerprintsSize
+	);
+	position += leafFingerprintsSize;
+
+	// Leafs are only matched if their fingerprints are unique on both
+	// sides
+	fingerprint_index const newLeafIndex{ IndexFingerprints(
+		LeafFingerprints()
+	) };
+	fingerprint_index const oldLeafIndex{ IndexFingerprints(
+		oldLeafFingerprints
+	) };
+	std::vector<int> newLeafForOldLeaf(header.numLeafs, -1);
+	for (std::size_t i = 0; i < header.numLeafs; i++) {
+		auto const newLeaf = newLeafIndex.find(oldLeafFingerprints[i]);
+		if (newLeaf != newLeafIndex.end() && newLeaf->second != -1
+		    && oldLeafIndex.at(oldLeafFingerprints[i]) != -1) {
+			newLeafForOldLeaf[i] = newLeaf->second;
+		}
+	}
+
+	std::vector<std::uint64_t> newPortalFingerprints(g_numportals * 2);
+	for (int i = 0; i < g_numportals * 2; i++) {
+		newPortalFingerprints[i] = PortalFingerprint(g_portals[i]);
+	}
+	fingerprint_index const newPortalIndex{ IndexFingerprints(
+		newPortalFingerprints
+	) };
+
+	// Used to make sure an old portal's fingerprint is unique too
+	fingerprint_index oldPortalCount;
+
+	std::vector<byte> oldBits(header.bitBytes);
+	std::vector<byte> mightsee(g_bitbytes);
+	std::vector<byte> visbits(g_bitbytes);
+	std::vector<vis_portal_t*> reusable;
+	std::vector<std::vector<byte>> reusableVisbits;
+	std::vector<int> reusableNumCanSee;
+	std::vector<std::uint64_t> reusableFingerprints;
+	for (std::size_t i = 0; i < header.numPortals; i++) {
+		incremental_portal record;
+		if (size - position < sizeof(record)) {
+			Warning("'%s' is damaged, not reusing it", filePath.c_str());
+			return;
+		}
+		std::memcpy(&record, data + position, sizeof(record));
+		position += sizeof(record);
+		if (size - position < std::size_t(record.mightseeSize)
+		        + record.visbitsSize) {
+			Warning("'%s' is damaged, not reusing it", filePath.c_str());
+			return;
+		}
+		std::span<byte const> const oldMightsee{ data + position,
+			                                     record.mightseeSize };
+		position += record.mightseeSize;
+		std::span<byte const> const oldVisbits{ data + position,
+			                                    record.visbitsSize };
+		position += record.visbitsSize;
+		oldPortalCount[record.fingerprint]++;
+
+		auto const newPortal = newPortalIndex.find(record.fingerprint);
+		if (newPortal == newPortalIndex.end() || newPortal->second == -1) {
+			continue;
+		}
+		vis_portal_t& p = g_portals[newPortal->second];
+		if (p.status != vstatus_t::stat_none) {
+			continue;
+		}
+
+		if (!DecompressVisBits(
+				oldMightsee, oldBits.data(), header.bitBytes
+			)
+		    || !RemapLeafBits(
+				oldBits.data(),
+				header.bitBytes,
+				newLeafForOldLeaf,
+				mightsee.data()
+			)
+		    || !std::ranges::equal(
+				mightsee, std::span{ p.mightsee, g_bitbytes }
+			)) {
+			continue;
+		}
+		if (!DecompressVisBits(
+				oldVisbits, oldBits.data(), header.bitBytes
+			)
+		    || !RemapLeafBits(
+				oldBits.data(),
+				header.bitBytes,
+				newLeafForOldLeaf,
+				visbits.data()
+			)) {
+			continue;
+		}
+		reusable.push_back(&p);
+		reusableVisbits.push_back(visbits);
+		reusableNumCanSee.push_back(record.numCanSee);
+		reusableFingerprints.push_back(record.fingerprint);
+	}
+
+	std::size_t numReused = 0;
+	for (std::size_t i = 0; i < reusable.size(); i++) {
+		if (oldPortalCount[reusableFingerprints[i]] != 1) {
+			continue;
+		}
+		vis_portal_t& p = *reusable[i];
+		p.visbits = (byte*) calloc(1, g_bitbytes);
+		std::ranges::copy(reusableVisbits[i], p.visbits);
+		p.numcansee = reusableNumCanSee[i];
+		p.status = vstatus_t::stat_done;
+		numReused++;
+	}
+
+	Log("Reusing the last vis of %zu of %i portals\n",
+	    numReused,
+	    g_numportals * 2);
+}
+
+// =====================================================================================
+//  SaveIncrementalVis
+//      Once every portal is done. It's written to a temporary file first,
+//      so an interruption can't leave a partial file behind
+// =====================================================================================
+void SaveIncrementalVis(std::filesystem::path const & filePath) {
+	std::string out;
+	incremental_header const header{
+		.magic = incrementalMagic,
+		.version = incrementalVersion,
+		.numLeafs = g_portalleafs,
+		.numPortals = std::uint32_t(g_numportals * 2),
+		.bitBytes = g_bitbytes,
+		.fullvis = std::uint32_t(g_fullvis)
+	};
+	out.append(reinterpret_cast<char const *>(&header), sizeof(header));
+
+	std::vector<std::uint64_t> const leafFingerprints{ LeafFingerprints() };
+	out.append(
+		reinterpret_cast<char const *>(leafFingerprints.data()),
+		leafFingerprints.size() * sizeof(std::uint64_t)
+	);
+
+	// A zero byte can take two bytes compressed
+	std::vector<byte> mightsee(g_bitbytes * 2);
+	std::vector<byte> visbits(g_bitbytes * 2);
+	for (int i = 0; i < g_numportals * 2; i++) {
+		vis_portal_t const & p = g_portals[i];
+		std::size_t const mightseeSize = CompressVis(
+			p.mightsee, g_bitbytes, mightsee.data(), mightsee.size()
+		);
+		std::size_t const visbitsSize = CompressVis(
+			p.visbits, g_bitbytes, visbits.data(), visbits.size()
+		);
+		incremental_portal const record{
+			.fingerprint = PortalFingerprint(p),
+			.numCanSee = p.numcansee,
+			.mightseeSize = std::uint32_t(mightseeSize),
+			.visbitsSize = std::uint32_t(visbitsSize)
+		};
+		out.append(reinterpret_cast<char const *>(&record), sizeof(record));
+		out.append(
+			reinterpret_cast<char const *>(mightsee.data()), mightseeSize
+		);
+		out.append(
+			reinterpret_cast<char const *>(visbits.data()), visbitsSize
+		);
+	}
+
+	std::filesystem::path temporaryFilePath{ filePath };
+	temporaryFilePath += ".tmp";
+	FILE* f = fopen(temporaryFilePath.c_str(), "wb");
+	if (!f) {
+		Warning("Couldn't write '%s'", temporaryFilePath.c_str());
+		return;
+	}
+	bool success = fwrite(out.data(), 1, out.size(), f) == out.size();
+	success = fclose(f) == 0 && success;
+
+	std::error_code error;
+	if (success) {
+		std::filesystem::rename(temporaryFilePath, filePath, error);
+	}
+	if (!success || error) {
+		Warning("Couldn't write '%s'", filePath.c_str());
+		std::filesystem::remove(temporaryFilePath, error);
+	}
+}
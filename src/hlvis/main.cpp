@@ -0,0 +1,5 @@
+#include "hlvis.h"
+
+int main(int const argc, char** argv) {
+	return hlvis_main(argc, argv);
+}
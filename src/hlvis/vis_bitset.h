@@ -0,0 +1,168 @@
+#pragma once
+
+#include "mathtypes.h"
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// The bit strings HLVIS keeps a bit per portal leaf in, like mightsee and
+// visbits. They're g_bitbytes long, which is always a multiple of 8, so
+// the kernels below work on whole 64-bit words past the vector part.
+// The widest vectors the compiler is allowed to use are picked at compile
+// time, with plain 64-bit words as the fallback. x86-64 always has SSE2.
+// The AVX2 paths are only built with the OHLT_AVX2 CMake option
+
+// Bit i of a bit string is bit i % 8 of byte i / 8. Loading 8 bytes as a
+// word only keeps bit i at bit i % 64 of the word on little-endian
+// machines, which the word kernels and their callers rely on
+static_assert(
+	std::endian::native == std::endian::little,
+	"The bit string kernels assume a little-endian machine"
+);
+
+inline std::uint64_t load_bit_word(byte const * bits) noexcept {
+	std::uint64_t word;
+	std::memcpy(&word, bits, sizeof(word));
+	return word;
+}
+
+inline void store_bit_word(byte* bits, std::uint64_t word) noexcept {
+	std::memcpy(bits, &word, sizeof(word));
+}
+
+// dst |= src
+inline void
+or_bits(byte* dst, byte const * src, std::size_t numBytes) noexcept {
+	std::size_t i = 0;
+#if defined(__AVX2__)
+	for (; i + 32 <= numBytes; i += 32) {
+		__m256i const d = _mm256_loadu_si256((__m256i const *) (dst + i));
+		__m256i const s = _mm256_loadu_si256((__m256i const *) (src + i));
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_or_si256(d, s));
+	}
+#elif defined(__SSE2__) || defined(_M_X64)
+	for (; i + 16 <= numBytes; i += 16) {
+		__m128i const d = _mm_loadu_si128((__m128i const *) (dst + i));
+		__m128i const s = _mm_loadu_si128((__m128i const *) (src + i));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_or_si128(d, s));
+	}
+#endif
+	for (; i < numBytes; i += 8) {
+		store_bit_word(
+			dst + i, load_bit_word(dst + i) | load_bit_word(src + i)
+		);
+	}
+}
+
+// dst = a & b. Returns whether dst has any bits that seen doesn't
+inline bool and_bits_has_new(
+	byte* dst,
+	byte const * a,
+	byte const * b,
+	byte const * seen,
+	std::size_t numBytes
+) noexcept {
+	std::size_t i = 0;
+	bool hasNew = false;
+#if defined(__AVX2__)
+	__m256i newBits = _mm256_setzero_si256();
+	for (; i + 32 <= numBytes; i += 32) {
+		__m256i const both = _mm256_and_si256(
+			_mm256_loadu_si256((__m256i const *) (a + i)),
+			_mm256_loadu_si256((__m256i const *) (b + i))
+		);
+		_mm256_storeu_si256((__m256i*) (dst + i), both);
+		newBits = _mm256_or_si256(
+			newBits,
+			_mm256_andnot_si256(
+				_mm256_loadu_si256((__m256i const *) (seen + i)), both
+			)
+		);
+	}
+	hasNew = !_mm256_testz_si256(newBits, newBits);
+#elif defined(__SSE2__) || defined(_M_X64)
+	__m128i newBits = _mm_setzero_si128();
+	for (; i + 16 <= numBytes; i += 16) {
+		__m128i const both = _mm_and_si128(
+			_mm_loadu_si128((__m128i const *) (a + i)),
+			_mm_loadu_si128((__m128i const *) (b + i))
+		);
+		_mm_storeu_si128((__m128i*) (dst + i), both);
+		newBits = _mm_or_si128(
+			newBits,
+			_mm_andnot_si128(
+				_mm_loadu_si128((__m128i const *) (seen + i)), both
+			)
+		);
+	}
+	hasNew = _mm_movemask_epi8(_mm_cmpeq_epi8(newBits, _mm_setzero_si128()))
+		!= 0xFFFF;
+#endif
+	std::uint64_t newWordBits = 0;
+	for (; i < numBytes; i += 8) {
+		std::uint64_t const both = load_bit_word(a + i)
+			& load_bit_word(b + i);
+		store_bit_word(dst + i, both);
+		newWordBits |= both & ~load_bit_word(seen + i);
+	}
+	return hasNew || newWordBits != 0;
+}
+
+inline std::size_t
+count_bits(byte const * bits, std::size_t numBytes) noexcept {
+	std::size_t count = 0;
+	for (std::size_t i = 0; i < numBytes; i += 8) {
+		count += std::popcount(load_bit_word(bits + i));
+	}
+	return count;
+}
+
+// Sets the bits [first, first + count). Unlike the kernels above, this
+// works on any number of bytes
+inline void
+set_bit_range(byte* bits, std::size_t first, std::size_t count) noexcept {
+	if (count == 0) {
+		return;
+	}
+	std::size_t const end = first + count;
+	std::size_t const firstByte = first >> 3;
+	std::size_t const lastByte = (end - 1) >> 3;
+	byte const firstMask = byte(0xFF << (first & 7));
+	byte const lastMask = byte(0xFF >> (7 - ((end - 1) & 7)));
+	if (firstByte == lastByte) {
+		bits[firstByte] |= firstMask & lastMask;
+		return;
+	}
+	bits[firstByte] |= firstMask;
+	std::memset(bits + firstByte + 1, 0xFF, lastByte - firstByte - 1);
+	bits[lastByte] |= lastMask;
+}
+
+// For each bit i set in portalLeafBits, sets the bits
+// [leafStarts[i], leafStarts[i] + leafCounts[i]) in leafBits
+inline void expand_portal_leaf_bits(
+	byte const * portalLeafBits,
+	std::size_t numBytes,
+	int const * leafStarts,
+	int const * leafCounts,
+	byte* leafBits
+) noexcept {
+	for (std::size_t i = 0; i < numBytes; i += 8) {
+		std::uint64_t word = load_bit_word(portalLeafBits + i);
+		while (word) {
+			std::size_t const portalLeaf = i * 8 + std::countr_zero(word);
+			word &= word - 1;
+			set_bit_range(
+				leafBits, leafStarts[portalLeaf], leafCounts[portalLeaf]
+			);
+		}
+	}
+}
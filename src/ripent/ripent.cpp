@@ -26,8 +26,6 @@ enum class hl_types {
 static hl_types g_mode = hl_types::hl_undefined;
 static hl_types g_texturemode = hl_types::hl_undefined;
 
-static bool g_chart = cli_option_defaults::chart;
-static bool g_info = cli_option_defaults::info;
 static bool g_parse = ripent_cli_option_defaults::parse;
 static bool g_textureparse = ripent_cli_option_defaults::textureParse;
 
@@ -893,6 +891,3 @@ int main(int argc, char** argv) {
 
 	return 0;
 }
-
-// do nothing - we don't have params to fetch
-void GetParamsFromEnt(entity_t* mapent) { }